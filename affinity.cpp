@@ -0,0 +1,131 @@
+#include "affinity.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <sched.h>
+
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#endif
+
+using namespace std;
+
+G_DEFINE_QUARK(libsouptest-affinity-error-quark, affinity_error)
+
+static CpuSet helperCpus;
+
+gboolean CpuSet::parse(const char *list, CpuSet &set, GError **error) {
+  set.cpus_.clear();
+  const char *p = list;
+  while (*p) {
+    char *end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end != p && *end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+    }
+    if (end == p || first < 0 || last < first || last >= CPU_SETSIZE || (*end && *end != ',')) {
+      g_set_error(error, AFFINITY_ERROR, AFFINITY_ERROR_PARSE, "Invalid CPU list '%s', expected e.g. 0-3,8", list);
+      return FALSE;
+    }
+    for (long cpu = first; cpu <= last; cpu++) set.cpus_.push_back((int) cpu);
+    p = *end ? end + 1 : end;
+  }
+
+  sort(set.cpus_.begin(), set.cpus_.end());
+  set.cpus_.erase(unique(set.cpus_.begin(), set.cpus_.end()), set.cpus_.end());
+  if (set.cpus_.empty()) {
+    g_set_error(error, AFFINITY_ERROR, AFFINITY_ERROR_PARSE, "Empty CPU list");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+CpuSet CpuSet::current() {
+  CpuSet set;
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &mask)) set.cpus_.push_back(cpu);
+    }
+  }
+  return set;
+}
+
+CpuSet CpuSet::slice(int index, int width) const {
+  CpuSet set;
+  if (cpus_.empty()) return set;
+  size_t n = cpus_.size();
+  width = max(1, min(width, (int) n));
+  for (int i = 0; i < width; i++) set.cpus_.push_back(cpus_[((size_t) index * width + i) % n]);
+  sort(set.cpus_.begin(), set.cpus_.end());
+  return set;
+}
+
+CpuSet CpuSet::without(const CpuSet &other) const {
+  CpuSet set;
+  set_difference(cpus_.begin(), cpus_.end(), other.cpus_.begin(), other.cpus_.end(), back_inserter(set.cpus_));
+  return set;
+}
+
+string CpuSet::to_string() const {
+  string out;
+  for (size_t i = 0; i < cpus_.size();) {
+    size_t j = i;
+    while (j + 1 < cpus_.size() && cpus_[j + 1] == cpus_[j] + 1) j++;
+    if (!out.empty()) out += ',';
+    out += std::to_string(cpus_[i]);
+    if (j > i) out += '-' + std::to_string(cpus_[j]);
+    i = j + 1;
+  }
+  return out;
+}
+
+gboolean CpuSet::apply(GError **error) const {
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  for (int cpu : cpus_) CPU_SET(cpu, &mask);
+  // pid 0 is the calling thread, not the whole process.
+  if (sched_setaffinity(0, sizeof(mask), &mask) != 0) {
+    int err = errno;
+    g_set_error(error, AFFINITY_ERROR, AFFINITY_ERROR_FAILED, "Cannot pin to CPUs %s: %s", to_string().c_str(), g_strerror(err));
+    return FALSE;
+  }
+  return TRUE;
+}
+
+gboolean pin_event_loop(const CpuSet &cpus, int *node, GError **error) {
+  *node = -1;
+  if (!cpus.apply(error)) return FALSE;
+#ifdef HAVE_LIBNUMA
+  if (numa_available() >= 0) {
+    *node = numa_node_of_cpu(cpus.cpus().front());
+    // Preferred rather than bound: running out of local memory should spill
+    // to the other node, not fail.
+    if (*node >= 0) numa_set_preferred(*node);
+  }
+#endif
+  return TRUE;
+}
+
+void set_helper_cpus(const CpuSet &cpus) {
+  helperCpus = cpus;
+}
+
+const CpuSet &helper_cpus() {
+  return helperCpus;
+}
+
+void pin_helper_thread() {
+  static thread_local bool pinned = false;
+  if (pinned || helperCpus.empty()) return;
+  pinned = true;
+  GError *error = nullptr;
+  if (!helperCpus.apply(&error)) {
+    g_warning("%s", error->message);
+    g_error_free(error);
+  }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <glib.h>
+
+#include <string>
+#include <vector>
+
+#define AFFINITY_ERROR (affinity_error_quark())
+GQuark affinity_error_quark(void);
+
+enum AffinityError {
+  AFFINITY_ERROR_PARSE,
+  AFFINITY_ERROR_FAILED,
+};
+
+// Ordered set of CPU numbers, written like taskset's lists: "0-3,8,10-11".
+class CpuSet {
+public:
+  static gboolean parse(const char *list, CpuSet &set, GError **error);
+  // The CPUs the calling thread may currently run on.
+  static CpuSet current();
+
+  // The index-th run of width CPUs, wrapping around when there are more
+  // workers than CPUs.
+  CpuSet slice(int index, int width) const;
+  CpuSet without(const CpuSet &other) const;
+
+  bool empty() const { return cpus_.empty(); }
+  const std::vector<int> &cpus() const { return cpus_; }
+  std::string to_string() const;
+
+  // Restricts the calling thread.
+  gboolean apply(GError **error) const;
+
+private:
+  std::vector<int> cpus_;
+};
+
+// Pins the calling event-loop thread to cpus and, when built with libnuma,
+// makes its allocations prefer the NUMA node of the first of them, so buffers
+// the loop touches stay local. Sets *node to that node, or -1.
+gboolean pin_event_loop(const CpuSet &cpus, int *node, GError **error);
+
+// CPUs for helper threads (file writers, pipeline workers, the trace
+// exporter). Set once before any of them start; empty leaves them alone.
+void set_helper_cpus(const CpuSet &cpus);
+const CpuSet &helper_cpus();
+// Called by helper threads before their first job; pins each thread once.
+void pin_helper_thread();
@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+"""Compare two libsouptest_bench JSON reports.
+
+    libsouptest_bench --benchmark_out=base.json --benchmark_out_format=json
+    ... change things, rebuild ...
+    libsouptest_bench --benchmark_out=new.json --benchmark_out_format=json
+    bench/compare_bench.py base.json new.json [--threshold PCT]
+
+Prints the change in time per iteration for every benchmark present in both
+reports and exits with status 1 if any got slower by more than the threshold
+(default 5%), so it can gate CI.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        report = json.load(f)
+    results = {}
+    for bench in report["benchmarks"]:
+        # With --benchmark_repetitions, compare the medians only.
+        if bench.get("run_type") == "aggregate" and bench.get("aggregate_name") != "median":
+            continue
+        if bench.get("error_occurred"):
+            continue
+        name = bench.get("run_name", bench["name"])
+        results[name] = bench
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("baseline")
+    parser.add_argument("contender")
+    parser.add_argument("--threshold", type=float, default=5.0, help="percent slowdown that counts as a regression")
+    parser.add_argument("--metric", choices=["real_time", "cpu_time"], default="real_time")
+    args = parser.parse_args()
+
+    base = load(args.baseline)
+    new = load(args.contender)
+    common = [name for name in base if name in new]
+    if not common:
+        print("no benchmarks in common", file=sys.stderr)
+        return 2
+
+    width = max(len("benchmark"), max(len(name) for name in common))
+    print(f"{'benchmark':<{width}}  {'baseline':>12}  {'contender':>12}  {'change':>8}")
+    regressions = []
+    for name in common:
+        before = base[name][args.metric]
+        after = new[name][args.metric]
+        unit = base[name].get("time_unit", "ns")
+        change = (after - before) / before * 100 if before else 0.0
+        flag = ""
+        if change > args.threshold:
+            flag = "  REGRESSION"
+            regressions.append(name)
+        print(f"{name:<{width}}  {before:>10.1f}{unit:>2}  {after:>10.1f}{unit:>2}  {change:>+7.1f}%{flag}")
+
+    for name in sorted(set(base) ^ set(new)):
+        print(f"{name}: only in {'baseline' if name in base else 'contender'}")
+
+    if regressions:
+        print(f"{len(regressions)} benchmark(s) slower by more than {args.threshold}%", file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,69 @@
+#include <glib-unix.h>
+#include <iostream>
+
+#include "../fault_proxy.h"
+
+using namespace std;
+
+static gint port = 8088;
+static gchar *upstream = nullptr;
+static gchar *faults = nullptr;
+static gint seed = 1;
+
+static GOptionEntry entries[] = {
+        {"port", 'p', 0, G_OPTION_ARG_INT, &port, "Listen on 127.0.0.1:PORT (default 8088, 0 for any)", "PORT"},
+        {"upstream", 'u', 0, G_OPTION_ARG_STRING, &upstream, "Forward to BASE, e.g. http://127.0.0.1:8080", "BASE"},
+        {"faults", 'f', 0, G_OPTION_ARG_STRING, &faults, "Fault profile, e.g. latency=lognormal:40:0.8,reset=0.01,errors=0.02:503:10", "SPEC"},
+        {"seed", 's', 0, G_OPTION_ARG_INT, &seed, "Seed for fault decisions (default 1)", "N"},
+        {nullptr}};
+
+static gboolean
+on_signal(gpointer data) {
+  g_main_loop_quit((GMainLoop *) data);
+  return G_SOURCE_REMOVE;
+}
+
+int main(int argc, char **argv) {
+  GError *error = nullptr;
+  GOptionContext *options = g_option_context_new("- fault-injecting reverse proxy for latency testing");
+  g_option_context_add_main_entries(options, entries, nullptr);
+  if (!g_option_context_parse(options, &argc, &argv, &error)) {
+    cerr << error->message << endl;
+    return 1;
+  }
+  g_option_context_free(options);
+  if (!upstream) {
+    cerr << "--upstream is required" << endl;
+    return 1;
+  }
+
+  FaultProfile profile;
+  if (!FaultProfile::parse(faults ? faults : "", profile, &error)) {
+    cerr << error->message << endl;
+    return 1;
+  }
+
+  GMainLoop *mainLoop = g_main_loop_new(nullptr, FALSE);
+  {
+    FaultProxy proxy(upstream, profile, (guint32) seed);
+    if (!proxy.listen((guint) port, &error)) {
+      cerr << error->message << endl;
+      return 1;
+    }
+    cout << "proxying " << proxy.base_url() << " -> " << upstream << endl;
+
+    g_unix_signal_add(SIGINT, on_signal, mainLoop);
+    g_unix_signal_add(SIGTERM, on_signal, mainLoop);
+    g_main_loop_run(mainLoop);
+
+    const FaultProxy::Stats &stats = proxy.stats();
+    cout << stats.requests << " requests: " << stats.forwarded << " forwarded (" << stats.upstreamFailures
+         << " upstream failures), " << stats.errors << " injected errors, " << stats.resets << " resets, "
+         << stats.slowloris << " slow-loris, " << stats.throttled << " throttled" << endl;
+  }
+
+  g_main_loop_unref(mainLoop);
+  g_free(upstream);
+  g_free(faults);
+  return 0;
+}
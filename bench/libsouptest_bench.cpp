@@ -0,0 +1,407 @@
+#include <benchmark/benchmark.h>
+
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <gio/gunixoutputstream.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "../cookie_jar.h"
+#include "../crawler.h"
+#include "../event_stream.h"
+#include "../hash.h"
+#include "../loopback_server.h"
+#include "../pipeline.h"
+#include "../sink.h"
+#include "../soupclient.h"
+
+using namespace std;
+
+static const char *BENCH_URL = "https://www.example.com/articles/2022/02/some-long-slug?page=2&sort=desc#comments";
+
+// Message construction: what queue_fetch pays per URL before anything is sent.
+static void
+BM_RequestGet(benchmark::State &state) {
+  for (auto _ : state) {
+    Request request = Request::get(BENCH_URL);
+    benchmark::DoNotOptimize(request.message());
+  }
+}
+BENCHMARK(BM_RequestGet);
+
+static void
+BM_UriParse(benchmark::State &state) {
+  for (auto _ : state) {
+    SoupURI *uri = soup_uri_new(BENCH_URL);
+    benchmark::DoNotOptimize(uri);
+    soup_uri_free(uri);
+  }
+}
+BENCHMARK(BM_UriParse);
+
+// Parse plus the crawler's dedup key.
+static void
+BM_UriNormalize(benchmark::State &state) {
+  for (auto _ : state) {
+    SoupURI *uri = soup_uri_new(BENCH_URL);
+    string key = normalize_url(uri);
+    benchmark::DoNotOptimize(key.data());
+    soup_uri_free(uri);
+  }
+}
+BENCHMARK(BM_UriNormalize);
+
+static void
+BM_HeaderBuild(benchmark::State &state) {
+  vector<string> names, values;
+  for (int i = 0; i < state.range(0); i++) {
+    names.push_back("X-Bench-Header-" + to_string(i));
+    values.push_back("value-" + to_string(i * 7919));
+  }
+  for (auto _ : state) {
+    Request request = Request::get(BENCH_URL);
+    for (size_t i = 0; i < names.size(); i++) request.header(names[i].c_str(), values[i].c_str());
+    benchmark::DoNotOptimize(request.message());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_HeaderBuild)->Arg(1)->Arg(8)->Arg(32);
+
+// Completion dispatch through the inline SmallFunction the session stores,
+// against std::function with the same capture: 40 trivially copyable bytes,
+// like the pointers and counters real completions carry, so only where the
+// callable lives differs.
+static void
+BM_CallbackSmallFunction(benchmark::State &state) {
+  uint64_t count = 0;
+  const char *url = BENCH_URL;
+  size_t len = strlen(url);
+  int id = 7, attempt = 1;
+  gint64 queuedUs = 1000;
+  for (auto _ : state) {
+    SmallFunction<void(int)> done([&count, url, len, id, attempt, queuedUs](int status) {
+      count += status + len + id + attempt + (uint64_t) queuedUs + (url[0] == 'h');
+    });
+    done(200);
+  }
+  benchmark::DoNotOptimize(count);
+}
+BENCHMARK(BM_CallbackSmallFunction);
+
+static void
+BM_CallbackStdFunction(benchmark::State &state) {
+  uint64_t count = 0;
+  const char *url = BENCH_URL;
+  size_t len = strlen(url);
+  int id = 7, attempt = 1;
+  gint64 queuedUs = 1000;
+  for (auto _ : state) {
+    function<void(int)> done([&count, url, len, id, attempt, queuedUs](int status) {
+      count += status + len + id + attempt + (uint64_t) queuedUs + (url[0] == 'h');
+    });
+    done(200);
+  }
+  benchmark::DoNotOptimize(count);
+}
+BENCHMARK(BM_CallbackStdFunction);
+
+static GBytes *
+filler_bytes(size_t size) {
+  string data(size, 'x');
+  for (size_t i = 0; i < size; i += 97) data[i] = '\n';
+  return g_bytes_new(data.data(), data.size());
+}
+
+// Body sink throughput per chunk size: the inline pipeline path that
+// got-chunk feeds.
+static void
+BM_PipelineChunk(benchmark::State &state) {
+  GBytes *chunk = filler_bytes((size_t) state.range(0));
+  for (auto _ : state) {
+    BodyPipeline pipeline;
+    pipeline_add_stages(pipeline, "xxh64,lines", nullptr);
+    for (int i = 0; i < 16; i++) pipeline.push(chunk);
+    pipeline.close([](BodyPipeline *) {});
+  }
+  state.SetBytesProcessed(state.iterations() * 16 * state.range(0));
+  g_bytes_unref(chunk);
+}
+BENCHMARK(BM_PipelineChunk)->RangeMultiplier(8)->Range(512, 1 << 20);
+
+// Per-chunk cost of each checksum --manifest can verify against.
+static void
+BM_ChecksumCrc32c(benchmark::State &state) {
+  string data((size_t) state.range(0), 'x');
+  Crc32c crc;
+  for (auto _ : state) crc.update(data.data(), data.size());
+  benchmark::DoNotOptimize(crc.digest());
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+  state.SetLabel(Crc32c::hardware() ? "sse4.2" : "portable");
+}
+BENCHMARK(BM_ChecksumCrc32c)->Arg(16 << 10)->Arg(1 << 20);
+
+static void
+BM_ChecksumXxHash64(benchmark::State &state) {
+  string data((size_t) state.range(0), 'x');
+  XxHash64 hash;
+  for (auto _ : state) hash.update(data.data(), data.size());
+  benchmark::DoNotOptimize(hash.digest());
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ChecksumXxHash64)->Arg(16 << 10)->Arg(1 << 20);
+
+static void
+BM_ChecksumSha256(benchmark::State &state) {
+  string data((size_t) state.range(0), 'x');
+  GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+  for (auto _ : state) g_checksum_update(checksum, (const guchar *) data.data(), data.size());
+  benchmark::DoNotOptimize(g_checksum_get_string(checksum));
+  g_checksum_free(checksum);
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ChecksumSha256)->Arg(16 << 10)->Arg(1 << 20);
+
+// The async stdout sink, pointed at /dev/null so only its own overhead counts.
+static void
+BM_StreamSinkChunk(benchmark::State &state) {
+  int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  GOutputStream *out = g_unix_output_stream_new(fd, TRUE);
+  StreamSink sink(out, nullptr);
+  g_object_unref(out);
+  GBytes *chunk = filler_bytes((size_t) state.range(0));
+
+  for (auto _ : state) {
+    for (int i = 0; i < 16; i++) sink.write(chunk);
+    bool drained = false;
+    sink.when_drained([&drained]() { drained = true; });
+    while (!drained) g_main_context_iteration(nullptr, TRUE);
+  }
+  state.SetBytesProcessed(state.iterations() * 16 * state.range(0));
+  g_bytes_unref(chunk);
+}
+BENCHMARK(BM_StreamSinkChunk)->RangeMultiplier(8)->Range(512, 1 << 20);
+
+// One request at a time through Session against the in-process server, so
+// the figure is per-request latency over a warm keep-alive connection.
+static void
+BM_LoopbackRequest(benchmark::State &state) {
+  LoopbackServer server;
+  GError *error = nullptr;
+  if (!server.start(&error)) {
+    state.SkipWithError(error->message);
+    g_error_free(error);
+    return;
+  }
+  Session session;
+  string url = server.url_for((size_t) state.range(0));
+
+  for (auto _ : state) {
+    bool done = false;
+    session.queue(Request::get(url.c_str()), [&done, &state](Response &response) {
+      if (!response.ok()) state.SkipWithError("request failed");
+      done = true;
+    });
+    while (!done) g_main_context_iteration(nullptr, TRUE);
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_LoopbackRequest)->Arg(0)->Arg(16 << 10)->Arg(1 << 20)->UseRealTime();
+
+// The same server over TCP loopback (0) or a Unix socket through
+// UnixTransport (1), by body size and requests kept in flight.
+static void
+BM_LoopbackTransport(benchmark::State &state) {
+  LoopbackServer server;
+  GError *error = nullptr;
+  // Removed again by the server.
+  string socketPath = string(g_get_tmp_dir()) + "/libsouptest-bench-" + to_string(getpid()) + ".sock";
+  if (!server.start(&error) || !server.listen_unix(socketPath, &error)) {
+    state.SkipWithError(error->message);
+    g_error_free(error);
+    return;
+  }
+  int concurrency = (int) state.range(2);
+  Session::Options options;
+  options.maxConns = options.maxConnsPerHost = concurrency;
+  Session session(options);
+  string url = server.url_for((size_t) state.range(1));
+  if (state.range(0)) {
+    session.add_unix_route("http://loopback.sock/", socketPath.c_str(), concurrency);
+    url = "http://loopback.sock/bytes/" + to_string(state.range(1));
+  }
+
+  for (auto _ : state) {
+    int outstanding = concurrency;
+    for (int i = 0; i < concurrency; i++) {
+      session.queue(Request::get(url.c_str()), [&outstanding, &state](Response &response) {
+        if (!response.ok()) state.SkipWithError("request failed");
+        outstanding--;
+      });
+    }
+    while (outstanding > 0) g_main_context_iteration(nullptr, TRUE);
+  }
+  state.SetItemsProcessed(state.iterations() * concurrency);
+  state.SetBytesProcessed(state.iterations() * concurrency * state.range(1));
+  state.SetLabel(state.range(0) ? "unix" : "tcp");
+}
+BENCHMARK(BM_LoopbackTransport)->ArgsProduct({{0, 1}, {0, 16 << 10}, {1, 16}})->UseRealTime();
+
+// Session options for the redirect benchmark: 0 leaves redirects to libsoup,
+// 1 has the session follow them, 2 adds the permanent-redirect cache.
+static Session::Options
+redirect_options(int64_t mode) {
+  Session::Options options;
+  if (mode > 0) options.maxRedirects = 20;
+  if (mode > 1) options.redirectCache = 1024;
+  return options;
+}
+
+// A 301 in front of every body: two round trips per request unless the
+// target is remembered.
+static void
+BM_LoopbackRedirect(benchmark::State &state) {
+  LoopbackServer server;
+  GError *error = nullptr;
+  if (!server.start(&error)) {
+    state.SkipWithError(error->message);
+    g_error_free(error);
+    return;
+  }
+  Session session(redirect_options(state.range(0)));
+  string url = server.redirect_url_for(0);
+
+  for (auto _ : state) {
+    bool done = false;
+    session.queue(Request::get(url.c_str()), [&done, &state](Response &response) {
+      if (!response.ok()) state.SkipWithError("request failed");
+      done = true;
+    });
+    while (!done) g_main_context_iteration(nullptr, TRUE);
+  }
+}
+BENCHMARK(BM_LoopbackRedirect)->Arg(0)->Arg(1)->Arg(2)->UseRealTime();
+
+static void
+on_bench_authenticate(SoupSession *session, SoupMessage *msg, SoupAuth *auth, gboolean retrying, gpointer usr_data) {
+  if (!retrying) soup_auth_authenticate(auth, LoopbackServer::AUTH_USER, LoopbackServer::AUTH_PASSWORD);
+}
+
+// Basic auth through libsoup's auth manager (0), which learns the realm from
+// a first 401, against a header set up front with the manager removed (1).
+static void
+BM_LoopbackAuth(benchmark::State &state) {
+  LoopbackServer server;
+  GError *error = nullptr;
+  if (!server.start(&error)) {
+    state.SkipWithError(error->message);
+    g_error_free(error);
+    return;
+  }
+  Session::Options options;
+  options.genericAuth = state.range(0) == 0;
+  Session session(options);
+  if (state.range(0) == 0) {
+    g_signal_connect(session.get(), "authenticate", G_CALLBACK(on_bench_authenticate), nullptr);
+  } else {
+    string credentials = string(LoopbackServer::AUTH_USER) + ":" + LoopbackServer::AUTH_PASSWORD;
+    gchar *encoded = g_base64_encode((const guchar *) credentials.data(), credentials.size());
+    session.add_credentials(server.base_url().c_str(), (string("Basic ") + encoded).c_str());
+    g_free(encoded);
+  }
+  string url = server.auth_url_for(0);
+
+  for (auto _ : state) {
+    bool done = false;
+    session.queue(Request::get(url.c_str()), [&done, &state](Response &response) {
+      if (!response.ok()) state.SkipWithError("request failed");
+      done = true;
+    });
+    while (!done) g_main_context_iteration(nullptr, TRUE);
+  }
+}
+BENCHMARK(BM_LoopbackAuth)->Arg(0)->Arg(1)->UseRealTime();
+
+// Four cookies on each of N hosts under one registered domain, looked up for
+// one host. libsoup's jar walks the same domain labels but builds a list of
+// SoupCookie copies and sorts it per request.
+static string
+cookie_host(int64_t i) {
+  return "h" + to_string(i) + ".example.com";
+}
+
+static void
+BM_CookieJarHeader(benchmark::State &state) {
+  CookieJar jar;
+  for (int64_t i = 0; i < state.range(0); i++) {
+    string url = "https://" + cookie_host(i) + "/";
+    SoupMessage *msg = soup_message_new("GET", url.c_str());
+    for (int c = 0; c < 3; c++) {
+      string cookie = "c" + to_string(c) + "=" + to_string(i * 7919 + c) + "; Path=/";
+      soup_message_headers_append(msg->response_headers, "Set-Cookie", cookie.c_str());
+    }
+    soup_message_headers_append(msg->response_headers, "Set-Cookie", "site=1; Domain=example.com; Path=/");
+    jar.store(msg);
+    g_object_unref(msg);
+  }
+  SoupURI *uri = soup_uri_new(("https://" + cookie_host(state.range(0) / 2) + "/articles/1").c_str());
+  string header;
+
+  for (auto _ : state) {
+    header.clear();
+    jar.header_for(uri, header);
+    benchmark::DoNotOptimize(header.data());
+  }
+  soup_uri_free(uri);
+}
+BENCHMARK(BM_CookieJarHeader)->Arg(16)->Arg(4096);
+
+static void
+BM_SoupCookieJarHeader(benchmark::State &state) {
+  SoupCookieJar *jar = soup_cookie_jar_new();
+  for (int64_t i = 0; i < state.range(0); i++) {
+    SoupURI *uri = soup_uri_new(("https://" + cookie_host(i) + "/").c_str());
+    for (int c = 0; c < 3; c++) {
+      string cookie = "c" + to_string(c) + "=" + to_string(i * 7919 + c) + "; Path=/";
+      soup_cookie_jar_set_cookie(jar, uri, cookie.c_str());
+    }
+    soup_cookie_jar_set_cookie(jar, uri, "site=1; Domain=example.com; Path=/");
+    soup_uri_free(uri);
+  }
+  SoupURI *uri = soup_uri_new(("https://" + cookie_host(state.range(0) / 2) + "/articles/1").c_str());
+
+  for (auto _ : state) {
+    char *header = soup_cookie_jar_get_cookies(jar, uri, TRUE);
+    benchmark::DoNotOptimize(header);
+    g_free(header);
+  }
+  soup_uri_free(uri);
+  g_object_unref(jar);
+}
+BENCHMARK(BM_SoupCookieJarHeader)->Arg(16)->Arg(4096);
+
+// --stream parsing per chunk size for sse (0) and ndjson (1): small chunks
+// split more events across chunks, which is where the parser copies.
+static void
+BM_EventStreamParse(benchmark::State &state) {
+  EventStreamParser::Format format = state.range(0) ? EventStreamParser::NDJSON : EventStreamParser::SSE;
+  string body;
+  for (int i = 0; body.size() < (1 << 20); i++) {
+    string payload = "{\"seq\":" + to_string(i) + ",\"value\":\"" + string(64, 'v') + "\"}";
+    if (format == EventStreamParser::SSE) body += "id: " + to_string(i) + "\nevent: tick\ndata: " + payload + "\n\n";
+    else body += payload + "\n";
+  }
+  size_t chunk = (size_t) state.range(1);
+  uint64_t events = 0;
+  EventStreamParser parser(format, 1 << 20, [&events](const StreamEvent &event) { events += event.data.size() > 0; });
+  for (auto _ : state) {
+    for (size_t i = 0; i < body.size(); i += chunk) parser.feed(body.data() + i, min(chunk, body.size() - i));
+  }
+  benchmark::DoNotOptimize(events);
+  state.SetBytesProcessed(state.iterations() * (int64_t) body.size());
+  state.SetItemsProcessed((int64_t) events);
+}
+BENCHMARK(BM_EventStreamParse)->ArgsProduct({{0, 1}, {256, 16 << 10}});
+
+BENCHMARK_MAIN();
@@ -0,0 +1,82 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "../link_extractor.h"
+
+using namespace std;
+
+// Synthetic page mix: mostly text and non-link attributes, with a link every
+// few hundred bytes, roughly what crawled HTML looks like.
+static string
+generate_html(size_t bytes) {
+  static const char *fragments[] = {
+          "<p class=\"lead\">Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor.</p>\n",
+          "<div id=\"main\" style=\"margin:0\" data-index=\"42\">",
+          "<a href=\"/articles/2022/02/some-long-slug-for-an-article\">Read more</a>\n",
+          "<img src=\"https://cdn.example.com/img/photo.jpg\" alt=\"a photo\" width=640 height=480>\n",
+          "<span>Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip.</span>\n",
+          "<script type=\"text/javascript\">var x = a == b ? 1 : 2; y = 3;</script>\n",
+          "<link rel=stylesheet href=/static/site.css>\n",
+          "</div>\n",
+  };
+  mt19937 rng(42);
+  string html;
+  html.reserve(bytes + 256);
+  while (html.size() < bytes) html += fragments[rng() % (sizeof(fragments) / sizeof(fragments[0]))];
+  return html;
+}
+
+static size_t
+naive_extract(const string &html) {
+  size_t links = 0;
+  for (const char *attr : {"href=", "src="}) {
+    size_t attrLen = strlen(attr);
+    for (size_t pos = html.find(attr); pos != string::npos; pos = html.find(attr, pos + attrLen)) {
+      size_t start = pos + attrLen;
+      char quote = html[start];
+      size_t end = (quote == '"' || quote == '\'') ? html.find(quote, ++start) : html.find_first_of(" \t\n>", start);
+      if (end != string::npos && end > start) links++;
+    }
+  }
+  return links;
+}
+
+template<typename F>
+static void
+measure(const char *name, const string &html, int rounds, F &&run) {
+  size_t links = 0;
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++) links = run();
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  double gbps = (double) html.size() * rounds / elapsed.count() / 1e9;
+  cout << name << ": " << gbps << " GB/s (" << links << " links)" << endl;
+}
+
+int main(int argc, char **argv) {
+  size_t mib = argc > 1 ? strtoul(argv[1], nullptr, 10) : 64;
+  size_t chunk = argc > 2 ? strtoul(argv[2], nullptr, 10) : 16 * 1024;
+  int rounds = 5;
+  string html = generate_html(mib << 20);
+
+  cout << "input " << mib << " MiB, " << chunk << " byte chunks, detected isa "
+       << LinkExtractor::isa_name(LinkExtractor::detected_isa()) << endl;
+
+  measure("std::string::find", html, rounds, [&] { return naive_extract(html); });
+
+  for (LinkExtractor::Isa isa : {LinkExtractor::ISA_SCALAR, LinkExtractor::ISA_SSE42, LinkExtractor::ISA_AVX2}) {
+    if (isa > LinkExtractor::detected_isa()) continue;
+    LinkExtractor::force_isa(isa);
+    measure(LinkExtractor::isa_name(isa), html, rounds, [&] {
+      LinkExtractor extractor([](const char *, size_t) {});
+      for (size_t off = 0; off < html.size(); off += chunk) extractor.feed(html.data() + off, min(chunk, html.size() - off));
+      extractor.finish();
+      return extractor.links();
+    });
+  }
+
+  return 0;
+}
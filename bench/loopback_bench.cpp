@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../affinity.h"
+#include "../fault_proxy.h"
+#include "../loopback_server.h"
+#include "../soupclient.h"
+
+using namespace std;
+
+// Fetches the same loopback URL requests times, keeping concurrency requests
+// in flight. Server and client share one main loop, so the figure covers the
+// whole request path on both sides; it is what the PGO training run replays.
+// With a FAULTS profile the requests go through an in-process FaultProxy and
+// the latency percentiles are the interesting part. With CPUS, the same load
+// runs once unpinned and once with the loop pinned to the first of CPUS.
+struct BenchRun {
+  Session *session;
+  GMainLoop *mainLoop;
+  string url;
+  long remaining;
+  long outstanding;
+  long failed;
+  uint64_t bytes;
+  vector<gint64> latencyUs;
+};
+
+static void
+issue(BenchRun *run) {
+  run->remaining--;
+  run->outstanding++;
+  gint64 sentUs = g_get_monotonic_time();
+  run->session->queue(Request::get(run->url.c_str()), [run, sentUs](Response &response) {
+    run->outstanding--;
+    run->latencyUs.push_back(g_get_monotonic_time() - sentUs);
+    if (response.ok()) run->bytes += response.body_size();
+    else run->failed++;
+
+    if (run->remaining > 0) issue(run);
+    else if (run->outstanding == 0) g_main_loop_quit(run->mainLoop);
+  });
+}
+
+static double
+percentile(const vector<gint64> &sorted, double p) {
+  return sorted.empty() ? 0 : sorted[(size_t) (p * (double) (sorted.size() - 1))] / 1000.0;
+}
+
+// One pass of requests over a warm session; returns requests per second.
+static double
+measure(const char *label, Session &session, GMainLoop *mainLoop, const string &url, long requests, long concurrency,
+        size_t bodyBytes, long *failed) {
+  BenchRun run = {&session, mainLoop, url, requests, 0, 0, 0, {}};
+  run.latencyUs.reserve((size_t) requests);
+  gint64 start = g_get_monotonic_time();
+  for (long i = 0; i < concurrency && run.remaining > 0; i++) issue(&run);
+  g_main_loop_run(mainLoop);
+  double secs = (double) (g_get_monotonic_time() - start) / G_USEC_PER_SEC;
+
+  // The "req/s" figure is parsed by cmake/BenchProfiles.cmake.
+  cout << label << ": " << requests << " requests of " << bodyBytes << " bytes, concurrency " << concurrency
+       << ": " << (long) (requests / secs) << " req/s, " << run.bytes / secs / (1 << 20) << " MiB/s, "
+       << run.failed << " failed" << endl;
+
+  sort(run.latencyUs.begin(), run.latencyUs.end());
+  cout << "latency: p50 " << percentile(run.latencyUs, 0.50) << " ms, p90 " << percentile(run.latencyUs, 0.90)
+       << " ms, p99 " << percentile(run.latencyUs, 0.99) << " ms, max " << percentile(run.latencyUs, 1.0) << " ms" << endl;
+  *failed += run.failed;
+  return requests / secs;
+}
+
+int main(int argc, char **argv) {
+  long requests = argc > 1 ? strtol(argv[1], nullptr, 10) : 20000;
+  long concurrency = argc > 2 ? strtol(argv[2], nullptr, 10) : 64;
+  size_t bodyBytes = argc > 3 ? strtoul(argv[3], nullptr, 10) : 16384;
+  // "" skips the proxy, so CPUS can be given without a fault profile.
+  const char *faults = argc > 4 && *argv[4] ? argv[4] : nullptr;
+  const char *cpus = argc > 5 ? argv[5] : nullptr;
+  if (requests < 1 || concurrency < 1 || bodyBytes > LoopbackServer::MAX_BODY_BYTES) {
+    cerr << "usage: " << argv[0] << " [REQUESTS] [CONCURRENCY] [BODY_BYTES] [FAULTS] [CPUS]" << endl;
+    return 1;
+  }
+  FaultProfile profile;
+  CpuSet pinned;
+  GError *error = nullptr;
+  if ((faults && !FaultProfile::parse(faults, profile, &error)) || (cpus && !CpuSet::parse(cpus, pinned, &error))) {
+    cerr << error->message << endl;
+    g_error_free(error);
+    return 1;
+  }
+
+  LoopbackServer server;
+  if (!server.start(&error)) {
+    cerr << error->message << endl;
+    g_error_free(error);
+    return 1;
+  }
+  unique_ptr<FaultProxy> proxy;
+  string url = server.url_for(bodyBytes);
+  if (faults) {
+    proxy.reset(new FaultProxy(server.base_url(), profile, 1));
+    if (!proxy->listen(0, &error)) {
+      cerr << error->message << endl;
+      g_error_free(error);
+      return 1;
+    }
+    url = proxy->base_url() + url.substr(server.base_url().size());
+  }
+
+  Session::Options options;
+  options.maxConns = (int) concurrency;
+  options.maxConnsPerHost = (int) concurrency;
+  Session session(options);
+  GMainLoop *mainLoop = g_main_loop_new(nullptr, FALSE);
+  long failed = 0;
+
+  if (!cpus) {
+    measure("loopback", session, mainLoop, url, requests, concurrency, bodyBytes, &failed);
+  } else {
+    // Open the connections first so neither pass pays for them.
+    BenchRun warmup = {&session, mainLoop, url, min(requests, concurrency * 4), 0, 0, 0, {}};
+    for (long i = 0; i < concurrency && warmup.remaining > 0; i++) issue(&warmup);
+    g_main_loop_run(mainLoop);
+    failed += warmup.failed;
+
+    double unpinnedRate = measure("loopback unpinned", session, mainLoop, url, requests, concurrency, bodyBytes, &failed);
+    CpuSet loop = pinned.slice(0, 1);
+    int node;
+    if (!pin_event_loop(loop, &node, &error)) {
+      cerr << error->message << endl;
+      g_error_free(error);
+      return 1;
+    }
+    string label = "loopback pinned to cpu " + loop.to_string() + (node >= 0 ? " (node " + to_string(node) + ")" : "");
+    double pinnedRate = measure(label.c_str(), session, mainLoop, url, requests, concurrency, bodyBytes, &failed);
+    cout << "pinning: " << (pinnedRate - unpinnedRate) / unpinnedRate * 100 << "% req/s" << endl;
+  }
+
+  if (proxy) {
+    const FaultProxy::Stats &stats = proxy->stats();
+    cout << "faults: " << stats.errors << " errors, " << stats.resets << " resets, " << stats.slowloris
+         << " slow-loris, " << stats.throttled << " throttled" << endl;
+  }
+
+  proxy.reset();
+  g_main_loop_unref(mainLoop);
+  // Failures are the point of a fault profile; only a clean run must be clean.
+  return failed && !faults ? 1 : 0;
+}
@@ -0,0 +1,67 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <sys/resource.h>
+
+#include "../loopback_server.h"
+#include "../shard.h"
+#include "../soupclient.h"
+#include "../websocket_load.h"
+
+using namespace std;
+
+// WebSocketLoad against the loopback server's /echo, with server and client
+// on one main loop: connections, message rate per connection, message size,
+// how long to send and optionally "text" for text frames.
+int main(int argc, char **argv) {
+  long connections = argc > 1 ? strtol(argv[1], nullptr, 10) : 1000;
+  double rate = argc > 2 ? strtod(argv[2], nullptr) : 10;
+  size_t messageBytes = argc > 3 ? strtoul(argv[3], nullptr, 10) : 64;
+  long durationMs = argc > 4 ? strtol(argv[4], nullptr, 10) : 5000;
+  bool text = argc > 5 && strcmp(argv[5], "text") == 0;
+  if (connections < 1 || rate <= 0 || durationMs < 1) {
+    cerr << "usage: " << argv[0] << " [CONNECTIONS] [RATE] [MESSAGE_BYTES] [DURATION_MS] [text]" << endl;
+    return 1;
+  }
+
+  // Both ends of every connection live in this process.
+  struct rlimit files;
+  if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+  }
+  if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur != RLIM_INFINITY && (rlim_t) connections * 2 + 64 > files.rlim_cur) {
+    cerr << "warning: " << connections << " connections need about " << connections * 2 << " descriptors, limit is "
+         << files.rlim_cur << endl;
+  }
+
+  LoopbackServer server;
+  GError *error = nullptr;
+  if (!server.start(&error)) {
+    cerr << error->message << endl;
+    g_error_free(error);
+    return 1;
+  }
+
+  WebSocketLoad::Options options;
+  options.connections = (int) connections;
+  options.rate = rate;
+  options.messageBytes = messageBytes;
+  options.durationMs = (guint) durationMs;
+  options.text = text;
+  Session::Options sessionOptions;
+  sessionOptions.maxConns = sessionOptions.maxConnsPerHost = options.connectBurst;
+  Session session(sessionOptions);
+  GMainLoop *mainLoop = g_main_loop_new(nullptr, FALSE);
+
+  WorkerStats *stats = new WorkerStats();
+  {
+    WebSocketLoad load(session, {server.echo_url()}, options, *stats);
+    load.run(mainLoop);
+    load.print_summary(cout);
+  }
+  delete stats;
+  g_main_loop_unref(mainLoop);
+  return 0;
+}
@@ -0,0 +1,47 @@
+#include "budget.h"
+
+#include <algorithm>
+
+using namespace std;
+
+MemoryBudget::MemoryBudget(Session &session, size_t limitBytes)
+    : session_(session), limit_(limitBytes), lowWater_(limitBytes / 4 * 3), used_(0), peak_(0), pauses_(0) {}
+
+MemoryBudget::~MemoryBudget() {
+  g_warn_if_fail(paused_.empty());
+}
+
+void MemoryBudget::watch(SoupMessage *msg) {
+  g_signal_connect(msg, "got-chunk", G_CALLBACK(on_got_chunk), this);
+}
+
+void MemoryBudget::forget(SoupMessage *msg) {
+  g_signal_handlers_disconnect_by_data(msg, this);
+  paused_.erase(remove(paused_.begin(), paused_.end(), msg), paused_.end());
+}
+
+void MemoryBudget::on_got_chunk(SoupMessage *msg, SoupBuffer *chunk, gpointer usr_data) {
+  MemoryBudget *budget = (MemoryBudget *) usr_data;
+  budget->charge(chunk->length);
+  if (budget->used_ > budget->limit_) {
+    budget->pauses_++;
+    budget->paused_.push_back(msg);
+    budget->session_.pause(msg);
+  }
+}
+
+void MemoryBudget::charge(size_t bytes) {
+  used_ += bytes;
+  peak_ = max(peak_, used_);
+}
+
+void MemoryBudget::release(size_t bytes) {
+  used_ -= min(bytes, used_);
+  if (used_ >= lowWater_ || paused_.empty()) return;
+
+  // Swap out first: an unpaused message may deliver a chunk and pause again
+  // before we are done here.
+  vector<SoupMessage *> resume;
+  resume.swap(paused_);
+  for (SoupMessage *msg : resume) session_.unpause(msg);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <libsoup/soup.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "soupclient.h"
+
+// Byte budget shared by every body buffered between the network and a sink.
+// Chunks are charged as they arrive; a message whose chunk pushes usage over
+// the limit is paused until consumers release enough to drop below the low
+// water mark. Usage can overshoot by at most one chunk per watched message.
+// Only watch messages whose body streams to a consumer that releases as it
+// goes; a body accumulating in its message would stay paused for good.
+class MemoryBudget {
+public:
+  MemoryBudget(Session &session, size_t limitBytes);
+  ~MemoryBudget();
+
+  MemoryBudget(const MemoryBudget &) = delete;
+  MemoryBudget &operator=(const MemoryBudget &) = delete;
+
+  // Charges every chunk msg receives. Pair with forget() once msg completes.
+  void watch(SoupMessage *msg);
+  void forget(SoupMessage *msg);
+
+  void charge(size_t bytes);
+  // Resumes paused messages once usage falls below the low water mark.
+  void release(size_t bytes);
+
+  size_t limit() const { return limit_; }
+  size_t used() const { return used_; }
+  size_t peak() const { return peak_; }
+  uint64_t pauses() const { return pauses_; }
+
+private:
+  static void on_got_chunk(SoupMessage *msg, SoupBuffer *chunk, gpointer usr_data);
+
+  Session &session_;
+  size_t limit_;
+  size_t lowWater_;
+  size_t used_;
+  size_t peak_;
+  uint64_t pauses_;
+  std::vector<SoupMessage *> paused_;
+};
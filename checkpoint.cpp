@@ -0,0 +1,468 @@
+#include "checkpoint.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+using namespace std;
+
+G_DEFINE_QUARK(libsouptest-checkpoint-error-quark, checkpoint_error)
+
+static const char CHECKPOINT_MAGIC[4] = {'S', 'C', 'K', 'P'};
+static const unsigned char CHECKPOINT_VERSION = 1;
+static const size_t RECORD_SIZE = 16;
+// magic, version, count, fingerprint
+static const size_t HEADER_SIZE = 4 + 1 + 4 + 8;
+
+static void
+put_le(string &buf, uint64_t v, int bytes) {
+  for (int i = 0; i < bytes; i++) buf += (char) (v >> (8 * i));
+}
+
+static uint64_t
+get_le(const unsigned char *p, int bytes) {
+  uint64_t v = 0;
+  for (int i = 0; i < bytes; i++) v |= (uint64_t) p[i] << (8 * i);
+  return v;
+}
+
+static void
+set_io_error(GError **error, const string &what) {
+  int err = errno;
+  g_set_error(error, CHECKPOINT_ERROR, CHECKPOINT_ERROR_IO, "%s: %s", what.c_str(), g_strerror(err));
+}
+
+static bool
+write_all(int fd, const char *p, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      if (n == 0) errno = EIO;
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Low 16 bits of the XXH64 of the record with its check field zeroed.
+static uint16_t
+record_check(const unsigned char *record) {
+  unsigned char copy[RECORD_SIZE];
+  memcpy(copy, record, RECORD_SIZE);
+  copy[6] = copy[7] = 0;
+  XxHash64 hash;
+  hash.update(copy, RECORD_SIZE);
+  return (uint16_t) hash.digest();
+}
+
+CheckpointJournal::~CheckpointJournal() {
+  if (walFd_ >= 0) {
+    GError *error = nullptr;
+    if (!close(&error)) {
+      g_warning("Checkpoint not saved: %s", error->message);
+      g_error_free(error);
+    }
+  }
+}
+
+uint64_t CheckpointJournal::fingerprint(const char *const *urls, uint32_t *count) {
+  XxHash64 hash;
+  uint32_t n = 0;
+  for (const char *const *url = urls; *url; url++, n++) hash.update(*url, strlen(*url) + 1);
+  if (count) *count = n;
+  return hash.digest();
+}
+
+gboolean CheckpointJournal::open(const char *path, uint32_t count, uint64_t fingerprint, const Options &options, GError **error) {
+  path_ = path;
+  walPath_ = path_ + ".wal";
+  options_ = options;
+  count_ = count;
+  fingerprint_ = fingerprint;
+  bitmap_.assign((count + 7) / 8, 0);
+  partial_.clear();
+  completed_ = 0;
+  recovered_ = 0;
+
+  if (g_file_test(path, G_FILE_TEST_EXISTS)) return load_snapshot(error) && replay_log(error);
+
+  // The snapshot goes first, so a log on disk always has one to apply to.
+  if (!write_snapshot(error)) return FALSE;
+  walFd_ = ::open(walPath_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if (walFd_ < 0) {
+    set_io_error(error, walPath_);
+    return FALSE;
+  }
+  walRecords_ = 0;
+  return TRUE;
+}
+
+gboolean CheckpointJournal::load_snapshot(GError **error) {
+  gchar *contents;
+  gsize length;
+  if (!g_file_get_contents(path_.c_str(), &contents, &length, error)) return FALSE;
+  const unsigned char *p = (const unsigned char *) contents;
+
+  size_t bitmapBytes = bitmap_.size();
+  gboolean ok = FALSE;
+  if (length < HEADER_SIZE || memcmp(p, CHECKPOINT_MAGIC, 4) != 0 || p[4] != CHECKPOINT_VERSION) {
+    g_set_error(error, CHECKPOINT_ERROR, CHECKPOINT_ERROR_FORMAT, "%s: not a checkpoint journal", path_.c_str());
+  } else if (get_le(p + 5, 4) != count_ || get_le(p + 9, 8) != fingerprint_) {
+    g_set_error(error, CHECKPOINT_ERROR, CHECKPOINT_ERROR_MISMATCH,
+                "%s: journal was written for a different URL list (%u urls)", path_.c_str(), (unsigned) get_le(p + 5, 4));
+  } else {
+    size_t partials = length >= HEADER_SIZE + bitmapBytes + 4 + 8 ? get_le(p + HEADER_SIZE + bitmapBytes, 4) : 0;
+    XxHash64 hash;
+    if (length == HEADER_SIZE + bitmapBytes + 4 + partials * 12 + 8) hash.update(p, length - 8);
+    if (length != HEADER_SIZE + bitmapBytes + 4 + partials * 12 + 8 || hash.digest() != get_le(p + length - 8, 8)) {
+      g_set_error(error, CHECKPOINT_ERROR, CHECKPOINT_ERROR_FORMAT, "%s: snapshot is corrupt", path_.c_str());
+    } else {
+      memcpy(bitmap_.data(), p + HEADER_SIZE, bitmapBytes);
+      for (uint32_t id = 0; id < count_; id++) completed_ += done(id);
+      const unsigned char *entry = p + HEADER_SIZE + bitmapBytes + 4;
+      for (size_t i = 0; i < partials; i++, entry += 12) {
+        uint32_t id = (uint32_t) get_le(entry, 4);
+        if (id < count_) partial_[id] = get_le(entry + 4, 8);
+      }
+      ok = TRUE;
+    }
+  }
+  g_free(contents);
+  return ok;
+}
+
+gboolean CheckpointJournal::replay_log(GError **error) {
+  walFd_ = ::open(walPath_.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (walFd_ < 0) {
+    set_io_error(error, walPath_);
+    return FALSE;
+  }
+
+  unsigned char record[RECORD_SIZE];
+  off_t good = 0;
+  for (;;) {
+    ssize_t n = pread(walFd_, record, RECORD_SIZE, good);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      set_io_error(error, walPath_);
+      return FALSE;
+    }
+    if ((size_t) n < RECORD_SIZE) break;
+
+    uint32_t id = (uint32_t) get_le(record, 4);
+    uint16_t kind = (uint16_t) get_le(record + 4, 2);
+    if (id >= count_ || (kind != DONE && kind != PARTIAL) || get_le(record + 6, 2) != record_check(record)) break;
+    apply(id, (Kind) kind, get_le(record + 8, 8));
+    good += RECORD_SIZE;
+  }
+
+  // Whatever follows the last good record is a torn write from a crash.
+  struct stat st;
+  if (fstat(walFd_, &st) == 0 && st.st_size > good && ftruncate(walFd_, good) != 0) {
+    set_io_error(error, walPath_);
+    return FALSE;
+  }
+  walRecords_ = recovered_ = (size_t) good / RECORD_SIZE;
+  return TRUE;
+}
+
+gboolean CheckpointJournal::write_snapshot(GError **error) {
+  string buf(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+  buf += (char) CHECKPOINT_VERSION;
+  put_le(buf, count_, 4);
+  put_le(buf, fingerprint_, 8);
+  buf.append((const char *) bitmap_.data(), bitmap_.size());
+  put_le(buf, partial_.size(), 4);
+  for (const auto &entry : partial_) {
+    put_le(buf, entry.first, 4);
+    put_le(buf, entry.second, 8);
+  }
+  XxHash64 hash;
+  hash.update(buf.data(), buf.size());
+  put_le(buf, hash.digest(), 8);
+
+  string tmpPath = path_ + ".tmp";
+  int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    set_io_error(error, tmpPath);
+    return FALSE;
+  }
+  if (!write_all(fd, buf.data(), buf.size()) || fsync(fd) != 0) {
+    set_io_error(error, tmpPath);
+    ::close(fd);
+    return FALSE;
+  }
+  if (::close(fd) != 0 || rename(tmpPath.c_str(), path_.c_str()) != 0) {
+    set_io_error(error, path_);
+    return FALSE;
+  }
+
+  // Make the rename itself durable.
+  char *dir = g_path_get_dirname(path_.c_str());
+  int dirFd = ::open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  g_free(dir);
+  if (dirFd >= 0) {
+    fsync(dirFd);
+    ::close(dirFd);
+  }
+  return TRUE;
+}
+
+void CheckpointJournal::apply(uint32_t id, Kind kind, uint64_t value) {
+  if (done(id)) return;
+  if (kind == DONE) {
+    bitmap_[id >> 3] |= (uint8_t) (1 << (id & 7));
+    completed_++;
+    partial_.erase(id);
+  } else if (value) {
+    partial_[id] = value;
+  } else {
+    partial_.erase(id);
+  }
+}
+
+uint64_t CheckpointJournal::partial(uint32_t id) const {
+  auto it = partial_.find(id);
+  return it == partial_.end() ? 0 : it->second;
+}
+
+void CheckpointJournal::mark_done(uint32_t id) {
+  if (id >= count_ || done(id)) return;
+  apply(id, DONE, 0);
+  append(id, DONE, 0);
+}
+
+void CheckpointJournal::mark_partial(uint32_t id, uint64_t bytes) {
+  if (id >= count_ || done(id)) return;
+  apply(id, PARTIAL, bytes);
+  append(id, PARTIAL, bytes);
+}
+
+void CheckpointJournal::append(uint32_t id, Kind kind, uint64_t value) {
+  size_t start = pending_.size();
+  put_le(pending_, id, 4);
+  put_le(pending_, kind, 2);
+  put_le(pending_, 0, 2);
+  put_le(pending_, value, 8);
+  unsigned char *record = (unsigned char *) &pending_[start];
+  uint16_t check = record_check(record);
+  record[6] = (unsigned char) check;
+  record[7] = (unsigned char) (check >> 8);
+
+  if (pending_.size() / RECORD_SIZE >= options_.syncBatch) {
+    start_sync();
+  } else if (!syncTimer_) {
+    syncTimer_ = g_timeout_add(options_.syncIntervalMs, on_sync_timer, this);
+  }
+}
+
+gboolean CheckpointJournal::on_sync_timer(gpointer data) {
+  CheckpointJournal *journal = (CheckpointJournal *) data;
+  journal->syncTimer_ = 0;
+  journal->start_sync();
+  return G_SOURCE_REMOVE;
+}
+
+// Hands the pending batch to the writer, or syncs it right here without one.
+// Records appended while a batch is out follow as soon as it lands.
+void CheckpointJournal::start_sync() {
+  if (!writer_) {
+    GError *error = nullptr;
+    if (!sync(&error)) {
+      g_warning("Checkpoint sync failed: %s", error->message);
+      g_error_free(error);
+    }
+    return;
+  }
+  if (syncTimer_) {
+    g_source_remove(syncTimer_);
+    syncTimer_ = 0;
+  }
+  if (writing_ || pending_.empty() || walFd_ < 0) return;
+
+  GBytes *batch = g_bytes_new(pending_.data(), pending_.size());
+  pending_.clear();
+  writing_ = true;
+  writer_->write_at(walFd_, walRecords_ * RECORD_SIZE, batch, true, [this, batch](int err) {
+    writing_ = false;
+    gsize len;
+    const char *data = (const char *) g_bytes_get_data(batch, &len);
+    if (err) {
+      g_warning("Checkpoint sync failed: %s: %s", walPath_.c_str(), g_strerror(err));
+      // As in sync(): no torn record stays behind, and the batch goes out
+      // again ahead of anything appended since.
+      if (ftruncate(walFd_, (off_t) (walRecords_ * RECORD_SIZE)) != 0) g_warning("%s: %s", walPath_.c_str(), g_strerror(errno));
+      pending_.insert(0, data, len);
+      if (!syncTimer_) syncTimer_ = g_timeout_add(options_.syncIntervalMs, on_sync_timer, this);
+    } else {
+      walRecords_ += len / RECORD_SIZE;
+      GError *error = nullptr;
+      if (walRecords_ >= options_.compactRecords && !compact(&error)) {
+        g_warning("Checkpoint compaction failed: %s", error->message);
+        g_error_free(error);
+      }
+      if (!pending_.empty()) start_sync();
+    }
+    g_bytes_unref(batch);
+  });
+}
+
+void CheckpointJournal::wait_for_writer() {
+  while (writing_) g_main_context_iteration(nullptr, TRUE);
+}
+
+gboolean CheckpointJournal::sync(GError **error) {
+  wait_for_writer();
+  if (syncTimer_) {
+    g_source_remove(syncTimer_);
+    syncTimer_ = 0;
+  }
+  if (pending_.empty() || walFd_ < 0) return TRUE;
+
+  if (!write_all(walFd_, pending_.data(), pending_.size()) || fdatasync(walFd_) != 0) {
+    set_io_error(error, walPath_);
+    // Drop whatever part made it, so the retry does not leave a torn record
+    // in the middle of the log.
+    if (ftruncate(walFd_, (off_t) (walRecords_ * RECORD_SIZE)) != 0) g_warning("%s: %s", walPath_.c_str(), g_strerror(errno));
+    return FALSE;
+  }
+  walRecords_ += pending_.size() / RECORD_SIZE;
+  pending_.clear();
+
+  if (walRecords_ >= options_.compactRecords) return compact(error);
+  return TRUE;
+}
+
+gboolean CheckpointJournal::compact(GError **error) {
+  // The snapshot covers everything in memory, pending records included.
+  if (!write_snapshot(error)) return FALSE;
+  pending_.clear();
+  if (ftruncate(walFd_, 0) != 0 || fdatasync(walFd_) != 0) {
+    set_io_error(error, walPath_);
+    return FALSE;
+  }
+  walRecords_ = 0;
+  return TRUE;
+}
+
+gboolean CheckpointJournal::close(GError **error) {
+  if (walFd_ < 0) return TRUE;
+  wait_for_writer();
+  if (syncTimer_) {
+    g_source_remove(syncTimer_);
+    syncTimer_ = 0;
+  }
+  gboolean ok = compact(error);
+  ::close(walFd_);
+  walFd_ = -1;
+  return ok;
+}
+
+PartFile::~PartFile() {
+  g_warn_if_fail(idle());
+  for (GBytes *data : queue_) g_bytes_unref(data);
+  if (fd_ >= 0) ::close(fd_);
+}
+
+gboolean PartFile::open(const string &path, uint64_t resumeFrom, GError **error) {
+  path_ = path;
+  partPath_ = path + ".part";
+  fd_ = ::open(partPath_.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  struct stat st;
+  if (fd_ < 0 || fstat(fd_, &st) != 0) {
+    set_io_error(error, partPath_);
+    return FALSE;
+  }
+  // Bytes past the recorded offset may not have reached the disk intact.
+  size_ = written_ = synced_ = syncTarget_ = min(resumeFrom, (uint64_t) st.st_size);
+  if (ftruncate(fd_, (off_t) size_) != 0) {
+    set_io_error(error, partPath_);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+gboolean PartFile::restart(GError **error) {
+  g_return_val_if_fail(idle(), FALSE);
+  if (ftruncate(fd_, 0) != 0) {
+    set_io_error(error, partPath_);
+    return FALSE;
+  }
+  size_ = written_ = synced_ = syncTarget_ = 0;
+  return TRUE;
+}
+
+void PartFile::append(GBytes *data) {
+  if (err_) return;
+  queue_.push_back(g_bytes_ref(data));
+  size_ += g_bytes_get_size(data);
+  pump();
+}
+
+void PartFile::sync() {
+  syncTarget_ = size_;
+  pump();
+}
+
+void PartFile::pump() {
+  bool sync = syncTarget_ > synced_;
+  if (writing_ || err_ || (queue_.empty() && !sync)) return;
+
+  GBytes *data;
+  if (queue_.size() == 1) {
+    data = queue_.front();
+  } else {
+    // Everything that piled up behind the last write goes out as one.
+    gsize len = (gsize) queued();
+    char *buf = (char *) g_malloc(len);
+    char *p = buf;
+    for (GBytes *chunk : queue_) {
+      gsize n;
+      const void *bytes = g_bytes_get_data(chunk, &n);
+      memcpy(p, bytes, n);
+      p += n;
+      g_bytes_unref(chunk);
+    }
+    data = g_bytes_new_take(buf, len);
+  }
+  queue_.clear();
+
+  size_t len = g_bytes_get_size(data);
+  writing_ = true;
+  writer_->write_at(fd_, written_, data, sync, [this, len, sync](int err) { written(len, sync, err); });
+  g_bytes_unref(data);
+}
+
+void PartFile::written(size_t len, bool synced, int err) {
+  writing_ = false;
+  if (err) {
+    err_ = err;
+    for (GBytes *data : queue_) g_bytes_unref(data);
+    queue_.clear();
+  } else {
+    written_ += len;
+    if (synced) synced_ = written_;
+    pump();
+  }
+  // Last: the callback may delete this.
+  progress_(synced && !err);
+}
+
+gboolean PartFile::commit(GError **error) {
+  g_return_val_if_fail(idle(), FALSE);
+  int fd = fd_;
+  fd_ = -1;
+  if (::close(fd) != 0 || rename(partPath_.c_str(), path_.c_str()) != 0) {
+    set_io_error(error, path_);
+    return FALSE;
+  }
+  return TRUE;
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <glib.h>
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "file_writer.h"
+
+#define CHECKPOINT_ERROR (checkpoint_error_quark())
+GQuark checkpoint_error_quark(void);
+
+enum CheckpointError {
+  CHECKPOINT_ERROR_IO,
+  CHECKPOINT_ERROR_FORMAT,
+  CHECKPOINT_ERROR_MISMATCH,
+};
+
+// Progress of a batch over a fixed, ordered URL list, where a URL's id is its
+// position in the list. Two files:
+//
+//   PATH      snapshot: "SCKP", version, url count, list fingerprint, one bit
+//             per URL, then the partial downloads as (id, bytes) pairs, all
+//             followed by an XXH64 of the lot. Replaced atomically.
+//   PATH.wal  16-byte records appended since the snapshot:
+//             id u32, kind u16, check u16, value u64 (little endian)
+//
+// Records are batched and made durable with one fdatasync per batch, so a
+// crash loses at most the last batch and those URLs are simply fetched again.
+// A torn record at the end of the log is dropped on open. With a FileWriter
+// the batches are written and synced off the main loop, one at a time.
+class CheckpointJournal {
+public:
+  struct Options {
+    // Sync pending records at least this often...
+    guint syncIntervalMs = 200;
+    // ...or as soon as this many are waiting.
+    size_t syncBatch = 1024;
+    // Fold the log into a new snapshot once it holds this many records.
+    size_t compactRecords = 1 << 18;
+  };
+
+  CheckpointJournal() = default;
+  // Syncs and compacts; call close() first to see errors.
+  ~CheckpointJournal();
+  CheckpointJournal(const CheckpointJournal &) = delete;
+  CheckpointJournal &operator=(const CheckpointJournal &) = delete;
+
+  // Creates the journal or recovers an existing one. fingerprint identifies
+  // the URL list; a journal written for another list is refused rather than
+  // silently skipping the wrong URLs.
+  gboolean open(const char *path, uint32_t count, uint64_t fingerprint, const Options &options, GError **error);
+  gboolean open(const char *path, uint32_t count, uint64_t fingerprint, GError **error) {
+    return open(path, count, fingerprint, Options(), error);
+  }
+
+  bool done(uint32_t id) const { return (bitmap_[id >> 3] >> (id & 7)) & 1; }
+  // Durable bytes of an unfinished download, 0 if none.
+  uint64_t partial(uint32_t id) const;
+
+  void mark_done(uint32_t id);
+  // Only record bytes that are already synced to disk.
+  void mark_partial(uint32_t id, uint64_t bytes);
+
+  // Batches go through writer from now on; it must outlive close().
+  void set_writer(FileWriter *writer) { writer_ = writer; }
+
+  // Both wait for a batch still with the writer, running the default context.
+  gboolean sync(GError **error);
+  gboolean close(GError **error);
+
+  uint32_t count() const { return count_; }
+  uint32_t completed() const { return completed_; }
+  // Records replayed from the log on open.
+  size_t recovered() const { return recovered_; }
+
+  // XXH64 over the URLs, each terminated by a NUL.
+  static uint64_t fingerprint(const char *const *urls, uint32_t *count);
+
+private:
+  enum Kind : uint16_t { DONE = 1, PARTIAL = 2 };
+
+  static gboolean on_sync_timer(gpointer data);
+
+  void start_sync();
+  void wait_for_writer();
+
+  gboolean load_snapshot(GError **error);
+  gboolean replay_log(GError **error);
+  gboolean write_snapshot(GError **error);
+  gboolean compact(GError **error);
+  void apply(uint32_t id, Kind kind, uint64_t value);
+  void append(uint32_t id, Kind kind, uint64_t value);
+
+  std::string path_;
+  std::string walPath_;
+  Options options_;
+  uint32_t count_ = 0;
+  uint64_t fingerprint_ = 0;
+  std::vector<uint8_t> bitmap_;
+  std::unordered_map<uint32_t, uint64_t> partial_;
+  uint32_t completed_ = 0;
+  size_t recovered_ = 0;
+
+  int walFd_ = -1;
+  size_t walRecords_ = 0;
+  std::string pending_;
+  guint syncTimer_ = 0;
+  FileWriter *writer_ = nullptr;
+  bool writing_ = false;
+};
+
+// Body of one checkpointed download: appended to PATH.part as it arrives and
+// renamed to PATH once complete, so an interrupted download can continue
+// with a Range request from the last synced offset. Writes and syncs go
+// through a FileWriter, one at a time; whatever arrives meanwhile is written
+// together next.
+class PartFile {
+public:
+  // Runs after each write completes; synced when it also synced the file.
+  // May delete the PartFile.
+  typedef SmallFunction<void(bool synced)> Progress;
+
+  PartFile(FileWriter *writer, Progress progress) : writer_(writer), progress_(std::move(progress)) {}
+  // Keeps the .part file for the next run. Only once idle().
+  ~PartFile();
+  PartFile(const PartFile &) = delete;
+  PartFile &operator=(const PartFile &) = delete;
+
+  // Keeps at most the first resumeFrom bytes of an existing PATH.part.
+  gboolean open(const std::string &path, uint64_t resumeFrom, GError **error);
+  // Discards what is there, for servers that answer a Range with the whole
+  // body. Only once idle().
+  gboolean restart(GError **error);
+  // Queues data after everything appended so far; takes its own reference.
+  void append(GBytes *data);
+  // Asks for an fdatasync once everything appended so far is written.
+  void sync();
+  // Renames PATH.part to PATH. Only once idle(); sync() first to make the
+  // body durable.
+  gboolean commit(GError **error);
+
+  const std::string &path() const { return path_; }
+  const std::string &part_path() const { return partPath_; }
+  uint64_t size() const { return size_; }
+  uint64_t synced() const { return synced_; }
+  // Appended but not yet written.
+  uint64_t queued() const { return size_ - written_; }
+  // Appended since the last sync().
+  uint64_t unsynced() const { return size_ - syncTarget_; }
+  bool idle() const { return !writing_; }
+  // errno of the first failed write; nothing more is written after it.
+  int error() const { return err_; }
+
+private:
+  void pump();
+  void written(size_t len, bool synced, int err);
+
+  FileWriter *writer_;
+  Progress progress_;
+  std::string path_;
+  std::string partPath_;
+  int fd_ = -1;
+  std::deque<GBytes *> queue_;
+  uint64_t size_ = 0;
+  uint64_t written_ = 0;
+  uint64_t synced_ = 0;
+  uint64_t syncTarget_ = 0;
+  bool writing_ = false;
+  int err_ = 0;
+};
@@ -0,0 +1,95 @@
+# Driven by the bench-profiles target: cmake -DSOURCE_DIR=... -DWORK_DIR=...
+# [-DCXX_COMPILER=...] [-DBENCH_ARGS="REQUESTS CONCURRENCY BODY_BYTES"]
+# [-DREPEAT=N] -P BenchProfiles.cmake
+#
+# Each profile gets its own build tree under WORK_DIR; the two PGO stages
+# share one, since GCC names .gcda files after the object paths and the
+# profile must be read from where it was written. Throughput is the
+# best of REPEAT loopback_bench runs, so one noisy run does not decide it.
+
+if (NOT SOURCE_DIR OR NOT WORK_DIR)
+    message(FATAL_ERROR "SOURCE_DIR and WORK_DIR are required")
+endif ()
+if (NOT DEFINED REPEAT)
+    set(REPEAT 3)
+endif ()
+separate_arguments(benchArgs UNIX_COMMAND "${BENCH_ARGS}")
+
+set(common -DCMAKE_BUILD_TYPE=Release)
+if (CXX_COMPILER)
+    list(APPEND common -DCMAKE_CXX_COMPILER=${CXX_COMPILER})
+endif ()
+set(optimized ${common} -DLIBSOUPTEST_LTO=ON -DLIBSOUPTEST_NATIVE=ON)
+set(profileDir ${WORK_DIR}/pgo-profile)
+
+function(build_profile name)
+    set(dir ${WORK_DIR}/${name})
+    message(STATUS "Building ${name}")
+    execute_process(COMMAND ${CMAKE_COMMAND} -S ${SOURCE_DIR} -B ${dir} ${ARGN}
+            OUTPUT_QUIET RESULT_VARIABLE result)
+    if (NOT result EQUAL 0)
+        message(FATAL_ERROR "Configuring ${name} failed")
+    endif ()
+    execute_process(COMMAND ${CMAKE_COMMAND} --build ${dir} --target loopback_bench --parallel
+            OUTPUT_QUIET RESULT_VARIABLE result)
+    if (NOT result EQUAL 0)
+        message(FATAL_ERROR "Building ${name} failed")
+    endif ()
+endfunction()
+
+function(run_bench name outVar)
+    set(best 0)
+    foreach (i RANGE 1 ${REPEAT})
+        execute_process(COMMAND ${WORK_DIR}/${name}/loopback_bench ${benchArgs}
+                OUTPUT_VARIABLE output RESULT_VARIABLE result)
+        if (NOT result EQUAL 0 OR NOT output MATCHES "([0-9]+) req/s")
+            message(FATAL_ERROR "loopback_bench (${name}) failed:\n${output}")
+        endif ()
+        if (CMAKE_MATCH_1 GREATER best)
+            set(best ${CMAKE_MATCH_1})
+        endif ()
+    endforeach ()
+    set(${outVar} ${best} PARENT_SCOPE)
+endfunction()
+
+build_profile(baseline -DCMAKE_BUILD_TYPE=RelWithDebInfo ${common})
+build_profile(release ${optimized})
+
+# PGO: instrument, train on the benchmark, rebuild with the profile in the
+# same tree.
+file(REMOVE_RECURSE ${profileDir})
+build_profile(pgo ${optimized} -DLIBSOUPTEST_PGO=GENERATE -DLIBSOUPTEST_PGO_DIR=${profileDir})
+run_bench(pgo ignored)
+file(GLOB rawProfiles ${profileDir}/*.profraw)
+if (rawProfiles)
+    find_program(LLVM_PROFDATA llvm-profdata REQUIRED)
+    execute_process(COMMAND ${LLVM_PROFDATA} merge -output=${profileDir}/default.profdata ${rawProfiles}
+            RESULT_VARIABLE result)
+    if (NOT result EQUAL 0)
+        message(FATAL_ERROR "llvm-profdata merge failed")
+    endif ()
+endif ()
+build_profile(pgo ${optimized} -DLIBSOUPTEST_PGO=USE -DLIBSOUPTEST_PGO_DIR=${profileDir})
+
+run_bench(baseline baselineRate)
+message("")
+message("profile        req/s   vs baseline")
+foreach (name baseline release pgo)
+    run_bench(${name} rate)
+    # Tenths of a percent, in integer math.
+    math(EXPR permille "(${rate} - ${baselineRate}) * 1000 / ${baselineRate}")
+    math(EXPR whole "${permille} / 10")
+    math(EXPR tenth "${permille} % 10")
+    if (tenth LESS 0)
+        math(EXPR tenth "-${tenth}")
+    endif ()
+    if (permille LESS 0 AND whole EQUAL 0)
+        set(whole "-0")
+    elseif (permille GREATER_EQUAL 0)
+        set(whole "+${whole}")
+    endif ()
+    string(LENGTH "${name}" len)
+    math(EXPR pad "14 - ${len}")
+    string(REPEAT " " ${pad} spaces)
+    message("${name}${spaces} ${rate}   ${whole}.${tenth}%")
+endforeach ()
@@ -0,0 +1,70 @@
+#include "coalesce.h"
+
+#include <cstring>
+
+using namespace std;
+
+vector<string> RequestCoalescer::default_vary_headers() {
+  return {"Accept", "Accept-Encoding", "Accept-Language", "Authorization", "Cookie", "Range"};
+}
+
+RequestCoalescer::RequestCoalescer(Session &session, vector<string> varyHeaders)
+    : session_(session), varyHeaders_(std::move(varyHeaders)), sent_(0), coalesced_(0) {}
+
+RequestCoalescer::~RequestCoalescer() {
+  // Outstanding leaders still point at their InFlight; the session must be
+  // drained before the coalescer goes away.
+  g_warn_if_fail(inFlight_.empty());
+}
+
+string RequestCoalescer::key_for(SoupMessage *msg) const {
+  char *url = soup_uri_to_string(soup_message_get_uri(msg), FALSE);
+  string key = msg->method;
+  key += ' ';
+  key += url;
+  g_free(url);
+
+  for (const string &name : varyHeaders_) {
+    const char *value = soup_message_headers_get_list(msg->request_headers, name.c_str());
+    key += '\n';
+    if (value) key += value;
+  }
+  return key;
+}
+
+void RequestCoalescer::queue(Request &&request, Completion done) {
+  SoupMessage *msg = request.message();
+  // Only safe methods are shared; anything else goes straight through.
+  bool shareable = msg && (strcmp(msg->method, "GET") == 0 || strcmp(msg->method, "HEAD") == 0);
+
+  string key;
+  if (shareable) {
+    key = key_for(msg);
+    auto it = inFlight_.find(key);
+    if (it != inFlight_.end()) {
+      coalesced_++;
+      it->second->waiters.push_back(std::move(done));
+      return;
+    }
+  }
+
+  InFlight *flight = new InFlight{key, shareable, {}};
+  flight->waiters.push_back(std::move(done));
+  if (shareable) inFlight_.emplace(std::move(key), flight);
+  sent_++;
+  session_.queue(std::move(request), [this, flight](Response &response) { complete(flight, response); });
+}
+
+void RequestCoalescer::complete(InFlight *flight, Response &response) {
+  // Later identical requests start a fresh fetch from here on.
+  if (flight->shared) inFlight_.erase(flight->key);
+
+  SoupBuffer *body = soup_message_body_flatten(response.message()->response_body);
+  GBytes *bytes = soup_buffer_get_as_bytes(body);
+  soup_buffer_free(body);
+
+  SharedResponse shared(response.message(), bytes);
+  g_bytes_unref(bytes);
+  for (Completion &waiter : flight->waiters) waiter(shared);
+  delete flight;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <libsoup/soup.h>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "soupclient.h"
+
+// Completed response shared by every caller that asked for it. Holds a
+// reference on the leader's message and on its flattened body, so waiters see
+// the same bytes without a copy each.
+class SharedResponse {
+public:
+  SharedResponse(SoupMessage *msg, GBytes *body) noexcept : msg_(MessageHandle::ref(msg)), body_(body ? g_bytes_ref(body) : nullptr) {}
+  SharedResponse(SharedResponse &&other) noexcept : msg_(std::move(other.msg_)), body_(std::exchange(other.body_, nullptr)) {}
+  SharedResponse(const SharedResponse &) = delete;
+  SharedResponse &operator=(const SharedResponse &) = delete;
+  ~SharedResponse() {
+    if (body_) g_bytes_unref(body_);
+  }
+
+  SoupMessage *message() const noexcept { return msg_.get(); }
+  guint status() const noexcept { return msg_->status_code; }
+  bool ok() const noexcept { return SOUP_STATUS_IS_SUCCESSFUL(msg_->status_code); }
+  const char *reason() const noexcept { return msg_->reason_phrase; }
+  const char *header(const char *name) const { return soup_message_headers_get_one(msg_->response_headers, name); }
+  SoupURI *uri() const { return soup_message_get_uri(msg_.get()); }
+
+  // New reference to the body; never NULL for a completed message.
+  GBytes *body() const { return g_bytes_ref(body_); }
+  const char *body_data() const { return body_ ? (const char *) g_bytes_get_data(body_, nullptr) : nullptr; }
+  size_t body_size() const { return body_ ? g_bytes_get_size(body_) : 0; }
+
+private:
+  MessageHandle msg_;
+  GBytes *body_;
+};
+
+// Single-flight layer in front of Session::queue(). An idempotent request
+// whose method, URL and vary headers match one already in flight is not sent;
+// its completion is attached to the in-flight one instead.
+class RequestCoalescer {
+public:
+  typedef SmallFunction<void(const SharedResponse &)> Completion;
+
+  // varyHeaders: request headers that distinguish otherwise identical
+  // requests. Defaults to those that usually change the representation.
+  explicit RequestCoalescer(Session &session, std::vector<std::string> varyHeaders = default_vary_headers());
+  ~RequestCoalescer();
+
+  RequestCoalescer(const RequestCoalescer &) = delete;
+  RequestCoalescer &operator=(const RequestCoalescer &) = delete;
+
+  void queue(Request &&request, Completion done);
+
+  uint64_t sent() const { return sent_; }
+  uint64_t coalesced() const { return coalesced_; }
+
+  static std::vector<std::string> default_vary_headers();
+
+private:
+  struct InFlight {
+    std::string key;
+    bool shared;
+    std::vector<Completion> waiters;
+  };
+
+  std::string key_for(SoupMessage *msg) const;
+  void complete(InFlight *flight, Response &response);
+
+  Session &session_;
+  std::vector<std::string> varyHeaders_;
+  std::unordered_map<std::string, InFlight *> inFlight_;
+  uint64_t sent_;
+  uint64_t coalesced_;
+};
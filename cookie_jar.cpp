@@ -0,0 +1,124 @@
+#include "cookie_jar.h"
+
+#include <cstring>
+
+using namespace std;
+
+bool CookieJar::path_matches(const string &cookiePath, const char *path) {
+  size_t len = cookiePath.size();
+  if (strncmp(path, cookiePath.c_str(), len) != 0) return false;
+  return path[len] == '\0' || path[len] == '/' || (len > 0 && cookiePath[len - 1] == '/');
+}
+
+void CookieJar::header_for(SoupURI *uri, string &out) {
+  if (!uri->host) return;
+  gint64 now = g_get_real_time();
+  bool https = uri->scheme == SOUP_URI_SCHEME_HTTPS;
+  const char *path = uri->path && *uri->path ? uri->path : "/";
+
+  // The host itself, then each parent domain short of the top level.
+  string domain = uri->host;
+  for (size_t start = 0;;) {
+    auto it = byDomain_.find(start ? domain.substr(start) : domain);
+    if (it != byDomain_.end()) {
+      vector<Cookie> &cookies = it->second;
+      for (size_t i = 0; i < cookies.size();) {
+        Cookie &cookie = cookies[i];
+        if (cookie.expiresUs && cookie.expiresUs <= now) {
+          cookies[i] = std::move(cookies.back());
+          cookies.pop_back();
+          size_--;
+          continue;
+        }
+        if ((start == 0 || !cookie.hostOnly) && (https || !cookie.secure) && path_matches(cookie.path, path)) {
+          if (!out.empty()) out += "; ";
+          out += cookie.name;
+          out += '=';
+          out += cookie.value;
+        }
+        i++;
+      }
+      if (cookies.empty()) byDomain_.erase(it);
+    }
+    size_t dot = domain.find('.', start);
+    if (dot == string::npos || domain.find('.', dot + 1) == string::npos) break;
+    start = dot + 1;
+  }
+}
+
+void CookieJar::store(SoupMessage *msg) {
+  GSList *parsed = soup_cookies_from_response(msg);
+  for (GSList *l = parsed; l; l = l->next) {
+    SoupCookie *soupCookie = (SoupCookie *) l->data;
+    const char *domain = soup_cookie_get_domain(soupCookie);
+    if (!domain || !*domain) continue;
+
+    SoupDate *expires = soup_cookie_get_expires(soupCookie);
+    Cookie cookie{soup_cookie_get_name(soupCookie), soup_cookie_get_value(soupCookie),
+                  soup_cookie_get_path(soupCookie) ? soup_cookie_get_path(soupCookie) : "/",
+                  expires ? (gint64) soup_date_to_time_t(expires) * G_USEC_PER_SEC : 0,
+                  (bool) soup_cookie_get_secure(soupCookie), domain[0] != '.', 0};
+    // libsoup marks domain cookies with a leading dot.
+    add(domain[0] == '.' ? domain + 1 : domain, std::move(cookie));
+  }
+  soup_cookies_free(parsed);
+}
+
+void CookieJar::add(const char *domain, Cookie &&cookie) {
+  bool expired = cookie.expiresUs && cookie.expiresUs <= g_get_real_time();
+  auto it = byDomain_.find(domain);
+  if (it != byDomain_.end()) {
+    vector<Cookie> &cookies = it->second;
+    for (size_t i = 0; i < cookies.size(); i++) {
+      if (cookies[i].name == cookie.name && cookies[i].path == cookie.path && cookies[i].hostOnly == cookie.hostOnly) {
+        if (expired) {
+          remove(it, i);
+        } else {
+          cookie.seq = cookies[i].seq;
+          cookies[i] = std::move(cookie);
+        }
+        return;
+      }
+    }
+  }
+  if (expired) return;
+
+  cookie.seq = nextSeq_++;
+  if (it != byDomain_.end() && it->second.size() >= MAX_PER_DOMAIN) {
+    vector<Cookie> &cookies = it->second;
+    size_t oldest = 0;
+    for (size_t i = 1; i < cookies.size(); i++) {
+      if (cookies[i].seq < cookies[oldest].seq) oldest = i;
+    }
+    remove(it, oldest);
+  } else if (size_ >= MAX_COOKIES) {
+    evict_oldest();
+    it = byDomain_.find(domain);
+  }
+  if (it == byDomain_.end()) it = byDomain_.emplace(domain, vector<Cookie>()).first;
+  it->second.push_back(std::move(cookie));
+  size_++;
+}
+
+void CookieJar::remove(DomainMap::iterator it, size_t i) {
+  vector<Cookie> &cookies = it->second;
+  cookies[i] = std::move(cookies.back());
+  cookies.pop_back();
+  size_--;
+  if (cookies.empty()) byDomain_.erase(it);
+}
+
+// A scan of the whole jar, but only when it is full.
+void CookieJar::evict_oldest() {
+  auto oldestDomain = byDomain_.end();
+  size_t oldest = 0;
+  for (auto it = byDomain_.begin(); it != byDomain_.end(); ++it) {
+    for (size_t i = 0; i < it->second.size(); i++) {
+      if (oldestDomain == byDomain_.end() || it->second[i].seq < oldestDomain->second[oldest].seq) {
+        oldestDomain = it;
+        oldest = i;
+      }
+    }
+  }
+  if (oldestDomain != byDomain_.end()) remove(oldestDomain, oldest);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <libsoup/soup.h>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Flat cookie store for one Session, in place of SoupCookieJar. Cookies sit
+// in small vectors keyed by the domain they were set for, so building a
+// request's Cookie header is one hash lookup per label of the host rather
+// than a scan of every domain. There is no locking and no persistence: each
+// worker's session keeps its own jar, and with --procs one host's cookies
+// stay in the worker that fetches it.
+class CookieJar {
+public:
+  // RFC 6265 minimums, which browsers use as limits too. Past either one the
+  // oldest cookie goes first (of the domain, or of the whole jar).
+  static const size_t MAX_PER_DOMAIN = 50;
+  static const size_t MAX_COOKIES = 3000;
+
+  CookieJar() = default;
+  CookieJar(const CookieJar &) = delete;
+  CookieJar &operator=(const CookieJar &) = delete;
+
+  // Appends "name=value; ..." for every cookie that applies to uri; leaves
+  // out untouched when none do.
+  void header_for(SoupURI *uri, std::string &out);
+  // Stores (or, when already expired, removes) every Set-Cookie of msg's
+  // response, as validated by libsoup's parser against the request URI.
+  void store(SoupMessage *msg);
+
+  size_t size() const { return size_; }
+
+private:
+  struct Cookie {
+    std::string name;
+    std::string value;
+    std::string path;
+    // Microseconds of real time; 0 for a session cookie.
+    gint64 expiresUs;
+    bool secure;
+    // Set without a Domain attribute: only for that exact host.
+    bool hostOnly;
+    // Order of creation, kept when the cookie is replaced.
+    uint64_t seq;
+  };
+  typedef std::unordered_map<std::string, std::vector<Cookie>> DomainMap;
+
+  void add(const char *domain, Cookie &&cookie);
+  // Drops the domain's entry along with its last cookie.
+  void remove(DomainMap::iterator it, size_t i);
+  void evict_oldest();
+  static bool path_matches(const std::string &cookiePath, const char *path);
+
+  DomainMap byDomain_;
+  size_t size_ = 0;
+  uint64_t nextSeq_ = 0;
+};
@@ -0,0 +1,140 @@
+#include "crawler.h"
+
+#include <ostream>
+
+using namespace std;
+
+string normalize_url(SoupURI *uri) {
+  if (uri->scheme != SOUP_URI_SCHEME_HTTP && uri->scheme != SOUP_URI_SCHEME_HTTPS) return string();
+  if (!uri->host || !*uri->host) return string();
+
+  SoupURI *copy = soup_uri_copy(uri);
+  soup_uri_set_fragment(copy, nullptr);
+  if (!copy->path || !*copy->path) soup_uri_set_path(copy, "/");
+  if (copy->query && !*copy->query) soup_uri_set_query(copy, nullptr);
+
+  char *str = soup_uri_to_string(copy, FALSE);
+  string normalized(str);
+  g_free(str);
+  soup_uri_free(copy);
+  return normalized;
+}
+
+string Crawler::host_key(SoupURI *uri) {
+  return string(uri->host) + ":" + to_string(uri->port);
+}
+
+Crawler::Crawler(const Options &options, StartFn start)
+    : options_(options), start_(std::move(start)), seen_(options.expectedUrls),
+      timer_(0), timerAt_(0), seq_(0), inFlight_(0), started_(0), queued_(0), duplicates_(0), startFailures_(0) {}
+
+Crawler::~Crawler() {
+  if (timer_) g_source_remove(timer_);
+}
+
+bool Crawler::add(const char *url, int depth) {
+  SoupURI *uri = soup_uri_new(url);
+  if (!uri) return false;
+  bool added = add(uri, depth);
+  soup_uri_free(uri);
+  return added;
+}
+
+bool Crawler::add(SoupURI *uri, int depth) {
+  if (depth > options_.maxDepth) return false;
+
+  string url = normalize_url(uri);
+  if (url.empty()) return false;
+  if (!seen_.insert(url.data(), url.size())) {
+    duplicates_++;
+    return false;
+  }
+
+  string key = host_key(uri);
+  Host &host = hosts_[key];
+  bool wasEmpty = host.pending.empty();
+  host.pending.push(Entry{std::move(url), depth, seq_++});
+  queued_++;
+  if (wasEmpty && !host.busy) schedule_host(key, host);
+  return true;
+}
+
+void Crawler::schedule_host(const string &key, Host &host) {
+  ready_.push(ReadyHost(host.readyAt, key));
+}
+
+void Crawler::completed(const string &url) {
+  SoupURI *uri = soup_uri_new(url.c_str());
+  if (uri) {
+    string key = host_key(uri);
+    soup_uri_free(uri);
+
+    auto it = hosts_.find(key);
+    if (it != hosts_.end()) {
+      Host &host = it->second;
+      host.busy = false;
+      host.readyAt = g_get_monotonic_time() + (gint64) options_.delayMs * 1000;
+      if (!host.pending.empty()) schedule_host(key, host);
+    }
+  }
+
+  inFlight_--;
+  pump();
+}
+
+void Crawler::pump() {
+  gint64 now = g_get_monotonic_time();
+
+  while (inFlight_ < options_.concurrency && page_budget_left() && !ready_.empty()) {
+    const ReadyHost &next = ready_.top();
+    if (next.first > now) {
+      // A host that finished since the timer was armed can be due sooner.
+      if (timer_ && next.first < timerAt_) {
+        g_source_remove(timer_);
+        timer_ = 0;
+      }
+      if (!timer_) {
+        guint waitMs = (guint) ((next.first - now + 999) / 1000);
+        timer_ = g_timeout_add(waitMs, on_timer, this);
+        timerAt_ = next.first;
+      }
+      return;
+    }
+
+    string key = next.second;
+    ready_.pop();
+    Host &host = hosts_[key];
+    Entry entry = host.pending.top();
+    host.pending.pop();
+    host.busy = true;
+
+    inFlight_++;
+    started_++;
+    if (!start_(entry.url, entry.depth)) {
+      // Nothing will complete it; let the host's next URL go instead.
+      inFlight_--;
+      started_--;
+      startFailures_++;
+      host.busy = false;
+      if (!host.pending.empty()) schedule_host(key, host);
+    }
+  }
+}
+
+gboolean Crawler::on_timer(gpointer data) {
+  Crawler *crawler = (Crawler *) data;
+  crawler->timer_ = 0;
+  crawler->pump();
+  return G_SOURCE_REMOVE;
+}
+
+bool Crawler::idle() const {
+  return inFlight_ == 0 && (ready_.empty() || !page_budget_left());
+}
+
+void Crawler::print_stats(ostream &out) const {
+  out << "crawl: " << started_ << " pages fetched, " << queued_ << " urls queued, "
+      << duplicates_ << " duplicates dropped, " << startFailures_ << " failed to start, " << hosts_.size() << " hosts" << endl;
+  out << "crawl: seen filter " << seen_.size() << " urls in " << seen_.memory_bytes() << " bytes ("
+      << (seen_.size() ? seen_.memory_bytes() / seen_.size() : 0) << " bytes/url)" << endl;
+}
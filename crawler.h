@@ -0,0 +1,95 @@
+#pragma once
+
+#include <libsoup/soup.h>
+
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "url_filter.h"
+
+// Normalized form used for dedup: http(s) only, no fragment, empty path as
+// "/", default port dropped. Returns an empty string for URLs not worth
+// crawling.
+std::string normalize_url(SoupURI *uri);
+
+// URL frontier with per-host politeness. Each host has at most one fetch in
+// flight and waits delayMs between fetches; within a host, shallower pages go
+// first. start is invoked for every URL handed to the session and returns
+// false if it could not be started, in which case the URL is dropped.
+class Crawler {
+public:
+  struct Options {
+    int maxDepth;
+    guint delayMs;
+    int concurrency;
+    size_t maxPages;
+    size_t expectedUrls;
+  };
+
+  typedef std::function<bool(const std::string &url, int depth)> StartFn;
+
+  Crawler(const Options &options, StartFn start);
+  ~Crawler();
+
+  Crawler(const Crawler &) = delete;
+  Crawler &operator=(const Crawler &) = delete;
+
+  // Returns true if the URL was new and has been queued.
+  bool add(SoupURI *uri, int depth);
+  bool add(const char *url, int depth);
+
+  // Must be called once for every URL start accepted.
+  void completed(const std::string &url);
+
+  // Hands as many ready URLs to start as concurrency allows.
+  void pump();
+
+  // Nothing in flight and nothing left that will be started.
+  bool idle() const;
+
+  void print_stats(std::ostream &out) const;
+
+private:
+  struct Entry {
+    std::string url;
+    int depth;
+    uint64_t seq;
+
+    bool operator<(const Entry &other) const {
+      // priority_queue is a max-heap: invert so shallow, older entries win.
+      return depth != other.depth ? depth > other.depth : seq > other.seq;
+    }
+  };
+
+  struct Host {
+    std::priority_queue<Entry> pending;
+    gint64 readyAt = 0;
+    bool busy = false;
+  };
+
+  typedef std::pair<gint64, std::string> ReadyHost;
+
+  static gboolean on_timer(gpointer data);
+  static std::string host_key(SoupURI *uri);
+  void schedule_host(const std::string &key, Host &host);
+  bool page_budget_left() const { return options_.maxPages == 0 || started_ < options_.maxPages; }
+
+  Options options_;
+  StartFn start_;
+  UrlSeenFilter seen_;
+  std::unordered_map<std::string, Host> hosts_;
+  std::priority_queue<ReadyHost, std::vector<ReadyHost>, std::greater<ReadyHost>> ready_;
+  guint timer_;
+  // When timer_ fires.
+  gint64 timerAt_;
+  uint64_t seq_;
+  int inFlight_;
+  size_t started_;
+  size_t queued_;
+  size_t duplicates_;
+  size_t startFailures_;
+};
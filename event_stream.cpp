@@ -0,0 +1,289 @@
+#include "event_stream.h"
+
+#include <cstring>
+
+using namespace std;
+
+// Buffers that grew past this for one large event are given back once it has
+// been dispatched, so an idle stream holds little memory.
+static const size_t KEEP_BUFFER_BYTES = 64 << 10;
+static const char UTF8_BOM[] = "\xEF\xBB\xBF";
+
+static void
+shrink(string &buffer) {
+  buffer.clear();
+  if (buffer.capacity() > KEEP_BUFFER_BYTES) string().swap(buffer);
+}
+
+// First '\r' or '\n' in [p, end), or nullptr.
+static const char *
+find_eol(const char *p, const char *end) {
+  const char *nl = (const char *) memchr(p, '\n', end - p);
+  const char *cr = (const char *) memchr(p, '\r', (nl ? nl : end) - p);
+  return cr ? cr : nl;
+}
+
+EventStreamParser::EventStreamParser(Format format, size_t maxEventBytes, Handler onEvent)
+    : format_(format), maxEventBytes_(maxEventBytes), onEvent_(std::move(onEvent)), discarding_(false), skipLF_(false),
+      firstLine_(true), hasData_(false), dataOwned_(false), typeOwned_(false), droppingEvent_(false), retryMs_(-1),
+      events_(0), overflows_(0) {}
+
+gboolean EventStreamParser::parse_format(const char *name, Format *format, GError **error) {
+  if (strcmp(name, "sse") == 0) *format = SSE;
+  else if (strcmp(name, "ndjson") == 0) *format = NDJSON;
+  else {
+    g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Unknown stream format '%s', expected sse or ndjson", name);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+void EventStreamParser::feed(const char *data, size_t len) {
+  const char *p = data;
+  const char *end = data + len;
+  if (skipLF_ && p < end) {
+    if (*p == '\n') p++;
+    skipLF_ = false;
+  }
+
+  // partial_ may back the pending event until the end of this chunk, so it
+  // is only emptied then.
+  bool partialUsed = false;
+  while (p < end) {
+    const char *eol = find_eol(p, end);
+    if (!eol) break;
+
+    if (discarding_) {
+      discarding_ = false;
+      partialUsed = true;
+    } else if (!partial_.empty() && !partialUsed) {
+      partialUsed = true;
+      if (partial_.size() + (size_t) (eol - p) > maxEventBytes_) {
+        overflow();
+      } else {
+        partial_.append(p, eol - p);
+        line(partial_.data(), partial_.size());
+      }
+    } else if ((size_t) (eol - p) > maxEventBytes_) {
+      overflow();
+    } else {
+      line(p, eol - p);
+    }
+
+    p = eol + 1;
+    if (*eol == '\r') {
+      if (p < end && *p == '\n') p++;
+      else if (p == end) skipLF_ = true;
+    }
+  }
+
+  own_pending();
+  if (partialUsed) shrink(partial_);
+  if (p == end || discarding_) return;
+  if (partial_.size() + (size_t) (end - p) > maxEventBytes_) {
+    overflow();
+    shrink(partial_);
+    discarding_ = true;
+  } else {
+    partial_.append(p, end - p);
+  }
+}
+
+void EventStreamParser::finish() {
+  if (format_ == NDJSON && !partial_.empty() && !discarding_) line(partial_.data(), partial_.size());
+  clear_event();
+  shrink(partial_);
+  discarding_ = false;
+  skipLF_ = false;
+  firstLine_ = true;
+}
+
+void EventStreamParser::line(const char *data, size_t len) {
+  if (firstLine_) {
+    firstLine_ = false;
+    if (len >= 3 && memcmp(data, UTF8_BOM, 3) == 0) {
+      data += 3;
+      len -= 3;
+    }
+  }
+
+  if (format_ == NDJSON) {
+    if (len == 0) return;
+    StreamEvent event;
+    event.data = string_view(data, len);
+    events_++;
+    onEvent_(event);
+    return;
+  }
+
+  if (len == 0) {
+    dispatch();
+    return;
+  }
+  // Comment, usually a keep-alive.
+  if (data[0] == ':') return;
+
+  const char *colon = (const char *) memchr(data, ':', len);
+  if (!colon) {
+    field(string_view(data, len), string_view());
+    return;
+  }
+  const char *value = colon + 1;
+  const char *end = data + len;
+  if (value < end && *value == ' ') value++;
+  field(string_view(data, colon - data), string_view(value, end - value));
+}
+
+void EventStreamParser::field(string_view name, string_view value) {
+  if (name == "data") {
+    if (droppingEvent_) return;
+    if (!hasData_) {
+      hasData_ = true;
+      data_ = value;
+      return;
+    }
+    if (data_.size() + 1 + value.size() > maxEventBytes_) {
+      overflow();
+      return;
+    }
+    // A second line: from here on the data is assembled in dataBuf_.
+    if (!dataOwned_) {
+      dataBuf_.assign(data_.data(), data_.size());
+      dataOwned_ = true;
+    }
+    dataBuf_ += '\n';
+    dataBuf_.append(value.data(), value.size());
+    data_ = dataBuf_;
+  } else if (name == "event") {
+    type_ = value;
+    typeOwned_ = false;
+  } else if (name == "id") {
+    // IDs with NUL are ignored, as the spec says.
+    if (value.find('\0') == string_view::npos) lastId_.assign(value.data(), value.size());
+  } else if (name == "retry") {
+    if (value.empty()) return;
+    gint64 ms = 0;
+    for (char c : value) {
+      if (!g_ascii_isdigit(c) || ms > G_MAXINT32 / 10) return;
+      ms = ms * 10 + (c - '0');
+    }
+    retryMs_ = ms;
+  }
+}
+
+void EventStreamParser::dispatch() {
+  if (hasData_ && !droppingEvent_) {
+    StreamEvent event;
+    event.type = type_.empty() ? string_view("message") : type_;
+    event.data = data_;
+    event.id = lastId_;
+    events_++;
+    onEvent_(event);
+  }
+  clear_event();
+}
+
+void EventStreamParser::clear_event() {
+  hasData_ = false;
+  droppingEvent_ = false;
+  data_ = string_view();
+  type_ = string_view();
+  if (dataOwned_) shrink(dataBuf_);
+  if (typeOwned_) shrink(typeBuf_);
+  dataOwned_ = false;
+  typeOwned_ = false;
+}
+
+void EventStreamParser::own_pending() {
+  if (hasData_ && !dataOwned_) {
+    dataBuf_.assign(data_.data(), data_.size());
+    data_ = dataBuf_;
+    dataOwned_ = true;
+  }
+  if (!type_.empty() && !typeOwned_) {
+    typeBuf_.assign(type_.data(), type_.size());
+    type_ = typeBuf_;
+    typeOwned_ = true;
+  }
+}
+
+void EventStreamParser::overflow() {
+  overflows_++;
+  // The rest of an SSE event is meaningless without the dropped line.
+  if (format_ == SSE) droppingEvent_ = true;
+}
+
+EventStream::EventStream(Session &session, string url, const Options &options, EventStreamParser::Handler onEvent,
+                         function<void(EventStream *, guint)> ended)
+    : session_(session), url_(std::move(url)), options_(options),
+      parser_(options.format, options.maxEventBytes, std::move(onEvent)), ended_(std::move(ended)), msg_(nullptr),
+      retrySource_(0), stopped_(false), bytes_(0), connects_(0) {}
+
+EventStream::~EventStream() {
+  if (retrySource_) g_source_remove(retrySource_);
+  if (msg_) g_signal_handlers_disconnect_by_data(msg_, this);
+}
+
+void EventStream::start() {
+  Request request = Request::get(url_.c_str());
+  if (!request.valid()) {
+    ended_(this, SOUP_STATUS_MALFORMED);
+    return;
+  }
+  if (options_.format == EventStreamParser::SSE) {
+    request.header("Accept", "text/event-stream").header("Cache-Control", "no-cache");
+    if (!parser_.last_id().empty()) request.header("Last-Event-ID", parser_.last_id().c_str());
+  } else {
+    request.header("Accept", "application/x-ndjson");
+  }
+  request.stream_body();
+
+  msg_ = request.message();
+  g_signal_connect(msg_, "got-chunk", G_CALLBACK(on_got_chunk), this);
+  connects_++;
+  session_.queue(std::move(request), [this](Response &response) { completed(response); });
+}
+
+void EventStream::stop() {
+  if (stopped_) return;
+  stopped_ = true;
+  if (msg_) {
+    session_.cancel(msg_);
+  } else if (retrySource_) {
+    g_source_remove(retrySource_);
+    retrySource_ = 0;
+    ended_(this, SOUP_STATUS_CANCELLED);
+  }
+}
+
+void EventStream::on_got_chunk(SoupMessage *msg, SoupBuffer *chunk, gpointer usr_data) {
+  EventStream *stream = (EventStream *) usr_data;
+  // Error pages are not events.
+  if (!SOUP_STATUS_IS_SUCCESSFUL(msg->status_code)) return;
+  stream->bytes_ += chunk->length;
+  stream->parser_.feed(chunk->data, chunk->length);
+}
+
+gboolean EventStream::on_retry(gpointer data) {
+  EventStream *stream = (EventStream *) data;
+  stream->retrySource_ = 0;
+  stream->start();
+  return G_SOURCE_REMOVE;
+}
+
+void EventStream::completed(Response &response) {
+  guint status = response.status();
+  msg_ = nullptr;
+  parser_.finish();
+
+  // Like EventSource: reconnect after the stream ends or the connection
+  // drops, but not after 204 (the server asking to stop) or an HTTP error.
+  bool retry = options_.reconnect && !stopped_ && status != SOUP_STATUS_NO_CONTENT &&
+               (response.ok() || SOUP_STATUS_IS_TRANSPORT_ERROR(status));
+  if (!retry) {
+    ended_(this, status);
+    return;
+  }
+  guint delayMs = parser_.retry_ms() >= 0 ? (guint) parser_.retry_ms() : options_.retryMs;
+  retrySource_ = g_timeout_add(delayMs, on_retry, this);
+}
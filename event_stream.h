@@ -0,0 +1,142 @@
+#pragma once
+
+#include <glib.h>
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+#include "soupclient.h"
+
+// One event. The views point into the chunk being parsed, or into the
+// parser's own buffers for events that straddle chunks, and are only valid
+// during the callback.
+struct StreamEvent {
+  // SSE event type ("message" unless named); empty for NDJSON.
+  std::string_view type;
+  // SSE data lines joined with '\n', or one NDJSON line.
+  std::string_view data;
+  // Last event ID seen on this stream; empty for NDJSON.
+  std::string_view id;
+};
+
+// Incremental text/event-stream or newline-delimited JSON parser. Events that
+// arrive whole within one chunk are handed out in place; only a line or event
+// cut off at the end of a chunk is copied, so memory per stream is bounded by
+// the largest event rather than by the stream. Events or lines larger than
+// maxEventBytes are dropped and counted.
+class EventStreamParser {
+public:
+  enum Format { SSE, NDJSON };
+
+  typedef std::function<void(const StreamEvent &)> Handler;
+
+  EventStreamParser(Format format, size_t maxEventBytes, Handler onEvent);
+
+  EventStreamParser(const EventStreamParser &) = delete;
+  EventStreamParser &operator=(const EventStreamParser &) = delete;
+
+  // "sse" or "ndjson".
+  static gboolean parse_format(const char *name, Format *format, GError **error);
+
+  void feed(const char *data, size_t len);
+  // The connection ended. An unterminated SSE event is dropped, as the spec
+  // says; a final NDJSON line without its newline still counts.
+  void finish();
+
+  // For reconnecting: the last event ID and retry delay (-1 if the server
+  // never sent one) survive finish().
+  const std::string &last_id() const { return lastId_; }
+  gint64 retry_ms() const { return retryMs_; }
+
+  uint64_t events() const { return events_; }
+  uint64_t overflows() const { return overflows_; }
+
+private:
+  void line(const char *data, size_t len);
+  void field(std::string_view name, std::string_view value);
+  void dispatch();
+  void clear_event();
+  // Copies whatever the pending event still points to in the current chunk.
+  void own_pending();
+  void overflow();
+
+  Format format_;
+  size_t maxEventBytes_;
+  Handler onEvent_;
+
+  // Tail of the previous chunk that did not end in a line break.
+  std::string partial_;
+  // Skipping the rest of an oversized line.
+  bool discarding_;
+  // A chunk ended on '\r'; a '\n' starting the next one belongs to it.
+  bool skipLF_;
+  bool firstLine_;
+
+  // The SSE event being assembled.
+  bool hasData_;
+  bool dataOwned_;
+  bool typeOwned_;
+  // Dropping an oversized event until its blank line.
+  bool droppingEvent_;
+  std::string_view data_;
+  std::string_view type_;
+  std::string dataBuf_;
+  std::string typeBuf_;
+  std::string lastId_;
+  gint64 retryMs_;
+
+  uint64_t events_;
+  uint64_t overflows_;
+};
+
+// A long-lived GET whose body is parsed as it streams in; the body is never
+// accumulated. With reconnect set it is reissued after it ends, after the
+// server's SSE retry delay and with Last-Event-ID, the way an EventSource
+// would, until stop() or an HTTP error.
+class EventStream {
+public:
+  struct Options {
+    EventStreamParser::Format format = EventStreamParser::SSE;
+    size_t maxEventBytes = 1 << 20;
+    bool reconnect = false;
+    // Until the server sends a retry: field.
+    guint retryMs = 3000;
+  };
+
+  // ended runs once the stream is over for good, with the status of its last
+  // response.
+  EventStream(Session &session, std::string url, const Options &options, EventStreamParser::Handler onEvent,
+              std::function<void(EventStream *, guint status)> ended);
+  ~EventStream();
+
+  EventStream(const EventStream &) = delete;
+  EventStream &operator=(const EventStream &) = delete;
+
+  void start();
+  // Cancels the current request or pending reconnect; ended still runs.
+  void stop();
+
+  const std::string &url() const { return url_; }
+  const EventStreamParser &parser() const { return parser_; }
+  uint64_t bytes() const { return bytes_; }
+  uint64_t connects() const { return connects_; }
+
+private:
+  static void on_got_chunk(SoupMessage *msg, SoupBuffer *chunk, gpointer usr_data);
+  static gboolean on_retry(gpointer data);
+
+  void completed(Response &response);
+
+  Session &session_;
+  std::string url_;
+  Options options_;
+  EventStreamParser parser_;
+  std::function<void(EventStream *, guint)> ended_;
+  SoupMessage *msg_;
+  guint retrySource_;
+  bool stopped_;
+  uint64_t bytes_;
+  uint64_t connects_;
+};
@@ -0,0 +1,347 @@
+#include "fault_proxy.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <sys/socket.h>
+
+using namespace std;
+
+G_DEFINE_QUARK(libsouptest-fault-proxy-error-quark, fault_proxy_error)
+
+// Never forwarded in either direction (RFC 7230 6.1), plus what libsoup
+// recomputes or undoes itself.
+static const char *SKIPPED_HEADERS[] = {"Connection", "Keep-Alive", "Proxy-Authenticate", "Proxy-Authorization", "TE",
+                                        "Trailer", "Transfer-Encoding", "Upgrade", "Host", "Content-Length",
+                                        "Accept-Encoding", "Content-Encoding"};
+
+static bool
+skipped_header(const char *name) {
+  for (const char *skipped : SKIPPED_HEADERS) {
+    if (g_ascii_strcasecmp(name, skipped) == 0) return true;
+  }
+  return false;
+}
+
+static void
+copy_header(const char *name, const char *value, gpointer usr_data) {
+  if (!skipped_header(name) && g_ascii_strcasecmp(name, "Content-Type") != 0) {
+    soup_message_headers_append((SoupMessageHeaders *) usr_data, name, value);
+  }
+}
+
+// sscanf that must consume the whole argument.
+#define SCAN_ALL(arg, fmt, ...) (n = -1, sscanf(arg, fmt "%n", __VA_ARGS__, &n) >= 1 && n >= 0 && (arg)[n] == '\0')
+
+static bool
+probability(double p) {
+  return p >= 0 && p <= 1;
+}
+
+gboolean FaultProfile::parse(const char *spec, FaultProfile &profile, GError **error) {
+  profile = FaultProfile();
+  gchar **parts = g_strsplit(spec, ",", -1);
+  gboolean ok = TRUE;
+
+  for (gchar **part = parts; ok && *part; part++) {
+    if (**part == '\0') continue;
+    const char *eq = strchr(*part, '=');
+    string key = eq ? string(*part, eq - *part) : string(*part);
+    const char *arg = eq ? eq + 1 : "";
+    int n;
+    unsigned status;
+
+    if (key == "latency") {
+      if (SCAN_ALL(arg, "fixed:%lf", &profile.latencyA)) {
+        profile.latency = FIXED;
+      } else if (SCAN_ALL(arg, "uniform:%lf:%lf", &profile.latencyA, &profile.latencyB) && profile.latencyA <= profile.latencyB) {
+        profile.latency = UNIFORM;
+      } else if (SCAN_ALL(arg, "lognormal:%lf:%lf", &profile.latencyA, &profile.latencyB) && profile.latencyA > 0) {
+        profile.latency = LOGNORMAL;
+      } else {
+        ok = FALSE;
+      }
+      ok = ok && profile.latencyA >= 0 && profile.latencyB >= 0;
+    } else if (key == "bandwidth") {
+      unsigned long long bps;
+      ok = SCAN_ALL(arg, "%llu", &bps) && bps > 0;
+      profile.bandwidth = bps;
+    } else if (key == "reset") {
+      ok = SCAN_ALL(arg, "%lf", &profile.resetRate) && probability(profile.resetRate);
+    } else if (key == "slowloris") {
+      ok = SCAN_ALL(arg, "%lf:%zu:%u", &profile.slowlorisRate, &profile.slowlorisBytes, &profile.slowlorisIntervalMs) &&
+           probability(profile.slowlorisRate) && profile.slowlorisBytes > 0;
+    } else if (key == "errors") {
+      ok = SCAN_ALL(arg, "%lf:%u:%d", &profile.errorRate, &status, &profile.errorBurst) && probability(profile.errorRate) &&
+           status >= 100 && status < 600 && profile.errorBurst > 0;
+      profile.errorStatus = status;
+    } else {
+      g_set_error(error, FAULT_PROXY_ERROR, FAULT_PROXY_ERROR_BAD_SPEC, "Unknown fault '%s'", key.c_str());
+      g_strfreev(parts);
+      return FALSE;
+    }
+
+    if (!ok) g_set_error(error, FAULT_PROXY_ERROR, FAULT_PROXY_ERROR_BAD_SPEC, "Invalid fault '%s'", *part);
+  }
+
+  g_strfreev(parts);
+  return ok;
+}
+
+struct FaultProxy::Exchange {
+  FaultProxy *proxy;
+  SoupServer *server;
+  MessageHandle msg;
+  // Unset when answering with an injected error.
+  MessageHandle upstream;
+  GBytes *body;
+  guint status;
+  guint delayMs;
+  size_t sent;
+  size_t chunkBytes;
+  guint intervalMs;
+  guint timer;
+  bool upstreamPending;
+  bool completed;
+  bool finished;
+
+  ~Exchange() {
+    proxy->exchanges_.erase(this);
+    if (timer) g_source_remove(timer);
+    if (body) g_bytes_unref(body);
+  }
+};
+
+struct FaultProxy::Reset {
+  FaultProxy *proxy;
+  GIOStream *stream;
+  guint timer;
+};
+
+FaultProxy::FaultProxy(const string &upstream, const FaultProfile &profile, guint32 seed)
+    : upstream_(upstream), profile_(profile), rand_(g_rand_new_with_seed(seed)),
+      server_(GObjectHandle<SoupServer>::adopt(soup_server_new(SOUP_SERVER_SERVER_HEADER, "libsouptest-fault-proxy", nullptr))),
+      burstLeft_(0), closing_(false) {
+  while (!upstream_.empty() && upstream_.back() == '/') upstream_.pop_back();
+  soup_server_add_handler(server_.get(), nullptr, handle, this, nullptr);
+}
+
+FaultProxy::~FaultProxy() {
+  // Upstream completions delete their exchanges instead of arming a timer.
+  closing_ = true;
+  soup_session_abort(session_.get());
+  while (!exchanges_.empty()) {
+    Exchange *exchange = *exchanges_.begin();
+    g_signal_handlers_disconnect_by_data(exchange->msg.get(), exchange);
+    delete exchange;
+  }
+  for (Reset *reset : resets_) {
+    g_source_remove(reset->timer);
+    g_io_stream_close(reset->stream, nullptr, nullptr);
+    g_object_unref(reset->stream);
+    delete reset;
+  }
+  resets_.clear();
+  soup_server_disconnect(server_.get());
+  g_rand_free(rand_);
+}
+
+gboolean FaultProxy::listen(guint port, GError **error) {
+  if (!soup_server_listen_local(server_.get(), port, SOUP_SERVER_LISTEN_IPV4_ONLY, error)) return FALSE;
+
+  GSList *uris = soup_server_get_uris(server_.get());
+  baseUrl_ = "http://127.0.0.1:" + to_string(((SoupURI *) uris->data)->port);
+  g_slist_free_full(uris, (GDestroyNotify) soup_uri_free);
+  return TRUE;
+}
+
+bool FaultProxy::roll(double probability) {
+  return probability > 0 && g_rand_double(rand_) < probability;
+}
+
+guint FaultProxy::sample_latency_ms() {
+  double ms = 0;
+  switch (profile_.latency) {
+    case FaultProfile::NONE:
+      break;
+    case FaultProfile::FIXED:
+      ms = profile_.latencyA;
+      break;
+    case FaultProfile::UNIFORM:
+      ms = g_rand_double_range(rand_, profile_.latencyA, profile_.latencyB);
+      break;
+    case FaultProfile::LOGNORMAL: {
+      // Box-Muller; latencyA is the median, latencyB sigma of the log.
+      double u1 = 1.0 - g_rand_double(rand_);
+      double u2 = g_rand_double(rand_);
+      double z = sqrt(-2.0 * log(u1)) * cos(2.0 * G_PI * u2);
+      ms = profile_.latencyA * exp(profile_.latencyB * z);
+      break;
+    }
+  }
+  return (guint) min(ms, 600000.0);
+}
+
+void FaultProxy::handle(SoupServer *server, SoupMessage *msg, const char *path, GHashTable *query,
+                        SoupClientContext *client, gpointer usr_data) {
+  FaultProxy *proxy = (FaultProxy *) usr_data;
+  proxy->stats_.requests++;
+  guint delayMs = proxy->sample_latency_ms();
+
+  if (proxy->roll(proxy->profile_.resetRate)) {
+    // Take the connection away from the server and abort it with an RST
+    // once the latency has passed.
+    GSocket *socket = soup_client_context_get_gsocket(client);
+    struct linger abort = {1, 0};
+    setsockopt(g_socket_get_fd(socket), SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+    GIOStream *stream = soup_client_context_steal_connection(client);
+    proxy->stats_.resets++;
+    Reset *reset = new Reset{proxy, stream, 0};
+    reset->timer = g_timeout_add(delayMs, on_reset, reset);
+    proxy->resets_.insert(reset);
+    return;
+  }
+
+  Exchange *exchange = new Exchange{proxy, server, MessageHandle::ref(msg), MessageHandle(), nullptr, 0, delayMs, 0, 0, 0, 0, false, false, false};
+  proxy->exchanges_.insert(exchange);
+  g_signal_connect(msg, "finished", G_CALLBACK(on_finished), exchange);
+  soup_server_pause_message(server, msg);
+
+  if (proxy->burstLeft_ > 0 || proxy->roll(proxy->profile_.errorRate)) {
+    proxy->burstLeft_ = proxy->burstLeft_ > 0 ? proxy->burstLeft_ - 1 : proxy->profile_.errorBurst - 1;
+    proxy->stats_.errors++;
+    exchange->status = proxy->profile_.errorStatus;
+    exchange->timer = g_timeout_add(delayMs, on_respond, exchange);
+    return;
+  }
+  proxy->forward(exchange, path, query);
+}
+
+void FaultProxy::forward(Exchange *exchange, const char *path, GHashTable *query) {
+  SoupMessage *msg = exchange->msg.get();
+  string url = upstream_ + path;
+  SoupURI *uri = soup_message_get_uri(msg);
+  if (uri->query) url += string("?") + uri->query;
+
+  Request request = Request::method(msg->method, url.c_str());
+  if (!request.valid()) {
+    exchange->status = SOUP_STATUS_BAD_REQUEST;
+    respond(exchange);
+    return;
+  }
+  soup_message_headers_foreach(msg->request_headers, copy_header, request.message()->request_headers);
+  if (msg->request_body->length > 0) {
+    SoupBuffer *body = soup_message_body_flatten(msg->request_body);
+    request.body(soup_message_headers_get_content_type(msg->request_headers, nullptr), body->data, body->length);
+    soup_buffer_free(body);
+  }
+
+  stats_.forwarded++;
+  exchange->upstreamPending = true;
+  session_.queue(std::move(request), [this, exchange](Response &response) {
+    exchange->upstreamPending = false;
+    if (exchange->finished || closing_) {
+      // The client went away while we were waiting, or the proxy is closing.
+      delete exchange;
+      return;
+    }
+
+    if (SOUP_STATUS_IS_TRANSPORT_ERROR(response.status())) {
+      stats_.upstreamFailures++;
+      exchange->status = SOUP_STATUS_BAD_GATEWAY;
+    } else {
+      exchange->upstream = MessageHandle::ref(response.message());
+      exchange->status = response.status();
+      SoupBuffer *body = soup_message_body_flatten(response.message()->response_body);
+      exchange->body = soup_buffer_get_as_bytes(body);
+      soup_buffer_free(body);
+    }
+    exchange->timer = g_timeout_add(exchange->delayMs, on_respond, exchange);
+  });
+}
+
+gboolean FaultProxy::on_respond(gpointer data) {
+  Exchange *exchange = (Exchange *) data;
+  exchange->timer = 0;
+  exchange->proxy->respond(exchange);
+  return G_SOURCE_REMOVE;
+}
+
+void FaultProxy::respond(Exchange *exchange) {
+  SoupMessage *msg = exchange->msg.get();
+  soup_message_set_status(msg, exchange->status);
+  if (exchange->upstream) {
+    SoupMessageHeaders *headers = exchange->upstream->response_headers;
+    soup_message_headers_foreach(headers, copy_header, msg->response_headers);
+    const char *contentType = soup_message_headers_get_content_type(headers, nullptr);
+    if (contentType) soup_message_headers_replace(msg->response_headers, "Content-Type", contentType);
+  }
+
+  size_t size = exchange->body ? g_bytes_get_size(exchange->body) : 0;
+  if (size > 0 && roll(profile_.slowlorisRate)) {
+    stats_.slowloris++;
+    exchange->chunkBytes = profile_.slowlorisBytes;
+    exchange->intervalMs = profile_.slowlorisIntervalMs;
+  } else if (size > 0 && profile_.bandwidth) {
+    // Ten chunks a second approximates the rate without a timer per byte.
+    stats_.throttled++;
+    exchange->chunkBytes = (size_t) max<uint64_t>(profile_.bandwidth / 10, 1);
+    exchange->intervalMs = 100;
+  }
+
+  if (!exchange->chunkBytes) {
+    if (size > 0) soup_message_body_append(msg->response_body, SOUP_MEMORY_COPY, g_bytes_get_data(exchange->body, nullptr), size);
+    soup_server_unpause_message(exchange->server, msg);
+    return;
+  }
+
+  soup_message_headers_set_encoding(msg->response_headers, SOUP_ENCODING_CHUNKED);
+  g_signal_connect(msg, "wrote-chunk", G_CALLBACK(on_wrote_chunk), exchange);
+  trickle(exchange);
+}
+
+// Appends the next chunk, or the terminator once the body is out.
+void FaultProxy::trickle(Exchange *exchange) {
+  SoupMessage *msg = exchange->msg.get();
+  gsize size;
+  const char *data = (const char *) g_bytes_get_data(exchange->body, &size);
+  if (exchange->sent < size) {
+    size_t len = min(exchange->chunkBytes, size - exchange->sent);
+    soup_message_body_append(msg->response_body, SOUP_MEMORY_COPY, data + exchange->sent, len);
+    exchange->sent += len;
+  } else {
+    exchange->completed = true;
+    soup_message_body_complete(msg->response_body);
+  }
+  soup_server_unpause_message(exchange->server, msg);
+}
+
+void FaultProxy::on_wrote_chunk(SoupMessage *msg, gpointer usr_data) {
+  Exchange *exchange = (Exchange *) usr_data;
+  if (exchange->completed) return;
+  soup_server_pause_message(exchange->server, msg);
+  exchange->timer = g_timeout_add(exchange->intervalMs, on_trickle, exchange);
+}
+
+gboolean FaultProxy::on_trickle(gpointer data) {
+  Exchange *exchange = (Exchange *) data;
+  exchange->timer = 0;
+  exchange->proxy->trickle(exchange);
+  return G_SOURCE_REMOVE;
+}
+
+void FaultProxy::on_finished(SoupMessage *msg, gpointer usr_data) {
+  Exchange *exchange = (Exchange *) usr_data;
+  g_signal_handlers_disconnect_by_data(msg, exchange);
+  exchange->finished = true;
+  if (!exchange->upstreamPending) delete exchange;
+}
+
+gboolean FaultProxy::on_reset(gpointer data) {
+  Reset *reset = (Reset *) data;
+  reset->proxy->resets_.erase(reset);
+  g_io_stream_close(reset->stream, nullptr, nullptr);
+  g_object_unref(reset->stream);
+  delete reset;
+  return G_SOURCE_REMOVE;
+}
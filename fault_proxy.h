@@ -0,0 +1,105 @@
+#pragma once
+
+#include <libsoup/soup.h>
+
+#include <cstdint>
+#include <set>
+#include <string>
+
+#include "soupclient.h"
+
+#define FAULT_PROXY_ERROR (fault_proxy_error_quark())
+GQuark fault_proxy_error_quark(void);
+
+enum FaultProxyError {
+  FAULT_PROXY_ERROR_BAD_SPEC,
+};
+
+// What a FaultProxy does to each exchange. Parsed from a comma-separated
+// spec, every part optional:
+//
+//   latency=fixed:MS | uniform:LO_MS:HI_MS | lognormal:MEDIAN_MS:SIGMA
+//   bandwidth=BYTES_PER_SEC              cap on each response body
+//   reset=P                              drop the connection with an RST
+//   slowloris=P:BYTES:INTERVAL_MS        dribble the body out
+//   errors=P:STATUS:BURST                answer BURST requests with STATUS
+//
+// P is a probability per request, e.g. "latency=lognormal:40:0.8,errors=0.01:503:20".
+struct FaultProfile {
+  enum Latency { NONE, FIXED, UNIFORM, LOGNORMAL };
+
+  Latency latency = NONE;
+  double latencyA = 0;
+  double latencyB = 0;
+  uint64_t bandwidth = 0;
+  double resetRate = 0;
+  double slowlorisRate = 0;
+  size_t slowlorisBytes = 1;
+  guint slowlorisIntervalMs = 1000;
+  double errorRate = 0;
+  guint errorStatus = SOUP_STATUS_SERVICE_UNAVAILABLE;
+  int errorBurst = 1;
+
+  static gboolean parse(const char *spec, FaultProfile &profile, GError **error);
+};
+
+// Reverse proxy on 127.0.0.1 that forwards every request to upstream through
+// its own Session and applies a FaultProfile on the way back. Random choices
+// come from a seeded generator, so a profile and seed replay the same faults
+// for the same request sequence.
+class FaultProxy {
+public:
+  struct Stats {
+    uint64_t requests = 0;
+    uint64_t forwarded = 0;
+    uint64_t upstreamFailures = 0;
+    uint64_t resets = 0;
+    uint64_t errors = 0;
+    uint64_t slowloris = 0;
+    uint64_t throttled = 0;
+  };
+
+  // upstream: scheme://host[:port] that request paths are appended to.
+  FaultProxy(const std::string &upstream, const FaultProfile &profile, guint32 seed);
+  ~FaultProxy();
+
+  FaultProxy(const FaultProxy &) = delete;
+  FaultProxy &operator=(const FaultProxy &) = delete;
+
+  // port 0 picks an ephemeral one.
+  gboolean listen(guint port, GError **error);
+
+  const std::string &base_url() const { return baseUrl_; }
+  const Stats &stats() const { return stats_; }
+
+private:
+  struct Exchange;
+  struct Reset;
+
+  static void handle(SoupServer *server, SoupMessage *msg, const char *path, GHashTable *query,
+                     SoupClientContext *client, gpointer usr_data);
+  static void on_finished(SoupMessage *msg, gpointer usr_data);
+  static void on_wrote_chunk(SoupMessage *msg, gpointer usr_data);
+  static gboolean on_respond(gpointer data);
+  static gboolean on_trickle(gpointer data);
+  static gboolean on_reset(gpointer data);
+
+  bool roll(double probability);
+  guint sample_latency_ms();
+  void forward(Exchange *exchange, const char *path, GHashTable *query);
+  void respond(Exchange *exchange);
+  void trickle(Exchange *exchange);
+
+  std::string upstream_;
+  FaultProfile profile_;
+  GRand *rand_;
+  Session session_;
+  GObjectHandle<SoupServer> server_;
+  std::string baseUrl_;
+  Stats stats_;
+  int burstLeft_;
+  // Live exchanges and pending resets, torn down with the proxy.
+  std::set<Exchange *> exchanges_;
+  std::set<Reset *> resets_;
+  bool closing_;
+};
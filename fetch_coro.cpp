@@ -0,0 +1,58 @@
+#include "fetch_coro.h"
+
+void FetchScope::cancel() {
+  cancelled_ = true;
+  // Cancelling may complete (and unlink) the awaiter synchronously.
+  while (FetchAwaiter *awaiter = head_) {
+    awaiter->unlink();
+    soup_session_cancel_message(awaiter->session_, awaiter->msg_, SOUP_STATUS_CANCELLED);
+  }
+}
+
+void FetchAwaiter::unlink() {
+  if (!scope_) return;
+  if (prev_) prev_->next_ = next_;
+  else if (scope_->head_ == this) scope_->head_ = next_;
+  if (next_) next_->prev_ = prev_;
+  prev_ = next_ = nullptr;
+  scope_ = nullptr;
+}
+
+bool FetchAwaiter::await_suspend(std::coroutine_handle<> h) {
+  if (scope_ && scope_->cancelled()) {
+    soup_message_set_status(msg_, SOUP_STATUS_CANCELLED);
+    return false;
+  }
+
+  handle_ = h;
+  context_ = g_main_context_get_thread_default();
+  if (!context_) context_ = g_main_context_default();
+
+  if (scope_) {
+    next_ = scope_->head_;
+    if (next_) next_->prev_ = this;
+    scope_->head_ = this;
+  }
+
+  // The session consumes one reference; ours is handed to FetchResult.
+  g_object_ref(msg_);
+  soup_session_queue_message(session_, msg_, on_complete, this);
+  return true;
+}
+
+void FetchAwaiter::on_complete(SoupSession *session, SoupMessage *msg, gpointer usr_data) {
+  FetchAwaiter *awaiter = (FetchAwaiter *) usr_data;
+  awaiter->unlink();
+  // Runs inline when the session dispatches on the awaiting context, which is
+  // the normal case. Only a cross-thread session costs an idle source here.
+  g_main_context_invoke(awaiter->context_, resume_in_context, awaiter);
+}
+
+gboolean FetchAwaiter::resume_in_context(gpointer data) {
+  ((FetchAwaiter *) data)->handle_.resume();
+  return G_SOURCE_REMOVE;
+}
+
+Task<FetchResult> fetch_task(SoupSession *session, const char *url, FetchScope *scope) {
+  co_return co_await fetch(session, url, scope);
+}
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <libsoup/soup.h>
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "soupclient.h"
+
+// Coroutine layer over SoupSession: `FetchResult r = co_await fetch(session, url);`
+// resumes on the GMainContext that was thread-default when the fetch was
+// awaited. The awaiter lives in the coroutine frame and is handed to libsoup
+// as the callback data, so a fetch costs no allocation of its own.
+
+template<typename T = void>
+class Task;
+
+struct TaskPromiseBase {
+  std::coroutine_handle<> continuation = std::noop_coroutine();
+  std::exception_ptr exception;
+
+  struct FinalAwaiter {
+    bool await_ready() const noexcept { return false; }
+    template<typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept { return h.promise().continuation; }
+    void await_resume() const noexcept {}
+  };
+
+  std::suspend_always initial_suspend() const noexcept { return {}; }
+  FinalAwaiter final_suspend() const noexcept { return {}; }
+  void unhandled_exception() noexcept { exception = std::current_exception(); }
+};
+
+template<typename T>
+struct TaskPromise : TaskPromiseBase {
+  std::optional<T> value;
+
+  Task<T> get_return_object() noexcept;
+  void return_value(T v) { value.emplace(std::move(v)); }
+
+  T take() {
+    if (exception) std::rethrow_exception(exception);
+    return std::move(*value);
+  }
+};
+
+template<>
+struct TaskPromise<void> : TaskPromiseBase {
+  Task<void> get_return_object() noexcept;
+  void return_void() const noexcept {}
+
+  void take() {
+    if (exception) std::rethrow_exception(exception);
+  }
+};
+
+// Lazily started, single-awaiter coroutine. Completion transfers straight to
+// the awaiting coroutine.
+template<typename T>
+class Task {
+public:
+  using promise_type = TaskPromise<T>;
+  using handle_type = std::coroutine_handle<promise_type>;
+
+  explicit Task(handle_type h) noexcept : h_(h) {}
+  Task(Task &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      if (h_) h_.destroy();
+      h_ = std::exchange(other.h_, {});
+    }
+    return *this;
+  }
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+  ~Task() {
+    if (h_) h_.destroy();
+  }
+
+  bool done() const noexcept { return !h_ || h_.done(); }
+
+  // Runs a top-level task until its first suspension point. The frame stays
+  // alive until the Task is destroyed.
+  void start() {
+    if (h_ && !h_.done()) h_.resume();
+  }
+
+  // Result of a finished task; rethrows its exception, if any.
+  T take_result() { return h_.promise().take(); }
+
+  auto operator co_await() noexcept {
+    struct Awaiter {
+      handle_type h;
+      bool await_ready() const noexcept { return !h || h.done(); }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        h.promise().continuation = awaiting;
+        return h;
+      }
+      T await_resume() { return h.promise().take(); }
+    };
+    return Awaiter{h_};
+  }
+
+  // Like co_await, but leaves the result in the task for take_result().
+  auto when_ready() noexcept {
+    struct Awaiter {
+      handle_type h;
+      bool await_ready() const noexcept { return !h || h.done(); }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        h.promise().continuation = awaiting;
+        return h;
+      }
+      void await_resume() const noexcept {}
+    };
+    return Awaiter{h_};
+  }
+
+private:
+  handle_type h_;
+};
+
+template<typename T>
+inline Task<T> TaskPromise<T>::get_return_object() noexcept {
+  return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept {
+  return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// Owned reference to a completed SoupMessage.
+class FetchResult {
+public:
+  explicit FetchResult(SoupMessage *msg) noexcept : msg_(msg) {}
+  FetchResult(FetchResult &&other) noexcept : msg_(std::exchange(other.msg_, nullptr)) {}
+  FetchResult &operator=(FetchResult &&other) noexcept {
+    std::swap(msg_, other.msg_);
+    return *this;
+  }
+  FetchResult(const FetchResult &) = delete;
+  FetchResult &operator=(const FetchResult &) = delete;
+  ~FetchResult() {
+    if (msg_) g_object_unref(msg_);
+  }
+
+  SoupMessage *message() const noexcept { return msg_; }
+  guint status() const noexcept { return msg_ ? msg_->status_code : (guint) SOUP_STATUS_MALFORMED; }
+  bool ok() const noexcept { return SOUP_STATUS_IS_SUCCESSFUL(status()); }
+  const char *body() const noexcept { return msg_ ? msg_->response_body->data : nullptr; }
+  size_t body_size() const noexcept { return msg_ ? (size_t) msg_->response_body->length : 0; }
+
+private:
+  SoupMessage *msg_;
+};
+
+class FetchAwaiter;
+
+// Tracks the fetches awaited under it so they can be cancelled together, e.g.
+// the losers of when_any(). Must outlive every fetch registered with it.
+class FetchScope {
+public:
+  FetchScope() = default;
+  FetchScope(const FetchScope &) = delete;
+  FetchScope &operator=(const FetchScope &) = delete;
+
+  void cancel();
+  bool cancelled() const noexcept { return cancelled_; }
+
+private:
+  friend class FetchAwaiter;
+
+  FetchAwaiter *head_ = nullptr;
+  bool cancelled_ = false;
+};
+
+class FetchAwaiter {
+public:
+  // Adopts the caller's reference on msg.
+  FetchAwaiter(SoupSession *session, SoupMessage *msg, FetchScope *scope) noexcept
+      : session_(session), msg_(msg), scope_(scope) {}
+  FetchAwaiter(const FetchAwaiter &) = delete;
+  FetchAwaiter &operator=(const FetchAwaiter &) = delete;
+  ~FetchAwaiter() {
+    if (msg_) g_object_unref(msg_);
+  }
+
+  bool await_ready() const noexcept { return !msg_; }
+  bool await_suspend(std::coroutine_handle<> h);
+  FetchResult await_resume() noexcept { return FetchResult(std::exchange(msg_, nullptr)); }
+
+private:
+  friend class FetchScope;
+
+  static void on_complete(SoupSession *session, SoupMessage *msg, gpointer usr_data);
+  static gboolean resume_in_context(gpointer data);
+  void unlink();
+
+  SoupSession *session_;
+  SoupMessage *msg_;
+  FetchScope *scope_;
+  GMainContext *context_ = nullptr;
+  std::coroutine_handle<> handle_;
+  FetchAwaiter *prev_ = nullptr;
+  FetchAwaiter *next_ = nullptr;
+};
+
+// Queues msg on session when awaited. Adopts the caller's reference.
+inline FetchAwaiter fetch(SoupSession *session, SoupMessage *msg, FetchScope *scope = nullptr) {
+  return FetchAwaiter(session, msg, scope);
+}
+
+// GET url. An unparsable URL completes immediately with SOUP_STATUS_MALFORMED.
+inline FetchAwaiter fetch(SoupSession *session, const char *url, FetchScope *scope = nullptr) {
+  return FetchAwaiter(session, soup_message_new("GET", url), scope);
+}
+
+inline FetchAwaiter fetch(Session &session, Request &&request, FetchScope *scope = nullptr) {
+  return FetchAwaiter(session.get(), request.take().release(), scope);
+}
+
+// fetch() as a Task, for use with the combinators. url must stay valid until
+// the task has started.
+Task<FetchResult> fetch_task(SoupSession *session, const char *url, FetchScope *scope = nullptr);
+
+// Fan-in bookkeeping shared by the combinators; lives in the combinator's
+// frame.
+struct TaskLatch {
+  size_t remaining;
+  size_t first = (size_t) -1;
+  FetchScope *cancelOnFirst = nullptr;
+  std::coroutine_handle<> waiter;
+
+  explicit TaskLatch(size_t count) : remaining(count) {}
+
+  void arrive(size_t index) {
+    if (first == (size_t) -1) {
+      first = index;
+      if (cancelOnFirst) cancelOnFirst->cancel();
+    }
+    if (--remaining == 0 && waiter) waiter.resume();
+  }
+
+  bool await_ready() const noexcept { return remaining == 0; }
+  void await_suspend(std::coroutine_handle<> h) noexcept { waiter = h; }
+  void await_resume() const noexcept {}
+};
+
+struct DetachedTask {
+  struct promise_type {
+    DetachedTask get_return_object() const noexcept { return {}; }
+    std::suspend_never initial_suspend() const noexcept { return {}; }
+    std::suspend_never final_suspend() const noexcept { return {}; }
+    void return_void() const noexcept {}
+    void unhandled_exception() const noexcept { std::terminate(); }
+  };
+};
+
+template<typename T>
+DetachedTask run_into_latch(Task<T> &task, TaskLatch &latch, size_t index) {
+  co_await task.when_ready();
+  latch.arrive(index);
+}
+
+// Runs all tasks concurrently and completes when every one has finished.
+// Results stay in the tasks; take them with take_result().
+template<typename T>
+Task<void> when_all(std::vector<Task<T>> &tasks) {
+  TaskLatch latch(tasks.size());
+  for (size_t i = 0; i < tasks.size(); i++) run_into_latch(tasks[i], latch, i);
+  co_await latch;
+}
+
+// Runs all tasks concurrently and yields the index of the first to finish.
+// Fetches registered with scope are cancelled at that point; the combinator
+// still waits for every task to wind down so no frame is left dangling.
+template<typename T>
+Task<size_t> when_any(std::vector<Task<T>> &tasks, FetchScope *scope = nullptr) {
+  TaskLatch latch(tasks.size());
+  latch.cancelOnFirst = scope;
+  for (size_t i = 0; i < tasks.size(); i++) run_into_latch(tasks[i], latch, i);
+  co_await latch;
+  co_return latch.first;
+}
@@ -0,0 +1,346 @@
+#include "file_writer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <deque>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "affinity.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#endif
+
+using namespace std;
+
+static const int OPEN_FLAGS = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+static const mode_t OPEN_MODE = 0644;
+
+namespace {
+
+  // Blocking open/write/fsync/close on pool threads; completions are handed
+  // back to the owning context.
+  class ThreadPoolWriter : public FileWriter {
+  public:
+    explicit ThreadPoolWriter(unsigned threads) : context_(g_main_context_ref_thread_default()) {
+      pool_ = g_thread_pool_new(pool_func, nullptr, (gint) threads, FALSE, nullptr);
+    }
+
+    ~ThreadPoolWriter() override {
+      g_thread_pool_free(pool_, FALSE, TRUE);
+      g_main_context_unref(context_);
+    }
+
+    void write_file(const char *path, GBytes *body, bool sync, Done done) override {
+      Job *job = new Job{path, -1, 0, g_bytes_ref(body), sync, 0, std::move(done), context_};
+      g_thread_pool_push(pool_, job, nullptr);
+    }
+
+    void write_at(int fd, uint64_t offset, GBytes *data, bool sync, Done done) override {
+      Job *job = new Job{string(), fd, offset, g_bytes_ref(data), sync, 0, std::move(done), context_};
+      g_thread_pool_push(pool_, job, nullptr);
+    }
+
+    const char *backend() const override { return "threads"; }
+
+  private:
+    struct Job {
+      // Opened, written from the start and closed by the job when fd is -1.
+      string path;
+      int fd;
+      uint64_t offset;
+      GBytes *body;
+      bool sync;
+      int err;
+      Done done;
+      GMainContext *context;
+    };
+
+    static void pool_func(gpointer data, gpointer usr_data) {
+      Job *job = (Job *) data;
+      pin_helper_thread();
+      bool owned = job->fd < 0;
+      int fd = owned ? open(job->path.c_str(), OPEN_FLAGS, OPEN_MODE) : job->fd;
+      if (fd < 0) {
+        job->err = errno;
+      } else {
+        gsize size;
+        const char *p = (const char *) g_bytes_get_data(job->body, &size);
+        uint64_t offset = job->offset;
+        while (size > 0) {
+          ssize_t n = pwrite(fd, p, size, (off_t) offset);
+          if (n < 0 && errno == EINTR) continue;
+          if (n <= 0) {
+            job->err = n < 0 ? errno : EIO;
+            break;
+          }
+          p += n;
+          size -= n;
+          offset += n;
+        }
+        if (!job->err && job->sync && (owned ? fsync(fd) : fdatasync(fd)) != 0) job->err = errno;
+        if (owned && close(fd) != 0 && !job->err) job->err = errno;
+      }
+      g_main_context_invoke(job->context, complete_in_context, job);
+    }
+
+    static gboolean complete_in_context(gpointer data) {
+      Job *job = (Job *) data;
+      g_bytes_unref(job->body);
+      Done done = std::move(job->done);
+      int err = job->err;
+      delete job;
+      done(err);
+      return G_SOURCE_REMOVE;
+    }
+
+    GThreadPool *pool_;
+    GMainContext *context_;
+  };
+
+#ifdef HAVE_LIBURING
+  // Each file is an openat, then write (linked to fsync when syncing), then
+  // close; writes into a caller's open file skip the openat and close. Submissions made while handling one loop iteration go to the
+  // kernel in a single io_uring_submit from the source's prepare step, and
+  // completions are signalled through an eventfd polled by the main loop.
+  class UringWriter : public FileWriter {
+  public:
+    static UringWriter *create(unsigned queueDepth) {
+      UringWriter *writer = new UringWriter(queueDepth);
+      if (!writer->init()) {
+        delete writer;
+        return nullptr;
+      }
+      return writer;
+    }
+
+    ~UringWriter() override {
+      // Pending jobs would complete into a freed ring.
+      g_warn_if_fail(activeJobs_ == 0 && backlog_.empty());
+      if (source_) {
+        g_source_destroy(source_);
+        g_source_unref(source_);
+      }
+      if (ringReady_) io_uring_queue_exit(&ring_);
+      if (eventFd_ >= 0) close(eventFd_);
+    }
+
+    void write_file(const char *path, GBytes *body, bool sync, Done done) override {
+      Job *job = new Job{path, g_bytes_ref(body), 0, 0, -1, 0, 0, sync, false, true, std::move(done)};
+      if (activeJobs_ < queueDepth_) start(job);
+      else backlog_.push_back(job);
+    }
+
+    void write_at(int fd, uint64_t offset, GBytes *data, bool sync, Done done) override {
+      Job *job = new Job{string(), g_bytes_ref(data), offset, 0, fd, 0, 0, sync, false, false, std::move(done)};
+      if (activeJobs_ < queueDepth_) start(job);
+      else backlog_.push_back(job);
+    }
+
+    const char *backend() const override { return "io_uring"; }
+
+  private:
+    enum Kind { OPEN, WRITE, FSYNC, CLOSE };
+
+    struct Job {
+      string path;
+      GBytes *body;
+      // File offset of the body's first byte.
+      uint64_t base;
+      // Bytes of the body written so far.
+      size_t offset;
+      int fd;
+      int err;
+      // Operations submitted and not yet completed.
+      int inFlight;
+      bool sync;
+      bool synced;
+      // Opened and closed by the job; otherwise the caller's.
+      bool ownsFd;
+      Done done;
+    };
+
+    struct Source {
+      GSource source;
+      UringWriter *writer;
+    };
+
+    explicit UringWriter(unsigned queueDepth)
+        : queueDepth_(max(queueDepth, 1u)), activeJobs_(0), unsubmitted_(0), ringReady_(false),
+          eventFd_(-1), source_(nullptr) {}
+
+    bool init() {
+      // Every active job has at most two operations outstanding, so the
+      // rings can never fill up.
+      if (io_uring_queue_init(queueDepth_ * 2, &ring_, 0) < 0) return false;
+      ringReady_ = true;
+
+      io_uring_probe *probe = io_uring_get_probe_ring(&ring_);
+      bool supported = probe && io_uring_opcode_supported(probe, IORING_OP_OPENAT) && io_uring_opcode_supported(probe, IORING_OP_CLOSE);
+      if (probe) io_uring_free_probe(probe);
+      if (!supported) return false;
+
+      eventFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (eventFd_ < 0 || io_uring_register_eventfd(&ring_, eventFd_) < 0) return false;
+
+      // The kernel's io-wq workers (blocking opens, fsyncs) follow the helper
+      // CPUs too. Older kernels lack this; it is only a placement hint.
+      const CpuSet &helpers = helper_cpus();
+      if (!helpers.empty()) {
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        for (int cpu : helpers.cpus()) CPU_SET(cpu, &mask);
+        io_uring_register_iowq_aff(&ring_, sizeof(mask), &mask);
+      }
+
+      static GSourceFuncs funcs = {prepare, nullptr, dispatch, nullptr};
+      source_ = g_source_new(&funcs, sizeof(Source));
+      ((Source *) source_)->writer = this;
+      g_source_add_unix_fd(source_, eventFd_, G_IO_IN);
+      g_source_attach(source_, g_main_context_get_thread_default());
+      return true;
+    }
+
+    static gboolean prepare(GSource *source, gint *timeout) {
+      UringWriter *writer = ((Source *) source)->writer;
+      if (writer->unsubmitted_) {
+        io_uring_submit(&writer->ring_);
+        writer->unsubmitted_ = 0;
+      }
+      *timeout = -1;
+      return FALSE;
+    }
+
+    static gboolean dispatch(GSource *source, GSourceFunc callback, gpointer usr_data) {
+      UringWriter *writer = ((Source *) source)->writer;
+      uint64_t count;
+      if (read(writer->eventFd_, &count, sizeof(count)) < 0 && errno != EAGAIN) g_warning("eventfd read: %s", g_strerror(errno));
+      writer->reap();
+      return G_SOURCE_CONTINUE;
+    }
+
+    io_uring_sqe *sqe(Job *job, Kind kind) {
+      io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+      g_assert(sqe);
+      io_uring_sqe_set_data(sqe, (void *) ((uintptr_t) job | kind));
+      job->inFlight++;
+      unsubmitted_++;
+      return sqe;
+    }
+
+    void start(Job *job) {
+      activeJobs_++;
+      if (job->ownsFd) io_uring_prep_openat(sqe(job, OPEN), AT_FDCWD, job->path.c_str(), OPEN_FLAGS, OPEN_MODE);
+      else advance(job);
+    }
+
+    // Files the caller keeps open only need their data synced.
+    static unsigned fsync_flags(const Job *job) { return job->ownsFd ? 0 : IORING_FSYNC_DATASYNC; }
+
+    // Issues whatever the job needs next once nothing of it is in flight.
+    void advance(Job *job) {
+      gsize size;
+      const char *data = (const char *) g_bytes_get_data(job->body, &size);
+
+      if (job->fd < 0) {
+        finish(job);
+      } else if (!job->err && job->offset < size) {
+        unsigned len = (unsigned) min<size_t>(size - job->offset, 1u << 30);
+        io_uring_sqe *write = sqe(job, WRITE);
+        io_uring_prep_write(write, job->fd, data + job->offset, len, job->base + job->offset);
+        if (job->sync) {
+          // A short write breaks the link and cancels the fsync; it is
+          // reissued with the remainder.
+          io_uring_sqe_set_flags(write, IOSQE_IO_LINK);
+          io_uring_prep_fsync(sqe(job, FSYNC), job->fd, fsync_flags(job));
+        }
+      } else if (!job->err && job->sync && !job->synced) {
+        io_uring_prep_fsync(sqe(job, FSYNC), job->fd, fsync_flags(job));
+      } else if (!job->ownsFd) {
+        finish(job);
+      } else {
+        io_uring_prep_close(sqe(job, CLOSE), job->fd);
+      }
+    }
+
+    void reap() {
+      // Collect first: completions may queue new files and touch the ring.
+      io_uring_cqe *cqe;
+      unsigned head, count = 0;
+      io_uring_for_each_cqe(&ring_, head, cqe) {
+        reaped_.emplace_back(cqe->user_data, cqe->res);
+        count++;
+      }
+      io_uring_cq_advance(&ring_, count);
+
+      for (const auto &completion : reaped_) {
+        Job *job = (Job *) (uintptr_t) (completion.first & ~(uint64_t) 3);
+        complete(job, (Kind) (completion.first & 3), completion.second);
+      }
+      reaped_.clear();
+    }
+
+    void complete(Job *job, Kind kind, int res) {
+      job->inFlight--;
+      switch (kind) {
+        case OPEN:
+          if (res < 0) job->err = -res;
+          else job->fd = res;
+          break;
+        case WRITE:
+          if (res <= 0) job->err = res < 0 ? -res : EIO;
+          else job->offset += res;
+          break;
+        case FSYNC:
+          if (res == 0) job->synced = true;
+          else if (res != -ECANCELED) job->err = -res;
+          break;
+        case CLOSE:
+          if (res < 0 && !job->err) job->err = -res;
+          job->fd = -1;
+          break;
+      }
+      if (job->inFlight == 0) advance(job);
+    }
+
+    void finish(Job *job) {
+      activeJobs_--;
+      g_bytes_unref(job->body);
+      Done done = std::move(job->done);
+      int err = job->err;
+      delete job;
+
+      while (activeJobs_ < queueDepth_ && !backlog_.empty()) {
+        Job *next = backlog_.front();
+        backlog_.pop_front();
+        start(next);
+      }
+      done(err);
+    }
+
+    unsigned queueDepth_;
+    unsigned activeJobs_;
+    unsigned unsubmitted_;
+    deque<Job *> backlog_;
+    vector<pair<uint64_t, int>> reaped_;
+    io_uring ring_;
+    bool ringReady_;
+    int eventFd_;
+    GSource *source_;
+  };
+#endif
+
+} // namespace
+
+FileWriter *FileWriter::create(unsigned queueDepth) {
+#ifdef HAVE_LIBURING
+  // Kernels without io_uring, or sandboxes that forbid it, get the pool.
+  if (FileWriter *writer = UringWriter::create(queueDepth)) return writer;
+#endif
+  return new ThreadPoolWriter(min(max(queueDepth, 1u), 32u));
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <glib.h>
+
+#include <cstdint>
+
+#include "soupclient.h"
+
+// Writes bodies to files without blocking the main loop: whole files, or
+// pieces of files the caller keeps open. Completions run on the context that
+// was thread-default at creation.
+class FileWriter {
+public:
+  // errno-style result: 0 on success.
+  typedef SmallFunction<void(int err)> Done;
+
+  virtual ~FileWriter() {}
+
+  // Creates or truncates path and writes body to it, followed by fsync when
+  // sync is set. Takes its own reference on body.
+  virtual void write_file(const char *path, GBytes *body, bool sync, Done done) = 0;
+
+  // Writes data at offset into fd, followed by fdatasync when sync is set;
+  // empty data only syncs. fd must stay open until done runs, and callers
+  // keep at most one write per file in flight. Takes its own reference on
+  // data.
+  virtual void write_at(int fd, uint64_t offset, GBytes *data, bool sync, Done done) = 0;
+
+  virtual const char *backend() const = 0;
+
+  // io_uring when built with liburing and the kernel allows it, otherwise a
+  // pool of blocking writer threads. queueDepth bounds the operations in
+  // flight at once.
+  static FileWriter *create(unsigned queueDepth);
+};
@@ -0,0 +1,193 @@
+#include "hash.h"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t
+rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+read64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t
+read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t
+xxh64_round(uint64_t acc, uint64_t input) {
+  acc += input * PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static inline uint64_t
+xxh64_merge(uint64_t acc, uint64_t val) {
+  acc ^= xxh64_round(0, val);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+XxHash64::XxHash64(uint64_t seed) {
+  reset(seed);
+}
+
+void XxHash64::reset(uint64_t seed) {
+  seed_ = seed;
+  acc_[0] = seed + PRIME64_1 + PRIME64_2;
+  acc_[1] = seed + PRIME64_2;
+  acc_[2] = seed;
+  acc_[3] = seed - PRIME64_1;
+  total_ = 0;
+  bufLen_ = 0;
+}
+
+void XxHash64::update(const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char *) data;
+  const unsigned char *end = p + len;
+  total_ += len;
+
+  if (bufLen_ + len < sizeof(buf_)) {
+    memcpy(buf_ + bufLen_, p, len);
+    bufLen_ += len;
+    return;
+  }
+
+  if (bufLen_ > 0) {
+    size_t fill = sizeof(buf_) - bufLen_;
+    memcpy(buf_ + bufLen_, p, fill);
+    for (int i = 0; i < 4; i++) acc_[i] = xxh64_round(acc_[i], read64(buf_ + i * 8));
+    p += fill;
+    bufLen_ = 0;
+  }
+
+  while (p + 32 <= end) {
+    for (int i = 0; i < 4; i++) acc_[i] = xxh64_round(acc_[i], read64(p + i * 8));
+    p += 32;
+  }
+
+  bufLen_ = end - p;
+  memcpy(buf_, p, bufLen_);
+}
+
+uint64_t XxHash64::digest() const {
+  uint64_t h;
+  if (total_ >= 32) {
+    h = rotl64(acc_[0], 1) + rotl64(acc_[1], 7) + rotl64(acc_[2], 12) + rotl64(acc_[3], 18);
+    for (int i = 0; i < 4; i++) h = xxh64_merge(h, acc_[i]);
+  } else {
+    h = seed_ + PRIME64_5;
+  }
+  h += total_;
+
+  const unsigned char *p = buf_;
+  const unsigned char *end = buf_ + bufLen_;
+  while (p + 8 <= end) {
+    h ^= xxh64_round(0, read64(p));
+    h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    p += 8;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t) read32(p) * PRIME64_1;
+    h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= (*p) * PRIME64_5;
+    h = rotl64(h, 11) * PRIME64_1;
+    p++;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+// Reflected Castagnoli polynomial.
+static const uint32_t CRC32C_POLY = 0x82F63B78u;
+
+// tables[k][b]: CRC of byte b followed by k zero bytes.
+static const uint32_t (*crc32c_tables())[256] {
+  static uint32_t (*tables)[256] = [] {
+    uint32_t (*t)[256] = new uint32_t[8][256];
+    for (uint32_t b = 0; b < 256; b++) {
+      uint32_t crc = b;
+      for (int i = 0; i < 8; i++) crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+      t[0][b] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+      for (uint32_t b = 0; b < 256; b++) t[k][b] = (t[k - 1][b] >> 8) ^ t[0][t[k - 1][b] & 0xff];
+    }
+    return t;
+  }();
+  return tables;
+}
+
+static uint32_t
+crc32c_portable(uint32_t crc, const unsigned char *p, size_t len) {
+  const uint32_t (*t)[256] = crc32c_tables();
+  while (len >= 8) {
+    uint64_t v = read64(p) ^ crc;
+    crc = t[7][v & 0xff] ^ t[6][(v >> 8) & 0xff] ^ t[5][(v >> 16) & 0xff] ^ t[4][(v >> 24) & 0xff] ^
+          t[3][(v >> 32) & 0xff] ^ t[2][(v >> 40) & 0xff] ^ t[1][(v >> 48) & 0xff] ^ t[0][v >> 56];
+    p += 8;
+    len -= 8;
+  }
+  while (len--) crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+  uint64_t crc64 = crc;
+  while (len >= 8) {
+    crc64 = _mm_crc32_u64(crc64, read64(p));
+    p += 8;
+    len -= 8;
+  }
+  crc = (uint32_t) crc64;
+  while (len--) crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+#endif
+
+typedef uint32_t (*Crc32cFunc)(uint32_t, const unsigned char *, size_t);
+
+static Crc32cFunc
+crc32c_func() {
+  static Crc32cFunc func = [] {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) return crc32c_sse42;
+#endif
+    return crc32c_portable;
+  }();
+  return func;
+}
+
+void Crc32c::update(const void *data, size_t len) {
+  crc_ = crc32c_func()(crc_, (const unsigned char *) data, len);
+}
+
+bool Crc32c::hardware() {
+  return crc32c_func() != crc32c_portable;
+}
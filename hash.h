@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Streaming XXH64. Produces the same digests as the reference implementation
+// regardless of how the input is split across update() calls.
+class XxHash64 {
+public:
+  explicit XxHash64(uint64_t seed = 0);
+
+  void reset(uint64_t seed = 0);
+  void update(const void *data, size_t len);
+  uint64_t digest() const;
+
+private:
+  uint64_t acc_[4];
+  uint64_t seed_;
+  uint64_t total_;
+  unsigned char buf_[32];
+  size_t bufLen_;
+};
+
+// Streaming CRC32C (Castagnoli), as used by iSCSI, ext4 and cloud object
+// stores. Runs on the SSE4.2 crc32 instruction when the CPU has it and on
+// slice-by-8 tables otherwise.
+class Crc32c {
+public:
+  Crc32c() : crc_(0xFFFFFFFFu) {}
+
+  void reset() { crc_ = 0xFFFFFFFFu; }
+  void update(const void *data, size_t len);
+  uint32_t digest() const { return ~crc_; }
+
+  // Whether update() uses the hardware instruction on this machine.
+  static bool hardware();
+
+private:
+  uint32_t crc_;
+};
@@ -0,0 +1,247 @@
+#include "link_extractor.h"
+
+#include <atomic>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LINK_EXTRACTOR_X86 1
+#endif
+
+using namespace std;
+
+static const size_t MAX_LINK_BYTES = 2048;
+
+static inline bool
+is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+static inline char
+lower(char c) {
+  return (c >= 'A' && c <= 'Z') ? (char) (c | 0x20) : c;
+}
+
+// A candidate is an '=' directly after the last letter of href/src, or after
+// whitespace for the spaced "href = ..." form.
+static inline bool
+candidate_prev(char prev) {
+  char l = lower(prev);
+  return l == 'f' || l == 'c' || prev == ' ' || prev == '\t' || prev == '\n' || prev == '\r';
+}
+
+// Each scanner returns the index of the first candidate in [from, len), or
+// len. from must be at least 1 because the byte before each position is read.
+typedef size_t (*ScanFn)(const char *data, size_t from, size_t len);
+
+static size_t
+next_candidate_scalar(const char *data, size_t from, size_t len) {
+  for (size_t i = from; i < len; i++) {
+    const char *eq = (const char *) memchr(data + i, '=', len - i);
+    if (!eq) return len;
+    i = eq - data;
+    if (candidate_prev(data[i - 1])) return i;
+  }
+  return len;
+}
+
+#ifdef LINK_EXTRACTOR_X86
+
+__attribute__((target("sse4.2"))) static size_t
+next_candidate_sse42(const char *data, size_t from, size_t len) {
+  const __m128i eq = _mm_set1_epi8('=');
+  const __m128i prevSet = _mm_setr_epi8('f', 'F', 'c', 'C', ' ', '\t', '\n', '\r', 0, 0, 0, 0, 0, 0, 0, 0);
+  size_t i = from;
+  for (; i + 16 <= len; i += 16) {
+    __m128i cur = _mm_loadu_si128((const __m128i *) (data + i));
+    __m128i isEq = _mm_cmpeq_epi8(cur, eq);
+    if (!_mm_movemask_epi8(isEq)) continue;
+    __m128i prev = _mm_loadu_si128((const __m128i *) (data + i - 1));
+    __m128i prevOk = _mm_cmpestrm(prevSet, 8, prev, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_UNIT_MASK);
+    unsigned mask = (unsigned) _mm_movemask_epi8(_mm_and_si128(isEq, prevOk));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  return next_candidate_scalar(data, i, len);
+}
+
+__attribute__((target("avx2"))) static size_t
+next_candidate_avx2(const char *data, size_t from, size_t len) {
+  const __m256i eq = _mm256_set1_epi8('=');
+  const __m256i caseBit = _mm256_set1_epi8(0x20);
+  const __m256i f = _mm256_set1_epi8('f');
+  const __m256i c = _mm256_set1_epi8('c');
+  const __m256i sp = _mm256_set1_epi8(' ');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i nl = _mm256_set1_epi8('\n');
+  const __m256i cr = _mm256_set1_epi8('\r');
+  size_t i = from;
+  for (; i + 32 <= len; i += 32) {
+    __m256i cur = _mm256_loadu_si256((const __m256i *) (data + i));
+    __m256i isEq = _mm256_cmpeq_epi8(cur, eq);
+    if (!_mm256_movemask_epi8(isEq)) continue;
+    __m256i prev = _mm256_loadu_si256((const __m256i *) (data + i - 1));
+    __m256i folded = _mm256_or_si256(prev, caseBit);
+    __m256i name = _mm256_or_si256(_mm256_cmpeq_epi8(folded, f), _mm256_cmpeq_epi8(folded, c));
+    __m256i space = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(prev, sp), _mm256_cmpeq_epi8(prev, tab)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(prev, nl), _mm256_cmpeq_epi8(prev, cr)));
+    unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_and_si256(isEq, _mm256_or_si256(name, space)));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  return next_candidate_sse42(data, i, len);
+}
+
+#endif
+
+static LinkExtractor::Isa
+probe_isa() {
+#ifdef LINK_EXTRACTOR_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return LinkExtractor::ISA_AVX2;
+  if (__builtin_cpu_supports("sse4.2")) return LinkExtractor::ISA_SSE42;
+#endif
+  return LinkExtractor::ISA_SCALAR;
+}
+
+static ScanFn
+scanner_for(LinkExtractor::Isa isa) {
+#ifdef LINK_EXTRACTOR_X86
+  if (isa == LinkExtractor::ISA_AVX2) return next_candidate_avx2;
+  if (isa == LinkExtractor::ISA_SSE42) return next_candidate_sse42;
+#endif
+  return next_candidate_scalar;
+}
+
+// Atomic so force_isa can run while pipeline threads are extracting; each
+// feed() picks one implementation for the whole chunk.
+static atomic<ScanFn> scanner(scanner_for(LinkExtractor::detected_isa()));
+
+LinkExtractor::Isa LinkExtractor::detected_isa() {
+  static const Isa isa = probe_isa();
+  return isa;
+}
+
+const char *LinkExtractor::isa_name(Isa isa) {
+  switch (isa) {
+    case ISA_AVX2:
+      return "avx2";
+    case ISA_SSE42:
+      return "sse4.2";
+    default:
+      return "scalar";
+  }
+}
+
+void LinkExtractor::force_isa(Isa isa) {
+  scanner.store(scanner_for(isa <= detected_isa() ? isa : detected_isa()), memory_order_relaxed);
+}
+
+LinkExtractor::LinkExtractor(function<void(const char *, size_t)> onLink)
+    : onLink_(std::move(onLink)), state_(SCAN), quote_(0), overflow_(false), tailLen_(0), links_(0) {}
+
+bool LinkExtractor::attribute_precedes(const char *data, size_t at) const {
+  auto byte = [&](ptrdiff_t k) -> char {
+    if (k >= 0) return data[k];
+    if (-k <= (ptrdiff_t) tailLen_) return tail_[tailLen_ + k];
+    return 0;
+  };
+
+  ptrdiff_t j = (ptrdiff_t) at - 1;
+  for (int spaces = 0; spaces < 4 && is_space(byte(j)); spaces++) j--;
+
+  size_t nameLen;
+  if (lower(byte(j)) == 'f' && lower(byte(j - 1)) == 'e' && lower(byte(j - 2)) == 'r' && lower(byte(j - 3)) == 'h') {
+    nameLen = 4;
+  } else if (lower(byte(j)) == 'c' && lower(byte(j - 1)) == 'r' && lower(byte(j - 2)) == 's') {
+    nameLen = 3;
+  } else {
+    return false;
+  }
+
+  char before = byte(j - (ptrdiff_t) nameLen);
+  return before == 0 || is_space(before) || before == '"' || before == '\'' || before == '/';
+}
+
+size_t LinkExtractor::consume_value(const char *data, size_t len, size_t at) {
+  size_t i = at;
+  if (state_ == VALUE_START) {
+    while (i < len && is_space(data[i])) i++;
+    if (i == len) return len;
+    if (data[i] == '>') {
+      state_ = SCAN;
+      return i;
+    }
+    quote_ = (data[i] == '"' || data[i] == '\'') ? data[i++] : 0;
+    state_ = VALUE;
+  }
+
+  size_t end;
+  if (quote_) {
+    const char *q = (const char *) memchr(data + i, quote_, len - i);
+    end = q ? q - data : len;
+  } else {
+    end = i;
+    while (end < len && !is_space(data[end]) && data[end] != '>') end++;
+  }
+
+  if (!overflow_) {
+    if (value_.size() + (end - i) > MAX_LINK_BYTES) overflow_ = true;
+    else value_.append(data + i, end - i);
+  }
+  if (end == len) return len;
+
+  emit();
+  return quote_ ? end + 1 : end;
+}
+
+void LinkExtractor::emit() {
+  if (!overflow_ && !value_.empty()) {
+    links_++;
+    onLink_(value_.data(), value_.size());
+  }
+  value_.clear();
+  overflow_ = false;
+  state_ = SCAN;
+}
+
+void LinkExtractor::feed(const char *data, size_t len) {
+  size_t i = 0;
+  if (state_ != SCAN) i = consume_value(data, len, 0);
+  ScanFn scan = scanner.load(memory_order_relaxed);
+
+  while (i < len) {
+    size_t c;
+    if (i == 0) {
+      c = (data[0] == '=' && tailLen_ > 0 && candidate_prev(tail_[tailLen_ - 1])) ? 0 : scan(data, 1, len);
+    } else {
+      c = scan(data, i, len);
+    }
+    if (c >= len) break;
+
+    if (attribute_precedes(data, c)) {
+      state_ = VALUE_START;
+      value_.clear();
+      overflow_ = false;
+      i = consume_value(data, len, c + 1);
+    } else {
+      i = c + 1;
+    }
+  }
+
+  if (len >= sizeof(tail_)) {
+    memcpy(tail_, data + len - sizeof(tail_), sizeof(tail_));
+    tailLen_ = sizeof(tail_);
+  } else {
+    size_t keep = min(tailLen_, sizeof(tail_) - len);
+    memmove(tail_, tail_ + tailLen_ - keep, keep);
+    memcpy(tail_ + keep, data, len);
+    tailLen_ = keep + len;
+  }
+}
+
+void LinkExtractor::finish() {
+  if (state_ == VALUE && !quote_) emit();
+  state_ = SCAN;
+  value_.clear();
+  overflow_ = false;
+  tailLen_ = 0;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+
+// Pulls href= and src= attribute values out of HTML as it streams in. Candidate
+// '=' positions are located with SSE4.2 or AVX2 when the CPU supports them;
+// only those candidates are inspected byte by byte. Attributes and values that
+// straddle chunk boundaries are handled.
+class LinkExtractor {
+public:
+  enum Isa {
+    ISA_SCALAR,
+    ISA_SSE42,
+    ISA_AVX2,
+  };
+
+  explicit LinkExtractor(std::function<void(const char *, size_t)> onLink);
+
+  void feed(const char *data, size_t len);
+  void finish();
+
+  size_t links() const { return links_; }
+
+  // The widest implementation this CPU supports; used unless overridden.
+  static Isa detected_isa();
+  static const char *isa_name(Isa isa);
+  // Forces a particular implementation, for benchmarking. Requests for an
+  // unsupported ISA fall back to the detected one. Safe to call while other
+  // threads feed; chunks already being scanned finish with the old one.
+  static void force_isa(Isa isa);
+
+private:
+  enum State {
+    SCAN,
+    VALUE_START,
+    VALUE,
+  };
+
+  bool attribute_precedes(const char *data, size_t at) const;
+  size_t consume_value(const char *data, size_t len, size_t at);
+  void emit();
+
+  std::function<void(const char *, size_t)> onLink_;
+  State state_;
+  char quote_;
+  bool overflow_;
+  std::string value_;
+  // Last bytes of the previous chunk so attribute names can be matched
+  // backwards across a boundary.
+  char tail_[8];
+  size_t tailLen_;
+  size_t links_;
+};
@@ -0,0 +1,134 @@
+#include "loopback_server.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <gio/gunixsocketaddress.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char *
+filler() {
+  static char *buffer = [] {
+    char *data = (char *) g_malloc(LoopbackServer::MAX_BODY_BYTES);
+    for (size_t i = 0; i < LoopbackServer::MAX_BODY_BYTES; i++) data[i] = "0123456789abcdef"[i & 15];
+    return data;
+  }();
+  return buffer;
+}
+
+LoopbackServer::LoopbackServer() : server_(GObjectHandle<SoupServer>::adopt(soup_server_new(SOUP_SERVER_SERVER_HEADER, "libsouptest-loopback", nullptr))),
+      unixService_(nullptr) {
+  soup_server_add_handler(server_.get(), "/bytes", handle_bytes, nullptr, nullptr);
+  soup_server_add_handler(server_.get(), "/redirect", handle_redirect, nullptr, nullptr);
+  soup_server_add_handler(server_.get(), "/auth", handle_bytes, nullptr, nullptr);
+  soup_server_add_websocket_handler(server_.get(), "/echo", nullptr, nullptr, handle_echo, nullptr, nullptr);
+
+  SoupAuthDomain *domain = soup_auth_domain_basic_new(SOUP_AUTH_DOMAIN_REALM, "libsouptest", SOUP_AUTH_DOMAIN_ADD_PATH, "/auth",
+                                                      SOUP_AUTH_DOMAIN_BASIC_AUTH_CALLBACK, check_password, nullptr);
+  soup_server_add_auth_domain(server_.get(), domain);
+  g_object_unref(domain);
+}
+
+LoopbackServer::~LoopbackServer() {
+  if (unixService_) {
+    g_socket_service_stop(unixService_);
+    g_socket_listener_close(G_SOCKET_LISTENER(unixService_));
+    g_object_unref(unixService_);
+    unlink(unixPath_.c_str());
+  }
+  soup_server_disconnect(server_.get());
+}
+
+gboolean LoopbackServer::start(GError **error) {
+  if (!soup_server_listen_local(server_.get(), 0, SOUP_SERVER_LISTEN_IPV4_ONLY, error)) return FALSE;
+
+  GSList *uris = soup_server_get_uris(server_.get());
+  SoupURI *uri = (SoupURI *) uris->data;
+  baseUrl_ = "http://127.0.0.1:" + to_string(uri->port);
+  g_slist_free_full(uris, (GDestroyNotify) soup_uri_free);
+  return TRUE;
+}
+
+gboolean LoopbackServer::listen_unix(const string &path, GError **error) {
+  unlink(path.c_str());
+  GSocketService *service = g_socket_service_new();
+  GSocketAddress *address = g_unix_socket_address_new(path.c_str());
+  gboolean listening = g_socket_listener_add_address(G_SOCKET_LISTENER(service), address, G_SOCKET_TYPE_STREAM,
+                                                     G_SOCKET_PROTOCOL_DEFAULT, nullptr, nullptr, error);
+  g_object_unref(address);
+  if (!listening) {
+    g_object_unref(service);
+    return FALSE;
+  }
+  unixService_ = service;
+  unixPath_ = path;
+  g_signal_connect(service, "incoming", G_CALLBACK(on_unix_incoming), this);
+  g_socket_service_start(service);
+  return TRUE;
+}
+
+gboolean LoopbackServer::on_unix_incoming(GSocketService *service, GSocketConnection *connection, GObject *source,
+                                          gpointer usr_data) {
+  LoopbackServer *self = (LoopbackServer *) usr_data;
+  // The same server as over TCP; libsoup only needs the stream.
+  GSocketAddress *local = g_socket_connection_get_local_address(connection, nullptr);
+  GSocketAddress *remote = g_socket_connection_get_remote_address(connection, nullptr);
+  GError *error = nullptr;
+  if (!soup_server_accept_iostream(self->server_.get(), G_IO_STREAM(connection), local, remote, &error)) g_error_free(error);
+  if (local) g_object_unref(local);
+  if (remote) g_object_unref(remote);
+  return TRUE;
+}
+
+void LoopbackServer::handle_bytes(SoupServer *server, SoupMessage *msg, const char *path, GHashTable *query,
+                                  SoupClientContext *client, gpointer usr_data) {
+  if (msg->method != SOUP_METHOD_GET && msg->method != SOUP_METHOD_HEAD) {
+    soup_message_set_status(msg, SOUP_STATUS_NOT_IMPLEMENTED);
+    return;
+  }
+
+  const char *slash = strchr(path + 1, '/');
+  const char *count = slash ? slash + 1 : "";
+  char *end;
+  unsigned long long bytes = strtoull(count, &end, 10);
+  if (!*count || *end || bytes > MAX_BODY_BYTES) {
+    soup_message_set_status(msg, SOUP_STATUS_BAD_REQUEST);
+    return;
+  }
+
+  soup_message_set_status(msg, SOUP_STATUS_OK);
+  soup_message_set_response(msg, "application/octet-stream", SOUP_MEMORY_STATIC, filler(), (gsize) bytes);
+}
+
+void LoopbackServer::handle_redirect(SoupServer *server, SoupMessage *msg, const char *path, GHashTable *query,
+                                     SoupClientContext *client, gpointer usr_data) {
+  if (strncmp(path, "/redirect/", 10) != 0 || !path[10]) {
+    soup_message_set_status(msg, SOUP_STATUS_BAD_REQUEST);
+    return;
+  }
+  string location = string("/bytes/") + (path + 10);
+  soup_message_set_redirect(msg, SOUP_STATUS_MOVED_PERMANENTLY, location.c_str());
+}
+
+void LoopbackServer::handle_echo(SoupServer *server, SoupWebsocketConnection *connection, const char *path,
+                                 SoupClientContext *client, gpointer usr_data) {
+  // Lives until closed; the server keeps no reference of its own.
+  g_object_ref(connection);
+  g_object_set(connection, "max-incoming-payload-size", (guint64) 0, nullptr);
+  g_signal_connect(connection, "message", G_CALLBACK(on_echo_message), nullptr);
+  g_signal_connect(connection, "closed", G_CALLBACK(g_object_unref), nullptr);
+}
+
+void LoopbackServer::on_echo_message(SoupWebsocketConnection *connection, gint type, GBytes *message, gpointer usr_data) {
+  gsize len;
+  gconstpointer data = g_bytes_get_data(message, &len);
+  // Text messages arrive NUL-terminated.
+  if (type == SOUP_WEBSOCKET_DATA_TEXT) soup_websocket_connection_send_text(connection, (const char *) data);
+  else soup_websocket_connection_send_binary(connection, data, len);
+}
+
+gboolean LoopbackServer::check_password(SoupAuthDomain *domain, SoupMessage *msg, const char *username, const char *password,
+                                        gpointer usr_data) {
+  return strcmp(username, AUTH_USER) == 0 && strcmp(password, AUTH_PASSWORD) == 0;
+}
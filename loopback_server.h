@@ -0,0 +1,58 @@
+#pragma once
+
+#include <libsoup/soup.h>
+
+#include <string>
+
+#include "soupclient.h"
+
+// In-process HTTP server on 127.0.0.1 for benchmarks. GET /bytes/N answers
+// with N bytes of filler from a static buffer, so the server side costs as
+// little as libsoup allows and the client dominates the profile.
+// /redirect/N answers 301 to /bytes/N, and /auth/N is /bytes/N behind Basic
+// auth as AUTH_USER:AUTH_PASSWORD. /echo is a WebSocket endpoint that sends
+// every message straight back.
+class LoopbackServer {
+public:
+  static const size_t MAX_BODY_BYTES = 64 << 20;
+  static constexpr const char *AUTH_USER = "bench";
+  static constexpr const char *AUTH_PASSWORD = "bench";
+
+  LoopbackServer();
+  ~LoopbackServer();
+
+  LoopbackServer(const LoopbackServer &) = delete;
+  LoopbackServer &operator=(const LoopbackServer &) = delete;
+
+  // Listens on an ephemeral port, serving from the thread-default context.
+  gboolean start(GError **error);
+  // Also serves on a Unix socket at path, replacing any socket file there,
+  // for comparing transports. Removed again with the server.
+  gboolean listen_unix(const std::string &path, GError **error);
+
+  SoupServer *get() const { return server_.get(); }
+  // http://127.0.0.1:PORT, without a trailing slash.
+  const std::string &base_url() const { return baseUrl_; }
+  std::string url_for(size_t bodyBytes) const { return baseUrl_ + "/bytes/" + std::to_string(bodyBytes); }
+  std::string redirect_url_for(size_t bodyBytes) const { return baseUrl_ + "/redirect/" + std::to_string(bodyBytes); }
+  std::string auth_url_for(size_t bodyBytes) const { return baseUrl_ + "/auth/" + std::to_string(bodyBytes); }
+  // ws://127.0.0.1:PORT/echo
+  std::string echo_url() const { return "ws" + baseUrl_.substr(4) + "/echo"; }
+
+private:
+  static void handle_bytes(SoupServer *server, SoupMessage *msg, const char *path, GHashTable *query,
+                           SoupClientContext *client, gpointer usr_data);
+  static void handle_redirect(SoupServer *server, SoupMessage *msg, const char *path, GHashTable *query,
+                              SoupClientContext *client, gpointer usr_data);
+  static void handle_echo(SoupServer *server, SoupWebsocketConnection *connection, const char *path, SoupClientContext *client,
+                          gpointer usr_data);
+  static void on_echo_message(SoupWebsocketConnection *connection, gint type, GBytes *message, gpointer usr_data);
+  static gboolean on_unix_incoming(GSocketService *service, GSocketConnection *connection, GObject *source, gpointer usr_data);
+  static gboolean check_password(SoupAuthDomain *domain, SoupMessage *msg, const char *username, const char *password,
+                                 gpointer usr_data);
+
+  GObjectHandle<SoupServer> server_;
+  std::string baseUrl_;
+  GSocketService *unixService_;
+  std::string unixPath_;
+};
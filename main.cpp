@@ -1,40 +1,1261 @@
 #include <iostream>
+#include <gio/gunixoutputstream.h>
+#include <glib-unix.h>
 #include <libsoup/soup.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+
+#include "affinity.h"
+#include "budget.h"
+#include "checkpoint.h"
+#include "coalesce.h"
+#include "crawler.h"
+#include "event_stream.h"
+#include "fetch_coro.h"
+#include "file_writer.h"
+#include "link_extractor.h"
+#include "pipeline.h"
+#include "progress.h"
+#include "replay.h"
+#include "scheduler.h"
+#include "shard.h"
+#include "sink.h"
+#include "soupclient.h"
+#include "tracing.h"
+#include "upload.h"
+#include "verify.h"
+#include "websocket_load.h"
+
 using namespace std;
 
-static SoupMessage *
-generate_soup_get_message(const char *url) {
-  SoupMessage *msg = soup_message_new("GET", url);
-  g_object_ref(msg);
-  return msg;
+static gchar *pipelineSpec = nullptr;
+static gint pipelineThreads = 0;
+static gint followLinks = 0;
+static gboolean crawl = FALSE;
+static gint crawlDepth = 3;
+static gint crawlDelay = 1000;
+static gint crawlConcurrency = 16;
+static gint64 crawlMaxPages = 0;
+static gint64 crawlExpectedUrls = 1000000;
+static gboolean coroFanOut = FALSE;
+static gboolean coroRace = FALSE;
+static gchar **uploads = nullptr;
+static gchar *uploadContentType = nullptr;
+static gint64 uploadStreamThreshold = FileUpload::DEFAULT_STREAM_THRESHOLD;
+static gchar *replayPath = nullptr;
+static gdouble replaySpeed = 1.0;
+static gchar *replayTarget = nullptr;
+static gchar *recordPath = nullptr;
+static gboolean coalesce = FALSE;
+static gchar **urgentUrls = nullptr;
+static gchar **bulkUrls = nullptr;
+static gint deadlineMs = 0;
+static gint maxInFlight = 8;
+static gboolean deferLate = FALSE;
+static gint64 memoryBudget = 0;
+static gchar *outputDir = nullptr;
+static gboolean outputSync = FALSE;
+static gint ioDepth = 64;
+static gchar *traceFile = nullptr;
+static gchar *checkpointPath = nullptr;
+static gint procs = 0;
+static gchar *loopCpus = nullptr;
+static gint cpusPerWorker = 1;
+static gchar *helperCpus = nullptr;
+static gint progressMs = 0;
+static gchar *progressFormat = nullptr;
+static gint maxRedirects = -1;
+static gint redirectCache = 0;
+static gboolean cookies = FALSE;
+static gchar **authSpecs = nullptr;
+static gchar **authHeaders = nullptr;
+static gboolean verify = FALSE;
+static gchar *manifestPath = nullptr;
+static gint verifyRetries = 2;
+static gboolean websocket = FALSE;
+static gint wsConnections = 100;
+static gdouble wsRate = 10;
+static gint64 wsMessageBytes = 64;
+static gint wsDurationMs = 10000;
+static gboolean wsText = FALSE;
+static gchar *streamFormat = nullptr;
+static gboolean streamReconnect = FALSE;
+static gint64 streamMaxEvent = 1 << 20;
+static gint streamTimeout = 0;
+static gchar **unixSockets = nullptr;
+static gchar **urls = nullptr;
+
+static GOptionEntry entries[] = {
+        {"pipeline", 'p', 0, G_OPTION_ARG_STRING, &pipelineSpec, "Stream bodies through STAGES (sha256,xxh64,crc32c,lines,links,find=TEXT,regex=EXPR,json=FIELD,gzip[=PATH])", "STAGES"},
+        {"pipeline-threads", 0, 0, G_OPTION_ARG_INT, &pipelineThreads, "Run pipeline stages on N worker threads instead of the main loop", "N"},
+        {"follow-links", 'f', 0, G_OPTION_ARG_INT, &followLinks, "Queue up to N href/src links discovered in fetched pages", "N"},
+        {"crawl", 'c', 0, G_OPTION_ARG_NONE, &crawl, "Recursively crawl links through a deduplicating, per-host polite frontier", nullptr},
+        {"max-depth", 0, 0, G_OPTION_ARG_INT, &crawlDepth, "Do not crawl further than N links from a seed (default 3)", "N"},
+        {"crawl-delay", 0, 0, G_OPTION_ARG_INT, &crawlDelay, "Wait MS between fetches to the same host (default 1000)", "MS"},
+        {"concurrency", 0, 0, G_OPTION_ARG_INT, &crawlConcurrency, "Crawl at most N hosts at once (default 16)", "N"},
+        {"max-pages", 0, 0, G_OPTION_ARG_INT64, &crawlMaxPages, "Stop crawling after N pages (default unlimited)", "N"},
+        {"expected-urls", 0, 0, G_OPTION_ARG_INT64, &crawlExpectedUrls, "Size the seen-URL filter for N urls (default 1000000)", "N"},
+        {"fan-out", 0, 0, G_OPTION_ARG_NONE, &coroFanOut, "Fetch all URLs concurrently from a coroutine and report once all are done", nullptr},
+        {"race", 0, 0, G_OPTION_ARG_NONE, &coroRace, "Fetch all URLs concurrently, keep the first response and cancel the rest", nullptr},
+        {"upload", 'u', 0, G_OPTION_ARG_STRING_ARRAY, &uploads, "Send FILE to URL with METHOD (POST, PUT or PATCH); repeat for concurrent uploads", "METHOD,FILE,URL"},
+        {"content-type", 0, 0, G_OPTION_ARG_STRING, &uploadContentType, "Content-Type for uploads (default application/octet-stream)", "TYPE"},
+        {"stream-threshold", 0, 0, G_OPTION_ARG_INT64, &uploadStreamThreshold, "Stream uploads larger than BYTES in mapped windows instead of one mapping", "BYTES"},
+        {"replay", 0, 0, G_OPTION_ARG_FILENAME, &replayPath, "Reissue the requests recorded in LOG with their original timing", "LOG"},
+        {"replay-speed", 0, 0, G_OPTION_ARG_DOUBLE, &replaySpeed, "Replay FACTOR times faster than recorded (default 1.0)", "FACTOR"},
+        {"replay-target", 0, 0, G_OPTION_ARG_STRING, &replayTarget, "Send replayed requests to BASE instead of the recorded scheme://host:port", "BASE"},
+        {"record", 0, 0, G_OPTION_ARG_FILENAME, &recordPath, "Record every request issued to LOG for later --replay", "LOG"},
+        {"coalesce", 0, 0, G_OPTION_ARG_NONE, &coalesce, "Send identical concurrent GET requests once and share the response", nullptr},
+        {"urgent", 0, 0, G_OPTION_ARG_STRING_ARRAY, &urgentUrls, "Fetch URL ahead of everything else; repeat for more", "URL"},
+        {"bulk", 0, 0, G_OPTION_ARG_STRING_ARRAY, &bulkUrls, "Fetch URL only when nothing more urgent is waiting; repeat for more", "URL"},
+        {"deadline", 0, 0, G_OPTION_ARG_INT, &deadlineMs, "Give every request MS to complete, earliest deadline first within a class", "MS"},
+        {"in-flight", 0, 0, G_OPTION_ARG_INT, &maxInFlight, "Hand at most N scheduled requests to the session at once (default 8)", "N"},
+        {"defer-late", 0, 0, G_OPTION_ARG_NONE, &deferLate, "Send requests that cannot meet their deadline last instead of dropping them", nullptr},
+        {"memory-budget", 0, 0, G_OPTION_ARG_INT64, &memoryBudget, "Stream bodies to stdout, pausing downloads while more than BYTES are buffered (not with --output-dir)", "BYTES"},
+        {"output-dir", 'o', 0, G_OPTION_ARG_FILENAME, &outputDir, "Save each body to its own file in DIR without blocking the event loop", "DIR"},
+        {"fsync", 0, 0, G_OPTION_ARG_NONE, &outputSync, "fsync every file written to --output-dir", nullptr},
+        {"io-depth", 0, 0, G_OPTION_ARG_INT, &ioDepth, "Keep at most N file writes in flight (default 64)", "N"},
+        {"trace-file", 0, 0, G_OPTION_ARG_FILENAME, &traceFile, "Append OTLP-JSON spans for every request to FILE and send traceparent headers (not with --fan-out, --race or --websocket)", "FILE"},
+        {"checkpoint", 0, 0, G_OPTION_ARG_FILENAME, &checkpointPath, "Record finished URLs in FILE and skip them (and resume partial --output-dir files) when run again", "FILE"},
+        {"procs", 0, 0, G_OPTION_ARG_INT, &procs, "Fork N worker processes, each fetching the URLs of its share of hosts", "N"},
+        {"cpus", 0, 0, G_OPTION_ARG_STRING, &loopCpus, "Pin each event-loop worker to its own core from LIST (e.g. 0-7,16-23) and allocate from its NUMA node", "LIST"},
+        {"cpus-per-worker", 0, 0, G_OPTION_ARG_INT, &cpusPerWorker, "Give each pinned event-loop worker N cores from --cpus instead of one", "N"},
+        {"helper-cpus", 0, 0, G_OPTION_ARG_STRING, &helperCpus, "Run file writer, pipeline and trace threads on LIST (default: the CPUs --cpus leaves free)", "LIST"},
+        {"progress", 0, 0, G_OPTION_ARG_INT, &progressMs, "Report req/s, bytes/s, in-flight requests, errors and latency to stderr every MS", "MS"},
+        {"progress-format", 0, 0, G_OPTION_ARG_STRING, &progressFormat, "Write progress as text (default), csv or json (one object per line)", "FORMAT"},
+        {"max-redirects", 0, 0, G_OPTION_ARG_INT, &maxRedirects, "Follow at most N redirects per request, then report the 3xx (default: libsoup's 20)", "N"},
+        {"redirect-cache", 0, 0, G_OPTION_ARG_INT, &redirectCache, "Remember up to N permanent redirects and send later requests straight to the target", "N"},
+        {"cookies", 0, 0, G_OPTION_ARG_NONE, &cookies, "Keep cookies set by responses and send them back (per worker, in memory)", nullptr},
+        {"auth", 0, 0, G_OPTION_ARG_STRING_ARRAY, &authSpecs, "Send Basic credentials to ORIGIN (HOST[:PORT] for https only, or SCHEME://HOST[:PORT]) with every request; disables 401 challenge handling", "ORIGIN,USER:PASSWORD"},
+        {"auth-header", 0, 0, G_OPTION_ARG_STRING_ARRAY, &authHeaders, "Send \"Authorization: VALUE\" to ORIGIN (as for --auth) with every request; disables 401 challenge handling", "ORIGIN,VALUE"},
+        {"verify", 0, 0, G_OPTION_ARG_NONE, &verify, "Check each body against its Content-Length as it arrives and fetch again on a mismatch or when the connection drops mid-body; bodies are only printed, saved to --output-dir or resumed from a --checkpoint once they pass, so not with --memory-budget streaming to stdout", nullptr},
+        {"manifest", 0, 0, G_OPTION_ARG_FILENAME, &manifestPath, "Also check bodies against the crc32c, xxh64 or sha256 checksums and sizes in FILE (lines of URL ALGO:HEX [SIZE]); implies --verify", "FILE"},
+        {"verify-retries", 0, 0, G_OPTION_ARG_INT, &verifyRetries, "Fetch a body that fails verification or is cut off at most N more times (default 2)", "N"},
+        {"websocket", 0, 0, G_OPTION_ARG_NONE, &websocket, "Treat the URLs as WebSocket echo endpoints (ws:// or wss://) and time message round trips", nullptr},
+        {"ws-connections", 0, 0, G_OPTION_ARG_INT, &wsConnections, "Open N WebSocket connections, split across the URLs and --procs workers (default 100)", "N"},
+        {"ws-rate", 0, 0, G_OPTION_ARG_DOUBLE, &wsRate, "Send RATE messages per second on each connection (default 10)", "RATE"},
+        {"ws-size", 0, 0, G_OPTION_ARG_INT64, &wsMessageBytes, "Send messages of BYTES, at least 16 (default 64)", "BYTES"},
+        {"ws-duration", 0, 0, G_OPTION_ARG_INT, &wsDurationMs, "Send for MS before closing the connections (default 10000)", "MS"},
+        {"ws-text", 0, 0, G_OPTION_ARG_NONE, &wsText, "Send text frames instead of binary", nullptr},
+        {"stream", 0, 0, G_OPTION_ARG_STRING, &streamFormat, "Consume the URLs as endless sse or ndjson event streams and print each event as it arrives", "FORMAT"},
+        {"stream-reconnect", 0, 0, G_OPTION_ARG_NONE, &streamReconnect, "Reconnect streams that end or drop, after the server's retry delay and with Last-Event-ID", nullptr},
+        {"stream-max-event", 0, 0, G_OPTION_ARG_INT64, &streamMaxEvent, "Drop events or lines larger than BYTES (default 1048576)", "BYTES"},
+        {"stream-timeout", 0, 0, G_OPTION_ARG_INT, &streamTimeout, "Give up on a stream silent for SECONDS (default never)", "SECONDS"},
+        {"unix-socket", 0, 0, G_OPTION_ARG_STRING_ARRAY, &unixSockets, "Send requests for URLs starting with PREFIX over the Unix socket at PATH (e.g. a sidecar's); repeat for more", "PREFIX,PATH"},
+        {G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_STRING_ARRAY, &urls, nullptr, "[URL...]"},
+        {nullptr}};
+
+struct FetchRun {
+  Session *session;
+  GMainLoop *mainLoop;
+  GThreadPool *pipelinePool;
+  int outstanding;
+  int linksQueued;
+  unordered_set<string> seen;
+  Crawler *crawler;
+  ReplayLogWriter *recorder;
+  MemoryBudget *budget;
+  OutputSink *sink;
+  FileWriter *writer;
+  uint64_t filesStarted;
+  uint64_t fileErrors;
+  SpanExporter *tracer;
+  CheckpointJournal *journal;
+  WorkerStats *stats;
+  gint64 startUs;
+  ChecksumManifest *manifest;
+};
+
+struct Fetch {
+  FetchRun *run;
+  BodyPipeline *pipeline;
+  LinkExtractor *links;
+  vector<string> discovered;
+  string url;
+  int depth;
+  // Position in the URL list for checkpointing, -1 for discovered links.
+  gint64 id;
+  PartFile *part;
+  bool ok;
+  gint64 queuedUs;
+  BodyVerifier *verifier;
+  // Attempts before this one that failed verification; retry asks
+  // fetch_done for one more.
+  int attempt;
+  bool retry;
+  // A successful response's headers arrived, so a transport error after
+  // them cut the body short.
+  bool gotHeaders;
+  // While the request runs, for pausing it until part file writes catch up.
+  SoupMessage *msg;
+  bool paused;
+  // What the part file holds is not worth resuming from.
+  bool discard;
+};
+
+// Checkpoint a partial download after this much new body has been written.
+static const uint64_t PART_SYNC_BYTES = 8 << 20;
+// Pause a download while this much of it waits to be written.
+static const uint64_t PART_QUEUE_BYTES = 4 << 20;
+
+static bool queue_fetch(FetchRun *run, const char *url, int depth, gint64 id, int attempt = 0);
+
+static void
+fetch_done(Fetch *fetch) {
+  FetchRun *run = fetch->run;
+  string url = std::move(fetch->url);
+  if (run->journal && fetch->id >= 0 && fetch->ok) run->journal->mark_done((uint32_t) fetch->id);
+  int depth = fetch->depth;
+  gint64 id = fetch->id;
+  int attempt = fetch->attempt;
+  bool retry = fetch->retry;
+  delete fetch->links;
+  delete fetch->part;
+  delete fetch->verifier;
+  delete fetch;
+  // Queued before this one counts as done, so the loop does not stop in
+  // between; to the crawler the retry is the same fetch.
+  bool retried = retry && queue_fetch(run, url.c_str(), depth, id, attempt + 1);
+  run->outstanding--;
+  if (run->crawler) {
+    if (!retried) run->crawler->completed(url);
+    if (run->outstanding == 0 && run->crawler->idle()) g_main_loop_quit(run->mainLoop);
+  } else if (run->outstanding == 0) {
+    g_main_loop_quit(run->mainLoop);
+  }
+}
+
+static void
+on_got_chunk(SoupMessage *msg, SoupBuffer *chunk, gpointer usr_data) {
+  GBytes *bytes = soup_buffer_get_as_bytes(chunk);
+  ((BodyPipeline *) usr_data)->push(bytes);
+  g_bytes_unref(bytes);
+}
+
+static void
+on_got_chunk_links(SoupMessage *msg, SoupBuffer *chunk, gpointer usr_data) {
+  ((LinkExtractor *) usr_data)->feed(chunk->data, chunk->length);
+}
+
+static void
+on_got_chunk_sink(SoupMessage *msg, SoupBuffer *chunk, gpointer usr_data) {
+  GBytes *bytes = soup_buffer_get_as_bytes(chunk);
+  ((OutputSink *) usr_data)->write(bytes);
+  g_bytes_unref(bytes);
+}
+
+static void
+on_got_chunk_count(SoupMessage *msg, SoupBuffer *chunk, gpointer usr_data) {
+  ((WorkerStats *) usr_data)->add_bytes(chunk->length);
+}
+
+static void
+on_got_headers_verify(SoupMessage *msg, gpointer usr_data) {
+  Fetch *fetch = (Fetch *) usr_data;
+  if (!SOUP_STATUS_IS_SUCCESSFUL(msg->status_code)) return;
+  fetch->gotHeaders = true;
+  fetch->verifier->headers(msg);
+}
+
+static void
+on_got_chunk_verify(SoupMessage *msg, SoupBuffer *chunk, gpointer usr_data) {
+  // Redirect and error bodies are not what is being verified.
+  if (SOUP_STATUS_IS_SUCCESSFUL(msg->status_code)) ((BodyVerifier *) usr_data)->update(chunk->data, chunk->length);
+}
+
+// Checks the body that just completed. On a mismatch, has finish_part throw
+// away whatever of it was saved for resuming and asks fetch_done for another
+// attempt.
+static bool
+verify_body(Fetch *fetch) {
+  GError *error = nullptr;
+  if (fetch->verifier->finish(&error)) return true;
+
+  fetch->retry = fetch->attempt < verifyRetries;
+  cerr << "Verification failed: " << fetch->url << ": " << error->message;
+  if (fetch->retry) cerr << " (retry " << fetch->attempt + 1 << " of " << verifyRetries << ")";
+  cerr << endl;
+  g_error_free(error);
+  fetch->discard = true;
+  return false;
+}
+
+static void
+on_got_headers_part(SoupMessage *msg, gpointer usr_data) {
+  Fetch *fetch = (Fetch *) usr_data;
+  PartFile *part = fetch->part;
+  if (!SOUP_STATUS_IS_SUCCESSFUL(msg->status_code) || part->size() == 0) return;
+
+  if (msg->status_code == SOUP_STATUS_PARTIAL_CONTENT) {
+    goffset start, end, total;
+    if (soup_message_headers_get_content_range(msg->response_headers, &start, &end, &total) && (uint64_t) start == part->size()) return;
+    // Answered for some other offset; there is nothing to append that to.
+    part->restart(nullptr);
+    fetch->run->journal->mark_partial((uint32_t) fetch->id, 0);
+    fetch->run->session->cancel(msg, SOUP_STATUS_IO_ERROR);
+    return;
+  }
+
+  // Range ignored: the whole body follows, so start over.
+  GError *error = nullptr;
+  if (!part->restart(&error)) {
+    cerr << error->message << endl;
+    g_error_free(error);
+    fetch->run->session->cancel(msg, SOUP_STATUS_IO_ERROR);
+  }
+}
+
+static void
+on_got_chunk_part(SoupMessage *msg, SoupBuffer *chunk, gpointer usr_data) {
+  Fetch *fetch = (Fetch *) usr_data;
+  PartFile *part = fetch->part;
+  // Redirect and error bodies are not part of the file.
+  if (!SOUP_STATUS_IS_SUCCESSFUL(msg->status_code) || part->error()) return;
+
+  GBytes *bytes = soup_buffer_get_as_bytes(chunk);
+  part->append(bytes);
+  g_bytes_unref(bytes);
+  if (part->unsynced() >= PART_SYNC_BYTES) part->sync();
+  if (!fetch->paused && part->queued() >= PART_QUEUE_BYTES) {
+    fetch->paused = true;
+    fetch->run->session->pause(msg);
+  }
+}
+
+// Once the part file's last write has landed, renames a finished download
+// into place, or records how far an unfinished one got so the next run can
+// send a Range for the rest. Until then on_part_progress calls back in.
+static void
+finish_part(Fetch *fetch) {
+  FetchRun *run = fetch->run;
+  PartFile *part = fetch->part;
+  if (!part->idle()) return;
+  if (!part->error() && !fetch->discard && part->synced() < part->size() && (outputSync || !fetch->ok)) {
+    part->sync();
+    return;
+  }
+
+  GError *error = nullptr;
+  if (part->error()) {
+    cerr << "Failed to write " << part->part_path() << ": " << g_strerror(part->error()) << endl;
+    if (fetch->ok) {
+      run->filesStarted++;
+      run->fileErrors++;
+      fetch->ok = false;
+    }
+    run->journal->mark_partial((uint32_t) fetch->id, fetch->discard ? 0 : part->synced());
+  } else if (fetch->discard) {
+    part->restart(&error);
+    run->journal->mark_partial((uint32_t) fetch->id, 0);
+  } else if (fetch->ok) {
+    run->filesStarted++;
+    if (!part->commit(&error)) {
+      run->fileErrors++;
+      fetch->ok = false;
+    }
+  } else {
+    run->journal->mark_partial((uint32_t) fetch->id, part->synced());
+  }
+  if (error) {
+    cerr << "Failed to write " << part->path() << ": " << error->message << endl;
+    g_error_free(error);
+  }
+  fetch_done(fetch);
+}
+
+static void
+on_part_progress(Fetch *fetch, bool synced) {
+  PartFile *part = fetch->part;
+  if (!fetch->msg) {
+    finish_part(fetch);
+  } else if (part->error()) {
+    // finish_part reports it once the request completes.
+    fetch->run->session->cancel(fetch->msg, SOUP_STATUS_IO_ERROR);
+  } else {
+    if (synced) fetch->run->journal->mark_partial((uint32_t) fetch->id, part->synced());
+    if (fetch->paused && part->queued() < PART_QUEUE_BYTES / 2) {
+      fetch->paused = false;
+      fetch->run->session->unpause(fetch->msg);
+    }
+  }
+}
+
+// DIR/N-url with everything but [A-Za-z0-9.-] flattened to '_'.
+static string
+output_path(SoupURI *uri, uint64_t seq) {
+  char *url = soup_uri_to_string(uri, FALSE);
+  string name = to_string(seq) + "-";
+  for (const char *p = url; *p && name.size() < 200; p++) {
+    name += g_ascii_isalnum(*p) || *p == '.' || *p == '-' ? *p : '_';
+  }
+  g_free(url);
+
+  char *path = g_build_filename(outputDir, name.c_str(), nullptr);
+  string result = path;
+  g_free(path);
+  return result;
+}
+
+static void
+queue_discovered_links(Fetch *fetch, SoupURI *base) {
+  FetchRun *run = fetch->run;
+  fetch->links->finish();
+
+  for (const string &link : fetch->discovered) {
+    if (!run->crawler && run->linksQueued >= followLinks) break;
+
+    SoupURI *uri = soup_uri_new_with_base(base, link.c_str());
+    if (!uri) continue;
+    if (run->crawler) {
+      run->crawler->add(uri, fetch->depth + 1);
+    } else if (uri->scheme == SOUP_URI_SCHEME_HTTP || uri->scheme == SOUP_URI_SCHEME_HTTPS) {
+      soup_uri_set_fragment(uri, nullptr);
+      char *resolved = soup_uri_to_string(uri, FALSE);
+      if (run->seen.insert(resolved).second) {
+        run->linksQueued++;
+        queue_fetch(run, resolved, fetch->depth + 1, -1);
+      }
+      g_free(resolved);
+    }
+    soup_uri_free(uri);
+  }
+}
+
+static void
+print_pipeline_results(const char *url, BodyPipeline *pipeline) {
+  cout << url << endl;
+  for (const auto &stage : pipeline->stages()) {
+    cout << "  " << stage->name() << ": " << stage->result() << endl;
+  }
+}
+
+static bool
+queue_fetch(FetchRun *run, const char *url, int depth, gint64 id, int attempt) {
+  Request request = Request::get(url);
+  if (!request.valid()) {
+    cerr << "Invalid URL: " << url << endl;
+    return false;
+  }
+  SoupMessage *msg = request.message();
+  Fetch *fetch = new Fetch{run, nullptr, nullptr, {}, url, depth, id, nullptr, false, g_get_monotonic_time(), nullptr, attempt, false, false, nullptr, false, false};
+
+  if (run->journal && id >= 0 && outputDir) {
+    // Checkpointed downloads are written as they arrive, under a name that
+    // stays the same from run to run, so they can resume mid-body.
+    fetch->part = new PartFile(run->writer, [fetch](bool synced) { on_part_progress(fetch, synced); });
+    fetch->msg = msg;
+    GError *error = nullptr;
+    if (!fetch->part->open(output_path(soup_message_get_uri(msg), (uint64_t) id), run->journal->partial((uint32_t) id), &error)) {
+      cerr << error->message << endl;
+      g_error_free(error);
+      delete fetch->part;
+      delete fetch;
+      return false;
+    }
+    if (fetch->part->size() > 0) {
+      string range = "bytes=" + to_string(fetch->part->size()) + "-";
+      request.header("Range", range.c_str());
+    }
+    request.stream_body();
+    g_signal_connect(msg, "got-headers", G_CALLBACK(on_got_headers_part), fetch);
+    g_signal_connect(msg, "got-chunk", G_CALLBACK(on_got_chunk_part), fetch);
+  }
+
+  if (verify) {
+    fetch->verifier = new BodyVerifier(run->manifest ? run->manifest->find(fetch->url) : nullptr);
+    GError *error = nullptr;
+    if (fetch->part && fetch->part->size() > 0 && !fetch->verifier->resume_from(fetch->part->part_path(), fetch->part->size(), &error)) {
+      // Unreadable, so unverifiable: fetch the whole body instead.
+      cerr << error->message << endl;
+      g_error_free(error);
+      fetch->part->restart(nullptr);
+      soup_message_headers_remove(msg->request_headers, "Range");
+    }
+    // After on_got_headers_part, which may have restarted the file.
+    g_signal_connect(msg, "got-headers", G_CALLBACK(on_got_headers_verify), fetch);
+    g_signal_connect(msg, "got-chunk", G_CALLBACK(on_got_chunk_verify), fetch->verifier);
+  }
+
+  if (run->recorder) {
+    ReplayRecord record = {(uint64_t) (g_get_monotonic_time() - run->startUs), "GET", url, {}, {}};
+    GError *error = nullptr;
+    if (!run->recorder->write(record, &error)) {
+      cerr << "Recording failed: " << error->message << endl;
+      g_error_free(error);
+      delete run->recorder;
+      run->recorder = nullptr;
+    }
+  }
+
+  if (pipelineSpec) {
+    fetch->pipeline = new BodyPipeline(run->pipelinePool);
+    pipeline_add_stages(*fetch->pipeline, pipelineSpec, nullptr);
+    request.stream_body();
+    g_signal_connect(msg, "got-chunk", G_CALLBACK(on_got_chunk), fetch->pipeline);
+  }
+
+  if (followLinks > 0 || run->crawler) {
+    fetch->links = new LinkExtractor([fetch](const char *link, size_t len) {
+      fetch->discovered.emplace_back(link, len);
+    });
+    request.stream_body();
+    g_signal_connect(msg, "got-chunk", G_CALLBACK(on_got_chunk_links), fetch->links);
+  }
+
+  if (run->sink && !fetch->pipeline && !fetch->links && !fetch->part) {
+    // Charge chunks before the sink sees them, so a chunk that goes over
+    // budget pauses the message before anything else is read.
+    run->budget->watch(msg);
+    request.stream_body();
+    g_signal_connect(msg, "got-chunk", G_CALLBACK(on_got_chunk_sink), run->sink);
+  }
+
+  if (run->stats) {
+    run->stats->begin();
+    g_signal_connect(msg, "got-chunk", G_CALLBACK(on_got_chunk_count), run->stats);
+  }
+
+  run->outstanding++;
+  run->session->queue(std::move(request), [fetch](Response &response) {
+    bool ok = response.ok();
+    if (!ok) {
+      cerr << "Failed to perform request: " << response.uri()->path << " " << response.status() << " " << response.reason();
+      // Cut off mid-body: as good a reason to fetch again as a mismatch.
+      if (fetch->gotHeaders && SOUP_STATUS_IS_TRANSPORT_ERROR(response.status()) && response.status() != SOUP_STATUS_CANCELLED) {
+        fetch->retry = fetch->attempt < verifyRetries;
+        if (fetch->retry) cerr << " (retry " << fetch->attempt + 1 << " of " << verifyRetries << ")";
+      }
+      cerr << endl;
+    } else if (fetch->verifier) {
+      ok = verify_body(fetch);
+    }
+    fetch->ok = ok;
+    if (fetch->run->stats) fetch->run->stats->record(ok, g_get_monotonic_time() - fetch->queuedUs);
+    if (fetch->run->budget) fetch->run->budget->forget(response.message());
+
+    if (fetch->part) {
+      fetch->msg = nullptr;
+      if (response.status() == SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE) fetch->discard = true;
+      finish_part(fetch);
+      return;
+    }
+
+    if (fetch->links && ok) queue_discovered_links(fetch, response.uri());
+
+    if (fetch->pipeline) {
+      char *url = soup_uri_to_string(response.uri(), FALSE);
+      fetch->pipeline->close([fetch, url, ok](BodyPipeline *pipeline) {
+        if (ok) print_pipeline_results(url, pipeline);
+        g_free(url);
+        delete pipeline;
+        fetch_done(fetch);
+      });
+      return;
+    }
+
+    FetchRun *run = fetch->run;
+    if (outputDir && !fetch->links) {
+      if (!ok) {
+        fetch_done(fetch);
+        return;
+      }
+      SoupBuffer *buffer = soup_message_body_flatten(response.message()->response_body);
+      GBytes *body = soup_buffer_get_as_bytes(buffer);
+      soup_buffer_free(buffer);
+      string path = output_path(response.uri(), run->filesStarted++);
+      run->writer->write_file(path.c_str(), body, outputSync, [fetch, path](int err) {
+        if (err) {
+          cerr << "Failed to write " << path << ": " << g_strerror(err) << endl;
+          fetch->run->fileErrors++;
+          fetch->ok = false;
+        }
+        fetch_done(fetch);
+      });
+      g_bytes_unref(body);
+      return;
+    }
+
+    if (ok && run->sink && !fetch->links) {
+      // Body already went to the sink.
+    } else if (ok && !fetch->links) {
+      cout << "Lambda completion!" << endl;
+      cout << "Body:" << endl
+           << response.body() << endl;
+    } else if (ok) {
+      cout << response.uri()->path << " " << fetch->links->links() << " links" << endl;
+    }
+    fetch_done(fetch);
+  });
+  return true;
+}
+
+struct UploadRun {
+  GMainLoop *mainLoop;
+  int outstanding;
+  int failed;
+  uint64_t bytes;
+};
+
+// Returns the number of uploads that failed.
+static int
+run_uploads(Session &session, GMainLoop *mainLoop) {
+  UploadRun run = {mainLoop, 0, 0, 0};
+  gint64 start = g_get_monotonic_time();
+
+  for (gchar **spec = uploads; *spec; spec++) {
+    gchar **parts = g_strsplit(*spec, ",", 3);
+    if (g_strv_length(parts) != 3 || (strcmp(parts[0], "POST") != 0 && strcmp(parts[0], "PUT") != 0 && strcmp(parts[0], "PATCH") != 0)) {
+      cerr << "Invalid upload '" << *spec << "', expected METHOD,FILE,URL with METHOD one of POST, PUT, PATCH" << endl;
+      g_strfreev(parts);
+      run.failed++;
+      continue;
+    }
+
+    Request request = Request::method(parts[0], parts[2]);
+    if (!request.valid()) {
+      cerr << "Invalid URL: " << parts[2] << endl;
+      g_strfreev(parts);
+      run.failed++;
+      continue;
+    }
+
+    GError *error = nullptr;
+    FileUpload *upload = FileUpload::attach(session, request.message(), parts[1], uploadContentType, (uint64_t) uploadStreamThreshold, &error);
+    g_strfreev(parts);
+    if (!upload) {
+      cerr << error->message << endl;
+      g_error_free(error);
+      run.failed++;
+      continue;
+    }
+
+    run.outstanding++;
+    session.queue(std::move(request), [&run, upload](Response &response) {
+      char *url = soup_uri_to_string(response.uri(), FALSE);
+      if (response.ok()) {
+        double secs = upload->seconds();
+        cout << response.message()->method << " " << url << " " << response.status() << " "
+             << upload->written() << " bytes in " << secs << " s ("
+             << (secs > 0 ? upload->written() / secs / (1 << 20) : 0) << " MiB/s"
+             << (upload->streamed() ? ", streamed" : "") << ")" << endl;
+      } else {
+        cerr << "Upload failed: " << url << " " << response.status() << " " << response.reason() << endl;
+        run.failed++;
+      }
+      g_free(url);
+      run.bytes += upload->written();
+      delete upload;
+      if (--run.outstanding == 0) g_main_loop_quit(run.mainLoop);
+    });
+  }
+
+  if (run.outstanding > 0) g_main_loop_run(mainLoop);
+
+  double secs = (double) (g_get_monotonic_time() - start) / G_USEC_PER_SEC;
+  cout << "uploaded " << run.bytes << " bytes in " << secs << " s ("
+       << (secs > 0 ? run.bytes / secs / (1 << 20) : 0) << " MiB/s aggregate), "
+       << run.failed << " failed" << endl;
+  return run.failed;
+}
+
+static void
+run_coalesced(Session &session, const char *const *targets, GMainLoop *mainLoop) {
+  RequestCoalescer coalescer(session);
+  int outstanding = 0;
+
+  for (const char *const *url = targets; *url; url++) {
+    Request request = Request::get(*url);
+    if (!request.valid()) {
+      cerr << "Invalid URL: " << *url << endl;
+      continue;
+    }
+    outstanding++;
+    string target = *url;
+    coalescer.queue(std::move(request), [&outstanding, mainLoop, target](const SharedResponse &response) {
+      if (response.ok()) cout << target << " " << response.status() << " " << response.body_size() << " bytes" << endl;
+      else cerr << "Failed to perform request: " << target << " " << response.status() << " " << response.reason() << endl;
+      if (--outstanding == 0) g_main_loop_quit(mainLoop);
+    });
+  }
+
+  if (outstanding > 0) g_main_loop_run(mainLoop);
+  cout << coalescer.sent() << " requests sent, " << coalescer.coalesced() << " coalesced" << endl;
+}
+
+struct StreamRun {
+  GMainLoop *mainLoop;
+  vector<EventStream *> streams;
+  int active;
+  guint interrupt;
+};
+
+static gboolean
+on_stream_interrupt(gpointer data) {
+  StreamRun *run = (StreamRun *) data;
+  run->interrupt = 0;
+  for (EventStream *stream : run->streams) stream->stop();
+  return G_SOURCE_REMOVE;
+}
+
+static void
+run_streams(Session &session, const char *const *targets, const EventStream::Options &options, GMainLoop *mainLoop,
+            WorkerStats *stats) {
+  // A quiet stream is not a stalled one; only --stream-timeout gives up.
+  session.set_timeout((guint) streamTimeout);
+  StreamRun run = {mainLoop, {}, 0, 0};
+  bool named = targets[0] && targets[1];
+  gint64 start = g_get_monotonic_time();
+
+  for (const char *const *target = targets; *target; target++) {
+    const char *url = *target;
+    auto onEvent = [url, named, &options, stats](const StreamEvent &event) {
+      if (named) cout << url << " ";
+      if (options.format == EventStreamParser::SSE) cout << event.type << ": ";
+      cout << event.data << '\n';
+      if (stats) stats->add_bytes(event.data.size());
+    };
+    run.streams.push_back(new EventStream(session, url, options, onEvent, [&run](EventStream *stream, guint status) {
+      if (status != SOUP_STATUS_CANCELLED && !SOUP_STATUS_IS_SUCCESSFUL(status)) {
+        cerr << "Stream failed: " << stream->url() << " " << status << " " << soup_status_get_phrase(status) << endl;
+      }
+      if (--run.active == 0) g_main_loop_quit(run.mainLoop);
+    }));
+    run.active++;
+  }
+  // Stopping streams that never end is the usual way out; the summary
+  // still gets printed.
+  run.interrupt = g_unix_signal_add(SIGINT, on_stream_interrupt, &run);
+  for (size_t i = 0, n = run.streams.size(); i < n; i++) run.streams[i]->start();
+
+  if (run.active > 0) g_main_loop_run(mainLoop);
+  if (run.interrupt) g_source_remove(run.interrupt);
+  cout << flush;
+
+  uint64_t events = 0, bytes = 0, overflows = 0, reconnects = 0;
+  for (EventStream *stream : run.streams) {
+    events += stream->parser().events();
+    bytes += stream->bytes();
+    overflows += stream->parser().overflows();
+    reconnects += stream->connects() > 0 ? stream->connects() - 1 : 0;
+    delete stream;
+  }
+  double secs = (double) (g_get_monotonic_time() - start) / G_USEC_PER_SEC;
+  cerr << run.streams.size() << " streams: " << events << " events, " << bytes << " bytes in " << secs << " s ("
+       << (long) (secs > 0 ? events / secs : 0) << " events/s), " << overflows << " oversized dropped, " << reconnects
+       << " reconnects" << endl;
+}
+
+struct ScheduledRun {
+  GMainLoop *mainLoop;
+  int outstanding;
+};
+
+static void
+schedule_urls(RequestScheduler &scheduler, ScheduledRun &run, const char *const *targets, RequestScheduler::Class cls) {
+  for (const char *const *url = targets; url && *url; url++) {
+    gint64 deadlineUs = deadlineMs > 0 ? g_get_monotonic_time() + (gint64) deadlineMs * 1000 : 0;
+    run.outstanding++;
+    scheduler.queue(Request::get(*url), cls, deadlineUs, [&run, cls](Response &response) {
+      char *url = soup_uri_to_string(response.uri(), FALSE);
+      if (response.ok()) cout << RequestScheduler::class_name(cls) << " " << url << " " << response.status() << " " << response.body_size() << " bytes" << endl;
+      else cerr << RequestScheduler::class_name(cls) << " " << url << " failed: " << response.status() << " " << response.reason() << endl;
+      g_free(url);
+      if (--run.outstanding == 0) g_main_loop_quit(run.mainLoop);
+    });
+  }
+}
+
+static void
+run_scheduled(Session &session, const char *const *targets, GMainLoop *mainLoop) {
+  RequestScheduler::Options options;
+  options.maxInFlight = maxInFlight;
+  options.missPolicy = deferLate ? RequestScheduler::DEFER : RequestScheduler::DROP;
+  RequestScheduler scheduler(session, options);
+  ScheduledRun run = {mainLoop, 0};
+
+  schedule_urls(scheduler, run, urgentUrls, RequestScheduler::URGENT);
+  schedule_urls(scheduler, run, targets, RequestScheduler::NORMAL);
+  schedule_urls(scheduler, run, bulkUrls, RequestScheduler::BULK);
+
+  if (run.outstanding > 0) g_main_loop_run(mainLoop);
+  scheduler.print_stats(cout);
+}
+
+// fetch_task, counted in stats when there are any: these modes go past
+// Session, which counts everything else.
+static Task<FetchResult>
+counted_fetch(SoupSession *session, const char *url, WorkerStats *stats, FetchScope *scope = nullptr) {
+  if (stats) stats->begin();
+  gint64 startUs = g_get_monotonic_time();
+  FetchResult result = co_await fetch(session, url, scope);
+  if (stats) {
+    // The losers of a race are cancelled, not failed.
+    stats->record(result.ok() || result.status() == SOUP_STATUS_CANCELLED, g_get_monotonic_time() - startUs);
+    stats->add_bytes(result.body_size());
+  }
+  co_return result;
+}
+
+static Task<>
+fan_out(SoupSession *session, const char *const *targets, GMainLoop *mainLoop, WorkerStats *stats) {
+  vector<Task<FetchResult>> fetches;
+  for (const char *const *url = targets; *url; url++) fetches.push_back(counted_fetch(session, *url, stats));
+
+  co_await when_all(fetches);
+
+  for (size_t i = 0; i < fetches.size(); i++) {
+    FetchResult result = fetches[i].take_result();
+    cout << targets[i] << " " << result.status() << " " << result.body_size() << " bytes" << endl;
+  }
+  g_main_loop_quit(mainLoop);
+}
+
+static Task<>
+race(SoupSession *session, const char *const *targets, GMainLoop *mainLoop, WorkerStats *stats) {
+  FetchScope scope;
+  vector<Task<FetchResult>> fetches;
+  for (const char *const *url = targets; *url; url++) fetches.push_back(counted_fetch(session, *url, stats, &scope));
+
+  size_t winner = co_await when_any(fetches, &scope);
+
+  FetchResult result = fetches[winner].take_result();
+  cout << "First response: " << targets[winner] << " " << result.status() << " " << result.body_size() << " bytes" << endl;
+  g_main_loop_quit(mainLoop);
+}
+
+// Keeps only the URLs whose host belongs to shard.
+static gchar **
+shard_urls(const ShardSet &shards, int shard, const char *const *targets) {
+  GPtrArray *mine = g_ptr_array_new();
+  for (const char *const *url = targets; *url; url++) {
+    if (shards.shard_of(*url) == shard) g_ptr_array_add(mine, g_strdup(*url));
+  }
+  g_ptr_array_add(mine, nullptr);
+  return (gchar **) g_ptr_array_free(mine, FALSE);
+}
+
+// PATH.N, so workers do not write over each other's files.
+static void
+shard_path(gchar **path, int shard) {
+  if (!*path) return;
+  gchar *sharded = g_strdup_printf("%s.%d", *path, shard);
+  g_free(*path);
+  *path = sharded;
+}
+
+// ORIGIN,USER:PASSWORD (basic) or ORIGIN,VALUE into origin and Authorization
+// value.
+static bool
+parse_credentials(gchar **specs, bool basic, vector<pair<string, string>> &credentials) {
+  for (gchar **spec = specs; spec && *spec; spec++) {
+    const char *comma = strchr(*spec, ',');
+    if (!comma || comma == *spec || !comma[1] || (basic && !strchr(comma + 1, ':'))) {
+      cerr << "Invalid " << (basic ? "--auth" : "--auth-header") << " '" << *spec << "', expected "
+           << (basic ? "ORIGIN,USER:PASSWORD" : "ORIGIN,VALUE") << endl;
+      return false;
+    }
+    string value = comma + 1;
+    if (basic) {
+      gchar *encoded = g_base64_encode((const guchar *) value.data(), value.size());
+      value = string("Basic ") + encoded;
+      g_free(encoded);
+    }
+    credentials.emplace_back(string(*spec, comma - *spec), value);
+  }
+  return true;
 }
 
 int main(int argc, char **argv) {
-  SoupSession *session = soup_session_new();
+  GError *error = nullptr;
+  GOptionContext *options = g_option_context_new("- fetch URLs with libsoup");
+  g_option_context_add_main_entries(options, entries, nullptr);
+  if (!g_option_context_parse(options, &argc, &argv, &error)) {
+    cerr << error->message << endl;
+    return 1;
+  }
+  g_option_context_free(options);
+
+  if (pipelineSpec) {
+    BodyPipeline probe;
+    if (!pipeline_add_stages(probe, pipelineSpec, &error)) {
+      cerr << error->message << endl;
+      return 1;
+    }
+  }
+
+  // Those modes talk to the SoupSession directly, past the spans Session
+  // emits.
+  if (traceFile && (coroFanOut || coroRace || websocket)) {
+    cerr << "--trace-file cannot be used with --fan-out, --race or --websocket" << endl;
+    return 1;
+  }
+  // The journal follows the plain URL list, and resumes a body only when it
+  // goes straight to its own file.
+  if (checkpointPath && (crawl || coalesce || replayPath || uploads || coroFanOut || coroRace || urgentUrls || bulkUrls ||
+                         deadlineMs > 0 || websocket || streamFormat)) {
+    cerr << "--checkpoint only covers a plain URL list, not --crawl, --coalesce, --replay, --upload, --fan-out, --race, "
+            "--urgent, --bulk, --deadline, --websocket or --stream"
+         << endl;
+    return 1;
+  }
+  if (checkpointPath && outputDir && (pipelineSpec || followLinks > 0)) {
+    cerr << "--checkpoint cannot resume --output-dir files with --pipeline or --follow-links" << endl;
+    return 1;
+  }
+
+  static const char *defaultUrls[] = {"https://example.com", nullptr};
+
+  ProgressReporter::Format format = ProgressReporter::TEXT;
+  if (progressFormat && !ProgressReporter::parse_format(progressFormat, &format, &error)) {
+    cerr << error->message << endl;
+    return 1;
+  }
+
+  EventStream::Options streamOptions;
+  if (streamFormat && !EventStreamParser::parse_format(streamFormat, &streamOptions.format, &error)) {
+    cerr << error->message << endl;
+    return 1;
+  }
+  streamOptions.maxEventBytes = streamMaxEvent > 0 ? (size_t) streamMaxEvent : 1 << 20;
+  streamOptions.reconnect = streamReconnect;
+
+  vector<pair<string, string>> credentials;
+  if (!parse_credentials(authSpecs, true, credentials) || !parse_credentials(authHeaders, false, credentials)) return 1;
+
+  // Split at the last comma: prefixes are URLs, paths rarely have commas.
+  vector<pair<string, string>> unixRoutes;
+  for (gchar **spec = unixSockets; spec && *spec; spec++) {
+    const char *comma = strrchr(*spec, ',');
+    if (!comma || comma == *spec || !comma[1]) {
+      cerr << "Invalid --unix-socket '" << *spec << "', expected PREFIX,PATH" << endl;
+      return 1;
+    }
+    unixRoutes.emplace_back(string(*spec, comma - *spec), comma + 1);
+  }
+
+  ChecksumManifest *manifest = nullptr;
+  if (manifestPath) {
+    manifest = new ChecksumManifest();
+    if (!manifest->load(manifestPath, &error)) {
+      cerr << error->message << endl;
+      return 1;
+    }
+    verify = TRUE;
+  }
+  // The sink writes chunks out as they arrive, so a body that then fails
+  // verification could not be taken back before it is fetched again.
+  if (verify && memoryBudget > 0 && !outputDir) {
+    cerr << "--verify cannot hold back bodies that --memory-budget streams to stdout; use --output-dir" << endl;
+    return 1;
+  }
+
+  // Parsed up front so a bad list fails once, not in every worker.
+  CpuSet allowedCpus = CpuSet::current();
+  CpuSet loopSet, helperSet;
+  if ((loopCpus && !CpuSet::parse(loopCpus, loopSet, &error)) || (helperCpus && !CpuSet::parse(helperCpus, helperSet, &error))) {
+    cerr << error->message << endl;
+    return 1;
+  }
+  if (loopCpus && !helperCpus) {
+    helperSet = allowedCpus.without(loopSet);
+    if (helperSet.empty()) helperSet = allowedCpus;
+  }
+
+  // Fork before the session or any pool exists: workers only inherit the
+  // forking thread. Each worker then carries on below as a plain fetch over
+  // its own share of the URLs.
+  ShardSet *shards = nullptr;
+  WorkerStats *stats = nullptr;
+  int shard = 0;
+  if (procs > 1) {
+    shards = ShardSet::create(procs, &error);
+    if (!shards || !shards->fork_workers(&shard, &error)) {
+      cerr << error->message << endl;
+      return 1;
+    }
+    if (shard < 0) {
+      // Workers only count; the parent reports for all of them.
+      ProgressReporter reporter(&shards->stats(0), shards->procs(), format, cerr);
+      reporter.start(progressMs > 0 ? (guint) progressMs : 1000);
+      int failedWorkers = shards->supervise();
+      reporter.stop();
+      shards->print_summary(cout);
+      delete shards;
+      return failedWorkers ? 1 : 0;
+    }
+    if (websocket) {
+      // Few endpoints, many connections: split the connections instead.
+      wsConnections = wsConnections / procs + (shard < wsConnections % procs ? 1 : 0);
+    } else {
+      gchar **mine = shard_urls(*shards, shard, urls ? (const char *const *) urls : defaultUrls);
+      g_strfreev(urls);
+      urls = mine;
+    }
+    stats = &shards->stats(shard);
+    shard_path(&checkpointPath, shard);
+    shard_path(&recordPath, shard);
+    shard_path(&traceFile, shard);
+  }
+
+  // Before the session exists, so its buffers are allocated on the worker's
+  // node; helper threads pin themselves when they start.
+  set_helper_cpus(helperSet);
+  if (loopCpus) {
+    CpuSet mine = loopSet.slice(shard, cpusPerWorker);
+    int node;
+    if (!pin_event_loop(mine, &node, &error)) {
+      cerr << error->message << endl;
+      return 1;
+    }
+    cerr << "affinity: event loop " << shard << " on cpus " << mine.to_string();
+    if (node >= 0) cerr << " (node " << node << ")";
+    cerr << ", helpers on " << helperSet.to_string() << endl;
+  }
+
+  Session::Options sessionOptions;
+  if (crawl) sessionOptions.maxConns = crawlConcurrency;
+  WebSocketLoad::Options wsOptions;
+  if (websocket) {
+    // Handshakes go through the pool; established connections leave it.
+    sessionOptions.maxConns = sessionOptions.maxConnsPerHost = wsOptions.connectBurst;
+  }
+  if (streamFormat && urls) {
+    // Every stream holds its connection for good.
+    sessionOptions.maxConns = sessionOptions.maxConnsPerHost = max<int>(g_strv_length(urls), 2);
+  }
+  // A cache alone implies the session follows redirects itself.
+  sessionOptions.maxRedirects = maxRedirects < 0 && redirectCache > 0 ? 20 : maxRedirects;
+  sessionOptions.redirectCache = redirectCache > 0 ? (size_t) redirectCache : 0;
+  sessionOptions.cookies = cookies;
+  // Known credentials go out with the first request; answering challenges
+  // as well would only cost a second round trip on the ones they miss.
+  sessionOptions.genericAuth = credentials.empty();
+  Session session(sessionOptions);
+  for (const auto &credential : credentials) {
+    if (!session.add_credentials(credential.first.c_str(), credential.second.c_str())) {
+      cerr << "Invalid origin '" << credential.first << "' in --auth or --auth-header" << endl;
+      return 1;
+    }
+  }
+  int unixConns = sessionOptions.maxConnsPerHost > 0 ? sessionOptions.maxConnsPerHost : 16;
+  for (const auto &route : unixRoutes) session.add_unix_route(route.first.c_str(), route.second.c_str(), unixConns);
   GMainLoop *mainLoop = g_main_loop_new(nullptr, TRUE);
 
-  SoupMessage *msg = generate_soup_get_message("https://example.com");
+  FetchRun run = {&session, mainLoop, nullptr, 0, 0, {}, nullptr, nullptr, nullptr, nullptr, nullptr, 0, 0, nullptr, nullptr, stats, g_get_monotonic_time(), manifest};
+  ProgressReporter *reporter = nullptr;
+  if (progressMs > 0 && !shards) {
+    run.stats = new WorkerStats();
+    reporter = new ProgressReporter(run.stats, 1, format, cerr);
+    reporter->start((guint) progressMs);
+  }
+  if (recordPath) {
+    run.recorder = new ReplayLogWriter();
+    if (!run.recorder->open(recordPath, &error)) {
+      cerr << error->message << endl;
+      return 1;
+    }
+  }
+  FILE *traceOut = nullptr;
+  if (traceFile) {
+    traceOut = fopen(traceFile, "a");
+    if (!traceOut) {
+      cerr << traceFile << ": " << g_strerror(errno) << endl;
+      return 1;
+    }
+    run.tracer = new SpanExporter(traceOut);
+    session.set_tracer(run.tracer);
+  }
+  // See MemoryBudget: bodies saved to --output-dir are not streamed.
+  if (memoryBudget > 0 && outputDir) cerr << "--memory-budget only covers bodies streamed to stdout; ignored with --output-dir" << endl;
+  else if (memoryBudget > 0) run.budget = new MemoryBudget(session, (size_t) memoryBudget);
+  if (outputDir) {
+    if (g_mkdir_with_parents(outputDir, 0755) != 0) {
+      cerr << outputDir << ": " << g_strerror(errno) << endl;
+      return 1;
+    }
+  } else if (run.budget) {
+    GOutputStream *out = g_unix_output_stream_new(STDOUT_FILENO, FALSE);
+    run.sink = new StreamSink(out, run.budget);
+    g_object_unref(out);
+  }
+  // The checkpoint journal syncs through the writer too.
+  if (outputDir || checkpointPath) run.writer = FileWriter::create((unsigned) ioDepth);
+  if (pipelineSpec && pipelineThreads > 0) {
+    run.pipelinePool = BodyPipeline::create_pool(pipelineThreads, &error);
+    if (!run.pipelinePool) {
+      cerr << error->message << endl;
+      return 1;
+    }
+  }
+
+  const char *const *targets = urls ? (const char *const *) urls : defaultUrls;
+  int exitStatus = 0;
+
+  if (replayPath) {
+    ReplayLogReader reader;
+    if (replaySpeed <= 0 || !reader.open(replayPath, &error)) {
+      cerr << (error ? error->message : "--replay-speed must be positive") << endl;
+      return 1;
+    }
+    ReplayEngine::Options replayOptions;
+    replayOptions.speed = replaySpeed;
+    replayOptions.target = replayTarget;
+    ReplayEngine engine(session, reader, replayOptions);
+    // Fetches, streams and WebSocket messages count themselves; the modes
+    // built on Session alone are counted per request by the session.
+    session.set_stats(run.stats);
+    if (!engine.run(mainLoop, &error)) {
+      cerr << "Replay stopped early: " << error->message << endl;
+      g_clear_error(&error);
+    }
+    const ReplayEngine::Stats &stats = engine.stats();
+    cout << "replayed " << stats.sent << " requests: " << stats.succeeded << " ok, " << stats.failed << " failed, "
+         << stats.invalid << " invalid; schedule lag avg " << (stats.sent ? stats.lagSumUs / stats.sent : 0)
+         << " us, max " << stats.maxLagUs << " us" << endl;
+  } else if (uploads) {
+    session.set_stats(run.stats);
+    if (run_uploads(session, mainLoop) > 0) exitStatus = 1;
+  } else if (websocket) {
+    wsOptions.connections = wsConnections;
+    wsOptions.rate = wsRate;
+    wsOptions.messageBytes = wsMessageBytes > 0 ? (size_t) wsMessageBytes : 0;
+    wsOptions.durationMs = wsDurationMs > 0 ? (guint) wsDurationMs : 0;
+    wsOptions.text = wsText;
+    WorkerStats localStats{};
+    WebSocketLoad load(session, vector<string>(targets, targets + g_strv_length((gchar **) targets)), wsOptions,
+                       run.stats ? *run.stats : localStats);
+    if (wsConnections > 0 && wsRate > 0) load.run(mainLoop);
+    load.print_summary(cout);
+  } else if (streamFormat) {
+    run_streams(session, targets, streamOptions, mainLoop, run.stats);
+  } else if (urgentUrls || bulkUrls || deadlineMs > 0) {
+    session.set_stats(run.stats);
+    // Only fall back to the default URL when nothing was asked for at all.
+    run_scheduled(session, urls || (!urgentUrls && !bulkUrls) ? targets : nullptr, mainLoop);
+  } else if (coalesce) {
+    session.set_stats(run.stats);
+    run_coalesced(session, targets, mainLoop);
+  } else if (coroFanOut || coroRace) {
+    Task<> task = coroRace ? race(session.get(), targets, mainLoop, run.stats) : fan_out(session.get(), targets, mainLoop, run.stats);
+    task.start();
+    if (!task.done()) g_main_loop_run(mainLoop);
+    task.take_result();
+  } else if (crawl) {
+    Crawler::Options crawlOptions = {crawlDepth, (guint) crawlDelay, crawlConcurrency, (size_t) crawlMaxPages, (size_t) crawlExpectedUrls};
+    run.crawler = new Crawler(crawlOptions, [&run](const string &url, int depth) {
+      return queue_fetch(&run, url.c_str(), depth, -1);
+    });
+    for (const char *const *url = targets; *url; url++) run.crawler->add(*url, 0);
+    run.crawler->pump();
+  } else {
+    if (checkpointPath) {
+      uint32_t count;
+      uint64_t fingerprint = CheckpointJournal::fingerprint(targets, &count);
+      run.journal = new CheckpointJournal();
+      if (!run.journal->open(checkpointPath, count, fingerprint, &error)) {
+        cerr << error->message << endl;
+        return 1;
+      }
+      run.journal->set_writer(run.writer);
+      if (run.journal->completed()) {
+        cout << "checkpoint: skipping " << run.journal->completed() << " of " << count << " urls already fetched" << endl;
+      }
+    }
+    gint64 id = 0;
+    for (const char *const *url = targets; *url; url++, id++) {
+      if (run.journal && run.journal->done((uint32_t) id)) continue;
+      run.seen.insert(*url);
+      queue_fetch(&run, *url, 0, id);
+    }
+  }
 
-  soup_session_queue_message(
-          session, msg, [](SoupSession *session, SoupMessage *msg, gpointer usr_data) {
-            if (SOUP_STATUS_IS_SUCCESSFUL(msg->status_code)) {
-              cout << "Lambda completion!" << endl;
-              cout << "Body:" << endl
-                   << msg->response_body->data << endl;
-            } else {
-              cerr << "Failed to perform request: " << soup_message_get_uri(msg)->path << " " << msg->status_code << " " << msg->reason_phrase << endl;
-            }
-            g_object_unref(msg);
+  if (run.outstanding > 0) g_main_loop_run(mainLoop);
+  if (reporter) {
+    reporter->report();
+    delete reporter;
+    delete run.stats;
+  }
 
-            g_main_loop_quit((GMainLoop *) usr_data);
-          },
-          (gpointer) mainLoop);
+  if (run.sink) {
+    bool drained = false;
+    run.sink->when_drained([&drained, mainLoop]() {
+      drained = true;
+      g_main_loop_quit(mainLoop);
+    });
+    if (!drained) g_main_loop_run(mainLoop);
+    delete run.sink;
+  }
+  // Before the writer: closing waits for the journal's last write.
+  if (run.journal) {
+    if (!run.journal->close(&error)) {
+      cerr << error->message << endl;
+      g_clear_error(&error);
+    }
+    cout << "checkpoint: " << run.journal->completed() << " of " << run.journal->count() << " urls done" << endl;
+    delete run.journal;
+  }
+  if (run.writer) {
+    if (outputDir) {
+      cout << "wrote " << run.filesStarted - run.fileErrors << " files to " << outputDir << " via "
+           << run.writer->backend() << ", " << run.fileErrors << " failed" << endl;
+    }
+    delete run.writer;
+  }
+  if (run.tracer) {
+    if (run.tracer->dropped()) cerr << "tracing: " << run.tracer->dropped() << " spans dropped, export ring full" << endl;
+    // Joins the exporter thread, which writes out the last batch.
+    delete run.tracer;
+    fclose(traceOut);
+  }
+  if (run.budget) {
+    cerr << "memory budget: peak " << run.budget->peak() << " of " << run.budget->limit() << " bytes, "
+         << run.budget->pauses() << " pauses" << endl;
+    delete run.budget;
+  }
 
-  g_main_loop_run(mainLoop);
+  if (run.crawler) {
+    run.crawler->print_stats(cout);
+    delete run.crawler;
+  }
+  if (run.recorder) {
+    if (!run.recorder->close(&error)) {
+      cerr << error->message << endl;
+      g_clear_error(&error);
+    }
+    delete run.recorder;
+  }
 
+  if (run.pipelinePool) g_thread_pool_free(run.pipelinePool, FALSE, TRUE);
+  delete run.manifest;
+  // The parent reads the counters after this worker exits.
+  delete shards;
   g_main_loop_unref(mainLoop);
-  g_object_unref(session);
+  g_strfreev(urls);
+  g_free(pipelineSpec);
+  g_strfreev(uploads);
+  g_strfreev(urgentUrls);
+  g_strfreev(bulkUrls);
+  g_free(replayPath);
+  g_free(replayTarget);
+  g_free(recordPath);
+  g_free(outputDir);
+  g_free(traceFile);
+  g_free(checkpointPath);
+  g_free(loopCpus);
+  g_free(helperCpus);
+  g_free(progressFormat);
+  g_strfreev(authSpecs);
+  g_strfreev(authHeaders);
+  g_free(manifestPath);
+  g_free(streamFormat);
+  g_strfreev(unixSockets);
+  g_free(uploadContentType);
 
-  return 0;
+  return exitStatus;
 }
@@ -0,0 +1,584 @@
+#include "pipeline.h"
+#include "affinity.h"
+#include "hash.h"
+#include "link_extractor.h"
+
+#include <gio/gio.h>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <regex>
+
+using namespace std;
+
+G_DEFINE_QUARK(libsouptest-pipeline-error-quark, pipeline_error)
+
+static const size_t MAX_REPORTED_VALUES = 16;
+static const size_t MAX_VALUE_BYTES = 1024;
+
+LineSplitter::LineSplitter(function<void(const char *, size_t)> onLine, size_t maxLineBytes)
+    : onLine_(std::move(onLine)), maxLineBytes_(maxLineBytes), discarding_(false), overflows_(0) {}
+
+void LineSplitter::feed(const char *data, size_t len) {
+  const char *end = data + len;
+  while (data < end) {
+    const char *nl = (const char *) memchr(data, '\n', end - data);
+    if (!nl) {
+      if (discarding_) return;
+      if (partial_.size() + (size_t) (end - data) > maxLineBytes_) {
+        overflows_++;
+        partial_.clear();
+        discarding_ = true;
+      } else {
+        partial_.append(data, end - data);
+      }
+      return;
+    }
+    size_t lineLen = nl - data;
+    if (lineLen > 0 && data[lineLen - 1] == '\r') lineLen--;
+    if (discarding_) {
+      discarding_ = false;
+    } else if (partial_.size() + lineLen > maxLineBytes_) {
+      overflows_++;
+      partial_.clear();
+    } else if (partial_.empty()) {
+      onLine_(data, lineLen);
+    } else {
+      partial_.append(data, nl - data);
+      if (!partial_.empty() && partial_.back() == '\r') partial_.pop_back();
+      onLine_(partial_.data(), partial_.size());
+      partial_.clear();
+    }
+    data = nl + 1;
+  }
+}
+
+void LineSplitter::flush() {
+  if (!partial_.empty()) {
+    onLine_(partial_.data(), partial_.size());
+    partial_.clear();
+  }
+  discarding_ = false;
+}
+
+namespace {
+
+  class Sha256Stage : public PipelineStage {
+  public:
+    Sha256Stage() : checksum_(g_checksum_new(G_CHECKSUM_SHA256)) {}
+    ~Sha256Stage() override { g_checksum_free(checksum_); }
+
+    const char *name() const override { return "sha256"; }
+    void consume(const char *data, size_t len) override { g_checksum_update(checksum_, (const guchar *) data, len); }
+    void finish() override { digest_ = g_checksum_get_string(checksum_); }
+    string result() const override { return digest_; }
+
+  private:
+    GChecksum *checksum_;
+    string digest_;
+  };
+
+  class XxHash64Stage : public PipelineStage {
+  public:
+    const char *name() const override { return "xxh64"; }
+    void consume(const char *data, size_t len) override { hash_.update(data, len); }
+    string result() const override {
+      char hex[17];
+      snprintf(hex, sizeof(hex), "%016" PRIx64, hash_.digest());
+      return hex;
+    }
+
+  private:
+    XxHash64 hash_;
+  };
+
+  class Crc32cStage : public PipelineStage {
+  public:
+    const char *name() const override { return "crc32c"; }
+    void consume(const char *data, size_t len) override { crc_.update(data, len); }
+    string result() const override {
+      char hex[9];
+      snprintf(hex, sizeof(hex), "%08" PRIx32, crc_.digest());
+      return hex;
+    }
+
+  private:
+    Crc32c crc_;
+  };
+
+  class LineCountStage : public PipelineStage {
+  public:
+    LineCountStage() : splitter_([this](const char *, size_t len) {
+                         lines_++;
+                         if (len > longest_) longest_ = len;
+                       }) {}
+
+    const char *name() const override { return "lines"; }
+    void consume(const char *data, size_t len) override { splitter_.feed(data, len); }
+    void finish() override { splitter_.flush(); }
+    string result() const override {
+      string out = to_string(lines_) + " lines, longest " + to_string(longest_) + " bytes";
+      if (splitter_.overflows()) out += ", " + to_string(splitter_.overflows()) + " over " + to_string(LineSplitter::DEFAULT_MAX_LINE_BYTES) + " bytes skipped";
+      return out;
+    }
+
+  private:
+    LineSplitter splitter_;
+    size_t lines_ = 0;
+    size_t longest_ = 0;
+  };
+
+  // Counts occurrences of a fixed string, including ones that straddle chunks.
+  class SubstringSearchStage : public PipelineStage {
+  public:
+    explicit SubstringSearchStage(string needle) : needle_(std::move(needle)) {}
+
+    const char *name() const override { return "find"; }
+
+    void consume(const char *data, size_t len) override {
+      size_t n = needle_.size();
+      if (!tail_.empty()) {
+        string window = tail_;
+        window.append(data, min(len, n - 1));
+        const char *w = window.data();
+        const char *wEnd = w + window.size();
+        while (w < wEnd) {
+          const char *hit = (const char *) memmem(w, wEnd - w, needle_.data(), n);
+          if (!hit || (size_t) (hit - window.data()) >= tail_.size()) break;
+          record(offset_ - tail_.size() + (hit - window.data()));
+          w = hit + 1;
+        }
+      }
+
+      const char *p = data;
+      const char *end = data + len;
+      while (p < end) {
+        const char *hit = (const char *) memmem(p, end - p, needle_.data(), n);
+        if (!hit) break;
+        record(offset_ + (hit - data));
+        p = hit + 1;
+      }
+
+      size_t keep = min(n - 1, len);
+      if (keep == len) {
+        tail_.append(data, len);
+        if (tail_.size() > n - 1) tail_.erase(0, tail_.size() - (n - 1));
+      } else {
+        tail_.assign(end - keep, keep);
+      }
+      offset_ += len;
+    }
+
+    string result() const override {
+      if (matches_ == 0) return "\"" + needle_ + "\" not found";
+      return "\"" + needle_ + "\" found " + to_string(matches_) + " times, first at offset " + to_string(first_);
+    }
+
+  private:
+    void record(uint64_t at) {
+      if (matches_++ == 0) first_ = at;
+    }
+
+    string needle_;
+    string tail_;
+    uint64_t offset_ = 0;
+    uint64_t first_ = 0;
+    size_t matches_ = 0;
+  };
+
+  class RegexSearchStage : public PipelineStage {
+  public:
+    explicit RegexSearchStage(const string &expr)
+        : regex_(expr, regex::ECMAScript | regex::optimize),
+          splitter_([this](const char *line, size_t len) { match_line(line, len); }) {}
+
+    const char *name() const override { return "regex"; }
+    void consume(const char *data, size_t len) override { splitter_.feed(data, len); }
+    void finish() override { splitter_.flush(); }
+
+    string result() const override {
+      string out = to_string(matches_) + " matching lines";
+      if (splitter_.overflows()) out += ", " + to_string(splitter_.overflows()) + " too long to search";
+      for (const string &m : samples_) out += "\n    " + m;
+      return out;
+    }
+
+  private:
+    void match_line(const char *line, size_t len) {
+      cmatch m;
+      if (!regex_search(line, line + len, m, regex_)) return;
+      matches_++;
+      if (samples_.size() < MAX_REPORTED_VALUES) samples_.push_back(m.str(0).substr(0, MAX_VALUE_BYTES));
+    }
+
+    regex regex_;
+    LineSplitter splitter_;
+    size_t matches_ = 0;
+    vector<string> samples_;
+  };
+
+  // Pulls the values of every "field": ... pair out of a JSON document without
+  // building a tree. Nested values are captured verbatim.
+  class JsonFieldStage : public PipelineStage {
+  public:
+    explicit JsonFieldStage(string field) : field_(std::move(field)) {}
+
+    const char *name() const override { return "json"; }
+
+    void consume(const char *data, size_t len) override {
+      for (size_t i = 0; i < len; i++) step(data[i]);
+    }
+
+    void finish() override {
+      if (state_ == VALUE_SCALAR) emit();
+    }
+
+    string result() const override {
+      string out = "\"" + field_ + "\": " + to_string(matches_) + " values";
+      for (const string &v : values_) out += "\n    " + v;
+      return out;
+    }
+
+  private:
+    enum State {
+      SCAN,
+      SCAN_STRING,
+      VALUE_START,
+      VALUE_STRING,
+      VALUE_NESTED,
+      VALUE_SCALAR,
+    };
+
+    static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+
+    void append(char c) {
+      if (value_.size() < MAX_VALUE_BYTES) value_ += c;
+    }
+
+    void emit() {
+      matches_++;
+      if (values_.size() < MAX_REPORTED_VALUES) values_.push_back(value_);
+      value_.clear();
+      state_ = SCAN;
+    }
+
+    void step(char c) {
+      switch (state_) {
+        case SCAN:
+          if (c == '"') {
+            state_ = SCAN_STRING;
+            token_.clear();
+            tokenOverflow_ = false;
+            keyMatched_ = false;
+          } else if (c == ':' && keyMatched_) {
+            state_ = VALUE_START;
+            keyMatched_ = false;
+          } else if (!is_space(c)) {
+            keyMatched_ = false;
+          }
+          break;
+        case SCAN_STRING:
+          if (escape_) {
+            escape_ = false;
+          } else if (c == '\\') {
+            escape_ = true;
+          } else if (c == '"') {
+            state_ = SCAN;
+            keyMatched_ = !tokenOverflow_ && token_ == field_;
+            break;
+          }
+          if (token_.size() <= field_.size()) token_ += c;
+          else tokenOverflow_ = true;
+          break;
+        case VALUE_START:
+          if (is_space(c)) break;
+          if (c == '"') {
+            state_ = VALUE_STRING;
+          } else if (c == '{' || c == '[') {
+            state_ = VALUE_NESTED;
+            depth_ = 1;
+            nestedInString_ = false;
+            append(c);
+          } else {
+            state_ = VALUE_SCALAR;
+            append(c);
+          }
+          break;
+        case VALUE_STRING:
+          if (escape_) {
+            escape_ = false;
+          } else if (c == '\\') {
+            escape_ = true;
+          } else if (c == '"') {
+            emit();
+            break;
+          }
+          append(c);
+          break;
+        case VALUE_NESTED:
+          append(c);
+          if (nestedInString_) {
+            if (escape_) escape_ = false;
+            else if (c == '\\') escape_ = true;
+            else if (c == '"') nestedInString_ = false;
+          } else if (c == '"') {
+            nestedInString_ = true;
+          } else if (c == '{' || c == '[') {
+            depth_++;
+          } else if ((c == '}' || c == ']') && --depth_ == 0) {
+            emit();
+          }
+          break;
+        case VALUE_SCALAR:
+          if (c == ',' || c == '}' || c == ']' || is_space(c)) emit();
+          else append(c);
+          break;
+      }
+    }
+
+    string field_;
+    State state_ = SCAN;
+    bool escape_ = false;
+    string token_;
+    bool tokenOverflow_ = false;
+    bool keyMatched_ = false;
+    string value_;
+    int depth_ = 0;
+    bool nestedInString_ = false;
+    size_t matches_ = 0;
+    vector<string> values_;
+  };
+
+  class LinkStage : public PipelineStage {
+  public:
+    LinkStage() : extractor_([this](const char *link, size_t len) {
+                    if (samples_.size() < MAX_REPORTED_VALUES) samples_.emplace_back(link, len);
+                  }) {}
+
+    const char *name() const override { return "links"; }
+    void consume(const char *data, size_t len) override { extractor_.feed(data, len); }
+    void finish() override { extractor_.finish(); }
+
+    string result() const override {
+      string out = to_string(extractor_.links()) + " links";
+      for (const string &link : samples_) out += "\n    " + link;
+      return out;
+    }
+
+  private:
+    LinkExtractor extractor_;
+    vector<string> samples_;
+  };
+
+  // gzip-compresses the body as it streams, optionally writing it to a file.
+  class GzipStage : public PipelineStage {
+  public:
+    explicit GzipStage(const string &path)
+        : compressor_(g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1)),
+          out_(path.empty() ? nullptr : fopen(path.c_str(), "wb")),
+          path_(path),
+          writeErr_(!path.empty() && !out_ ? errno : 0) {}
+
+    ~GzipStage() override {
+      g_object_unref(compressor_);
+      if (out_) fclose(out_);
+      g_clear_error(&error_);
+    }
+
+    const char *name() const override { return "gzip"; }
+
+    void consume(const char *data, size_t len) override {
+      in_ += len;
+      convert(data, len, G_CONVERTER_NO_FLAGS);
+    }
+
+    void finish() override {
+      convert(nullptr, 0, G_CONVERTER_INPUT_AT_END);
+      if (out_) {
+        if (fclose(out_) != 0 && !writeErr_) writeErr_ = errno;
+        out_ = nullptr;
+      }
+    }
+
+    string result() const override {
+      if (error_) return string("compression failed: ") + error_->message;
+      char ratio[32];
+      snprintf(ratio, sizeof(ratio), "%.2f", in_ ? (double) compressed_ / in_ : 0.0);
+      string out = to_string(in_) + " -> " + to_string(compressed_) + " bytes (ratio " + ratio + ")";
+      if (writeErr_) out += ", not written to " + path_ + ": " + g_strerror(writeErr_);
+      else if (!path_.empty()) out += ", written to " + path_;
+      return out;
+    }
+
+  private:
+    void convert(const char *data, size_t len, GConverterFlags flags) {
+      char buf[64 * 1024];
+      while (!error_) {
+        gsize read = 0, written = 0;
+        GConverterResult res = g_converter_convert(G_CONVERTER(compressor_), data, len, buf, sizeof(buf), flags, &read, &written, &error_);
+        if (res == G_CONVERTER_ERROR) return;
+        compressed_ += written;
+        if (out_ && written && fwrite(buf, 1, written, out_) != written) {
+          // Keep compressing for the stats; the file is lost anyway.
+          writeErr_ = errno ? errno : EIO;
+          fclose(out_);
+          out_ = nullptr;
+        }
+        data += read;
+        len -= read;
+        if (res == G_CONVERTER_FINISHED) return;
+        if (len == 0 && !(flags & G_CONVERTER_INPUT_AT_END)) return;
+      }
+    }
+
+    GZlibCompressor *compressor_;
+    FILE *out_;
+    string path_;
+    // errno of the first failure to open or write path_.
+    int writeErr_;
+    uint64_t in_ = 0;
+    uint64_t compressed_ = 0;
+    GError *error_ = nullptr;
+  };
+
+} // namespace
+
+BodyPipeline::BodyPipeline(GThreadPool *pool)
+    : pool_(pool), context_(g_main_context_ref_thread_default()), scheduled_(false), closed_(false) {}
+
+BodyPipeline::~BodyPipeline() {
+  for (GBytes *chunk : pending_) g_bytes_unref(chunk);
+  g_main_context_unref(context_);
+}
+
+void BodyPipeline::add_stage(unique_ptr<PipelineStage> stage) {
+  stages_.push_back(std::move(stage));
+}
+
+void BodyPipeline::process(GBytes *chunk) {
+  gsize len;
+  const char *data = (const char *) g_bytes_get_data(chunk, &len);
+  for (auto &stage : stages_) stage->consume(data, len);
+}
+
+void BodyPipeline::finish_stages() {
+  for (auto &stage : stages_) stage->finish();
+}
+
+void BodyPipeline::push(GBytes *chunk) {
+  if (!pool_) {
+    process(chunk);
+    return;
+  }
+
+  lock_guard<mutex> lock(mutex_);
+  pending_.push_back(g_bytes_ref(chunk));
+  if (!scheduled_) {
+    scheduled_ = true;
+    g_thread_pool_push(pool_, this, nullptr);
+  }
+}
+
+void BodyPipeline::close(function<void(BodyPipeline *)> done) {
+  if (!pool_) {
+    finish_stages();
+    done(this);
+    return;
+  }
+
+  lock_guard<mutex> lock(mutex_);
+  closed_ = true;
+  done_ = std::move(done);
+  if (!scheduled_) {
+    scheduled_ = true;
+    g_thread_pool_push(pool_, this, nullptr);
+  }
+}
+
+void BodyPipeline::drain() {
+  for (;;) {
+    GBytes *chunk;
+    {
+      lock_guard<mutex> lock(mutex_);
+      if (pending_.empty()) {
+        scheduled_ = false;
+        if (!closed_) return;
+        break;
+      }
+      chunk = pending_.front();
+      pending_.pop_front();
+    }
+    process(chunk);
+    g_bytes_unref(chunk);
+  }
+
+  finish_stages();
+  g_main_context_invoke(context_, complete_in_context, this);
+}
+
+void BodyPipeline::pool_func(gpointer data, gpointer usr_data) {
+  pin_helper_thread();
+  ((BodyPipeline *) data)->drain();
+}
+
+gboolean BodyPipeline::complete_in_context(gpointer data) {
+  BodyPipeline *pipeline = (BodyPipeline *) data;
+  function<void(BodyPipeline *)> done = std::move(pipeline->done_);
+  done(pipeline);
+  return G_SOURCE_REMOVE;
+}
+
+GThreadPool *BodyPipeline::create_pool(int threads, GError **error) {
+  return g_thread_pool_new(pool_func, nullptr, threads, FALSE, error);
+}
+
+gboolean pipeline_add_stages(BodyPipeline &pipeline, const char *spec, GError **error) {
+  gchar **parts = g_strsplit(spec, ",", -1);
+  gboolean ok = TRUE;
+
+  for (gchar **part = parts; ok && *part; part++) {
+    if (**part == '\0') continue;
+
+    const char *eq = strchr(*part, '=');
+    string stage = eq ? string(*part, eq - *part) : string(*part);
+    string arg = eq ? string(eq + 1) : string();
+
+    if (stage == "sha256") {
+      pipeline.add_stage(unique_ptr<PipelineStage>(new Sha256Stage()));
+    } else if (stage == "xxh64") {
+      pipeline.add_stage(unique_ptr<PipelineStage>(new XxHash64Stage()));
+    } else if (stage == "crc32c") {
+      pipeline.add_stage(unique_ptr<PipelineStage>(new Crc32cStage()));
+    } else if (stage == "links") {
+      pipeline.add_stage(unique_ptr<PipelineStage>(new LinkStage()));
+    } else if (stage == "lines") {
+      pipeline.add_stage(unique_ptr<PipelineStage>(new LineCountStage()));
+    } else if (stage == "find" || stage == "json") {
+      if (arg.empty()) {
+        g_set_error(error, PIPELINE_ERROR, PIPELINE_ERROR_BAD_ARGUMENT, "Stage '%s' needs an argument", stage.c_str());
+        ok = FALSE;
+      } else if (stage == "find") {
+        pipeline.add_stage(unique_ptr<PipelineStage>(new SubstringSearchStage(arg)));
+      } else {
+        pipeline.add_stage(unique_ptr<PipelineStage>(new JsonFieldStage(arg)));
+      }
+    } else if (stage == "regex") {
+      try {
+        pipeline.add_stage(unique_ptr<PipelineStage>(new RegexSearchStage(arg)));
+      } catch (const regex_error &e) {
+        g_set_error(error, PIPELINE_ERROR, PIPELINE_ERROR_BAD_ARGUMENT, "Invalid regex '%s': %s", arg.c_str(), e.what());
+        ok = FALSE;
+      }
+    } else if (stage == "gzip") {
+      pipeline.add_stage(unique_ptr<PipelineStage>(new GzipStage(arg)));
+    } else {
+      g_set_error(error, PIPELINE_ERROR, PIPELINE_ERROR_UNKNOWN_STAGE, "Unknown pipeline stage '%s'", stage.c_str());
+      ok = FALSE;
+    }
+  }
+
+  g_strfreev(parts);
+  return ok;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <glib.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define PIPELINE_ERROR (pipeline_error_quark())
+GQuark pipeline_error_quark(void);
+
+enum PipelineError {
+  PIPELINE_ERROR_UNKNOWN_STAGE,
+  PIPELINE_ERROR_BAD_ARGUMENT,
+};
+
+// A single incremental step over a response body. consume() is called once per
+// received chunk, in order, and never concurrently for the same stage.
+class PipelineStage {
+public:
+  virtual ~PipelineStage() = default;
+
+  virtual const char *name() const = 0;
+  virtual void consume(const char *data, size_t len) = 0;
+  virtual void finish() {}
+  virtual std::string result() const = 0;
+};
+
+// Splits a byte stream into lines across chunk boundaries. Only the trailing
+// partial line is buffered; lines longer than maxLineBytes are dropped and
+// counted instead, so a body without newlines cannot grow the buffer.
+class LineSplitter {
+public:
+  static const size_t DEFAULT_MAX_LINE_BYTES = 1 << 20;
+
+  explicit LineSplitter(std::function<void(const char *, size_t)> onLine, size_t maxLineBytes = DEFAULT_MAX_LINE_BYTES);
+
+  void feed(const char *data, size_t len);
+  void flush();
+
+  size_t overflows() const { return overflows_; }
+
+private:
+  std::function<void(const char *, size_t)> onLine_;
+  size_t maxLineBytes_;
+  std::string partial_;
+  // Skipping the rest of an overlong line.
+  bool discarding_;
+  size_t overflows_;
+};
+
+// Feeds body chunks through a chain of stages. With a thread pool, chunks are
+// queued and drained by one worker at a time so stage order is preserved while
+// the network side keeps reading.
+class BodyPipeline {
+public:
+  explicit BodyPipeline(GThreadPool *pool = nullptr);
+  ~BodyPipeline();
+
+  BodyPipeline(const BodyPipeline &) = delete;
+  BodyPipeline &operator=(const BodyPipeline &) = delete;
+
+  void add_stage(std::unique_ptr<PipelineStage> stage);
+  const std::vector<std::unique_ptr<PipelineStage>> &stages() const { return stages_; }
+
+  // Takes a new reference on chunk.
+  void push(GBytes *chunk);
+
+  // No more chunks will follow. done runs on the thread-default main context
+  // of the thread that created the pipeline once every stage has finished.
+  void close(std::function<void(BodyPipeline *)> done);
+
+  static GThreadPool *create_pool(int threads, GError **error);
+
+private:
+  static void pool_func(gpointer data, gpointer usr_data);
+  static gboolean complete_in_context(gpointer data);
+
+  void process(GBytes *chunk);
+  void drain();
+  void finish_stages();
+
+  std::vector<std::unique_ptr<PipelineStage>> stages_;
+  GThreadPool *pool_;
+  GMainContext *context_;
+
+  std::mutex mutex_;
+  std::deque<GBytes *> pending_;
+  bool scheduled_;
+  bool closed_;
+  std::function<void(BodyPipeline *)> done_;
+};
+
+// Appends the stages described by spec, a comma separated list of
+// sha256, xxh64, crc32c, lines, links, find=TEXT, regex=EXPR, json=FIELD and gzip[=PATH].
+gboolean pipeline_add_stages(BodyPipeline &pipeline, const char *spec, GError **error);
@@ -0,0 +1,52 @@
+#pragma once
+
+// USDT tracepoints on the request lifecycle, provider "libsouptest":
+//
+//   request__queued       (id, url_hash, request_body_bytes)
+//   connection__acquired  (id, url_hash)
+//   headers__received     (id, status, content_length or -1)
+//   chunk__received       (id, chunk_bytes, body_bytes_so_far)
+//   request__retried      (id, status)
+//   request__completed    (id, url_hash, status, body_bytes, duration_us)
+//
+// e.g. bpftrace -e 'usdt:./libsouptest:libsouptest:request__completed
+//   { @us = hist(arg4); }'. Each site is a single nop until a tracer
+// attaches. The per-message signal handlers behind the middle four are only
+// connected while a tracer holds a semaphore, so untraced runs pay nothing
+// beyond one load per request. Configure with -DLIBSOUPTEST_USDT=OFF to
+// compile every probe out.
+
+#ifdef LIBSOUPTEST_USDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define SOUP_PROBE_SEMAPHORE(name) libsouptest_##name##_semaphore
+#define SOUP_PROBE_DECLARE(name) extern "C" unsigned short SOUP_PROBE_SEMAPHORE(name)
+#define SOUP_PROBE_DEFINE(name)                                                                                        \
+  extern "C" {                                                                                                         \
+  __attribute__((section(".probes"))) unsigned short SOUP_PROBE_SEMAPHORE(name) = 0;                                   \
+  }                                                                                                                    \
+  static_assert(true, "")
+#define SOUP_PROBE_ENABLED(name) __builtin_expect(SOUP_PROBE_SEMAPHORE(name) != 0, 0)
+#define SOUP_PROBE(name, ...) STAP_PROBEV(libsouptest, name, __VA_ARGS__)
+
+#else
+
+#define SOUP_PROBE_DECLARE(name) static_assert(true, "")
+#define SOUP_PROBE_DEFINE(name) static_assert(true, "")
+#define SOUP_PROBE_ENABLED(name) false
+#define SOUP_PROBE(name, ...) soup_probe_discard(__VA_ARGS__)
+
+// Keeps probe arguments "used" so call sites need no #ifdefs of their own.
+template<typename... Args>
+inline void soup_probe_discard(const Args &...) {}
+
+#endif
+
+SOUP_PROBE_DECLARE(request__queued);
+SOUP_PROBE_DECLARE(connection__acquired);
+SOUP_PROBE_DECLARE(headers__received);
+SOUP_PROBE_DECLARE(chunk__received);
+SOUP_PROBE_DECLARE(request__retried);
+SOUP_PROBE_DECLARE(request__completed);
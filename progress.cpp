@@ -0,0 +1,108 @@
+#include "progress.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+using namespace std;
+
+ProgressReporter::ProgressReporter(const WorkerStats *stats, int count, Format format, ostream &out)
+    : stats_(stats), count_(count), format_(format), out_(out), timer_(0), startUs_(0), lastUs_(0), lastCompleted_(0),
+      lastFailed_(0), lastBytes_(0), lastCounts_(LatencyHistogram::BUCKETS, 0), interval_(LatencyHistogram::BUCKETS, 0) {}
+
+ProgressReporter::~ProgressReporter() {
+  stop();
+}
+
+gboolean ProgressReporter::parse_format(const char *name, Format *format, GError **error) {
+  if (strcmp(name, "text") == 0) *format = TEXT;
+  else if (strcmp(name, "csv") == 0) *format = CSV;
+  else if (strcmp(name, "json") == 0) *format = JSON;
+  else {
+    g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Unknown progress format '%s', expected text, csv or json", name);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+void ProgressReporter::start(guint intervalMs) {
+  stop();
+  startUs_ = lastUs_ = g_get_monotonic_time();
+  if (format_ == CSV) {
+    out_ << "elapsed_s,requests_per_s,bytes_per_s,in_flight,error_rate,p50_ms,p90_ms,p99_ms,completed,failed" << endl;
+  }
+  timer_ = g_timeout_add(intervalMs, on_tick, this);
+}
+
+void ProgressReporter::stop() {
+  if (timer_) {
+    g_source_remove(timer_);
+    timer_ = 0;
+  }
+}
+
+gboolean ProgressReporter::on_tick(gpointer data) {
+  ((ProgressReporter *) data)->report();
+  return G_SOURCE_CONTINUE;
+}
+
+void ProgressReporter::report() {
+  gint64 now = g_get_monotonic_time();
+  uint64_t started = 0, completed = 0, failed = 0, bytes = 0, samples = 0;
+  fill(interval_.begin(), interval_.end(), 0);
+  for (int i = 0; i < count_; i++) {
+    const WorkerStats &stats = stats_[i];
+    // Every start of a completion seen here is seen too, so in-flight never
+    // goes negative.
+    completed += stats.completed.load(memory_order_acquire);
+    failed += stats.failed.load(memory_order_relaxed);
+    bytes += stats.bytes.load(memory_order_relaxed);
+    started += stats.started.load(memory_order_relaxed);
+    for (int b = 0; b < LatencyHistogram::BUCKETS; b++) interval_[b] += stats.latency.counts[b].load(memory_order_relaxed);
+  }
+  for (int b = 0; b < LatencyHistogram::BUCKETS; b++) {
+    uint64_t total = interval_[b];
+    interval_[b] = total - lastCounts_[b];
+    lastCounts_[b] = total;
+    samples += interval_[b];
+  }
+
+  double secs = (double) (now - lastUs_) / G_USEC_PER_SEC;
+  double elapsed = (double) (now - startUs_) / G_USEC_PER_SEC;
+  uint64_t done = completed - lastCompleted_;
+  double rate = secs > 0 ? done / secs : 0;
+  double byteRate = secs > 0 ? (bytes - lastBytes_) / secs : 0;
+  double errorRate = done ? (double) (failed - lastFailed_) / done : 0;
+  uint64_t inFlight = started > completed ? started - completed : 0;
+  double p50 = LatencyHistogram::percentile_ms(interval_.data(), samples, 0.50);
+  double p90 = LatencyHistogram::percentile_ms(interval_.data(), samples, 0.90);
+  double p99 = LatencyHistogram::percentile_ms(interval_.data(), samples, 0.99);
+
+  // Formatted in one go, so the line reaches out_ in a single write.
+  char line[512];
+  switch (format_) {
+    case TEXT:
+      snprintf(line, sizeof(line),
+               "[%8.1fs] %8.0f req/s %9.2f MiB/s %6" G_GUINT64_FORMAT " in flight %6.2f%% errors  p50 %.2f p90 %.2f p99 %.2f ms\n",
+               elapsed, rate, byteRate / (1 << 20), inFlight, errorRate * 100, p50, p90, p99);
+      break;
+    case CSV:
+      snprintf(line, sizeof(line), "%.3f,%.1f,%.0f,%" G_GUINT64_FORMAT ",%.5f,%.3f,%.3f,%.3f,%" G_GUINT64_FORMAT ",%" G_GUINT64_FORMAT "\n",
+               elapsed, rate, byteRate, inFlight, errorRate, p50, p90, p99, completed, failed);
+      break;
+    case JSON:
+      snprintf(line, sizeof(line),
+               "{\"elapsed_s\":%.3f,\"requests_per_s\":%.1f,\"bytes_per_s\":%.0f,\"in_flight\":%" G_GUINT64_FORMAT
+               ",\"error_rate\":%.5f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"completed\":%" G_GUINT64_FORMAT
+               ",\"failed\":%" G_GUINT64_FORMAT "}\n",
+               elapsed, rate, byteRate, inFlight, errorRate, p50, p90, p99, completed, failed);
+      break;
+  }
+  out_ << line << flush;
+
+  lastUs_ = now;
+  lastCompleted_ = completed;
+  lastFailed_ = failed;
+  lastBytes_ = bytes;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <glib.h>
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "shard.h"
+
+// Periodic throughput report from a main-loop timeout. Each tick snapshots
+// the WorkerStats counters with relaxed loads (no locks, so writers in this
+// or other processes never wait) and reports the difference from the last
+// tick: requests/s, bytes/s, requests in flight, error rate and latency
+// percentiles of the requests that completed during the interval.
+class ProgressReporter {
+public:
+  enum Format { TEXT, CSV, JSON };
+
+  // stats points at count adjacent WorkerStats, e.g. a ShardSet's segment.
+  ProgressReporter(const WorkerStats *stats, int count, Format format, std::ostream &out);
+  ~ProgressReporter();
+
+  ProgressReporter(const ProgressReporter &) = delete;
+  ProgressReporter &operator=(const ProgressReporter &) = delete;
+
+  // "text", "csv" or "json".
+  static gboolean parse_format(const char *name, Format *format, GError **error);
+
+  void start(guint intervalMs);
+  void stop();
+  // One report now, covering the time since the last one.
+  void report();
+
+private:
+  static gboolean on_tick(gpointer data);
+
+  const WorkerStats *stats_;
+  int count_;
+  Format format_;
+  std::ostream &out_;
+  guint timer_;
+  gint64 startUs_;
+  gint64 lastUs_;
+  uint64_t lastCompleted_;
+  uint64_t lastFailed_;
+  uint64_t lastBytes_;
+  std::vector<uint64_t> lastCounts_;
+  std::vector<uint64_t> interval_;
+};
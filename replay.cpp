@@ -0,0 +1,121 @@
+#include "replay.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+static const guint TICK_MS = 1;
+
+ReplayEngine::ReplayEngine(Session &session, ReplayLogReader &reader, const Options &options)
+    : session_(session), reader_(reader), options_(options), mainLoop_(nullptr), error_(nullptr),
+      startUs_(g_get_monotonic_time()), wheel_(startUs_, TICK_MS * 1000), haveNext_(false), eof_(false),
+      inFlight_(0), tickSource_(0) {}
+
+ReplayEngine::~ReplayEngine() {
+  if (tickSource_) g_source_remove(tickSource_);
+  g_clear_error(&error_);
+}
+
+gboolean ReplayEngine::run(GMainLoop *mainLoop, GError **error) {
+  mainLoop_ = mainLoop;
+  startUs_ = g_get_monotonic_time();
+  wheel_.reset(startUs_);
+
+  on_tick(this);
+  if (tickSource_ || inFlight_ > 0) g_main_loop_run(mainLoop);
+
+  if (error_) {
+    g_propagate_error(error, error_);
+    error_ = nullptr;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+// Pulls records from the log until the next one is due beyond the wheel's
+// span, so the wheel never holds more than one revolution of work.
+void ReplayEngine::refill(gint64 nowUs) {
+  gint64 horizonUs = nowUs + wheel_.span_us() / 2;
+  while (!eof_) {
+    if (!haveNext_) {
+      GError *error = nullptr;
+      if (!reader_.next(next_, &error)) {
+        eof_ = true;
+        if (error) g_propagate_error(&error_, error);
+        break;
+      }
+      haveNext_ = true;
+    }
+
+    gint64 dueUs = startUs_ + (gint64) (next_.offsetUs / options_.speed);
+    if (dueUs > horizonUs) break;
+    wheel_.schedule(dueUs, std::move(next_));
+    haveNext_ = false;
+  }
+}
+
+gboolean ReplayEngine::on_tick(gpointer data) {
+  ReplayEngine *engine = (ReplayEngine *) data;
+  gint64 nowUs = g_get_monotonic_time();
+
+  engine->refill(nowUs);
+  engine->wheel_.advance(nowUs, [engine, nowUs](ReplayRecord &record, gint64 dueUs) {
+    engine->send(record, dueUs, nowUs);
+  });
+
+  engine->tickSource_ = 0;
+  if (engine->eof_ && engine->wheel_.empty()) engine->check_done();
+  else engine->arm(g_get_monotonic_time());
+  return G_SOURCE_REMOVE;
+}
+
+void ReplayEngine::arm(gint64 nowUs) {
+  gint64 wakeUs = wheel_.next_due_us();
+  if (haveNext_) wakeUs = min(wakeUs, startUs_ + (gint64) (next_.offsetUs / options_.speed) - wheel_.span_us() / 2);
+  guint delayMs = wakeUs <= nowUs ? 0 : (guint) ((wakeUs - nowUs + 999) / 1000);
+  tickSource_ = g_timeout_add(delayMs, on_tick, this);
+}
+
+void ReplayEngine::send(ReplayRecord &record, gint64 dueUs, gint64 nowUs) {
+  string url;
+  if (options_.target) {
+    // Keep path and query; swap scheme://authority.
+    size_t authority = record.url.find("://");
+    size_t path = authority == string::npos ? string::npos : record.url.find('/', authority + 3);
+    url = options_.target;
+    if (path != string::npos) url.append(record.url, path, string::npos);
+  } else {
+    url = std::move(record.url);
+  }
+
+  Request request = Request::method(record.method.c_str(), url.c_str());
+  if (!request.valid()) {
+    stats_.invalid++;
+    return;
+  }
+
+  const char *contentType = nullptr;
+  for (const auto &header : record.headers) {
+    if (g_ascii_strcasecmp(header.first.c_str(), "Content-Type") == 0) contentType = header.second.c_str();
+    else if (g_ascii_strcasecmp(header.first.c_str(), "Content-Length") != 0) request.header(header.first.c_str(), header.second.c_str());
+  }
+  if (!record.body.empty() || contentType) request.body(contentType, record.body.data(), record.body.size());
+
+  gint64 lagUs = nowUs - dueUs;
+  stats_.lagSumUs += (uint64_t) lagUs;
+  if (lagUs > stats_.maxLagUs) stats_.maxLagUs = lagUs;
+  stats_.sent++;
+  inFlight_++;
+
+  session_.queue(std::move(request), [this](Response &response) {
+    if (response.ok()) stats_.succeeded++;
+    else stats_.failed++;
+    inFlight_--;
+    check_done();
+  });
+}
+
+void ReplayEngine::check_done() {
+  if (eof_ && !tickSource_ && inFlight_ == 0) g_main_loop_quit(mainLoop_);
+}
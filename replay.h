@@ -0,0 +1,68 @@
+#pragma once
+
+#include <glib.h>
+
+#include <cstdint>
+
+#include "replay_log.h"
+#include "soupclient.h"
+#include "timer_wheel.h"
+
+// Reissues a recorded request log against a session, preserving the recorded
+// inter-arrival times (divided by speed). The log is streamed: only records
+// due within one wheel revolution are held in memory, so logs with millions
+// of requests cost no more than their busiest few seconds.
+class ReplayEngine {
+public:
+  struct Options {
+    double speed = 1.0;
+    // Replaces scheme://host[:port] of every recorded URL, e.g. to point
+    // production traffic at a staging or loopback server.
+    const char *target = nullptr;
+  };
+
+  struct Stats {
+    uint64_t sent = 0;
+    uint64_t succeeded = 0;
+    uint64_t failed = 0;
+    uint64_t invalid = 0;
+    uint64_t lagSumUs = 0;
+    gint64 maxLagUs = 0;
+  };
+
+  ReplayEngine(Session &session, ReplayLogReader &reader, const Options &options);
+  ~ReplayEngine();
+
+  ReplayEngine(const ReplayEngine &) = delete;
+  ReplayEngine &operator=(const ReplayEngine &) = delete;
+
+  // Replays the whole log, running mainLoop until the last response is in.
+  // Returns FALSE if the log turned out to be corrupt part way through.
+  gboolean run(GMainLoop *mainLoop, GError **error);
+
+  const Stats &stats() const { return stats_; }
+
+private:
+  static gboolean on_tick(gpointer data);
+
+  void refill(gint64 nowUs);
+  // Sleeps until the next record is due or has to be pulled into the wheel.
+  void arm(gint64 nowUs);
+  void send(ReplayRecord &record, gint64 dueUs, gint64 nowUs);
+  void check_done();
+
+  Session &session_;
+  ReplayLogReader &reader_;
+  Options options_;
+  Stats stats_;
+  GMainLoop *mainLoop_;
+  GError *error_;
+
+  gint64 startUs_;
+  TimerWheel<ReplayRecord> wheel_;
+  ReplayRecord next_;
+  bool haveNext_;
+  bool eof_;
+  int inFlight_;
+  guint tickSource_;
+};
@@ -0,0 +1,144 @@
+#include "replay_log.h"
+
+#include <cerrno>
+#include <cstring>
+
+using namespace std;
+
+G_DEFINE_QUARK(libsouptest-replay-log-error-quark, replay_log_error)
+
+static const char REPLAY_MAGIC[4] = {'S', 'R', 'P', 'L'};
+static const unsigned char REPLAY_VERSION = 1;
+// Guards against allocating absurd amounts on a corrupt length prefix.
+static const uint64_t MAX_FIELD_BYTES = 1ULL << 30;
+static const uint64_t MAX_HEADERS = 4096;
+
+static void
+put_varint(string &buf, uint64_t v) {
+  while (v >= 0x80) {
+    buf += (char) (v | 0x80);
+    v >>= 7;
+  }
+  buf += (char) v;
+}
+
+static void
+put_string(string &buf, const string &s) {
+  put_varint(buf, s.size());
+  buf += s;
+}
+
+static void
+set_io_error(GError **error, const char *what) {
+  int err = errno;
+  g_set_error(error, REPLAY_LOG_ERROR, REPLAY_LOG_ERROR_IO, "%s: %s", what, g_strerror(err));
+}
+
+ReplayLogWriter::~ReplayLogWriter() {
+  if (file_) fclose(file_);
+}
+
+gboolean ReplayLogWriter::open(const char *path, GError **error) {
+  file_ = fopen(path, "wb");
+  if (!file_) {
+    set_io_error(error, path);
+    return FALSE;
+  }
+  if (fwrite(REPLAY_MAGIC, 1, sizeof(REPLAY_MAGIC), file_) != sizeof(REPLAY_MAGIC) || fputc(REPLAY_VERSION, file_) == EOF) {
+    set_io_error(error, path);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+gboolean ReplayLogWriter::write(const ReplayRecord &record, GError **error) {
+  buf_.clear();
+  put_varint(buf_, record.offsetUs >= lastOffsetUs_ ? record.offsetUs - lastOffsetUs_ : 0);
+  lastOffsetUs_ = max(lastOffsetUs_, record.offsetUs);
+  put_string(buf_, record.method);
+  put_string(buf_, record.url);
+  put_varint(buf_, record.headers.size());
+  for (const auto &header : record.headers) {
+    put_string(buf_, header.first);
+    put_string(buf_, header.second);
+  }
+  put_string(buf_, record.body);
+
+  if (fwrite(buf_.data(), 1, buf_.size(), file_) != buf_.size()) {
+    set_io_error(error, "write");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+gboolean ReplayLogWriter::close(GError **error) {
+  FILE *file = file_;
+  file_ = nullptr;
+  if (file && fclose(file) != 0) {
+    set_io_error(error, "close");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+ReplayLogReader::~ReplayLogReader() {
+  if (file_) fclose(file_);
+}
+
+gboolean ReplayLogReader::open(const char *path, GError **error) {
+  file_ = fopen(path, "rb");
+  if (!file_) {
+    set_io_error(error, path);
+    return FALSE;
+  }
+
+  char magic[sizeof(REPLAY_MAGIC)];
+  int version;
+  if (fread(magic, 1, sizeof(magic), file_) != sizeof(magic) || memcmp(magic, REPLAY_MAGIC, sizeof(magic)) != 0 ||
+      (version = fgetc(file_)) != REPLAY_VERSION) {
+    g_set_error(error, REPLAY_LOG_ERROR, REPLAY_LOG_ERROR_FORMAT, "%s is not a version %d replay log", path, REPLAY_VERSION);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+bool ReplayLogReader::read_varint(uint64_t &value) {
+  value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = getc_unlocked(file_);
+    if (c == EOF) return false;
+    value |= (uint64_t) (c & 0x7f) << shift;
+    if (!(c & 0x80)) return true;
+  }
+  return false;
+}
+
+bool ReplayLogReader::read_string(string &out) {
+  uint64_t len;
+  if (!read_varint(len) || len > MAX_FIELD_BYTES) return false;
+  out.resize(len);
+  return len == 0 || fread(&out[0], 1, len, file_) == len;
+}
+
+gboolean ReplayLogReader::next(ReplayRecord &record, GError **error) {
+  uint64_t delta;
+  int c = getc_unlocked(file_);
+  if (c == EOF) return FALSE;
+  ungetc(c, file_);
+
+  uint64_t headerCount = 0;
+  bool ok = read_varint(delta) && read_string(record.method) && read_string(record.url) && read_varint(headerCount) && headerCount <= MAX_HEADERS;
+  record.headers.resize(ok ? headerCount : 0);
+  for (size_t i = 0; ok && i < record.headers.size(); i++) {
+    ok = read_string(record.headers[i].first) && read_string(record.headers[i].second);
+  }
+  ok = ok && read_string(record.body);
+
+  if (!ok) {
+    g_set_error(error, REPLAY_LOG_ERROR, REPLAY_LOG_ERROR_FORMAT, "Truncated or corrupt replay record");
+    return FALSE;
+  }
+  offsetUs_ += delta;
+  record.offsetUs = offsetUs_;
+  return TRUE;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <glib.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define REPLAY_LOG_ERROR (replay_log_error_quark())
+GQuark replay_log_error_quark(void);
+
+enum ReplayLogError {
+  REPLAY_LOG_ERROR_IO,
+  REPLAY_LOG_ERROR_FORMAT,
+};
+
+struct ReplayRecord {
+  // Microseconds since the first record of the log.
+  uint64_t offsetUs;
+  std::string method;
+  std::string url;
+  std::vector<std::pair<std::string, std::string>> headers;
+  std::string body;
+};
+
+// Compact binary request log: the magic "SRPL", a version byte, then one
+// record per request. Every integer is a LEB128 varint and offsets are stored
+// as deltas from the previous record, so a typical GET costs little more than
+// its URL.
+//
+//   record := delta_us method url header_count (name value)* body
+//   string := varint length, bytes
+class ReplayLogWriter {
+public:
+  ReplayLogWriter() = default;
+  ~ReplayLogWriter();
+  ReplayLogWriter(const ReplayLogWriter &) = delete;
+  ReplayLogWriter &operator=(const ReplayLogWriter &) = delete;
+
+  gboolean open(const char *path, GError **error);
+  gboolean write(const ReplayRecord &record, GError **error);
+  gboolean close(GError **error);
+
+private:
+  FILE *file_ = nullptr;
+  uint64_t lastOffsetUs_ = 0;
+  std::string buf_;
+};
+
+class ReplayLogReader {
+public:
+  ReplayLogReader() = default;
+  ~ReplayLogReader();
+  ReplayLogReader(const ReplayLogReader &) = delete;
+  ReplayLogReader &operator=(const ReplayLogReader &) = delete;
+
+  gboolean open(const char *path, GError **error);
+  // Returns FALSE at end of log (error unset) or on a malformed record.
+  gboolean next(ReplayRecord &record, GError **error);
+
+private:
+  bool read_varint(uint64_t &value);
+  bool read_string(std::string &out);
+
+  FILE *file_ = nullptr;
+  uint64_t offsetUs_ = 0;
+};
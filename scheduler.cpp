@@ -0,0 +1,168 @@
+#include "scheduler.h"
+
+using namespace std;
+
+static const SoupMessagePriority CLASS_PRIORITY[RequestScheduler::CLASS_COUNT] = {
+        SOUP_MESSAGE_PRIORITY_VERY_HIGH, SOUP_MESSAGE_PRIORITY_NORMAL, SOUP_MESSAGE_PRIORITY_VERY_LOW};
+
+RequestScheduler::RequestScheduler(Session &session, const Options &options)
+    : session_(session), options_(options), inFlight_(0), seq_(0), freeEntries_(nullptr) {
+  if (options_.maxInFlight < 1) options_.maxInFlight = 1;
+}
+
+RequestScheduler::~RequestScheduler() {
+  // In-flight completions point back at us; the session must be drained first.
+  g_warn_if_fail(inFlight_ == 0);
+
+  for (Queue &queue : queues_) {
+    for (; !queue.empty(); queue.pop()) finish_unsent(queue.top(), "Scheduler destroyed");
+  }
+  for (; !deferred_.empty(); deferred_.pop()) finish_unsent(deferred_.top(), "Scheduler destroyed");
+
+  while (Entry *entry = freeEntries_) {
+    freeEntries_ = entry->nextFree;
+    delete entry;
+  }
+}
+
+const char *RequestScheduler::class_name(Class cls) {
+  switch (cls) {
+    case URGENT:
+      return "urgent";
+    case NORMAL:
+      return "normal";
+    case BULK:
+      return "bulk";
+    default:
+      return "?";
+  }
+}
+
+RequestScheduler::Entry *RequestScheduler::acquire_entry() {
+  Entry *entry = freeEntries_;
+  if (entry) {
+    freeEntries_ = entry->nextFree;
+  } else {
+    entry = new Entry{MessageHandle(), Completion(), NORMAL, 0, 0, 0, nullptr};
+  }
+  return entry;
+}
+
+void RequestScheduler::release_entry(Entry *entry) {
+  entry->msg = MessageHandle();
+  entry->done.reset();
+  entry->nextFree = freeEntries_;
+  freeEntries_ = entry;
+}
+
+size_t RequestScheduler::pending() const {
+  size_t count = deferred_.size();
+  for (const Queue &queue : queues_) count += queue.size();
+  return count;
+}
+
+void RequestScheduler::queue(Request &&request, Class cls, gint64 deadlineUs, Completion done) {
+  if (!request.valid()) {
+    // Let the session report it the usual way.
+    session_.queue(std::move(request), std::move(done));
+    return;
+  }
+
+  Entry *entry = acquire_entry();
+  entry->msg = request.take();
+  entry->done = std::move(done);
+  entry->cls = cls;
+  entry->deadlineUs = deadlineUs;
+  entry->seq = seq_++;
+  soup_message_set_priority(entry->msg.get(), CLASS_PRIORITY[cls]);
+
+  stats_[cls].queued++;
+  queues_[cls].push(entry);
+  pump();
+}
+
+bool RequestScheduler::can_meet(const Entry *entry, gint64 nowUs) const {
+  return entry->deadlineUs == 0 || nowUs + stats_[entry->cls].latencyUs <= entry->deadlineUs;
+}
+
+void RequestScheduler::pump() {
+  while (inFlight_ < options_.maxInFlight) {
+    gint64 nowUs = g_get_monotonic_time();
+    Entry *next = nullptr;
+
+    for (int cls = 0; cls < CLASS_COUNT && !next; cls++) {
+      Queue &queue = queues_[cls];
+      while (!queue.empty()) {
+        Entry *entry = queue.top();
+        queue.pop();
+        if (can_meet(entry, nowUs)) {
+          next = entry;
+          break;
+        }
+        // Anything behind it in this class has a later deadline, but may
+        // still fit, so keep looking.
+        if (options_.missPolicy == DEFER) {
+          stats_[cls].deferred++;
+          deferred_.push(entry);
+        } else {
+          stats_[cls].dropped++;
+          finish_unsent(entry, "Deadline cannot be met");
+        }
+      }
+    }
+
+    if (!next && !deferred_.empty()) {
+      next = deferred_.top();
+      deferred_.pop();
+    }
+    if (!next) break;
+    dispatch(next);
+  }
+}
+
+void RequestScheduler::dispatch(Entry *entry) {
+  inFlight_++;
+  entry->sentUs = g_get_monotonic_time();
+  session_.queue(Request::wrap(std::move(entry->msg)), [this, entry](Response &response) { complete(entry, response); });
+}
+
+void RequestScheduler::finish_unsent(Entry *entry, const char *reason) {
+  soup_message_set_status_full(entry->msg.get(), SOUP_STATUS_CANCELLED, reason);
+  Completion done = std::move(entry->done);
+  MessageHandle msg = std::move(entry->msg);
+  release_entry(entry);
+
+  Response response(msg.get());
+  done(response);
+}
+
+void RequestScheduler::complete(Entry *entry, Response &response) {
+  gint64 nowUs = g_get_monotonic_time();
+  ClassStats &stats = stats_[entry->cls];
+  stats.completed++;
+  if (entry->deadlineUs && nowUs > entry->deadlineUs) stats.late++;
+
+  // Cancelled messages say nothing about how long a real fetch takes.
+  if (response.status() != SOUP_STATUS_CANCELLED) {
+    gint64 sampleUs = nowUs - entry->sentUs;
+    stats.latencyUs = stats.latencyUs ? stats.latencyUs + (sampleUs - stats.latencyUs) / 8 : sampleUs;
+  }
+
+  Completion done = std::move(entry->done);
+  release_entry(entry);
+  inFlight_--;
+
+  done(response);
+  pump();
+}
+
+void RequestScheduler::print_stats(ostream &out) const {
+  for (int cls = 0; cls < CLASS_COUNT; cls++) {
+    const ClassStats &stats = stats_[cls];
+    if (!stats.queued) continue;
+    out << "schedule: " << class_name((Class) cls) << " " << stats.queued << " queued, " << stats.completed
+        << " completed, " << stats.late + stats.dropped << " deadline misses (" << stats.late << " late, "
+        << stats.dropped << " dropped, " << stats.deferred << " deferred), latency " << stats.latencyUs / 1000
+        << " ms" << endl;
+  }
+}
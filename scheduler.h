@@ -0,0 +1,103 @@
+#pragma once
+
+#include <libsoup/soup.h>
+
+#include <cstdint>
+#include <ostream>
+#include <queue>
+#include <vector>
+
+#include "soupclient.h"
+
+// Holds requests back from the session and releases them by class, then
+// earliest deadline first, so urgent fetches overtake bulk ones instead of
+// waiting their turn in libsoup's FIFO. The class is also mapped onto the
+// message priority for the session's own connection queue.
+class RequestScheduler {
+public:
+  enum Class { URGENT, NORMAL, BULK, CLASS_COUNT };
+
+  enum MissPolicy {
+    // Complete with SOUP_STATUS_CANCELLED without sending.
+    DROP,
+    // Send anyway once nothing with a reachable deadline is waiting.
+    DEFER,
+  };
+
+  struct Options {
+    // Requests handed to the session at once; the rest wait here, in order.
+    int maxInFlight = 8;
+    MissPolicy missPolicy = DROP;
+  };
+
+  struct ClassStats {
+    uint64_t queued = 0;
+    uint64_t completed = 0;
+    // Completed, but after their deadline.
+    uint64_t late = 0;
+    // Never sent because the deadline could not be met.
+    uint64_t dropped = 0;
+    uint64_t deferred = 0;
+    // Smoothed send-to-completion time, used to predict misses.
+    gint64 latencyUs = 0;
+  };
+
+  typedef Session::Completion Completion;
+
+  RequestScheduler(Session &session, const Options &options);
+  ~RequestScheduler();
+
+  RequestScheduler(const RequestScheduler &) = delete;
+  RequestScheduler &operator=(const RequestScheduler &) = delete;
+
+  // deadlineUs is on the g_get_monotonic_time() clock; 0 means none.
+  void queue(Request &&request, Class cls, gint64 deadlineUs, Completion done);
+
+  size_t pending() const;
+  int in_flight() const { return inFlight_; }
+  const ClassStats &stats(Class cls) const { return stats_[cls]; }
+  void print_stats(std::ostream &out) const;
+
+  static const char *class_name(Class cls);
+
+private:
+  struct Entry {
+    MessageHandle msg;
+    Completion done;
+    Class cls;
+    gint64 deadlineUs;
+    gint64 sentUs;
+    uint64_t seq;
+    Entry *nextFree;
+  };
+
+  struct Later {
+    // priority_queue is a max-heap: invert so the earliest deadline wins,
+    // entries without one go last, and ties keep arrival order.
+    bool operator()(const Entry *a, const Entry *b) const {
+      gint64 da = a->deadlineUs ? a->deadlineUs : G_MAXINT64;
+      gint64 db = b->deadlineUs ? b->deadlineUs : G_MAXINT64;
+      return da != db ? da > db : a->seq > b->seq;
+    }
+  };
+
+  typedef std::priority_queue<Entry *, std::vector<Entry *>, Later> Queue;
+
+  void pump();
+  bool can_meet(const Entry *entry, gint64 nowUs) const;
+  void dispatch(Entry *entry);
+  void finish_unsent(Entry *entry, const char *reason);
+  void complete(Entry *entry, Response &response);
+  Entry *acquire_entry();
+  void release_entry(Entry *entry);
+
+  Session &session_;
+  Options options_;
+  Queue queues_[CLASS_COUNT];
+  // Entries that cannot make their deadline under DEFER.
+  Queue deferred_;
+  ClassStats stats_[CLASS_COUNT];
+  int inFlight_;
+  uint64_t seq_;
+  Entry *freeEntries_;
+};
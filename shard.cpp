@@ -0,0 +1,163 @@
+#include "shard.h"
+
+#include <libsoup/soup.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+using namespace std;
+
+int LatencyHistogram::bucket_of(uint64_t us) {
+  if (us >= (1ULL << MAX_BITS)) us = (1ULL << MAX_BITS) - 1;
+  if (us < (1u << SUB_BITS)) return (int) us;
+  int msb = 63 - __builtin_clzll(us);
+  int sub = (int) (us >> (msb - SUB_BITS)) & ((1 << SUB_BITS) - 1);
+  return ((msb - SUB_BITS + 1) << SUB_BITS) + sub;
+}
+
+uint64_t LatencyHistogram::bucket_upper(int bucket) {
+  if (bucket < (1 << SUB_BITS)) return (uint64_t) bucket;
+  int msb = (bucket >> SUB_BITS) + SUB_BITS - 1;
+  uint64_t sub = (uint64_t) (bucket & ((1 << SUB_BITS) - 1));
+  uint64_t width = 1ULL << (msb - SUB_BITS);
+  return (((1ULL << SUB_BITS) + sub) << (msb - SUB_BITS)) + width - 1;
+}
+
+double LatencyHistogram::percentile_ms(const uint64_t *counts, uint64_t samples, double p) {
+  if (!samples) return 0;
+  uint64_t rank = max<uint64_t>(1, (uint64_t) (p * (double) samples + 0.5));
+  uint64_t seen = 0;
+  for (int b = 0; b < BUCKETS; b++) {
+    seen += counts[b];
+    if (seen >= rank) return bucket_upper(b) / 1000.0;
+  }
+  return 0;
+}
+
+ShardSet *ShardSet::create(int procs, GError **error) {
+  size_t bytes = sizeof(WorkerStats) * (size_t) procs;
+  void *mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "mmap: %s", g_strerror(err));
+    return nullptr;
+  }
+  // Anonymous mappings start zeroed, so every counter starts at 0.
+  WorkerStats *stats = (WorkerStats *) mem;
+  for (int i = 0; i < procs; i++) new (&stats[i]) WorkerStats();
+  return new ShardSet(procs, stats, bytes);
+}
+
+ShardSet::ShardSet(int procs, WorkerStats *stats, size_t mappedBytes)
+    : procs_(procs), stats_(stats), mappedBytes_(mappedBytes), loop_(nullptr), running_(0), failedWorkers_(0),
+      startUs_(0) {}
+
+ShardSet::~ShardSet() {
+  munmap(stats_, mappedBytes_);
+}
+
+gboolean ShardSet::fork_workers(int *shard, GError **error) {
+  // Whatever is still buffered would otherwise be written once per process.
+  cout.flush();
+  cerr.flush();
+  fflush(nullptr);
+
+  startUs_ = g_get_monotonic_time();
+  for (int i = 0; i < procs_; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      *shard = i;
+      pids_.clear();
+      return TRUE;
+    }
+    if (pid < 0) {
+      int err = errno;
+      g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "fork: %s", g_strerror(err));
+      for (pid_t started : pids_) kill(started, SIGTERM);
+      for (pid_t started : pids_) waitpid(started, nullptr, 0);
+      pids_.clear();
+      return FALSE;
+    }
+    pids_.push_back(pid);
+  }
+  *shard = -1;
+  return TRUE;
+}
+
+int ShardSet::shard_of(const char *url) const {
+  SoupURI *uri = soup_uri_new(url);
+  if (!uri) return 0;
+  XxHash64 hash;
+  if (uri->host) hash.update(uri->host, strlen(uri->host));
+  soup_uri_free(uri);
+  return (int) (hash.digest() % (uint64_t) procs_);
+}
+
+ShardSet::Totals ShardSet::totals() const {
+  Totals totals;
+  for (int i = 0; i < procs_; i++) {
+    totals.completed += stats_[i].completed.load(memory_order_relaxed);
+    totals.failed += stats_[i].failed.load(memory_order_relaxed);
+    totals.bytes += stats_[i].bytes.load(memory_order_relaxed);
+  }
+  return totals;
+}
+
+int ShardSet::supervise() {
+  loop_ = g_main_loop_new(nullptr, FALSE);
+  running_ = (int) pids_.size();
+  failedWorkers_ = 0;
+
+  for (pid_t pid : pids_) g_child_watch_add(pid, on_child_exit, this);
+  if (running_ > 0) g_main_loop_run(loop_);
+
+  g_main_loop_unref(loop_);
+  loop_ = nullptr;
+  pids_.clear();
+  return failedWorkers_;
+}
+
+void ShardSet::on_child_exit(GPid pid, gint status, gpointer usr_data) {
+  ShardSet *shards = (ShardSet *) usr_data;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    shards->failedWorkers_++;
+    if (WIFSIGNALED(status)) cerr << "worker " << pid << " killed by signal " << WTERMSIG(status) << endl;
+    else cerr << "worker " << pid << " exited with status " << WEXITSTATUS(status) << endl;
+  }
+  g_spawn_close_pid(pid);
+  if (--shards->running_ == 0) g_main_loop_quit(shards->loop_);
+}
+
+void ShardSet::print_summary(ostream &out) const {
+  Totals totals = this->totals();
+  double secs = (double) (g_get_monotonic_time() - startUs_) / G_USEC_PER_SEC;
+
+  // Fold the per-worker histograms into one.
+  vector<uint64_t> counts(LatencyHistogram::BUCKETS, 0);
+  uint64_t samples = 0;
+  for (int i = 0; i < procs_; i++) {
+    for (int b = 0; b < LatencyHistogram::BUCKETS; b++) {
+      uint64_t n = stats_[i].latency.counts[b].load(memory_order_relaxed);
+      counts[b] += n;
+      samples += n;
+    }
+  }
+  auto percentile = [&counts, samples](double p) { return LatencyHistogram::percentile_ms(counts.data(), samples, p); };
+
+  out << "procs: " << procs_ << " workers, " << totals.completed << " requests (" << totals.failed << " failed), "
+      << totals.bytes << " bytes in " << secs << " s: " << (long) (secs > 0 ? totals.completed / secs : 0) << " req/s, "
+      << (secs > 0 ? totals.bytes / secs / (1 << 20) : 0) << " MiB/s" << endl;
+  if (samples) {
+    out << "latency: p50 " << percentile(0.50) << " ms, p90 " << percentile(0.90) << " ms, p99 " << percentile(0.99)
+        << " ms, max " << percentile(1.0) << " ms" << endl;
+  }
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <glib.h>
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <sys/types.h>
+#include <vector>
+
+// Every counter below lives in memory shared between forked processes; only
+// lock-free atomics are safe there, since a lock-based fallback would not be
+// shared.
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shard statistics need lock-free 64-bit atomics");
+
+// Log-linear latency buckets: exact below 8 us, then 8 per power of two
+// (within 12.5%) up to about 12 days.
+struct LatencyHistogram {
+  static const int SUB_BITS = 3;
+  static const int MAX_BITS = 40;
+  static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) << SUB_BITS;
+
+  std::atomic<uint64_t> counts[BUCKETS];
+
+  void record(uint64_t us) { counts[bucket_of(us)].fetch_add(1, std::memory_order_relaxed); }
+
+  static int bucket_of(uint64_t us);
+  // Largest value that lands in bucket.
+  static uint64_t bucket_upper(int bucket);
+  // Upper bound in ms of the bucket holding the p-th of samples, given
+  // BUCKETS counts copied out of one or more histograms; 0 without samples.
+  static double percentile_ms(const uint64_t *counts, uint64_t samples, double p);
+};
+
+// One worker's counters. Only that worker writes them; the parent reads.
+struct alignas(64) WorkerStats {
+  std::atomic<uint64_t> started;
+  std::atomic<uint64_t> completed;
+  std::atomic<uint64_t> failed;
+  std::atomic<uint64_t> bytes;
+  LatencyHistogram latency;
+
+  void begin() { started.fetch_add(1, std::memory_order_relaxed); }
+  void record(bool ok, gint64 latencyUs) {
+    if (!ok) failed.fetch_add(1, std::memory_order_relaxed);
+    // Releases the begin() before it to readers that acquire completed.
+    completed.fetch_add(1, std::memory_order_release);
+    latency.record(latencyUs > 0 ? (uint64_t) latencyUs : 0);
+  }
+  void add_bytes(size_t n) { bytes.fetch_add(n, std::memory_order_relaxed); }
+};
+
+// N forked workers, each fetching the URLs whose host hashes to its shard, so
+// one host's connections stay in one process. Statistics go through an
+// anonymous shared mapping made before the fork.
+class ShardSet {
+public:
+  // Maps the shared segment. Call before anything starts threads: only the
+  // forking thread survives in the workers.
+  static ShardSet *create(int procs, GError **error);
+  ~ShardSet();
+
+  ShardSet(const ShardSet &) = delete;
+  ShardSet &operator=(const ShardSet &) = delete;
+
+  // Sets *shard to the worker's index in each child and to -1 in the parent.
+  // On failure the workers already started are killed.
+  gboolean fork_workers(int *shard, GError **error);
+
+  int shard_of(const char *url) const;
+  WorkerStats &stats(int shard) { return stats_[shard]; }
+  int procs() const { return procs_; }
+
+  // Parent only: runs the default main context (and so any progress
+  // reporter on it) until every worker has exited. Returns how many exited
+  // unsuccessfully.
+  int supervise();
+  void print_summary(std::ostream &out) const;
+
+private:
+  struct Totals {
+    uint64_t completed = 0;
+    uint64_t failed = 0;
+    uint64_t bytes = 0;
+  };
+
+  ShardSet(int procs, WorkerStats *stats, size_t mappedBytes);
+
+  static void on_child_exit(GPid pid, gint status, gpointer usr_data);
+
+  Totals totals() const;
+
+  int procs_;
+  WorkerStats *stats_;
+  size_t mappedBytes_;
+  std::vector<pid_t> pids_;
+
+  // Supervision state.
+  GMainLoop *loop_;
+  int running_;
+  int failedWorkers_;
+  gint64 startUs_;
+};
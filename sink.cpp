@@ -0,0 +1,73 @@
+#include "sink.h"
+
+using namespace std;
+
+void OutputSink::when_drained(Drained done) {
+  if (queuedBytes_ == 0) {
+    done();
+    return;
+  }
+  drained_ = std::move(done);
+}
+
+void OutputSink::written(size_t bytes) {
+  queuedBytes_ -= bytes;
+  if (budget_) budget_->release(bytes);
+  if (queuedBytes_ == 0 && drained_) {
+    Drained done = std::move(drained_);
+    done();
+  }
+}
+
+StreamSink::StreamSink(GOutputStream *stream, MemoryBudget *budget)
+    : OutputSink(budget), stream_(GObjectHandle<GOutputStream>::ref(stream)), writing_(false), error_(nullptr) {}
+
+StreamSink::~StreamSink() {
+  g_warn_if_fail(!writing_);
+  for (GBytes *bytes : pending_) g_bytes_unref(bytes);
+  g_clear_error(&error_);
+}
+
+void StreamSink::write(GBytes *bytes) {
+  size_t size = g_bytes_get_size(bytes);
+  queued(size);
+  if (error_) {
+    written(size);
+    return;
+  }
+  pending_.push_back(g_bytes_ref(bytes));
+  if (!writing_) start();
+}
+
+void StreamSink::start() {
+  writing_ = true;
+  gsize size;
+  const void *data = g_bytes_get_data(pending_.front(), &size);
+  g_output_stream_write_all_async(stream_.get(), data, size, G_PRIORITY_DEFAULT, nullptr, on_written, this);
+}
+
+void StreamSink::on_written(GObject *source, GAsyncResult *result, gpointer usr_data) {
+  StreamSink *sink = (StreamSink *) usr_data;
+  GError *error = nullptr;
+  g_output_stream_write_all_finish(G_OUTPUT_STREAM(source), result, nullptr, &error);
+
+  GBytes *bytes = sink->pending_.front();
+  sink->pending_.pop_front();
+  size_t size = g_bytes_get_size(bytes);
+  g_bytes_unref(bytes);
+
+  size_t dropped = 0;
+  if (error) {
+    // Nothing more will get through; give the budget back in one go.
+    sink->error_ = error;
+    for (GBytes *rest : sink->pending_) {
+      dropped += g_bytes_get_size(rest);
+      g_bytes_unref(rest);
+    }
+    sink->pending_.clear();
+  }
+
+  sink->writing_ = !sink->pending_.empty();
+  if (sink->writing_) sink->start();
+  sink->written(size + dropped);
+}
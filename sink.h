@@ -0,0 +1,62 @@
+#pragma once
+
+#include <gio/gio.h>
+
+#include <cstddef>
+#include <deque>
+
+#include "budget.h"
+#include "soupclient.h"
+
+// Destination for body bytes that must not block the main loop. Bytes are
+// owned by the sink until written, then released from the budget (if any),
+// which is what lets a slow consumer throttle the network side.
+class OutputSink {
+public:
+  typedef SmallFunction<void()> Drained;
+
+  explicit OutputSink(MemoryBudget *budget) : budget_(budget), queuedBytes_(0) {}
+  virtual ~OutputSink() {}
+
+  OutputSink(const OutputSink &) = delete;
+  OutputSink &operator=(const OutputSink &) = delete;
+
+  // Takes its own reference on bytes.
+  virtual void write(GBytes *bytes) = 0;
+
+  size_t queued_bytes() const { return queuedBytes_; }
+  // Runs done once everything written so far has reached the destination
+  // (or failed to); immediately if nothing is queued.
+  void when_drained(Drained done);
+
+protected:
+  void queued(size_t bytes) { queuedBytes_ += bytes; }
+  void written(size_t bytes);
+
+private:
+  MemoryBudget *budget_;
+  size_t queuedBytes_;
+  Drained drained_;
+};
+
+// Writes to a GOutputStream with one async write in flight at a time.
+class StreamSink : public OutputSink {
+public:
+  StreamSink(GOutputStream *stream, MemoryBudget *budget);
+  // Must be drained first; a pending write still points at the sink.
+  ~StreamSink() override;
+
+  void write(GBytes *bytes) override;
+
+  // First write error, after which further bytes are discarded.
+  const GError *error() const { return error_; }
+
+private:
+  static void on_written(GObject *source, GAsyncResult *result, gpointer usr_data);
+  void start();
+
+  GObjectHandle<GOutputStream> stream_;
+  std::deque<GBytes *> pending_;
+  bool writing_;
+  GError *error_;
+};
@@ -0,0 +1,319 @@
+#include "soupclient.h"
+
+#include <cstring>
+
+#include "hash.h"
+#include "probes.h"
+#include "shard.h"
+
+SOUP_PROBE_DEFINE(request__queued);
+SOUP_PROBE_DEFINE(connection__acquired);
+SOUP_PROBE_DEFINE(headers__received);
+SOUP_PROBE_DEFINE(chunk__received);
+SOUP_PROBE_DEFINE(request__retried);
+SOUP_PROBE_DEFINE(request__completed);
+
+static bool
+tracing_messages() {
+  return SOUP_PROBE_ENABLED(connection__acquired) || SOUP_PROBE_ENABLED(headers__received) ||
+         SOUP_PROBE_ENABLED(chunk__received) || SOUP_PROBE_ENABLED(request__retried);
+}
+
+static bool
+tracing() {
+  return SOUP_PROBE_ENABLED(request__queued) || SOUP_PROBE_ENABLED(request__completed) || tracing_messages();
+}
+
+Session::Session()
+    : session_(SessionHandle::adopt(soup_session_new())), tracer_(nullptr), stats_(nullptr), freeSlots_(nullptr), nextId_(0),
+      maxRedirects_(-1), redirectCacheSize_(0) {}
+
+Session::Session(const Options &options)
+    : session_(SessionHandle::adopt(soup_session_new())), tracer_(nullptr), stats_(nullptr), freeSlots_(nullptr), nextId_(0),
+      maxRedirects_(options.maxRedirects), redirectCacheSize_(options.maxRedirects >= 0 ? options.redirectCache : 0),
+      cookies_(options.cookies ? new CookieJar() : nullptr) {
+  if (options.maxConns > 0) g_object_set(session_.get(), SOUP_SESSION_MAX_CONNS, options.maxConns, nullptr);
+  if (options.maxConnsPerHost > 0) g_object_set(session_.get(), SOUP_SESSION_MAX_CONNS_PER_HOST, options.maxConnsPerHost, nullptr);
+  if (options.timeoutSeconds > 0) g_object_set(session_.get(), SOUP_SESSION_TIMEOUT, options.timeoutSeconds, nullptr);
+  if (options.userAgent) g_object_set(session_.get(), SOUP_SESSION_USER_AGENT, options.userAgent, nullptr);
+  if (!options.genericAuth) soup_session_remove_feature_by_type(session_.get(), SOUP_TYPE_AUTH_MANAGER);
+}
+
+Session::~Session() {
+  // Routed requests complete into slots too.
+  unixRoutes_.clear();
+  soup_session_abort(session_.get());
+  free_slots();
+}
+
+Session::Slot *Session::acquire_slot() {
+  Slot *slot = freeSlots_;
+  if (slot) {
+    freeSlots_ = slot->nextFree;
+  } else {
+    slot = new Slot{this, Completion(), nullptr, 0, 0, 0, 0, false, false, 0, false, 0};
+  }
+  return slot;
+}
+
+void Session::release_slot(Slot *slot) {
+  slot->done.reset();
+  slot->nextFree = freeSlots_;
+  freeSlots_ = slot;
+}
+
+void Session::free_slots() {
+  while (Slot *slot = freeSlots_) {
+    freeSlots_ = slot->nextFree;
+    delete slot;
+  }
+}
+
+void Session::queue(Request &&request, Completion done) {
+  MessageHandle msg = request.take();
+  if (!msg) {
+    // Complete on a throwaway message so callers see one code path.
+    MessageHandle invalid = MessageHandle::adopt(soup_message_new("GET", "http://invalid./"));
+    soup_message_set_status(invalid.get(), SOUP_STATUS_MALFORMED);
+    Response response(invalid.get());
+    done(response);
+    return;
+  }
+
+  Slot *slot = acquire_slot();
+  slot->done = std::move(done);
+  slot->id = nextId_++;
+  slot->traced = false;
+  slot->counted = stats_ != nullptr;
+  slot->featured = false;
+  slot->redirects = 0;
+  UnixTransport *transport = unixRoutes_.empty() ? nullptr : route_for(msg.get());
+  if (maxRedirects_ >= 0 || cookies_ || !credentials_.empty()) prepare(slot, msg.get(), !transport);
+  if (tracing()) trace_queued(slot, msg.get());
+  if (tracer_) slot->trace.start(*tracer_, msg.get());
+  if (slot->counted) {
+    stats_->begin();
+    slot->queuedUs = g_get_monotonic_time();
+    g_signal_connect(msg.get(), "got-chunk", G_CALLBACK(on_got_chunk_stats), stats_);
+  }
+  if (transport) {
+    transport->send(msg.release(), on_routed_complete, slot);
+    return;
+  }
+  // The session takes over our reference and drops it after on_complete.
+  soup_session_queue_message(session_.get(), msg.release(), on_complete, slot);
+}
+
+void Session::on_complete(SoupSession *session, SoupMessage *msg, gpointer usr_data) {
+  Slot *slot = (Slot *) usr_data;
+  if (slot->traced || slot->featured) g_signal_handlers_disconnect_by_data(msg, slot);
+  if (slot->traced) {
+    SOUP_PROBE(request__completed, slot->id, slot->urlHash, msg->status_code, (uint64_t) msg->response_body->length,
+               g_get_monotonic_time() - slot->startUs);
+  }
+  slot->trace.finish(msg);
+  if (slot->counted) {
+    g_signal_handlers_disconnect_by_func(msg, (gpointer) on_got_chunk_stats, slot->owner->stats_);
+    slot->owner->stats_->record(SOUP_STATUS_IS_SUCCESSFUL(msg->status_code), g_get_monotonic_time() - slot->queuedUs);
+  }
+
+  Completion done = std::move(slot->done);
+  slot->owner->release_slot(slot);
+
+  Response response(msg);
+  done(response);
+}
+
+void Session::on_routed_complete(SoupMessage *msg, gpointer usr_data) {
+  on_complete(nullptr, msg, usr_data);
+}
+
+void Session::add_unix_route(const char *prefix, const char *socketPath, int maxConns) {
+  guint timeout;
+  g_object_get(session_.get(), SOUP_SESSION_TIMEOUT, &timeout, nullptr);
+  unixRoutes_.emplace_back(prefix, std::unique_ptr<UnixTransport>(new UnixTransport(socketPath, maxConns, timeout)));
+}
+
+void Session::set_timeout(guint seconds) {
+  g_object_set(session_.get(), SOUP_SESSION_TIMEOUT, seconds, nullptr);
+  for (const auto &route : unixRoutes_) route.second->set_timeout(seconds);
+}
+
+UnixTransport *Session::route_for(SoupMessage *msg) const {
+  char *url = soup_uri_to_string(soup_message_get_uri(msg), FALSE);
+  UnixTransport *transport = nullptr;
+  for (const auto &route : unixRoutes_) {
+    if (strncmp(url, route.first.c_str(), route.first.size()) == 0) {
+      transport = route.second.get();
+      break;
+    }
+  }
+  g_free(url);
+  return transport;
+}
+
+void Session::trace_queued(Slot *slot, SoupMessage *msg) {
+  char *url = soup_uri_to_string(soup_message_get_uri(msg), FALSE);
+  XxHash64 hash;
+  hash.update(url, strlen(url));
+  g_free(url);
+
+  slot->traced = true;
+  slot->urlHash = hash.digest();
+  slot->startUs = g_get_monotonic_time();
+  slot->received = 0;
+  SOUP_PROBE(request__queued, slot->id, slot->urlHash, (uint64_t) msg->request_body->length);
+
+  if (tracing_messages()) {
+    g_signal_connect(msg, "starting", G_CALLBACK(on_starting), slot);
+    g_signal_connect(msg, "got-headers", G_CALLBACK(on_got_headers), slot);
+    g_signal_connect(msg, "got-chunk", G_CALLBACK(on_got_chunk), slot);
+    g_signal_connect(msg, "restarted", G_CALLBACK(on_restarted), slot);
+  }
+}
+
+void Session::on_starting(SoupMessage *msg, gpointer usr_data) {
+  Slot *slot = (Slot *) usr_data;
+  SOUP_PROBE(connection__acquired, slot->id, slot->urlHash);
+}
+
+void Session::on_got_headers(SoupMessage *msg, gpointer usr_data) {
+  Slot *slot = (Slot *) usr_data;
+  gint64 length = -1;
+  if (soup_message_headers_get_encoding(msg->response_headers) == SOUP_ENCODING_CONTENT_LENGTH) {
+    length = soup_message_headers_get_content_length(msg->response_headers);
+  }
+  SOUP_PROBE(headers__received, slot->id, msg->status_code, length);
+}
+
+void Session::on_got_chunk(SoupMessage *msg, SoupBuffer *chunk, gpointer usr_data) {
+  Slot *slot = (Slot *) usr_data;
+  slot->received += chunk->length;
+  SOUP_PROBE(chunk__received, slot->id, (uint64_t) chunk->length, slot->received);
+}
+
+void Session::on_restarted(SoupMessage *msg, gpointer usr_data) {
+  Slot *slot = (Slot *) usr_data;
+  slot->received = 0;
+  SOUP_PROBE(request__retried, slot->id, msg->status_code);
+}
+
+void Session::on_got_chunk_stats(SoupMessage *msg, SoupBuffer *chunk, gpointer usr_data) {
+  ((WorkerStats *) usr_data)->add_bytes(chunk->length);
+}
+
+void Session::prepare(Slot *slot, SoupMessage *msg, bool redirects) {
+  slot->featured = true;
+  if (maxRedirects_ >= 0 && redirects) {
+    // Redirects are followed from on_got_body_redirect instead, so they can
+    // be counted and cached.
+    soup_message_set_flags(msg, soup_message_get_flags(msg) | SOUP_MESSAGE_NO_REDIRECT);
+    if (!redirectCache_.empty()) follow_cached_redirects(slot, msg);
+    g_signal_connect(msg, "got-body", G_CALLBACK(on_got_body_redirect), slot);
+  }
+  if (cookies_ || !credentials_.empty()) {
+    apply_headers(msg, false);
+    g_signal_connect(msg, "restarted", G_CALLBACK(on_restarted_headers), slot);
+  }
+  if (cookies_) g_signal_connect(msg, "got-headers", G_CALLBACK(on_got_headers_cookies), slot);
+}
+
+void Session::follow_cached_redirects(Slot *slot, SoupMessage *msg) {
+  if (msg->method != SOUP_METHOD_GET && msg->method != SOUP_METHOD_HEAD) return;
+  char *url = soup_uri_to_string(soup_message_get_uri(msg), FALSE);
+  auto it = redirectCache_.find(url);
+  g_free(url);
+
+  // Chains count against the limit, which also ends any cycle.
+  const std::string *target = nullptr;
+  while (it != redirectCache_.end() && slot->redirects < maxRedirects_) {
+    target = &it->second;
+    slot->redirects++;
+    it = redirectCache_.find(*target);
+  }
+  if (!target) return;
+  SoupURI *uri = soup_uri_new(target->c_str());
+  if (uri) {
+    soup_message_set_uri(msg, uri);
+    soup_uri_free(uri);
+  }
+}
+
+void Session::remember_redirect(const char *from, const char *to) {
+  auto found = redirectCache_.find(from);
+  if (found != redirectCache_.end()) {
+    found->second = to;
+    return;
+  }
+  if (redirectCache_.size() >= redirectCacheSize_) {
+    redirectCache_.erase(redirectOrder_.front());
+    redirectOrder_.pop_front();
+  }
+  redirectCache_.emplace(from, to);
+  redirectOrder_.emplace_back(from);
+}
+
+bool Session::add_credentials(const char *origin, const char *authorization) {
+  // A bare host means https, so credentials only go out in the clear when
+  // asked for by scheme.
+  std::string url = strstr(origin, "://") ? origin : std::string("https://") + origin;
+  SoupURI *uri = soup_uri_new(url.c_str());
+  bool ok = uri && uri->host && *uri->host && (uri->scheme == SOUP_URI_SCHEME_HTTP || uri->scheme == SOUP_URI_SCHEME_HTTPS);
+  if (ok) credentials_[origin_of(uri)] = authorization;
+  if (uri) soup_uri_free(uri);
+  return ok;
+}
+
+std::string Session::origin_of(SoupURI *uri) {
+  return std::string(uri->scheme) + "://" + uri->host + ":" + std::to_string(uri->port);
+}
+
+void Session::apply_headers(SoupMessage *msg, bool restarted) {
+  SoupURI *uri = soup_message_get_uri(msg);
+  if (!credentials_.empty()) {
+    auto it = uri->host ? credentials_.find(origin_of(uri)) : credentials_.end();
+    if (it != credentials_.end()) {
+      soup_message_headers_replace(msg->request_headers, "Authorization", it->second.c_str());
+    } else if (restarted) {
+      // Redirected off the origin the credentials were meant for.
+      soup_message_headers_remove(msg->request_headers, "Authorization");
+    }
+  }
+  if (cookies_) {
+    cookieHeader_.clear();
+    cookies_->header_for(uri, cookieHeader_);
+    if (!cookieHeader_.empty()) soup_message_headers_replace(msg->request_headers, "Cookie", cookieHeader_.c_str());
+    else if (restarted) soup_message_headers_remove(msg->request_headers, "Cookie");
+  }
+}
+
+void Session::on_got_body_redirect(SoupMessage *msg, gpointer usr_data) {
+  Slot *slot = (Slot *) usr_data;
+  Session *self = slot->owner;
+  if (!SOUP_STATUS_IS_REDIRECTION(msg->status_code) || slot->redirects >= self->maxRedirects_) return;
+  if (!soup_session_would_redirect(self->session_.get(), msg)) return;
+
+  bool permanent = msg->status_code == SOUP_STATUS_MOVED_PERMANENTLY || msg->status_code == SOUP_STATUS_PERMANENT_REDIRECT;
+  char *from = nullptr;
+  if (permanent && self->redirectCacheSize_ > 0 && (msg->method == SOUP_METHOD_GET || msg->method == SOUP_METHOD_HEAD)) {
+    from = soup_uri_to_string(soup_message_get_uri(msg), FALSE);
+  }
+  slot->redirects++;
+  soup_session_redirect_message(self->session_.get(), msg);
+  if (from) {
+    char *to = soup_uri_to_string(soup_message_get_uri(msg), FALSE);
+    self->remember_redirect(from, to);
+    g_free(to);
+    g_free(from);
+  }
+}
+
+void Session::on_restarted_headers(SoupMessage *msg, gpointer usr_data) {
+  Slot *slot = (Slot *) usr_data;
+  slot->owner->apply_headers(msg, true);
+}
+
+void Session::on_got_headers_cookies(SoupMessage *msg, gpointer usr_data) {
+  Slot *slot = (Slot *) usr_data;
+  slot->owner->cookies_->store(msg);
+}
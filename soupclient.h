@@ -0,0 +1,329 @@
+#pragma once
+
+#include <libsoup/soup.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "cookie_jar.h"
+#include "tracing.h"
+#include "unix_transport.h"
+
+struct WorkerStats;
+
+// Move-only owner of one GObject reference.
+template<typename T>
+class GObjectHandle {
+public:
+  GObjectHandle() noexcept : ptr_(nullptr) {}
+  GObjectHandle(GObjectHandle &&other) noexcept : ptr_(std::exchange(other.ptr_, nullptr)) {}
+  GObjectHandle &operator=(GObjectHandle &&other) noexcept {
+    std::swap(ptr_, other.ptr_);
+    return *this;
+  }
+  GObjectHandle(const GObjectHandle &) = delete;
+  GObjectHandle &operator=(const GObjectHandle &) = delete;
+  ~GObjectHandle() {
+    if (ptr_) g_object_unref(ptr_);
+  }
+
+  // Takes over a reference the caller already owns (e.g. from *_new()).
+  static GObjectHandle adopt(T *ptr) noexcept { return GObjectHandle(ptr); }
+  // Adds a reference of its own.
+  static GObjectHandle ref(T *ptr) noexcept { return GObjectHandle(ptr ? (T *) g_object_ref(ptr) : nullptr); }
+
+  T *get() const noexcept { return ptr_; }
+  T *operator->() const noexcept { return ptr_; }
+  explicit operator bool() const noexcept { return ptr_ != nullptr; }
+
+  // Hands the reference back to the caller.
+  T *release() noexcept { return std::exchange(ptr_, nullptr); }
+
+private:
+  explicit GObjectHandle(T *ptr) noexcept : ptr_(ptr) {}
+
+  T *ptr_;
+};
+
+typedef GObjectHandle<SoupSession> SessionHandle;
+typedef GObjectHandle<SoupMessage> MessageHandle;
+
+template<typename Signature, size_t Capacity = 48>
+class SmallFunction;
+
+// Type-erased callable stored inline. Callables that do not fit are rejected
+// at compile time rather than spilling to the heap.
+template<typename R, typename... Args, size_t Capacity>
+class SmallFunction<R(Args...), Capacity> {
+public:
+  SmallFunction() noexcept : ops_(nullptr) {}
+
+  template<typename F, typename = std::enable_if_t<!std::is_same<std::decay_t<F>, SmallFunction>::value>>
+  SmallFunction(F &&f) noexcept(std::is_nothrow_constructible<std::decay_t<F>, F>::value) {
+    typedef std::decay_t<F> Fn;
+    static_assert(sizeof(Fn) <= Capacity, "callable too large for SmallFunction; capture less or raise Capacity");
+    static_assert(alignof(Fn) <= alignof(std::max_align_t), "over-aligned callable");
+    static_assert(std::is_nothrow_move_constructible<Fn>::value, "callable must be nothrow movable");
+    new (storage_) Fn(std::forward<F>(f));
+    ops_ = &OpsFor<Fn>::ops;
+  }
+
+  SmallFunction(SmallFunction &&other) noexcept : ops_(other.ops_) {
+    if (ops_) {
+      ops_->move(storage_, other.storage_);
+      other.reset();
+    }
+  }
+
+  SmallFunction &operator=(SmallFunction &&other) noexcept {
+    if (this != &other) {
+      reset();
+      if (other.ops_) {
+        ops_ = other.ops_;
+        ops_->move(storage_, other.storage_);
+        other.reset();
+      }
+    }
+    return *this;
+  }
+
+  SmallFunction(const SmallFunction &) = delete;
+  SmallFunction &operator=(const SmallFunction &) = delete;
+
+  ~SmallFunction() { reset(); }
+
+  explicit operator bool() const noexcept { return ops_ != nullptr; }
+
+  R operator()(Args... args) { return ops_->invoke(storage_, std::forward<Args>(args)...); }
+
+  void reset() noexcept {
+    if (ops_) {
+      ops_->destroy(storage_);
+      ops_ = nullptr;
+    }
+  }
+
+private:
+  struct Ops {
+    R (*invoke)(void *, Args &&...);
+    void (*move)(void *, void *);
+    void (*destroy)(void *);
+  };
+
+  template<typename Fn>
+  struct OpsFor {
+    static R invoke(void *f, Args &&...args) { return (*(Fn *) f)(std::forward<Args>(args)...); }
+    static void move(void *to, void *from) { new (to) Fn(std::move(*(Fn *) from)); }
+    static void destroy(void *f) { ((Fn *) f)->~Fn(); }
+    static constexpr Ops ops = {invoke, move, destroy};
+  };
+
+  alignas(std::max_align_t) unsigned char storage_[Capacity];
+  const Ops *ops_;
+};
+
+// View of a finished message, valid for the duration of a completion.
+class Response {
+public:
+  explicit Response(SoupMessage *msg) noexcept : msg_(msg) {}
+
+  SoupMessage *message() const noexcept { return msg_; }
+  guint status() const noexcept { return msg_->status_code; }
+  bool ok() const noexcept { return SOUP_STATUS_IS_SUCCESSFUL(msg_->status_code); }
+  const char *reason() const noexcept { return msg_->reason_phrase; }
+  const char *header(const char *name) const { return soup_message_headers_get_one(msg_->response_headers, name); }
+  const char *body() const noexcept { return msg_->response_body->data; }
+  size_t body_size() const noexcept { return (size_t) msg_->response_body->length; }
+  SoupURI *uri() const { return soup_message_get_uri(msg_); }
+
+private:
+  SoupMessage *msg_;
+};
+
+// Builder for a SoupMessage. An unparsable URL yields an invalid request.
+class Request {
+public:
+  static Request get(const char *url) { return Request("GET", url); }
+  static Request method(const char *method, const char *url) { return Request(method, url); }
+  static Request wrap(MessageHandle msg) noexcept { return Request(std::move(msg)); }
+
+  bool valid() const noexcept { return (bool) msg_; }
+  SoupMessage *message() const noexcept { return msg_.get(); }
+
+  Request &header(const char *name, const char *value) {
+    soup_message_headers_append(msg_->request_headers, name, value);
+    return *this;
+  }
+  // Body is copied into the message.
+  Request &body(const char *contentType, const char *data, size_t len) {
+    soup_message_set_request(msg_.get(), contentType, SOUP_MEMORY_COPY, data, len);
+    return *this;
+  }
+  Request &priority(SoupMessagePriority priority) {
+    soup_message_set_priority(msg_.get(), priority);
+    return *this;
+  }
+  Request &flags(guint flags) {
+    soup_message_set_flags(msg_.get(), soup_message_get_flags(msg_.get()) | flags);
+    return *this;
+  }
+  // Stream the response through got-chunk instead of buffering it.
+  Request &stream_body() {
+    soup_message_body_set_accumulate(msg_->response_body, FALSE);
+    return *this;
+  }
+
+  MessageHandle take() noexcept { return std::move(msg_); }
+
+private:
+  Request(const char *method, const char *url) : msg_(MessageHandle::adopt(soup_message_new(method, url))) {}
+  explicit Request(MessageHandle msg) noexcept : msg_(std::move(msg)) {}
+
+  MessageHandle msg_;
+};
+
+// Owns a SoupSession. Completion callbacks are stored inline in recycled
+// slots, so queueing a request does not allocate once the session is warm.
+class Session {
+public:
+  struct Options {
+    int maxConns = 0;
+    int maxConnsPerHost = 0;
+    guint timeoutSeconds = 0;
+    const char *userAgent = nullptr;
+    // -1 leaves redirects to libsoup (up to 20). Otherwise the session
+    // follows at most this many itself; past that the 3xx completes.
+    int maxRedirects = -1;
+    // Permanent (301/308) redirects of GET/HEAD remembered, oldest evicted
+    // first. Later requests for a remembered URL go straight to its target.
+    // Needs maxRedirects >= 0.
+    size_t redirectCache = 0;
+    // Keep cookies in a CookieJar of this session's own.
+    bool cookies = false;
+    // Keep libsoup's SoupAuthManager, which answers 401s by emitting
+    // "authenticate" and retrying. Without it only add_credentials() applies.
+    bool genericAuth = true;
+  };
+
+  typedef SmallFunction<void(Response &)> Completion;
+
+  Session();
+  explicit Session(const Options &options);
+  // Pending completions point back at the session, so it stays put.
+  Session(const Session &) = delete;
+  Session &operator=(const Session &) = delete;
+  // Aborts anything still in flight; their completions run with
+  // SOUP_STATUS_CANCELLED.
+  ~Session();
+
+  SoupSession *get() const noexcept { return session_.get(); }
+
+  // Sends "Authorization: <authorization>" with every request to origin,
+  // up front rather than after a 401. origin is HOST[:PORT] for https only,
+  // or SCHEME://HOST[:PORT] to allow plain http too; the port defaults to
+  // the scheme's. The header is dropped when a redirect leaves the origin.
+  // Returns false when origin does not parse.
+  bool add_credentials(const char *origin, const char *authorization);
+
+  // Sends requests whose URL starts with prefix over the Unix socket at
+  // socketPath, keeping up to maxConns connections to it (see
+  // UnixTransport) under the session's timeout. The first matching route
+  // wins. Cached redirects are not applied to routed requests and their
+  // redirects are not followed.
+  void add_unix_route(const char *prefix, const char *socketPath, int maxConns = 16);
+
+  // SOUP_SESSION_TIMEOUT, for routed requests as well; 0 waits for ever.
+  void set_timeout(guint seconds);
+
+  // Emits spans for every request queued from here on and sends them with
+  // traceparent headers. exporter must outlive those requests.
+  void set_tracer(SpanExporter *exporter) { tracer_ = exporter; }
+
+  // Counts every request queued from here on in stats: its start, its
+  // completion (failed unless 2xx) with latency, and body bytes as they
+  // arrive. stats must outlive those requests.
+  void set_stats(WorkerStats *stats) { stats_ = stats; }
+
+  // Invalid requests complete immediately with SOUP_STATUS_MALFORMED.
+  void queue(Request &&request, Completion done);
+
+  void cancel(SoupMessage *msg, guint status = SOUP_STATUS_CANCELLED) {
+    if (UnixTransport *transport = routed(msg)) transport->cancel(msg, status);
+    else soup_session_cancel_message(session_.get(), msg, status);
+  }
+  void pause(SoupMessage *msg) {
+    if (UnixTransport *transport = routed(msg)) transport->pause(msg);
+    else soup_session_pause_message(session_.get(), msg);
+  }
+  void unpause(SoupMessage *msg) {
+    if (UnixTransport *transport = routed(msg)) transport->unpause(msg);
+    else soup_session_unpause_message(session_.get(), msg);
+  }
+
+private:
+  struct Slot {
+    Session *owner;
+    Completion done;
+    Slot *nextFree;
+    // Only filled in while a tracer is attached (see probes.h).
+    uint64_t id;
+    uint64_t urlHash;
+    gint64 startUs;
+    uint64_t received;
+    bool traced;
+    // Started in the owner's stats; counted from queuedUs.
+    bool counted;
+    gint64 queuedUs;
+    // Redirect, cookie or credential handlers are connected.
+    bool featured;
+    int redirects;
+    RequestTrace trace;
+  };
+
+  static void on_complete(SoupSession *session, SoupMessage *msg, gpointer usr_data);
+  static void on_routed_complete(SoupMessage *msg, gpointer usr_data);
+  UnixTransport *route_for(SoupMessage *msg) const;
+  UnixTransport *routed(SoupMessage *msg) const { return unixRoutes_.empty() ? nullptr : UnixTransport::of(msg); }
+  static void trace_queued(Slot *slot, SoupMessage *msg);
+  static void on_starting(SoupMessage *msg, gpointer usr_data);
+  static void on_got_headers(SoupMessage *msg, gpointer usr_data);
+  static void on_got_chunk(SoupMessage *msg, SoupBuffer *chunk, gpointer usr_data);
+  static void on_restarted(SoupMessage *msg, gpointer usr_data);
+  static void on_got_chunk_stats(SoupMessage *msg, SoupBuffer *chunk, gpointer usr_data);
+  void prepare(Slot *slot, SoupMessage *msg, bool redirects);
+  void follow_cached_redirects(Slot *slot, SoupMessage *msg);
+  void remember_redirect(const char *from, const char *to);
+  void apply_headers(SoupMessage *msg, bool restarted);
+  // scheme://host:port, the key of credentials_.
+  static std::string origin_of(SoupURI *uri);
+  static void on_got_body_redirect(SoupMessage *msg, gpointer usr_data);
+  static void on_restarted_headers(SoupMessage *msg, gpointer usr_data);
+  static void on_got_headers_cookies(SoupMessage *msg, gpointer usr_data);
+  Slot *acquire_slot();
+  void release_slot(Slot *slot);
+  void free_slots();
+
+  SessionHandle session_;
+  SpanExporter *tracer_;
+  WorkerStats *stats_;
+  Slot *freeSlots_;
+  uint64_t nextId_;
+
+  int maxRedirects_;
+  size_t redirectCacheSize_;
+  std::unordered_map<std::string, std::string> redirectCache_;
+  std::deque<std::string> redirectOrder_;
+  std::unique_ptr<CookieJar> cookies_;
+  std::unordered_map<std::string, std::string> credentials_;
+  // Reused for each Cookie header.
+  std::string cookieHeader_;
+  std::vector<std::pair<std::string, std::unique_ptr<UnixTransport>>> unixRoutes_;
+};
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <glib.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <utility>
+#include <vector>
+
+// Hashed timing wheel. Scheduling and firing are O(1) per timer; the cost of
+// advancing is proportional to the ticks elapsed, not the number of pending
+// timers. Timers further out than one revolution stay in their slot and are
+// skipped until their round comes up, so callers that schedule within
+// span_us() never pay for that. Nodes are recycled through a free list.
+template<typename T>
+class TimerWheel {
+public:
+  explicit TimerWheel(gint64 originUs, gint64 tickUs = 1000, size_t slots = 4096)
+      : originUs_(originUs), tickUs_(tickUs), mask_(slots - 1), heads_(slots, nullptr), tails_(slots, nullptr),
+        currentTick_(0), size_(0), free_(nullptr) {
+    g_assert((slots & (slots - 1)) == 0);
+  }
+
+  TimerWheel(const TimerWheel &) = delete;
+  TimerWheel &operator=(const TimerWheel &) = delete;
+
+  // Moves time zero of an empty wheel.
+  void reset(gint64 originUs) {
+    g_assert(size_ == 0);
+    originUs_ = originUs;
+    currentTick_ = 0;
+  }
+
+  gint64 span_us() const { return tickUs_ * (gint64) heads_.size(); }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  // Start of the tick the earliest timer fires in, or G_MAXINT64 when
+  // empty, so callers can sleep until then instead of advancing every tick.
+  // Looks at one revolution of slots, and only past that at every timer.
+  gint64 next_due_us() const {
+    if (size_ == 0) return G_MAXINT64;
+    // Everything left is due at or after currentTick_, so the first slot
+    // holding a timer for this revolution has the earliest one.
+    for (uint64_t tick = currentTick_; tick < currentTick_ + heads_.size(); tick++) {
+      for (Node *node = heads_[tick & mask_]; node; node = node->next) {
+        if (node->tick == tick) return originUs_ + (gint64) tick * tickUs_;
+      }
+    }
+    uint64_t earliest = UINT64_MAX;
+    for (Node *head : heads_) {
+      for (Node *node = head; node; node = node->next) earliest = std::min(earliest, node->tick);
+    }
+    return originUs_ + (gint64) earliest * tickUs_;
+  }
+
+  // Timers due in the past fire on the next advance(). A timer never fires
+  // before it is due, and at most one tick after.
+  void schedule(gint64 dueUs, T &&value) {
+    uint64_t tick = dueUs <= originUs_ ? 0 : (uint64_t) ((dueUs - originUs_ + tickUs_ - 1) / tickUs_);
+    if (tick < currentTick_) tick = currentTick_;
+
+    Node *node = free_;
+    if (node) {
+      free_ = node->next;
+    } else {
+      storage_.emplace_back();
+      node = &storage_.back();
+    }
+    node->tick = tick;
+    node->dueUs = dueUs;
+    node->next = nullptr;
+    node->value = std::move(value);
+
+    size_t slot = tick & mask_;
+    if (tails_[slot]) tails_[slot]->next = node;
+    else heads_[slot] = node;
+    tails_[slot] = node;
+    size_++;
+  }
+
+  // Fires every timer due at or before nowUs, in tick order, as
+  // fire(T &value, gint64 dueUs).
+  template<typename F>
+  void advance(gint64 nowUs, F &&fire) {
+    if (nowUs < originUs_) return;
+    uint64_t nowTick = (uint64_t) ((nowUs - originUs_) / tickUs_);
+
+    for (; currentTick_ <= nowTick && size_ > 0; currentTick_++) {
+      size_t slot = currentTick_ & mask_;
+      Node *prev = nullptr;
+      Node *node = heads_[slot];
+      while (node) {
+        Node *next = node->next;
+        if (node->tick <= currentTick_) {
+          if (prev) prev->next = next;
+          else heads_[slot] = next;
+          if (tails_[slot] == node) tails_[slot] = prev;
+          size_--;
+
+          fire(node->value, node->dueUs);
+          node->value = T();
+          node->next = free_;
+          free_ = node;
+        } else {
+          prev = node;
+        }
+        node = next;
+      }
+    }
+    if (currentTick_ <= nowTick) currentTick_ = nowTick + 1;
+  }
+
+private:
+  struct Node {
+    uint64_t tick;
+    gint64 dueUs;
+    Node *next;
+    T value;
+  };
+
+  gint64 originUs_;
+  gint64 tickUs_;
+  size_t mask_;
+  std::vector<Node *> heads_;
+  std::vector<Node *> tails_;
+  uint64_t currentTick_;
+  size_t size_;
+  Node *free_;
+  std::deque<Node> storage_;
+};
@@ -0,0 +1,250 @@
+#include "tracing.h"
+
+#include <chrono>
+#include <cstring>
+#include <unistd.h>
+
+#include "affinity.h"
+
+using namespace std;
+
+static const char *SPAN_NAMES[SpanRecord::KIND_COUNT] = {"fetch", "dns", "connect", "tls", "wait", "transfer"};
+
+static void
+append_hex(string &out, const uint8_t *bytes, size_t len) {
+  static const char digits[] = "0123456789abcdef";
+  for (size_t i = 0; i < len; i++) {
+    out += digits[bytes[i] >> 4];
+    out += digits[bytes[i] & 15];
+  }
+}
+
+static void
+append_json_string(string &out, const char *s) {
+  out += '"';
+  for (; *s; s++) {
+    unsigned char c = (unsigned char) *s;
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += (char) c;
+    } else if (c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out += escaped;
+    } else {
+      out += (char) c;
+    }
+  }
+  out += '"';
+}
+
+SpanExporter::SpanExporter(FILE *out, size_t capacity, guint flushIntervalMs)
+    : out_(out), ring_(new SpanRecord[capacity]), capacity_(capacity), flushIntervalMs_(flushIntervalMs), head_(0),
+      tail_(0), exported_(0), dropped_(0), rng_((uint64_t) g_get_real_time() ^ ((uint64_t) getpid() << 32)),
+      stop_(false) {
+  if (!rng_) rng_ = 1;
+  thread_ = thread(&SpanExporter::run, this);
+}
+
+SpanExporter::~SpanExporter() {
+  {
+    lock_guard<mutex> lock(stopMutex_);
+    stop_ = true;
+  }
+  stopCond_.notify_one();
+  thread_.join();
+  delete[] ring_;
+}
+
+bool SpanExporter::submit(const SpanRecord &span) {
+  size_t head = head_.load(memory_order_relaxed);
+  if (head - tail_.load(memory_order_acquire) == capacity_) {
+    dropped_.fetch_add(1, memory_order_relaxed);
+    return false;
+  }
+  ring_[head % capacity_] = span;
+  head_.store(head + 1, memory_order_release);
+  return true;
+}
+
+// xorshift64*: ids only need to be unique, not unpredictable.
+void SpanExporter::new_span_id(uint8_t id[8]) {
+  uint64_t v;
+  do {
+    rng_ ^= rng_ >> 12;
+    rng_ ^= rng_ << 25;
+    rng_ ^= rng_ >> 27;
+    v = rng_ * 0x2545F4914F6CDD1DULL;
+  } while (!v);
+  memcpy(id, &v, 8);
+}
+
+void SpanExporter::new_trace_id(uint8_t id[16]) {
+  new_span_id(id);
+  new_span_id(id + 8);
+}
+
+void SpanExporter::run() {
+  pin_helper_thread();
+  unique_lock<mutex> lock(stopMutex_);
+  while (!stop_) {
+    stopCond_.wait_for(lock, chrono::milliseconds(flushIntervalMs_));
+    lock.unlock();
+    drain();
+    lock.lock();
+  }
+  lock.unlock();
+  drain();
+}
+
+size_t SpanExporter::drain() {
+  size_t tail = tail_.load(memory_order_relaxed);
+  size_t head = head_.load(memory_order_acquire);
+  if (tail == head) return 0;
+
+  batch_ = "{\"resourceSpans\":[{\"resource\":{\"attributes\":[{\"key\":\"service.name\",\"value\":{\"stringValue\":\"libsouptest\"}}]},"
+           "\"scopeSpans\":[{\"scope\":{\"name\":\"libsouptest\"},\"spans\":[";
+  for (size_t i = tail; i != head; i++) {
+    if (i != tail) batch_ += ',';
+    append_span(ring_[i % capacity_]);
+  }
+  batch_ += "]}]}]}\n";
+  // Free the slots before the (possibly slow) write.
+  tail_.store(head, memory_order_release);
+
+  fwrite(batch_.data(), 1, batch_.size(), out_);
+  fflush(out_);
+  exported_.fetch_add(head - tail, memory_order_relaxed);
+  return head - tail;
+}
+
+void SpanExporter::append_span(const SpanRecord &span) {
+  static const uint8_t noParent[8] = {};
+  bool root = span.kind == SpanRecord::FETCH;
+
+  batch_ += "{\"traceId\":\"";
+  append_hex(batch_, span.traceId, sizeof(span.traceId));
+  batch_ += "\",\"spanId\":\"";
+  append_hex(batch_, span.spanId, sizeof(span.spanId));
+  batch_ += "\",\"parentSpanId\":\"";
+  if (memcmp(span.parentId, noParent, sizeof(noParent)) != 0) append_hex(batch_, span.parentId, sizeof(span.parentId));
+  batch_ += "\",\"name\":";
+  append_json_string(batch_, root ? span.method : SPAN_NAMES[span.kind]);
+  // SPAN_KIND_CLIENT for the fetch, SPAN_KIND_INTERNAL for its phases.
+  batch_ += root ? ",\"kind\":3" : ",\"kind\":1";
+  batch_ += ",\"startTimeUnixNano\":\"" + to_string(span.startUs * 1000) + "\"";
+  batch_ += ",\"endTimeUnixNano\":\"" + to_string(span.endUs * 1000) + "\"";
+
+  if (root) {
+    batch_ += ",\"attributes\":[{\"key\":\"http.method\",\"value\":{\"stringValue\":";
+    append_json_string(batch_, span.method);
+    batch_ += "}},{\"key\":\"http.url\",\"value\":{\"stringValue\":";
+    append_json_string(batch_, span.url);
+    batch_ += "}},{\"key\":\"http.status_code\",\"value\":{\"intValue\":\"" + to_string(span.status) + "\"}}";
+    batch_ += ",{\"key\":\"http.response_content_length\",\"value\":{\"intValue\":\"" + to_string(span.bodyBytes) + "\"}}]";
+    // STATUS_CODE_OK / STATUS_CODE_ERROR
+    batch_ += SOUP_STATUS_IS_SUCCESSFUL(span.status) ? ",\"status\":{\"code\":1}" : ",\"status\":{\"code\":2}";
+  }
+  batch_ += '}';
+}
+
+void RequestTrace::start(SpanExporter &exporter, SoupMessage *msg) {
+  exporter_ = &exporter;
+  memset(&root_, 0, sizeof(root_));
+  root_.kind = SpanRecord::FETCH;
+  exporter.new_trace_id(root_.traceId);
+  exporter.new_span_id(root_.spanId);
+  root_.startUs = g_get_real_time();
+  g_strlcpy(root_.method, msg->method, sizeof(root_.method));
+  char *url = soup_uri_to_string(soup_message_get_uri(msg), FALSE);
+  g_strlcpy(root_.url, url, sizeof(root_.url));
+  g_free(url);
+  for (int i = 0; i < SpanRecord::KIND_COUNT; i++) phaseStartUs_[i] = phaseEndUs_[i] = 0;
+
+  // version-traceid-parentid-flags, sampled.
+  string traceparent = "00-";
+  append_hex(traceparent, root_.traceId, sizeof(root_.traceId));
+  traceparent += '-';
+  append_hex(traceparent, root_.spanId, sizeof(root_.spanId));
+  traceparent += "-01";
+  soup_message_headers_replace(msg->request_headers, "traceparent", traceparent.c_str());
+
+  g_signal_connect(msg, "network-event", G_CALLBACK(on_network_event), this);
+  g_signal_connect(msg, "wrote-body", G_CALLBACK(on_wrote_body), this);
+  g_signal_connect(msg, "got-headers", G_CALLBACK(on_got_headers), this);
+}
+
+void RequestTrace::on_network_event(SoupMessage *msg, GSocketClientEvent event, GIOStream *connection, gpointer usr_data) {
+  RequestTrace *trace = (RequestTrace *) usr_data;
+  gint64 now = g_get_real_time();
+  switch (event) {
+    case G_SOCKET_CLIENT_RESOLVING:
+      trace->phaseStartUs_[SpanRecord::DNS] = now;
+      break;
+    case G_SOCKET_CLIENT_RESOLVED:
+      trace->phaseEndUs_[SpanRecord::DNS] = now;
+      break;
+    case G_SOCKET_CLIENT_CONNECTING:
+      trace->phaseStartUs_[SpanRecord::CONNECT] = now;
+      break;
+    case G_SOCKET_CLIENT_CONNECTED:
+      trace->phaseEndUs_[SpanRecord::CONNECT] = now;
+      break;
+    case G_SOCKET_CLIENT_TLS_HANDSHAKING:
+      trace->phaseStartUs_[SpanRecord::TLS] = now;
+      break;
+    case G_SOCKET_CLIENT_TLS_HANDSHAKED:
+      trace->phaseEndUs_[SpanRecord::TLS] = now;
+      break;
+    default:
+      break;
+  }
+}
+
+void RequestTrace::on_wrote_body(SoupMessage *msg, gpointer usr_data) {
+  RequestTrace *trace = (RequestTrace *) usr_data;
+  // Restarts (redirects, auth) overwrite: the spans describe the final hop.
+  trace->phaseStartUs_[SpanRecord::WAIT] = g_get_real_time();
+}
+
+void RequestTrace::on_got_headers(SoupMessage *msg, gpointer usr_data) {
+  RequestTrace *trace = (RequestTrace *) usr_data;
+  gint64 now = g_get_real_time();
+  trace->phaseEndUs_[SpanRecord::WAIT] = now;
+  trace->phaseStartUs_[SpanRecord::TRANSFER] = now;
+}
+
+void RequestTrace::emit(SpanRecord::Kind kind, gint64 startUs, gint64 endUs) {
+  SpanRecord span;
+  memcpy(span.traceId, root_.traceId, sizeof(span.traceId));
+  exporter_->new_span_id(span.spanId);
+  memcpy(span.parentId, root_.spanId, sizeof(span.parentId));
+  span.kind = kind;
+  span.startUs = startUs;
+  span.endUs = endUs;
+  span.status = 0;
+  span.bodyBytes = 0;
+  span.method[0] = span.url[0] = '\0';
+  exporter_->submit(span);
+}
+
+void RequestTrace::finish(SoupMessage *msg) {
+  if (!exporter_) return;
+  g_signal_handlers_disconnect_by_data(msg, this);
+
+  gint64 now = g_get_real_time();
+  phaseEndUs_[SpanRecord::TRANSFER] = phaseStartUs_[SpanRecord::TRANSFER] ? now : 0;
+  for (int kind = SpanRecord::DNS; kind < SpanRecord::KIND_COUNT; kind++) {
+    // Phases that never started (reused connection) or never ended (failed
+    // there) are left out.
+    if (phaseStartUs_[kind] && phaseEndUs_[kind] >= phaseStartUs_[kind]) {
+      emit((SpanRecord::Kind) kind, phaseStartUs_[kind], phaseEndUs_[kind]);
+    }
+  }
+
+  root_.endUs = now;
+  root_.status = msg->status_code;
+  root_.bodyBytes = (uint64_t) msg->response_body->length;
+  exporter_->submit(root_);
+  exporter_ = nullptr;
+}
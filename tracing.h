@@ -0,0 +1,102 @@
+#pragma once
+
+#include <libsoup/soup.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// One finished span, fixed size so the ring never allocates.
+struct SpanRecord {
+  enum Kind { FETCH, DNS, CONNECT, TLS, WAIT, TRANSFER, KIND_COUNT };
+
+  uint8_t traceId[16];
+  uint8_t spanId[8];
+  uint8_t parentId[8];
+  Kind kind;
+  gint64 startUs;
+  gint64 endUs;
+  // FETCH only.
+  guint status;
+  uint64_t bodyBytes;
+  char method[8];
+  // Truncated to fit; the full URL is not worth a heap copy per span.
+  char url[160];
+};
+
+// Writes spans as OTLP-JSON (one ExportTraceServiceRequest per line, as the
+// OpenTelemetry file exporter does) from a background thread. submit() is
+// wait-free: a single producer fills a preallocated ring and the exporter
+// drains it in batches. When the ring is full, spans are dropped and counted
+// rather than stalling the caller.
+class SpanExporter {
+public:
+  SpanExporter(FILE *out, size_t capacity = 8192, guint flushIntervalMs = 200);
+  // Flushes whatever is left. Does not close out.
+  ~SpanExporter();
+
+  SpanExporter(const SpanExporter &) = delete;
+  SpanExporter &operator=(const SpanExporter &) = delete;
+
+  // Only ever call from one thread.
+  bool submit(const SpanRecord &span);
+
+  // Random non-zero ids from a per-exporter generator; producer thread only.
+  void new_trace_id(uint8_t id[16]);
+  void new_span_id(uint8_t id[8]);
+
+  uint64_t exported() const { return exported_.load(std::memory_order_relaxed); }
+  uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+  void run();
+  size_t drain();
+  void append_span(const SpanRecord &span);
+
+  FILE *out_;
+  SpanRecord *ring_;
+  size_t capacity_;
+  guint flushIntervalMs_;
+  // head_ is written by the producer only, tail_ by the exporter only.
+  alignas(64) std::atomic<size_t> head_;
+  alignas(64) std::atomic<size_t> tail_;
+  std::atomic<uint64_t> exported_;
+  std::atomic<uint64_t> dropped_;
+  uint64_t rng_;
+
+  // Exporter side only; the producer never touches these.
+  std::string batch_;
+  std::mutex stopMutex_;
+  std::condition_variable stopCond_;
+  bool stop_;
+  std::thread thread_;
+};
+
+// Spans for one message: a client span for the whole fetch plus children for
+// DNS, connect and TLS (when the message opened a new connection), waiting
+// for the response headers and transferring the body. start() also sets the
+// W3C traceparent header so the server can join the trace.
+class RequestTrace {
+public:
+  RequestTrace() : exporter_(nullptr) {}
+
+  void start(SpanExporter &exporter, SoupMessage *msg);
+  // Emits the spans. Call from the completion callback.
+  void finish(SoupMessage *msg);
+
+private:
+  static void on_network_event(SoupMessage *msg, GSocketClientEvent event, GIOStream *connection, gpointer usr_data);
+  static void on_wrote_body(SoupMessage *msg, gpointer usr_data);
+  static void on_got_headers(SoupMessage *msg, gpointer usr_data);
+
+  void emit(SpanRecord::Kind kind, gint64 startUs, gint64 endUs);
+
+  SpanExporter *exporter_;
+  SpanRecord root_;
+  gint64 phaseStartUs_[SpanRecord::KIND_COUNT];
+  gint64 phaseEndUs_[SpanRecord::KIND_COUNT];
+};
@@ -0,0 +1,506 @@
+#include "unix_transport.h"
+
+#include <algorithm>
+#include <cstring>
+#include <gio/gunixsocketaddress.h>
+
+using namespace std;
+
+// Response headers have to fit; bodies stream through.
+static const size_t BUFFER_BYTES = 64 << 10;
+// Chunk-size and trailer lines longer than this are not HTTP.
+static const size_t MAX_LINE_BYTES = 4096;
+
+G_DEFINE_QUARK(libsouptest-unix-transport-exchange, exchange)
+
+static void
+append_header(const char *name, const char *value, gpointer usr_data) {
+  string *out = (string *) usr_data;
+  out->append(name).append(": ").append(value).append("\r\n");
+}
+
+static void
+got_chunk(SoupMessage *msg, const char *data, size_t len) {
+  SoupBuffer *chunk = soup_buffer_new(SOUP_MEMORY_TEMPORARY, data, len);
+  // Copies into the body unless accumulation is off, as libsoup does.
+  soup_message_body_got_chunk(msg->response_body, chunk);
+  soup_message_got_chunk(msg, chunk);
+  soup_buffer_free(chunk);
+}
+
+UnixTransport::UnixTransport(const string &socketPath, int maxConns, guint timeoutSeconds)
+    : path_(socketPath), maxConns_(max(maxConns, 1)), timeoutSeconds_(timeoutSeconds), client_(g_socket_client_new()),
+      address_(g_unix_socket_address_new(socketPath.c_str())), closing_(false) {}
+
+UnixTransport::~UnixTransport() {
+  closing_ = true;
+  vector<Exchange *> aborted(waiting_.begin(), waiting_.end());
+  waiting_.clear();
+  for (Connection *conn : connections_) {
+    if (conn->exchange) {
+      conn->exchange->conn = nullptr;
+      aborted.push_back(conn->exchange);
+    }
+    conn->exchange = nullptr;
+    if (conn->pending) {
+      // Freed by its callback once the cancellation arrives.
+      conn->transport = nullptr;
+      g_cancellable_cancel(conn->cancellable);
+    } else {
+      free_connection(conn);
+    }
+  }
+  connections_.clear();
+  idle_.clear();
+  for (Exchange *exchange : aborted) complete(exchange, SOUP_STATUS_CANCELLED);
+  g_object_unref(address_);
+  g_object_unref(client_);
+}
+
+UnixTransport::Exchange *UnixTransport::exchange_of(SoupMessage *msg) {
+  return (Exchange *) g_object_get_qdata(G_OBJECT(msg), exchange_quark());
+}
+
+UnixTransport *UnixTransport::of(SoupMessage *msg) {
+  Exchange *exchange = exchange_of(msg);
+  return exchange ? exchange->transport : nullptr;
+}
+
+void UnixTransport::send(SoupMessage *msg, Callback done, gpointer usr_data) {
+  Exchange *exchange = new Exchange{this, msg, done, usr_data, nullptr, 0, false, false};
+  if (closing_) {
+    complete(exchange, SOUP_STATUS_CANCELLED);
+    return;
+  }
+  g_object_set_qdata(G_OBJECT(msg), exchange_quark(), exchange);
+  waiting_.push_back(exchange);
+  pump();
+}
+
+void UnixTransport::cancel(SoupMessage *msg, guint status) {
+  Exchange *exchange = exchange_of(msg);
+  // Everything is being cancelled already.
+  if (!exchange || exchange->abortStatus || closing_) return;
+  exchange->abortStatus = status;
+
+  Connection *conn = exchange->conn;
+  if (!conn) {
+    waiting_.erase(find(waiting_.begin(), waiting_.end(), exchange));
+    complete(exchange, status);
+  } else if (conn->pending) {
+    // The operation's callback ends the exchange.
+    g_cancellable_cancel(conn->cancellable);
+  } else if (!conn->busy) {
+    // Paused between reads.
+    close(conn);
+    complete(exchange, status);
+    pump();
+  }
+}
+
+void UnixTransport::pause(SoupMessage *msg) {
+  Exchange *exchange = exchange_of(msg);
+  if (exchange) exchange->paused = true;
+}
+
+void UnixTransport::unpause(SoupMessage *msg) {
+  Exchange *exchange = exchange_of(msg);
+  if (!exchange || !exchange->paused) return;
+  exchange->paused = false;
+  // Picked up where process() stopped, from the main loop as libsoup does.
+  Connection *conn = exchange->conn;
+  if (conn && !conn->pending && !conn->busy && !conn->resumeSource && conn->state != CONNECTING && conn->state != WRITING) {
+    conn->resumeSource = g_idle_add(on_resume, conn);
+  }
+}
+
+void UnixTransport::pump() {
+  while (!waiting_.empty()) {
+    Connection *conn;
+    if (!idle_.empty()) {
+      conn = idle_.back();
+      idle_.pop_back();
+    } else if ((int) connections_.size() < maxConns_) {
+      conn = open_connection();
+    } else {
+      return;
+    }
+    Exchange *exchange = waiting_.front();
+    waiting_.pop_front();
+    conn->exchange = exchange;
+    exchange->conn = conn;
+    if (conn->state == IDLE) write_request(conn);
+  }
+}
+
+UnixTransport::Connection *UnixTransport::open_connection() {
+  Connection *conn = new Connection{this, nullptr, g_cancellable_new(), nullptr, CONNECTING, string(), vector<char>(BUFFER_BYTES),
+                                    0, 0, 0, false, false, false, false, false, 0, 0};
+  connections_.push_back(conn);
+  begin_operation(conn);
+  g_socket_client_connect_async(client_, G_SOCKET_CONNECTABLE(address_), conn->cancellable, on_connected, conn);
+  return conn;
+}
+
+void UnixTransport::begin_operation(Connection *conn) {
+  conn->pending = true;
+  if (timeoutSeconds_) conn->timeoutSource = g_timeout_add_seconds(timeoutSeconds_, on_timeout, conn);
+}
+
+void UnixTransport::operation_done(Connection *conn) {
+  conn->pending = false;
+  if (conn->timeoutSource) {
+    g_source_remove(conn->timeoutSource);
+    conn->timeoutSource = 0;
+  }
+}
+
+gboolean UnixTransport::on_timeout(gpointer data) {
+  Connection *conn = (Connection *) data;
+  conn->timeoutSource = 0;
+  // The operation's callback fails the exchange.
+  conn->timedOut = true;
+  g_cancellable_cancel(conn->cancellable);
+  return G_SOURCE_REMOVE;
+}
+
+void UnixTransport::free_connection(Connection *conn) {
+  if (conn->resumeSource) g_source_remove(conn->resumeSource);
+  if (conn->timeoutSource) g_source_remove(conn->timeoutSource);
+  if (conn->stream) g_object_unref(conn->stream);
+  g_object_unref(conn->cancellable);
+  delete conn;
+}
+
+void UnixTransport::on_connected(GObject *source, GAsyncResult *result, gpointer usr_data) {
+  Connection *conn = (Connection *) usr_data;
+  GError *error = nullptr;
+  conn->stream = g_socket_client_connect_finish(G_SOCKET_CLIENT(source), result, &error);
+  operation_done(conn);
+  if (!conn->transport) {
+    g_clear_error(&error);
+    free_connection(conn);
+    return;
+  }
+  if (!conn->stream) {
+    conn->transport->failed(conn, error);
+    return;
+  }
+  conn->transport->write_request(conn);
+}
+
+void UnixTransport::write_request(Connection *conn) {
+  Exchange *exchange = conn->exchange;
+  SoupMessage *msg = exchange->msg;
+  // As libsoup does once the message has its connection; handlers may still
+  // change the request headers, or cancel.
+  conn->busy = true;
+  g_signal_emit_by_name(msg, "starting");
+  conn->busy = false;
+  if (exchange->abortStatus) {
+    close(conn);
+    complete(exchange, exchange->abortStatus);
+    pump();
+    return;
+  }
+
+  SoupURI *uri = soup_message_get_uri(msg);
+  string &out = conn->request;
+  char *target = soup_uri_to_string(uri, TRUE);
+  out.assign(msg->method).append(" ").append(target).append(" HTTP/1.1\r\nHost: ").append(uri->host);
+  g_free(target);
+  if (!soup_uri_uses_default_port(uri)) out.append(":").append(to_string(uri->port));
+  out.append("\r\n");
+  soup_message_headers_foreach(msg->request_headers, append_header, &out);
+
+  SoupBuffer *body = msg->request_body->length > 0 ? soup_message_body_flatten(msg->request_body) : nullptr;
+  bool sendsBody = body || msg->method == SOUP_METHOD_POST || msg->method == SOUP_METHOD_PUT;
+  if (sendsBody && !soup_message_headers_get_one(msg->request_headers, "Content-Length")) {
+    out.append("Content-Length: ").append(to_string(body ? body->length : 0)).append("\r\n");
+  }
+  out.append("\r\n");
+  if (body) {
+    out.append(body->data, body->length);
+    soup_buffer_free(body);
+  }
+
+  conn->state = WRITING;
+  begin_operation(conn);
+  g_output_stream_write_all_async(g_io_stream_get_output_stream(G_IO_STREAM(conn->stream)), out.data(), out.size(),
+                                  G_PRIORITY_DEFAULT, conn->cancellable, on_written, conn);
+}
+
+void UnixTransport::on_written(GObject *source, GAsyncResult *result, gpointer usr_data) {
+  Connection *conn = (Connection *) usr_data;
+  GError *error = nullptr;
+  gboolean written = g_output_stream_write_all_finish(G_OUTPUT_STREAM(source), result, nullptr, &error);
+  operation_done(conn);
+  if (!conn->transport) {
+    g_clear_error(&error);
+    free_connection(conn);
+    return;
+  }
+  if (!written) {
+    conn->transport->failed(conn, error);
+    return;
+  }
+  // A cancel from these handlers is picked up by process().
+  SoupMessage *msg = conn->exchange->msg;
+  conn->state = HEADERS;
+  conn->busy = true;
+  soup_message_wrote_headers(msg);
+  soup_message_wrote_body(msg);
+  conn->busy = false;
+  conn->transport->process(conn);
+}
+
+void UnixTransport::read(Connection *conn) {
+  if (conn->start == conn->end) {
+    conn->start = conn->end = 0;
+  } else if (conn->end == conn->buffer.size()) {
+    if (conn->start == 0) {
+      // Headers larger than the whole buffer.
+      Exchange *exchange = conn->exchange;
+      close(conn);
+      complete(exchange, SOUP_STATUS_MALFORMED);
+      pump();
+      return;
+    }
+    memmove(conn->buffer.data(), conn->buffer.data() + conn->start, conn->end - conn->start);
+    conn->end -= conn->start;
+    conn->start = 0;
+  }
+  begin_operation(conn);
+  g_input_stream_read_async(g_io_stream_get_input_stream(G_IO_STREAM(conn->stream)), conn->buffer.data() + conn->end,
+                            conn->buffer.size() - conn->end, G_PRIORITY_DEFAULT, conn->cancellable, on_read, conn);
+}
+
+void UnixTransport::on_read(GObject *source, GAsyncResult *result, gpointer usr_data) {
+  Connection *conn = (Connection *) usr_data;
+  GError *error = nullptr;
+  gssize n = g_input_stream_read_finish(G_INPUT_STREAM(source), result, &error);
+  operation_done(conn);
+  if (!conn->transport) {
+    g_clear_error(&error);
+    free_connection(conn);
+    return;
+  }
+  if (n < 0) {
+    conn->transport->failed(conn, error);
+  } else if (n == 0) {
+    conn->transport->eof(conn);
+  } else {
+    conn->end += (size_t) n;
+    conn->transport->process(conn);
+  }
+}
+
+gboolean UnixTransport::on_resume(gpointer data) {
+  Connection *conn = (Connection *) data;
+  conn->resumeSource = 0;
+  conn->transport->process(conn);
+  return G_SOURCE_REMOVE;
+}
+
+void UnixTransport::process(Connection *conn) {
+  Exchange *exchange = conn->exchange;
+  conn->busy = true;
+  while (!exchange->abortStatus && !exchange->paused && conn->state != DONE && step(conn)) {
+  }
+  if (conn->state == DONE && !exchange->abortStatus) soup_message_got_body(exchange->msg);
+  conn->busy = false;
+
+  if (exchange->abortStatus) {
+    close(conn);
+    complete(exchange, exchange->abortStatus);
+    pump();
+  } else if (conn->state == DONE) {
+    finish(conn);
+  } else if (!exchange->paused) {
+    read(conn);
+  }
+}
+
+bool UnixTransport::step(Connection *conn) {
+  SoupMessage *msg = conn->exchange->msg;
+  const char *p = conn->buffer.data() + conn->start;
+  size_t avail = conn->end - conn->start;
+  const char *eol;
+
+  switch (conn->state) {
+    case HEADERS: {
+      const char *blank = (const char *) memmem(p, avail, "\r\n\r\n", 4);
+      if (!blank) return false;
+      size_t headerLen = blank + 4 - p;
+      SoupHTTPVersion version;
+      guint status;
+      char *reason;
+      soup_message_headers_clear(msg->response_headers);
+      if (!soup_headers_parse_response(p, (int) headerLen, msg->response_headers, &version, &status, &reason)) {
+        conn->exchange->abortStatus = SOUP_STATUS_MALFORMED;
+        return false;
+      }
+      conn->start += headerLen;
+      if (SOUP_STATUS_IS_INFORMATIONAL(status)) {
+        // 100 Continue and the like: the real response follows.
+        g_free(reason);
+        return true;
+      }
+      soup_message_set_status_full(msg, status, reason);
+      g_free(reason);
+
+      conn->keepAlive = version == SOUP_HTTP_1_1
+                                ? !soup_message_headers_header_contains(msg->response_headers, "Connection", "close")
+                                : soup_message_headers_header_contains(msg->response_headers, "Connection", "keep-alive");
+      if (msg->method == SOUP_METHOD_HEAD || status == SOUP_STATUS_NO_CONTENT || status == SOUP_STATUS_NOT_MODIFIED) {
+        conn->state = DONE;
+      } else {
+        switch (soup_message_headers_get_encoding(msg->response_headers)) {
+          case SOUP_ENCODING_CONTENT_LENGTH:
+            conn->remaining = (guint64) soup_message_headers_get_content_length(msg->response_headers);
+            conn->state = conn->remaining > 0 ? BODY_LENGTH : DONE;
+            break;
+          case SOUP_ENCODING_CHUNKED:
+            conn->state = CHUNK_SIZE;
+            break;
+          case SOUP_ENCODING_NONE:
+            conn->state = DONE;
+            break;
+          default:
+            conn->state = BODY_EOF;
+            conn->keepAlive = false;
+            break;
+        }
+      }
+      soup_message_got_headers(msg);
+      return true;
+    }
+
+    case BODY_LENGTH:
+    case CHUNK_DATA: {
+      if (avail == 0) return false;
+      size_t n = (size_t) min<guint64>(avail, conn->remaining);
+      conn->start += n;
+      conn->remaining -= n;
+      if (conn->remaining == 0) conn->state = conn->state == BODY_LENGTH ? DONE : CHUNK_END;
+      got_chunk(msg, p, n);
+      return true;
+    }
+
+    case BODY_EOF:
+      if (avail == 0) return false;
+      conn->start += avail;
+      got_chunk(msg, p, avail);
+      return true;
+
+    case CHUNK_SIZE:
+    case CHUNK_END:
+    case TRAILER: {
+      eol = (const char *) memchr(p, '\n', avail);
+      if (!eol) {
+        if (avail > MAX_LINE_BYTES) conn->exchange->abortStatus = SOUP_STATUS_MALFORMED;
+        return false;
+      }
+      size_t lineLen = eol - p;
+      if (lineLen > 0 && p[lineLen - 1] == '\r') lineLen--;
+      conn->start += eol + 1 - p;
+
+      if (conn->state == CHUNK_END) {
+        conn->state = CHUNK_SIZE;
+      } else if (conn->state == TRAILER) {
+        if (lineLen == 0) conn->state = DONE;
+      } else {
+        // Anything after the hex digits is a chunk extension.
+        char *sizeEnd;
+        conn->remaining = g_ascii_strtoull(p, &sizeEnd, 16);
+        if (sizeEnd == p) {
+          conn->exchange->abortStatus = SOUP_STATUS_MALFORMED;
+          return false;
+        }
+        conn->state = conn->remaining > 0 ? CHUNK_DATA : TRAILER;
+      }
+      return true;
+    }
+
+    default:
+      return false;
+  }
+}
+
+bool UnixTransport::can_resend(Connection *conn) const {
+  // A kept-alive connection the server closed before it saw this request.
+  return conn->reused && !conn->timedOut && !conn->exchange->resent && !conn->exchange->abortStatus &&
+         (conn->state == WRITING || (conn->state == HEADERS && conn->end == 0));
+}
+
+void UnixTransport::resend(Connection *conn) {
+  Exchange *exchange = conn->exchange;
+  exchange->resent = true;
+  close(conn);
+  waiting_.push_front(exchange);
+  pump();
+}
+
+void UnixTransport::failed(Connection *conn, GError *error) {
+  Exchange *exchange = conn->exchange;
+  guint status = conn->state == CONNECTING ? (guint) SOUP_STATUS_CANT_CONNECT : (guint) SOUP_STATUS_IO_ERROR;
+  g_error_free(error);
+  if (can_resend(conn)) {
+    resend(conn);
+    return;
+  }
+  close(conn);
+  complete(exchange, exchange->abortStatus ? exchange->abortStatus : status);
+  pump();
+}
+
+void UnixTransport::eof(Connection *conn) {
+  if (conn->state == BODY_EOF) {
+    conn->state = DONE;
+    process(conn);
+    return;
+  }
+  if (can_resend(conn)) {
+    resend(conn);
+    return;
+  }
+  Exchange *exchange = conn->exchange;
+  close(conn);
+  complete(exchange, SOUP_STATUS_IO_ERROR);
+  pump();
+}
+
+void UnixTransport::finish(Connection *conn) {
+  Exchange *exchange = conn->exchange;
+  conn->exchange = nullptr;
+  exchange->conn = nullptr;
+  // Leftover bytes would be a response nobody asked for.
+  if (conn->keepAlive && conn->start == conn->end) {
+    conn->start = conn->end = 0;
+    conn->reused = true;
+    conn->state = IDLE;
+    idle_.push_back(conn);
+  } else {
+    close(conn);
+  }
+  complete(exchange, 0);
+  pump();
+}
+
+void UnixTransport::close(Connection *conn) {
+  if (conn->exchange) conn->exchange->conn = nullptr;
+  connections_.erase(find(connections_.begin(), connections_.end(), conn));
+  auto idle = find(idle_.begin(), idle_.end(), conn);
+  if (idle != idle_.end()) idle_.erase(idle);
+  free_connection(conn);
+}
+
+void UnixTransport::complete(Exchange *exchange, guint status) {
+  SoupMessage *msg = exchange->msg;
+  if (status) soup_message_set_status(msg, status);
+  g_object_set_qdata(G_OBJECT(msg), exchange_quark(), nullptr);
+  soup_message_finished(msg);
+  exchange->done(msg, exchange->data);
+  g_object_unref(msg);
+  delete exchange;
+}
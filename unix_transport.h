@@ -0,0 +1,129 @@
+#pragma once
+
+#include <libsoup/soup.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+// HTTP/1.1 over a Unix domain socket, for a sidecar on the same host where
+// TCP loopback costs show. libsoup 2.4 only connects over TCP (a session
+// cannot be given its own GSocketConnectable), so Session hands routed
+// messages here instead of to its SoupSession. The transport writes the
+// request and fills in the status, response headers and body itself,
+// emitting got-headers, got-chunk and got-body as libsoup does, so handlers
+// on those signals work unchanged.
+//
+// Connections are kept alive and reused, at most maxConns at once; further
+// requests wait in order. "starting" is emitted once a request has its
+// connection. Request bodies are sent whole, and redirects and auth
+// challenges complete as received. A connect, write or read that takes
+// longer than timeoutSeconds fails the request like libsoup's timeout does;
+// 0 waits for ever.
+class UnixTransport {
+public:
+  typedef void (*Callback)(SoupMessage *msg, gpointer usr_data);
+
+  UnixTransport(const std::string &socketPath, int maxConns, guint timeoutSeconds = 0);
+  // Completes anything queued or in flight with SOUP_STATUS_CANCELLED.
+  ~UnixTransport();
+
+  UnixTransport(const UnixTransport &) = delete;
+  UnixTransport &operator=(const UnixTransport &) = delete;
+
+  // Takes over the caller's reference to msg and drops it after done runs.
+  void send(SoupMessage *msg, Callback done, gpointer usr_data);
+  // Like the SoupSession calls, for messages sent through this transport.
+  void cancel(SoupMessage *msg, guint status);
+  void pause(SoupMessage *msg);
+  void unpause(SoupMessage *msg);
+
+  // The transport msg is in flight on, or nullptr.
+  static UnixTransport *of(SoupMessage *msg);
+
+  const std::string &socket_path() const { return path_; }
+  // Applies to operations started from here on.
+  void set_timeout(guint seconds) { timeoutSeconds_ = seconds; }
+
+private:
+  enum State { CONNECTING, WRITING, HEADERS, BODY_LENGTH, BODY_EOF, CHUNK_SIZE, CHUNK_DATA, CHUNK_END, TRAILER, DONE, IDLE };
+
+  struct Connection;
+
+  struct Exchange {
+    UnixTransport *transport;
+    SoupMessage *msg;
+    Callback done;
+    gpointer data;
+    Connection *conn;
+    // Set by cancel() or a malformed response; the exchange ends with it at
+    // the next chance.
+    guint abortStatus;
+    bool paused;
+    // Already sent again after a kept-alive connection turned out closed.
+    bool resent;
+  };
+
+  struct Connection {
+    // nullptr once the transport is gone and only a cancelled operation
+    // still refers to the connection.
+    UnixTransport *transport;
+    GSocketConnection *stream;
+    GCancellable *cancellable;
+    Exchange *exchange;
+    State state;
+    std::string request;
+    std::vector<char> buffer;
+    size_t start;
+    size_t end;
+    guint64 remaining;
+    bool keepAlive;
+    // Served a request before this one.
+    bool reused;
+    // A connect, write or read is in flight.
+    bool pending;
+    // Inside process(), which finishes off an abort once it unwinds.
+    bool busy;
+    // The pending operation was cancelled for taking too long.
+    bool timedOut;
+    guint resumeSource;
+    guint timeoutSource;
+  };
+
+  static void on_connected(GObject *source, GAsyncResult *result, gpointer usr_data);
+  static void on_written(GObject *source, GAsyncResult *result, gpointer usr_data);
+  static void on_read(GObject *source, GAsyncResult *result, gpointer usr_data);
+  static gboolean on_resume(gpointer data);
+  static gboolean on_timeout(gpointer data);
+  static void operation_done(Connection *conn);
+  static void free_connection(Connection *conn);
+
+  static Exchange *exchange_of(SoupMessage *msg);
+
+  void pump();
+  Connection *open_connection();
+  // Marks conn's operation pending and starts its timeout.
+  void begin_operation(Connection *conn);
+  void write_request(Connection *conn);
+  void read(Connection *conn);
+  void process(Connection *conn);
+  // Parses what the buffer holds; false when it needs more.
+  bool step(Connection *conn);
+  void failed(Connection *conn, GError *error);
+  void eof(Connection *conn);
+  bool can_resend(Connection *conn) const;
+  void resend(Connection *conn);
+  void finish(Connection *conn);
+  void close(Connection *conn);
+  void complete(Exchange *exchange, guint status);
+
+  std::string path_;
+  int maxConns_;
+  guint timeoutSeconds_;
+  GSocketClient *client_;
+  GSocketAddress *address_;
+  std::deque<Exchange *> waiting_;
+  std::vector<Connection *> connections_;
+  std::vector<Connection *> idle_;
+  bool closing_;
+};
@@ -0,0 +1,116 @@
+#include "upload.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+G_DEFINE_QUARK(libsouptest-upload-error-quark, upload_error)
+
+struct MappedWindow {
+  void *addr;
+  size_t len;
+};
+
+static void
+unmap_window(gpointer data) {
+  MappedWindow *window = (MappedWindow *) data;
+  munmap(window->addr, window->len);
+  delete window;
+}
+
+// Wraps [offset, offset + len) of fd in a SoupBuffer that unmaps itself when
+// libsoup drops its last reference.
+static SoupBuffer *
+map_buffer(int fd, uint64_t offset, size_t len, GError **error) {
+  void *addr = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, (off_t) offset);
+  if (addr == MAP_FAILED) {
+    int err = errno;
+    g_set_error(error, UPLOAD_ERROR, UPLOAD_ERROR_MAP, "mmap failed: %s", g_strerror(err));
+    return nullptr;
+  }
+  madvise(addr, len, MADV_SEQUENTIAL);
+  return soup_buffer_new_with_owner(addr, len, new MappedWindow{addr, len}, unmap_window);
+}
+
+FileUpload *FileUpload::attach(Session &session, SoupMessage *msg, const char *path, const char *contentType,
+                               uint64_t streamThreshold, GError **error) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    int err = errno;
+    g_set_error(error, UPLOAD_ERROR, UPLOAD_ERROR_OPEN, "Cannot open %s: %s", path, g_strerror(err));
+    if (fd >= 0) close(fd);
+    return nullptr;
+  }
+
+  uint64_t size = (uint64_t) st.st_size;
+  bool streamed = size > streamThreshold;
+  FileUpload *upload = new FileUpload(session, msg, fd, size, streamed);
+
+  soup_message_headers_replace(msg->request_headers, "Content-Type", contentType ? contentType : "application/octet-stream");
+  soup_message_headers_set_encoding(msg->request_headers, SOUP_ENCODING_CONTENT_LENGTH);
+  soup_message_headers_set_content_length(msg->request_headers, (gint64) size);
+  soup_message_body_truncate(msg->request_body);
+
+  if (streamed) {
+    // Written windows are released as soon as libsoup is done with them.
+    soup_message_body_set_accumulate(msg->request_body, FALSE);
+    g_signal_connect(msg, "wrote-chunk", G_CALLBACK(on_wrote_chunk), upload);
+  }
+  g_signal_connect(msg, "wrote-body-data", G_CALLBACK(on_wrote_body_data), upload);
+
+  if (size > 0 && !upload->append_window(error)) {
+    delete upload;
+    return nullptr;
+  }
+  if (upload->mapped_ == size) soup_message_body_complete(msg->request_body);
+  return upload;
+}
+
+FileUpload::FileUpload(Session &session, SoupMessage *msg, int fd, uint64_t size, bool streamed)
+    : session_(session), msg_(MessageHandle::ref(msg)), fd_(fd), size_(size), mapped_(0), written_(0),
+      streamed_(streamed), firstWrite_(0), lastWrite_(0) {}
+
+FileUpload::~FileUpload() {
+  g_signal_handlers_disconnect_by_data(msg_.get(), this);
+  close(fd_);
+}
+
+bool FileUpload::append_window(GError **error) {
+  size_t len = streamed_ ? (size_t) std::min<uint64_t>(WINDOW_BYTES, size_ - mapped_) : (size_t) size_;
+  SoupBuffer *buffer = map_buffer(fd_, mapped_, len, error);
+  if (!buffer) return false;
+  soup_message_body_append_buffer(msg_->request_body, buffer);
+  soup_buffer_free(buffer);
+  mapped_ += len;
+  return true;
+}
+
+void FileUpload::on_wrote_chunk(SoupMessage *msg, gpointer usr_data) {
+  FileUpload *upload = (FileUpload *) usr_data;
+  if (upload->mapped_ >= upload->size_) return;
+
+  GError *error = nullptr;
+  if (!upload->append_window(&error)) {
+    g_warning("Upload aborted: %s", error->message);
+    g_error_free(error);
+    upload->session_.cancel(msg, SOUP_STATUS_IO_ERROR);
+    return;
+  }
+  if (upload->mapped_ == upload->size_) soup_message_body_complete(msg->request_body);
+}
+
+void FileUpload::on_wrote_body_data(SoupMessage *msg, SoupBuffer *chunk, gpointer usr_data) {
+  FileUpload *upload = (FileUpload *) usr_data;
+  gint64 now = g_get_monotonic_time();
+  if (upload->written_ == 0) upload->firstWrite_ = now;
+  upload->lastWrite_ = now;
+  upload->written_ += chunk->length;
+}
+
+double FileUpload::seconds() const {
+  return (double) (lastWrite_ - firstWrite_) / G_USEC_PER_SEC;
+}
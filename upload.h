@@ -0,0 +1,59 @@
+#pragma once
+
+#include <libsoup/soup.h>
+
+#include <cstdint>
+
+#include "soupclient.h"
+
+#define UPLOAD_ERROR (upload_error_quark())
+GQuark upload_error_quark(void);
+
+enum UploadError {
+  UPLOAD_ERROR_OPEN,
+  UPLOAD_ERROR_MAP,
+};
+
+// Request body backed by a memory-mapped file. Files up to streamThreshold are
+// mapped once and handed to libsoup as a single SoupBuffer that owns the
+// mapping, so nothing is copied. Larger files are mapped one window at a time
+// and each window is appended as the previous one is written, keeping RSS
+// bounded however big the file is.
+class FileUpload {
+public:
+  static const uint64_t DEFAULT_STREAM_THRESHOLD = 64ULL << 20;
+  static const size_t WINDOW_BYTES = 8 << 20;
+
+  // Replaces msg's request body. The upload must outlive the message's
+  // transfer; destroying it disconnects from the message.
+  static FileUpload *attach(Session &session, SoupMessage *msg, const char *path, const char *contentType,
+                            uint64_t streamThreshold, GError **error);
+  ~FileUpload();
+
+  FileUpload(const FileUpload &) = delete;
+  FileUpload &operator=(const FileUpload &) = delete;
+
+  uint64_t size() const { return size_; }
+  uint64_t written() const { return written_; }
+  bool streamed() const { return streamed_; }
+  // Time from the first body byte written to the last.
+  double seconds() const;
+
+private:
+  FileUpload(Session &session, SoupMessage *msg, int fd, uint64_t size, bool streamed);
+
+  bool append_window(GError **error);
+
+  static void on_wrote_chunk(SoupMessage *msg, gpointer usr_data);
+  static void on_wrote_body_data(SoupMessage *msg, SoupBuffer *chunk, gpointer usr_data);
+
+  Session &session_;
+  MessageHandle msg_;
+  int fd_;
+  uint64_t size_;
+  uint64_t mapped_;
+  uint64_t written_;
+  bool streamed_;
+  gint64 firstWrite_;
+  gint64 lastWrite_;
+};
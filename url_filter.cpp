@@ -0,0 +1,108 @@
+#include "url_filter.h"
+#include "hash.h"
+
+using namespace std;
+
+static const int BLOOM_PROBES = 7;
+
+static inline uint64_t
+mix64(uint64_t x) {
+  x ^= x >> 31;
+  x *= 0x7fb5d329728ea185ULL;
+  x ^= x >> 27;
+  x *= 0x81dadef4bc2dd44dULL;
+  x ^= x >> 33;
+  return x;
+}
+
+static size_t
+next_pow2(size_t n) {
+  size_t p = 1;
+  while (p < n) p <<= 1;
+  return p;
+}
+
+BloomFilter::BloomFilter(size_t expectedKeys) {
+  // ~10 bits per key, rounded up to a power of two number of 512-bit blocks.
+  size_t blocks = next_pow2((expectedKeys * 10 + 511) / 512);
+  blocks_.assign(blocks, Block{});
+  blockMask_ = blocks - 1;
+}
+
+bool BloomFilter::maybe_contains(uint64_t hash) const {
+  const Block &block = blocks_[hash & blockMask_];
+  uint64_t h = mix64(hash);
+  for (int i = 0; i < BLOOM_PROBES; i++) {
+    unsigned bit = (h >> (i * 9)) & 511;
+    if (!(block.words[bit >> 6] & (1ULL << (bit & 63)))) return false;
+  }
+  return true;
+}
+
+void BloomFilter::insert(uint64_t hash) {
+  Block &block = blocks_[hash & blockMask_];
+  uint64_t h = mix64(hash);
+  for (int i = 0; i < BLOOM_PROBES; i++) {
+    unsigned bit = (h >> (i * 9)) & 511;
+    block.words[bit >> 6] |= 1ULL << (bit & 63);
+  }
+}
+
+FingerprintSet::FingerprintSet(size_t expectedKeys)
+    : slots_(next_pow2(expectedKeys + expectedKeys / 3 + 1), 0), size_(0) {}
+
+bool FingerprintSet::contains(uint64_t fingerprint) const {
+  if (fingerprint == 0) fingerprint = 1;
+  size_t mask = slots_.size() - 1;
+  for (size_t i = fingerprint & mask;; i = (i + 1) & mask) {
+    if (slots_[i] == fingerprint) return true;
+    if (slots_[i] == 0) return false;
+  }
+}
+
+bool FingerprintSet::insert(uint64_t fingerprint) {
+  if (fingerprint == 0) fingerprint = 1;
+  // Keep the load factor at or below 3/4.
+  if ((size_ + 1) * 4 > slots_.size() * 3) grow();
+
+  size_t mask = slots_.size() - 1;
+  for (size_t i = fingerprint & mask;; i = (i + 1) & mask) {
+    if (slots_[i] == fingerprint) return false;
+    if (slots_[i] == 0) {
+      slots_[i] = fingerprint;
+      size_++;
+      return true;
+    }
+  }
+}
+
+void FingerprintSet::grow() {
+  vector<uint64_t> old(slots_.size() * 2, 0);
+  old.swap(slots_);
+  size_t mask = slots_.size() - 1;
+  for (uint64_t fp : old) {
+    if (!fp) continue;
+    size_t i = fp & mask;
+    while (slots_[i]) i = (i + 1) & mask;
+    slots_[i] = fp;
+  }
+}
+
+UrlSeenFilter::UrlSeenFilter(size_t expectedUrls)
+    : bloom_(expectedUrls), exact_(expectedUrls) {}
+
+bool UrlSeenFilter::insert(const char *url, size_t len) {
+  XxHash64 hash;
+  hash.update(url, len);
+  uint64_t fingerprint = hash.digest();
+
+  // The exact set indexes on the low bits; give the Bloom filter the high
+  // ones so the two structures are not correlated.
+  uint64_t bloomKey = (fingerprint >> 32) | (fingerprint << 32);
+  if (!bloom_.maybe_contains(bloomKey)) {
+    bloom_.insert(bloomKey);
+    exact_.insert(fingerprint);
+    return true;
+  }
+  return exact_.insert(fingerprint);
+}
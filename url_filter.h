@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Blocked Bloom filter: every key touches a single 64-byte block, so a lookup
+// costs one cache miss. Sized for the expected key count at roughly 1% false
+// positives, about 1.25 bytes per key.
+class BloomFilter {
+public:
+  explicit BloomFilter(size_t expectedKeys);
+
+  bool maybe_contains(uint64_t hash) const;
+  void insert(uint64_t hash);
+
+  size_t memory_bytes() const { return blocks_.size() * sizeof(Block); }
+
+private:
+  struct alignas(64) Block {
+    uint64_t words[8];
+  };
+
+  std::vector<Block> blocks_;
+  uint64_t blockMask_;
+};
+
+// Exact set of 64-bit URL fingerprints, open addressed with linear probing.
+// Zero marks an empty slot, so a zero fingerprint is remapped on the way in.
+class FingerprintSet {
+public:
+  explicit FingerprintSet(size_t expectedKeys = 1024);
+
+  // Returns false if the fingerprint was already present.
+  bool insert(uint64_t fingerprint);
+  bool contains(uint64_t fingerprint) const;
+
+  size_t size() const { return size_; }
+  size_t memory_bytes() const { return slots_.size() * sizeof(uint64_t); }
+
+private:
+  void grow();
+
+  std::vector<uint64_t> slots_;
+  size_t size_;
+};
+
+// Seen-URL filter for crawling. The Bloom filter answers most "never seen"
+// queries without touching the much larger exact set.
+class UrlSeenFilter {
+public:
+  explicit UrlSeenFilter(size_t expectedUrls);
+
+  // Returns true the first time a URL (after normalization) is offered.
+  bool insert(const char *url, size_t len);
+
+  size_t size() const { return exact_.size(); }
+  size_t memory_bytes() const { return bloom_.memory_bytes() + exact_.memory_bytes(); }
+
+private:
+  BloomFilter bloom_;
+  FingerprintSet exact_;
+};
@@ -0,0 +1,205 @@
+#include "verify.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+G_DEFINE_QUARK(libsouptest-verify-error-quark, verify_error)
+
+static const struct {
+  const char *name;
+  ChecksumAlgorithm algorithm;
+  size_t hexDigits;
+} ALGORITHMS[] = {
+        {"crc32c", CHECKSUM_CRC32C, 8},
+        {"xxh64", CHECKSUM_XXH64, 16},
+        {"sha256", CHECKSUM_SHA256, 64},
+};
+
+static const char *
+algorithm_name(ChecksumAlgorithm algorithm) {
+  for (const auto &known : ALGORITHMS) {
+    if (known.algorithm == algorithm) return known.name;
+  }
+  return "none";
+}
+
+// ALGO:HEX, or "-" for none.
+static bool
+parse_checksum(const string &field, ExpectedBody &expected) {
+  if (field == "-") return true;
+  size_t colon = field.find(':');
+  if (colon == string::npos) return false;
+  for (const auto &known : ALGORITHMS) {
+    if (field.compare(0, colon, known.name) != 0 || field.size() - colon - 1 != known.hexDigits) continue;
+    expected.algorithm = known.algorithm;
+    expected.digest = field.substr(colon + 1);
+    for (char &c : expected.digest) {
+      if (!g_ascii_isxdigit(c)) return false;
+      c = g_ascii_tolower(c);
+    }
+    return true;
+  }
+  return false;
+}
+
+gboolean ChecksumManifest::load(const char *path, GError **error) {
+  gchar *contents;
+  gsize length;
+  if (!g_file_get_contents(path, &contents, &length, error)) return FALSE;
+
+  unsigned lineNo = 0;
+  const char *p = contents;
+  const char *end = contents + length;
+  while (p < end) {
+    const char *eol = (const char *) memchr(p, '\n', end - p);
+    if (!eol) eol = end;
+    lineNo++;
+
+    vector<string> fields;
+    for (const char *f = p; f < eol;) {
+      while (f < eol && g_ascii_isspace(*f)) f++;
+      const char *start = f;
+      while (f < eol && !g_ascii_isspace(*f)) f++;
+      if (f > start) fields.emplace_back(start, f - start);
+    }
+    p = eol + 1;
+    if (fields.empty() || fields[0][0] == '#') continue;
+
+    ExpectedBody expected;
+    bool valid = (fields.size() == 2 || fields.size() == 3) && parse_checksum(fields[1], expected);
+    if (valid && fields.size() == 3) {
+      char *sizeEnd;
+      expected.size = g_ascii_strtoll(fields[2].c_str(), &sizeEnd, 10);
+      valid = *sizeEnd == '\0' && expected.size >= 0;
+    }
+    if (!valid || (expected.algorithm == CHECKSUM_NONE && expected.size < 0)) {
+      g_set_error(error, VERIFY_ERROR, VERIFY_ERROR_MANIFEST, "%s:%u: expected URL ALGO:HEX [SIZE]", path, lineNo);
+      g_free(contents);
+      return FALSE;
+    }
+    entries_[fields[0]] = std::move(expected);
+  }
+  g_free(contents);
+  return TRUE;
+}
+
+const ExpectedBody *ChecksumManifest::find(const string &url) const {
+  auto it = entries_.find(url);
+  return it != entries_.end() ? &it->second : nullptr;
+}
+
+BodyVerifier::BodyVerifier(const ExpectedBody *expected)
+    : expected_(expected), sha_(nullptr), size_(0), expectedSize_(-1) {
+  if (expected_ && expected_->algorithm == CHECKSUM_SHA256) sha_ = g_checksum_new(G_CHECKSUM_SHA256);
+}
+
+BodyVerifier::~BodyVerifier() {
+  if (sha_) g_checksum_free(sha_);
+}
+
+void BodyVerifier::reset() {
+  crc_.reset();
+  xxh_.reset();
+  if (sha_) g_checksum_reset(sha_);
+  size_ = 0;
+}
+
+gboolean BodyVerifier::resume_from(const string &path, uint64_t len, GError **error) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    int err = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "%s: %s", path.c_str(), g_strerror(err));
+    return FALSE;
+  }
+  vector<char> buffer(1 << 20);
+  while (size_ < len) {
+    ssize_t n = read(fd, buffer.data(), (size_t) min<uint64_t>(buffer.size(), len - size_));
+    if (n <= 0) {
+      int err = n < 0 ? errno : EIO;
+      g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err), "%s: %s", path.c_str(),
+                  n < 0 ? g_strerror(err) : "shorter than recorded");
+      close(fd);
+      return FALSE;
+    }
+    update(buffer.data(), (size_t) n);
+  }
+  close(fd);
+  return TRUE;
+}
+
+void BodyVerifier::headers(SoupMessage *msg) {
+  if (msg->status_code != SOUP_STATUS_PARTIAL_CONTENT) reset();
+
+  expectedSize_ = -1;
+  const char *coding = soup_message_headers_get_one(msg->response_headers, "Content-Encoding");
+  if ((!coding || g_ascii_strcasecmp(coding, "identity") == 0) &&
+      soup_message_headers_get_encoding(msg->response_headers) == SOUP_ENCODING_CONTENT_LENGTH) {
+    expectedSize_ = (gint64) size_ + soup_message_headers_get_content_length(msg->response_headers);
+  }
+}
+
+void BodyVerifier::update(const char *data, size_t len) {
+  size_ += len;
+  if (!expected_) return;
+  switch (expected_->algorithm) {
+    case CHECKSUM_CRC32C:
+      crc_.update(data, len);
+      break;
+    case CHECKSUM_XXH64:
+      xxh_.update(data, len);
+      break;
+    case CHECKSUM_SHA256:
+      g_checksum_update(sha_, (const guchar *) data, len);
+      break;
+    case CHECKSUM_NONE:
+      break;
+  }
+}
+
+string BodyVerifier::digest() const {
+  char hex[17];
+  switch (expected_->algorithm) {
+    case CHECKSUM_CRC32C:
+      snprintf(hex, sizeof(hex), "%08" PRIx32, crc_.digest());
+      return hex;
+    case CHECKSUM_XXH64:
+      snprintf(hex, sizeof(hex), "%016" PRIx64, xxh_.digest());
+      return hex;
+    case CHECKSUM_SHA256:
+      // get_string closes the checksum; finish() is the last use.
+      return g_checksum_get_string(sha_);
+    case CHECKSUM_NONE:
+      break;
+  }
+  return string();
+}
+
+gboolean BodyVerifier::finish(GError **error) {
+  if (expectedSize_ >= 0 && size_ != (uint64_t) expectedSize_) {
+    g_set_error(error, VERIFY_ERROR, VERIFY_ERROR_LENGTH, "received %" G_GUINT64_FORMAT " of %" G_GINT64_FORMAT " bytes",
+                size_, expectedSize_);
+    return FALSE;
+  }
+  if (!expected_) return TRUE;
+  if (expected_->size >= 0 && size_ != (uint64_t) expected_->size) {
+    g_set_error(error, VERIFY_ERROR, VERIFY_ERROR_LENGTH, "%" G_GUINT64_FORMAT " bytes, manifest says %" G_GINT64_FORMAT,
+                size_, expected_->size);
+    return FALSE;
+  }
+  if (expected_->algorithm != CHECKSUM_NONE) {
+    string actual = digest();
+    if (actual != expected_->digest) {
+      g_set_error(error, VERIFY_ERROR, VERIFY_ERROR_CHECKSUM, "%s %s, manifest says %s", algorithm_name(expected_->algorithm),
+                  actual.c_str(), expected_->digest.c_str());
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
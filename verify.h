@@ -0,0 +1,88 @@
+#pragma once
+
+#include <libsoup/soup.h>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include "hash.h"
+
+#define VERIFY_ERROR (verify_error_quark())
+GQuark verify_error_quark(void);
+
+enum VerifyError {
+  VERIFY_ERROR_MANIFEST,
+  VERIFY_ERROR_LENGTH,
+  VERIFY_ERROR_CHECKSUM,
+};
+
+enum ChecksumAlgorithm {
+  CHECKSUM_NONE,
+  CHECKSUM_CRC32C,
+  CHECKSUM_XXH64,
+  CHECKSUM_SHA256,
+};
+
+// What one URL's body has to match.
+struct ExpectedBody {
+  ChecksumAlgorithm algorithm = CHECKSUM_NONE;
+  // Lower-case hex.
+  std::string digest;
+  // -1 when only the checksum is known.
+  gint64 size = -1;
+};
+
+// Expected checksums by URL, one per line:
+//
+//   URL ALGO:HEX [SIZE]
+//
+// with ALGO one of crc32c, xxh64 or sha256, or "-" in place of ALGO:HEX to
+// check the size alone. Blank lines and lines starting with '#' are skipped.
+class ChecksumManifest {
+public:
+  gboolean load(const char *path, GError **error);
+
+  // nullptr for URLs the manifest does not list.
+  const ExpectedBody *find(const std::string &url) const;
+  size_t size() const { return entries_.size(); }
+
+private:
+  std::unordered_map<std::string, ExpectedBody> entries_;
+};
+
+// Checks one response body chunk by chunk as it arrives, against the
+// response's own Content-Length and, if given, a manifest entry. Only the
+// algorithm the entry names is computed, so the cost is one pass of one
+// hash over data that is in cache anyway.
+class BodyVerifier {
+public:
+  explicit BodyVerifier(const ExpectedBody *expected);
+  ~BodyVerifier();
+  BodyVerifier(const BodyVerifier &) = delete;
+  BodyVerifier &operator=(const BodyVerifier &) = delete;
+
+  // Feeds the first len bytes of path: what an earlier run already saved of
+  // a download that resumes with a Range request.
+  gboolean resume_from(const std::string &path, uint64_t len, GError **error);
+  // For each successful response's headers. Anything but a 206 starts the
+  // body over; Content-Length says how much more is due, unless a content
+  // coding means the decoded bytes will not add up to it.
+  void headers(SoupMessage *msg);
+  void update(const char *data, size_t len);
+  // VERIFY_ERROR_LENGTH or VERIFY_ERROR_CHECKSUM on a mismatch.
+  gboolean finish(GError **error);
+
+  uint64_t size() const { return size_; }
+
+private:
+  void reset();
+  std::string digest() const;
+
+  const ExpectedBody *expected_;
+  Crc32c crc_;
+  XxHash64 xxh_;
+  GChecksum *sha_;
+  uint64_t size_;
+  gint64 expectedSize_;
+};
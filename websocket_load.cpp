@@ -0,0 +1,261 @@
+#include "websocket_load.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+// Wheel resolution; the timer sleeps until the earliest due slot.
+static const guint TICK_MS = 1;
+static const size_t STAMP_BYTES = 16;
+
+WebSocketLoad::WebSocketLoad(Session &session, vector<string> urls, const Options &options, WorkerStats &stats)
+    : session_(session), urls_(std::move(urls)), options_(options), workerStats_(stats), mainLoop_(nullptr),
+      cancellable_(g_cancellable_new()), intervalUs_((gint64) (G_USEC_PER_SEC / max(options.rate, 0.001))),
+      connecting_(0), open_(0), unanswered_(0), phase_(SENDING), startUs_(0), stopUs_(0), drainUntilUs_(0),
+      wheel_(g_get_monotonic_time(), TICK_MS * 1000), tickSource_(0) {
+  if (options_.messageBytes < STAMP_BYTES) options_.messageBytes = STAMP_BYTES;
+  // Printable filler works for both frame types.
+  payload_.resize(options_.messageBytes);
+  for (size_t i = 0; i < payload_.size(); i++) payload_[i] = "0123456789abcdef"[i & 15];
+}
+
+WebSocketLoad::~WebSocketLoad() {
+  if (tickSource_) g_source_remove(tickSource_);
+  for (Connection *conn : connections_) {
+    if (conn->ws) {
+      g_signal_handlers_disconnect_by_data(conn->ws, conn);
+      g_object_unref(conn->ws);
+    }
+    delete conn;
+  }
+  g_object_unref(cancellable_);
+}
+
+void WebSocketLoad::run(GMainLoop *mainLoop) {
+  mainLoop_ = mainLoop;
+  startUs_ = g_get_monotonic_time();
+  wheel_.reset(startUs_);
+
+  connect_more();
+  arm(startUs_);
+  g_main_loop_run(mainLoop);
+}
+
+void WebSocketLoad::connect_more() {
+  while (phase_ == SENDING && connecting_ < options_.connectBurst && (int) connections_.size() < options_.connections) {
+    const string &url = urls_[connections_.size() % urls_.size()];
+    Connection *conn = new Connection{this, nullptr, g_get_monotonic_time(), 0, false};
+    connections_.push_back(conn);
+
+    SoupMessage *msg = soup_message_new("GET", url.c_str());
+    if (!msg) {
+      stats_.connectFailed++;
+      if (firstError_.empty()) firstError_ = "invalid URL " + url;
+      continue;
+    }
+    connecting_++;
+    soup_session_websocket_connect_async(session_.get(), msg, nullptr, nullptr, cancellable_, on_connected, conn);
+    g_object_unref(msg);
+  }
+}
+
+void WebSocketLoad::on_connected(GObject *source, GAsyncResult *result, gpointer usr_data) {
+  Connection *conn = (Connection *) usr_data;
+  WebSocketLoad *load = conn->load;
+  GError *error = nullptr;
+  conn->ws = soup_session_websocket_connect_finish(SOUP_SESSION(source), result, &error);
+  load->connecting_--;
+
+  if (!conn->ws) {
+    // Handshakes still pending when sending stops are cancelled, not failed.
+    if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      load->stats_.connectFailed++;
+      if (load->firstError_.empty()) load->firstError_ = error->message;
+    }
+    g_error_free(error);
+    if (load->phase_ == SENDING) load->arm(g_get_monotonic_time());
+  } else {
+    gint64 nowUs = g_get_monotonic_time();
+    load->handshakeUs_.push_back(nowUs - conn->connectStartUs);
+    conn->open = true;
+    load->open_++;
+    // The default 128 KiB cap would close the connection on large messages.
+    g_object_set(conn->ws, "max-incoming-payload-size", (guint64) 0, nullptr);
+    g_signal_connect(conn->ws, "message", G_CALLBACK(on_message), conn);
+    g_signal_connect(conn->ws, "closed", G_CALLBACK(on_closed), conn);
+
+    if (load->phase_ == SENDING) {
+      // Spread first sends over one interval so connections do not send in
+      // lockstep.
+      gint64 offsetUs = load->intervalUs_ * (gint64) load->stats_.connected / load->options_.connections;
+      load->wheel_.schedule(nowUs + offsetUs, (Connection *) conn);
+      load->arm(nowUs);
+    } else if (load->phase_ == CLOSING) {
+      soup_websocket_connection_close(conn->ws, SOUP_WEBSOCKET_CLOSE_NORMAL, nullptr);
+    }
+    load->stats_.connected++;
+  }
+
+  load->connect_more();
+  load->check_done();
+}
+
+gboolean WebSocketLoad::on_tick(gpointer data) {
+  WebSocketLoad *load = (WebSocketLoad *) data;
+  gint64 nowUs = g_get_monotonic_time();
+  load->tickSource_ = 0;
+
+  if (load->phase_ == SENDING) {
+    if (nowUs >= load->startUs_ + (gint64) load->options_.durationMs * 1000 || load->nothing_left()) {
+      load->stop_sending(nowUs);
+    } else {
+      load->wheel_.advance(nowUs, [load, nowUs](Connection *conn, gint64 dueUs) { load->send(conn, dueUs, nowUs); });
+    }
+  }
+  if (load->phase_ == DRAINING && (load->unanswered_ == 0 || nowUs >= load->drainUntilUs_)) {
+    load->close_all();
+    return G_SOURCE_REMOVE;
+  }
+  load->arm(g_get_monotonic_time());
+  return G_SOURCE_REMOVE;
+}
+
+bool WebSocketLoad::nothing_left() const {
+  return open_ == 0 && connecting_ == 0 && (int) connections_.size() == options_.connections;
+}
+
+void WebSocketLoad::arm(gint64 nowUs) {
+  if (tickSource_) {
+    g_source_remove(tickSource_);
+    tickSource_ = 0;
+  }
+  gint64 wakeUs;
+  if (phase_ == SENDING) {
+    wakeUs = nothing_left() ? nowUs : min(wheel_.next_due_us(), startUs_ + (gint64) options_.durationMs * 1000);
+  } else if (phase_ == DRAINING) {
+    wakeUs = unanswered_ == 0 ? nowUs : drainUntilUs_;
+  } else {
+    return;
+  }
+  guint delayMs = wakeUs <= nowUs ? 0 : (guint) ((wakeUs - nowUs + 999) / 1000);
+  tickSource_ = g_timeout_add(delayMs, on_tick, this);
+}
+
+void WebSocketLoad::send(Connection *conn, gint64 dueUs, gint64 nowUs) {
+  // Closed under us: drop it from the schedule.
+  if (!conn->open) return;
+
+  gint64 nextUs = dueUs + intervalUs_;
+  // Far behind (a stalled loop): drop the backlog rather than burst it out.
+  if (nextUs < nowUs - G_USEC_PER_SEC) nextUs = nowUs;
+  wheel_.schedule(nextUs, (Connection *) conn);
+
+  if (conn->unanswered >= options_.maxUnanswered) {
+    stats_.skipped++;
+    return;
+  }
+
+  gint64 sentUs = g_get_monotonic_time();
+  if (options_.text) {
+    char stamp[STAMP_BYTES + 1];
+    snprintf(stamp, sizeof(stamp), "%016" G_GINT64_MODIFIER "x", sentUs);
+    memcpy(&payload_[0], stamp, STAMP_BYTES);
+    soup_websocket_connection_send_text(conn->ws, payload_.c_str());
+  } else {
+    memcpy(&payload_[0], &sentUs, sizeof(sentUs));
+    soup_websocket_connection_send_binary(conn->ws, payload_.data(), payload_.size());
+  }
+  conn->unanswered++;
+  unanswered_++;
+  stats_.sent++;
+  stats_.bytesSent += payload_.size();
+  workerStats_.begin();
+}
+
+void WebSocketLoad::on_message(SoupWebsocketConnection *ws, gint type, GBytes *message, gpointer usr_data) {
+  Connection *conn = (Connection *) usr_data;
+  WebSocketLoad *load = conn->load;
+  gsize len;
+  const char *data = (const char *) g_bytes_get_data(message, &len);
+  if (len < STAMP_BYTES || conn->unanswered == 0) return;
+
+  gint64 sentUs;
+  if (type == SOUP_WEBSOCKET_DATA_TEXT) {
+    char stamp[STAMP_BYTES + 1];
+    memcpy(stamp, data, STAMP_BYTES);
+    stamp[STAMP_BYTES] = '\0';
+    sentUs = (gint64) g_ascii_strtoull(stamp, nullptr, 16);
+  } else {
+    memcpy(&sentUs, data, sizeof(sentUs));
+  }
+
+  conn->unanswered--;
+  load->unanswered_--;
+  load->stats_.echoed++;
+  load->stats_.bytesEchoed += len;
+  load->workerStats_.record(true, g_get_monotonic_time() - sentUs);
+  load->workerStats_.add_bytes(len);
+  // The last echo ends the drain early.
+  if (load->phase_ == DRAINING && load->unanswered_ == 0) load->arm(g_get_monotonic_time());
+}
+
+void WebSocketLoad::on_closed(SoupWebsocketConnection *ws, gpointer usr_data) {
+  Connection *conn = (Connection *) usr_data;
+  WebSocketLoad *load = conn->load;
+  conn->open = false;
+  load->open_--;
+  // Whatever it still owed will not come.
+  load->unanswered_ -= (uint64_t) conn->unanswered;
+  conn->unanswered = 0;
+  if (load->phase_ != CLOSING) {
+    load->stats_.closedEarly++;
+    load->arm(g_get_monotonic_time());
+  }
+  load->check_done();
+}
+
+void WebSocketLoad::stop_sending(gint64 nowUs) {
+  phase_ = DRAINING;
+  stopUs_ = nowUs;
+  drainUntilUs_ = nowUs + (gint64) options_.drainMs * 1000;
+  g_cancellable_cancel(cancellable_);
+}
+
+void WebSocketLoad::close_all() {
+  phase_ = CLOSING;
+  for (Connection *conn : connections_) {
+    if (conn->open) soup_websocket_connection_close(conn->ws, SOUP_WEBSOCKET_CLOSE_NORMAL, nullptr);
+  }
+  check_done();
+}
+
+void WebSocketLoad::check_done() {
+  if (phase_ == CLOSING && open_ == 0 && connecting_ == 0) g_main_loop_quit(mainLoop_);
+}
+
+void WebSocketLoad::print_summary(ostream &out) const {
+  double secs = (double) (stopUs_ - startUs_) / G_USEC_PER_SEC;
+  out << "websocket: " << stats_.connected << " of " << options_.connections << " connected (" << stats_.connectFailed
+      << " failed, " << stats_.closedEarly << " closed early)";
+  if (!handshakeUs_.empty()) {
+    vector<gint64> sorted = handshakeUs_;
+    sort(sorted.begin(), sorted.end());
+    out << ", handshake p50 " << sorted[sorted.size() / 2] / 1000.0 << " ms, p99 "
+        << sorted[(size_t) (0.99 * (double) (sorted.size() - 1))] / 1000.0 << " ms";
+  }
+  out << endl;
+  if (!firstError_.empty()) out << "first connect error: " << firstError_ << endl;
+
+  out << "messages: " << stats_.sent << " of " << options_.messageBytes << " bytes sent, " << stats_.echoed << " echoed, "
+      << stats_.skipped << " skipped in " << secs << " s: " << (long) (secs > 0 ? stats_.echoed / secs : 0) << " msg/s, "
+      << (secs > 0 ? stats_.bytesEchoed / secs / (1 << 20) : 0) << " MiB/s echoed" << endl;
+  if (stats_.echoed) {
+    uint64_t rtt[LatencyHistogram::BUCKETS];
+    for (int b = 0; b < LatencyHistogram::BUCKETS; b++) rtt[b] = workerStats_.latency.counts[b].load(memory_order_relaxed);
+    out << "round trip: p50 " << LatencyHistogram::percentile_ms(rtt, stats_.echoed, 0.50) << " ms, p90 "
+        << LatencyHistogram::percentile_ms(rtt, stats_.echoed, 0.90) << " ms, p99 "
+        << LatencyHistogram::percentile_ms(rtt, stats_.echoed, 0.99) << " ms, max "
+        << LatencyHistogram::percentile_ms(rtt, stats_.echoed, 1.0) << " ms" << endl;
+  }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <libsoup/soup.h>
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "shard.h"
+#include "soupclient.h"
+#include "timer_wheel.h"
+
+// WebSocket load generator. Opens many connections through a Session's
+// SoupSession, sends fixed-size messages on each at a steady rate and times
+// every echo. A message carries its own send time, so the peer only has to
+// return it unchanged (as LoopbackServer's /echo does). Sends for every
+// connection are paced from one timer wheel, so thousands of connections
+// cost one timer rather than one each.
+class WebSocketLoad {
+public:
+  struct Options {
+    int connections = 100;
+    // Handshakes in flight at once. The session needs at least this many
+    // connections per host, since handshakes go through its pool.
+    int connectBurst = 64;
+    // Messages per second on each connection.
+    double rate = 10;
+    // At least 16: the send time goes in front.
+    size_t messageBytes = 64;
+    guint durationMs = 10000;
+    // Then wait this long for outstanding echoes before closing.
+    guint drainMs = 2000;
+    // Skip a send rather than queue it on a connection this far behind.
+    int maxUnanswered = 64;
+    // Text frames (the send time as hex) instead of binary.
+    bool text = false;
+  };
+
+  struct Stats {
+    uint64_t connected = 0;
+    uint64_t connectFailed = 0;
+    uint64_t closedEarly = 0;
+    uint64_t sent = 0;
+    uint64_t echoed = 0;
+    uint64_t skipped = 0;
+    uint64_t bytesSent = 0;
+    uint64_t bytesEchoed = 0;
+  };
+
+  // Connections go round-robin to urls (ws:// or wss://). Sends count as
+  // started in stats and echoes as completed, with their round trip time.
+  WebSocketLoad(Session &session, std::vector<std::string> urls, const Options &options, WorkerStats &stats);
+  ~WebSocketLoad();
+
+  WebSocketLoad(const WebSocketLoad &) = delete;
+  WebSocketLoad &operator=(const WebSocketLoad &) = delete;
+
+  // Runs mainLoop until every connection has closed again.
+  void run(GMainLoop *mainLoop);
+
+  const Stats &stats() const { return stats_; }
+  void print_summary(std::ostream &out) const;
+
+private:
+  enum Phase { SENDING, DRAINING, CLOSING };
+
+  struct Connection {
+    WebSocketLoad *load;
+    SoupWebsocketConnection *ws;
+    gint64 connectStartUs;
+    int unanswered;
+    bool open;
+  };
+
+  static void on_connected(GObject *source, GAsyncResult *result, gpointer usr_data);
+  static void on_message(SoupWebsocketConnection *ws, gint type, GBytes *message, gpointer usr_data);
+  static void on_closed(SoupWebsocketConnection *ws, gpointer usr_data);
+  static gboolean on_tick(gpointer data);
+
+  void connect_more();
+  // Every connection has been tried and none is left open.
+  bool nothing_left() const;
+  // (Re)sets the timer for whatever the phase waits on next.
+  void arm(gint64 nowUs);
+  void send(Connection *conn, gint64 dueUs, gint64 nowUs);
+  void stop_sending(gint64 nowUs);
+  void close_all();
+  void check_done();
+
+  Session &session_;
+  std::vector<std::string> urls_;
+  Options options_;
+  WorkerStats &workerStats_;
+  Stats stats_;
+  GMainLoop *mainLoop_;
+  GCancellable *cancellable_;
+
+  std::vector<Connection *> connections_;
+  std::vector<gint64> handshakeUs_;
+  std::string firstError_;
+  std::string payload_;
+  gint64 intervalUs_;
+  int connecting_;
+  int open_;
+  uint64_t unanswered_;
+
+  Phase phase_;
+  gint64 startUs_;
+  gint64 stopUs_;
+  gint64 drainUntilUs_;
+  TimerWheel<Connection *> wheel_;
+  guint tickSource_;
+};